@@ -0,0 +1,291 @@
+/* Generated by rpcgen from idl/calc.idl; do not edit */
+
+#include <stdlib.h>
+#include <string.h>
+#include "calc_rpc.h"
+#include "rpc_client.h"
+
+int calc_add(int32_t a, int32_t b, int32_t *result) {
+    if (result == NULL) {
+        rpc_set_last_error(ERR_INVALID_ARGS);
+        return -1;
+    }
+    size_t rpc_size = 15;
+    char rpc_frame[MESSAGE_HEADER_SIZE + 15];
+    uint8_t *rpc_p = (uint8_t*)rpc_frame + MESSAGE_HEADER_SIZE;
+    rpc_p += serialize_int(rpc_p, CALC_ADD_ID);
+    *rpc_p++ = 2;
+    *rpc_p++ = TYPE_INT;
+    rpc_p += serialize_int(rpc_p, a);
+    *rpc_p++ = TYPE_INT;
+    rpc_p += serialize_int(rpc_p, b);
+
+    char *rpc_reply;
+    size_t rpc_reply_len;
+    int rpc_rc = rpc_call_frame(MSG_TYPED_REQUEST, rpc_frame, rpc_size, &rpc_reply, &rpc_reply_len);
+    if (rpc_rc != 0) {
+        return -1;
+    }
+    if (rpc_reply_len != 5 || (uint8_t)rpc_reply[0] != TYPE_INT) {
+        free(rpc_reply);
+        rpc_set_last_error(ERR_SERIALIZATION);
+        return -1;
+    }
+    int rpc_result;
+    deserialize_int((const uint8_t*)rpc_reply + 1, &rpc_result);
+    *result = rpc_result;
+    free(rpc_reply);
+    return 0;
+}
+
+int calc_scale(float x, float factor, float *result) {
+    if (result == NULL) {
+        rpc_set_last_error(ERR_INVALID_ARGS);
+        return -1;
+    }
+    size_t rpc_size = 15;
+    char rpc_frame[MESSAGE_HEADER_SIZE + 15];
+    uint8_t *rpc_p = (uint8_t*)rpc_frame + MESSAGE_HEADER_SIZE;
+    rpc_p += serialize_int(rpc_p, CALC_SCALE_ID);
+    *rpc_p++ = 2;
+    *rpc_p++ = TYPE_FLOAT;
+    rpc_p += serialize_float(rpc_p, x);
+    *rpc_p++ = TYPE_FLOAT;
+    rpc_p += serialize_float(rpc_p, factor);
+
+    char *rpc_reply;
+    size_t rpc_reply_len;
+    int rpc_rc = rpc_call_frame(MSG_TYPED_REQUEST, rpc_frame, rpc_size, &rpc_reply, &rpc_reply_len);
+    if (rpc_rc != 0) {
+        return -1;
+    }
+    if (rpc_reply_len != 5 || (uint8_t)rpc_reply[0] != TYPE_FLOAT) {
+        free(rpc_reply);
+        rpc_set_last_error(ERR_SERIALIZATION);
+        return -1;
+    }
+    float rpc_result;
+    deserialize_float((const uint8_t*)rpc_reply + 1, &rpc_result);
+    *result = rpc_result;
+    free(rpc_reply);
+    return 0;
+}
+
+int calc_repeat(const char *text, int32_t count, char **result) {
+    if (text == NULL || result == NULL) {
+        rpc_set_last_error(ERR_INVALID_ARGS);
+        return -1;
+    }
+    size_t text_len = strlen(text);
+    size_t rpc_size = 16 + text_len;
+    if (rpc_size > MAX_PAYLOAD_SIZE) {
+        rpc_set_last_error(ERR_INVALID_ARGS);
+        return -1;
+    }
+    char rpc_stack_frame[MESSAGE_HEADER_SIZE + 256];
+    char *rpc_frame = rpc_size <= 256 ? rpc_stack_frame : malloc(MESSAGE_HEADER_SIZE + rpc_size);
+    if (rpc_frame == NULL) {
+        rpc_set_last_error(ERR_SERIALIZATION);
+        return -1;
+    }
+    uint8_t *rpc_p = (uint8_t*)rpc_frame + MESSAGE_HEADER_SIZE;
+    rpc_p += serialize_int(rpc_p, CALC_REPEAT_ID);
+    *rpc_p++ = 2;
+    *rpc_p++ = TYPE_STRING;
+    rpc_p += serialize_int(rpc_p, (int)text_len);
+    memcpy(rpc_p, text, text_len);
+    rpc_p += text_len;
+    *rpc_p++ = '\0';
+    *rpc_p++ = TYPE_INT;
+    rpc_p += serialize_int(rpc_p, count);
+
+    char *rpc_reply;
+    size_t rpc_reply_len;
+    int rpc_rc = rpc_call_frame(MSG_TYPED_REQUEST, rpc_frame, rpc_size, &rpc_reply, &rpc_reply_len);
+    if (rpc_frame != rpc_stack_frame) {
+        free(rpc_frame);
+    }
+    if (rpc_rc != 0) {
+        return -1;
+    }
+    int rpc_len = -1;
+    if (rpc_reply_len >= 5 && (uint8_t)rpc_reply[0] == TYPE_STRING) {
+        deserialize_int((const uint8_t*)rpc_reply + 1, &rpc_len);
+    }
+    if (rpc_len < 0 || (size_t)rpc_len + 6 != rpc_reply_len) {
+        free(rpc_reply);
+        rpc_set_last_error(ERR_SERIALIZATION);
+        return -1;
+    }
+    memmove(rpc_reply, rpc_reply + 5, rpc_len);
+    rpc_reply[rpc_len] = '\0';
+    *result = rpc_reply;
+    return 0;
+}
+
+int calc_checksum(const void *data, size_t data_len, int32_t *result) {
+    if ((data == NULL && data_len > 0) || result == NULL) {
+        rpc_set_last_error(ERR_INVALID_ARGS);
+        return -1;
+    }
+    size_t rpc_size = 10 + data_len;
+    if (rpc_size > MAX_PAYLOAD_SIZE) {
+        rpc_set_last_error(ERR_INVALID_ARGS);
+        return -1;
+    }
+    char rpc_stack_frame[MESSAGE_HEADER_SIZE + 256];
+    char *rpc_frame = rpc_size <= 256 ? rpc_stack_frame : malloc(MESSAGE_HEADER_SIZE + rpc_size);
+    if (rpc_frame == NULL) {
+        rpc_set_last_error(ERR_SERIALIZATION);
+        return -1;
+    }
+    uint8_t *rpc_p = (uint8_t*)rpc_frame + MESSAGE_HEADER_SIZE;
+    rpc_p += serialize_int(rpc_p, CALC_CHECKSUM_ID);
+    *rpc_p++ = 1;
+    *rpc_p++ = TYPE_BYTES;
+    rpc_p += serialize_int(rpc_p, (int)data_len);
+    if (data_len > 0) {
+        memcpy(rpc_p, data, data_len);
+    }
+    rpc_p += data_len;
+
+    char *rpc_reply;
+    size_t rpc_reply_len;
+    int rpc_rc = rpc_call_frame(MSG_TYPED_REQUEST, rpc_frame, rpc_size, &rpc_reply, &rpc_reply_len);
+    if (rpc_frame != rpc_stack_frame) {
+        free(rpc_frame);
+    }
+    if (rpc_rc != 0) {
+        return -1;
+    }
+    if (rpc_reply_len != 5 || (uint8_t)rpc_reply[0] != TYPE_INT) {
+        free(rpc_reply);
+        rpc_set_last_error(ERR_SERIALIZATION);
+        return -1;
+    }
+    int rpc_result;
+    deserialize_int((const uint8_t*)rpc_reply + 1, &rpc_result);
+    *result = rpc_result;
+    free(rpc_reply);
+    return 0;
+}
+
+int calc_reverse(const void *data, size_t data_len, void **result, size_t *result_len) {
+    if ((data == NULL && data_len > 0) || result == NULL || result_len == NULL) {
+        rpc_set_last_error(ERR_INVALID_ARGS);
+        return -1;
+    }
+    size_t rpc_size = 10 + data_len;
+    if (rpc_size > MAX_PAYLOAD_SIZE) {
+        rpc_set_last_error(ERR_INVALID_ARGS);
+        return -1;
+    }
+    char rpc_stack_frame[MESSAGE_HEADER_SIZE + 256];
+    char *rpc_frame = rpc_size <= 256 ? rpc_stack_frame : malloc(MESSAGE_HEADER_SIZE + rpc_size);
+    if (rpc_frame == NULL) {
+        rpc_set_last_error(ERR_SERIALIZATION);
+        return -1;
+    }
+    uint8_t *rpc_p = (uint8_t*)rpc_frame + MESSAGE_HEADER_SIZE;
+    rpc_p += serialize_int(rpc_p, CALC_REVERSE_ID);
+    *rpc_p++ = 1;
+    *rpc_p++ = TYPE_BYTES;
+    rpc_p += serialize_int(rpc_p, (int)data_len);
+    if (data_len > 0) {
+        memcpy(rpc_p, data, data_len);
+    }
+    rpc_p += data_len;
+
+    char *rpc_reply;
+    size_t rpc_reply_len;
+    int rpc_rc = rpc_call_frame(MSG_TYPED_REQUEST, rpc_frame, rpc_size, &rpc_reply, &rpc_reply_len);
+    if (rpc_frame != rpc_stack_frame) {
+        free(rpc_frame);
+    }
+    if (rpc_rc != 0) {
+        return -1;
+    }
+    int rpc_len = -1;
+    if (rpc_reply_len >= 5 && (uint8_t)rpc_reply[0] == TYPE_BYTES) {
+        deserialize_int((const uint8_t*)rpc_reply + 1, &rpc_len);
+    }
+    if (rpc_len < 0 || (size_t)rpc_len + 5 != rpc_reply_len) {
+        free(rpc_reply);
+        rpc_set_last_error(ERR_SERIALIZATION);
+        return -1;
+    }
+    memmove(rpc_reply, rpc_reply + 5, rpc_len);
+    rpc_reply[rpc_len] = '\0';
+    *result = rpc_reply;
+    *result_len = (size_t)rpc_len;
+    return 0;
+}
+
+int calc_reset(void) {
+    size_t rpc_size = 5;
+    char rpc_frame[MESSAGE_HEADER_SIZE + 5];
+    uint8_t *rpc_p = (uint8_t*)rpc_frame + MESSAGE_HEADER_SIZE;
+    rpc_p += serialize_int(rpc_p, CALC_RESET_ID);
+    *rpc_p++ = 0;
+
+    char *rpc_reply;
+    size_t rpc_reply_len;
+    int rpc_rc = rpc_call_frame(MSG_TYPED_REQUEST, rpc_frame, rpc_size, &rpc_reply, &rpc_reply_len);
+    if (rpc_rc != 0) {
+        return -1;
+    }
+    if (rpc_reply_len != 1 || (uint8_t)rpc_reply[0] != TYPE_VOID) {
+        free(rpc_reply);
+        rpc_set_last_error(ERR_SERIALIZATION);
+        return -1;
+    }
+    free(rpc_reply);
+    return 0;
+}
+
+int calc_calls(int32_t *result) {
+    if (result == NULL) {
+        rpc_set_last_error(ERR_INVALID_ARGS);
+        return -1;
+    }
+    size_t rpc_size = 5;
+    char rpc_frame[MESSAGE_HEADER_SIZE + 5];
+    uint8_t *rpc_p = (uint8_t*)rpc_frame + MESSAGE_HEADER_SIZE;
+    rpc_p += serialize_int(rpc_p, CALC_CALLS_ID);
+    *rpc_p++ = 0;
+
+    char *rpc_reply;
+    size_t rpc_reply_len;
+    int rpc_rc = rpc_call_frame(MSG_TYPED_REQUEST, rpc_frame, rpc_size, &rpc_reply, &rpc_reply_len);
+    if (rpc_rc != 0) {
+        return -1;
+    }
+    if (rpc_reply_len != 5 || (uint8_t)rpc_reply[0] != TYPE_INT) {
+        free(rpc_reply);
+        rpc_set_last_error(ERR_SERIALIZATION);
+        return -1;
+    }
+    int rpc_result;
+    deserialize_int((const uint8_t*)rpc_reply + 1, &rpc_result);
+    *result = rpc_result;
+    free(rpc_reply);
+    return 0;
+}
+
+int calc_client_check(void) {
+    static const char *const names[CALC_NUM_METHODS] = {
+        "calc.add",
+        "calc.scale",
+        "calc.repeat",
+        "calc.checksum",
+        "calc.reverse",
+        "calc.reset",
+        "calc.calls",
+    };
+    for (long id = 0; id < CALC_NUM_METHODS; id++) {
+        if (rpc_function_id(names[id]) != id) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+/* Generated by rpcgen from idl/calc.idl; do not edit */
+
+#ifndef CALC_RPC_H
+#define CALC_RPC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "rpc_context.h"
+
+/* Function IDs, in declaration order; calc_server_register() claims them */
+#define CALC_ADD_ID 0
+#define CALC_SCALE_ID 1
+#define CALC_REPEAT_ID 2
+#define CALC_CHECKSUM_ID 3
+#define CALC_REVERSE_ID 4
+#define CALC_RESET_ID 5
+#define CALC_CALLS_ID 6
+#define CALC_NUM_METHODS 7
+
+/* Client stubs: 0 on success, -1 on failure (see rpc_last_error).
+ * String and bytes results are malloc'd for the caller to free */
+int calc_add(int32_t a, int32_t b, int32_t *result);
+int calc_scale(float x, float factor, float *result);
+int calc_repeat(const char *text, int32_t count, char **result);
+int calc_checksum(const void *data, size_t data_len, int32_t *result);
+int calc_reverse(const void *data, size_t data_len, void **result, size_t *result_len);
+int calc_reset(void);
+int calc_calls(int32_t *result);
+/* 0 if the connected server registered this interface under the same IDs */
+int calc_client_check(void);
+
+/* Server side: the program implements these, returning 0 on success. String
+ * and bytes results may point into rpc_alloc(ctx) memory */
+int calc_add_impl(rpc_context *ctx, int32_t a, int32_t b, int32_t *result);
+int calc_scale_impl(rpc_context *ctx, float x, float factor, float *result);
+int calc_repeat_impl(rpc_context *ctx, const char *text, int32_t count, const char **result);
+int calc_checksum_impl(rpc_context *ctx, const void *data, size_t data_len, int32_t *result);
+int calc_reverse_impl(rpc_context *ctx, const void *data, size_t data_len, const void **result, size_t *result_len);
+int calc_reset_impl(rpc_context *ctx);
+int calc_calls_impl(rpc_context *ctx, int32_t *result);
+/* Register every method under its ID, before any other function is registered */
+int calc_server_register(void);
+
+#endif
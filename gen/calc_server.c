@@ -0,0 +1,261 @@
+/* Generated by rpcgen from idl/calc.idl; do not edit */
+
+#include <stdint.h>
+#include <string.h>
+#include "calc_rpc.h"
+#include "protocol.h"
+#include "rpc_server.h"
+
+static int calc_add_skeleton(rpc_context *ctx, const char *rpc_args, size_t rpc_args_len, rpc_output *rpc_out) {
+    const uint8_t *rpc_p = (const uint8_t*)rpc_args;
+    int rpc_n;
+
+    if (rpc_args_len != 11 || *rpc_p++ != 2) {
+        return -1;
+    }
+    if (*rpc_p++ != TYPE_INT) {
+        return -1;
+    }
+    rpc_p += deserialize_int(rpc_p, &rpc_n);
+    int32_t a = rpc_n;
+    if (*rpc_p++ != TYPE_INT) {
+        return -1;
+    }
+    rpc_p += deserialize_int(rpc_p, &rpc_n);
+    int32_t b = rpc_n;
+
+    int32_t result;
+    if (calc_add_impl(ctx, a, b, &result) != 0) {
+        return -1;
+    }
+
+    if (rpc_output_reserve(rpc_out, 5) != 0) {
+        return -1;
+    }
+    uint8_t *rpc_o = (uint8_t*)rpc_out->data + rpc_out->len;
+    *rpc_o++ = TYPE_INT;
+    serialize_int(rpc_o, result);
+    rpc_out->len += 5;
+    return 0;
+}
+
+static int calc_scale_skeleton(rpc_context *ctx, const char *rpc_args, size_t rpc_args_len, rpc_output *rpc_out) {
+    const uint8_t *rpc_p = (const uint8_t*)rpc_args;
+
+    if (rpc_args_len != 11 || *rpc_p++ != 2) {
+        return -1;
+    }
+    if (*rpc_p++ != TYPE_FLOAT) {
+        return -1;
+    }
+    float x;
+    rpc_p += deserialize_float(rpc_p, &x);
+    if (*rpc_p++ != TYPE_FLOAT) {
+        return -1;
+    }
+    float factor;
+    rpc_p += deserialize_float(rpc_p, &factor);
+
+    float result;
+    if (calc_scale_impl(ctx, x, factor, &result) != 0) {
+        return -1;
+    }
+
+    if (rpc_output_reserve(rpc_out, 5) != 0) {
+        return -1;
+    }
+    uint8_t *rpc_o = (uint8_t*)rpc_out->data + rpc_out->len;
+    *rpc_o++ = TYPE_FLOAT;
+    serialize_float(rpc_o, result);
+    rpc_out->len += 5;
+    return 0;
+}
+
+static int calc_repeat_skeleton(rpc_context *ctx, const char *rpc_args, size_t rpc_args_len, rpc_output *rpc_out) {
+    const uint8_t *rpc_p = (const uint8_t*)rpc_args;
+    const uint8_t *rpc_end = rpc_p + rpc_args_len;
+    int rpc_n;
+
+    if (rpc_args_len < 12 || *rpc_p++ != 2) {
+        return -1;
+    }
+    if (*rpc_p++ != TYPE_STRING) {
+        return -1;
+    }
+    rpc_p += deserialize_int(rpc_p, &rpc_n);
+    if (rpc_n < 0 || (size_t)(rpc_end - rpc_p) < (size_t)rpc_n + 6 || rpc_p[rpc_n] != '\0') {
+        return -1;
+    }
+    const char *text = (const char*)rpc_p;
+    rpc_p += rpc_n + 1;
+    if (*rpc_p++ != TYPE_INT) {
+        return -1;
+    }
+    rpc_p += deserialize_int(rpc_p, &rpc_n);
+    int32_t count = rpc_n;
+    if (rpc_p != rpc_end) {
+        return -1;
+    }
+
+    const char *result = NULL;
+    if (calc_repeat_impl(ctx, text, count, &result) != 0) {
+        return -1;
+    }
+
+    if (result == NULL) {
+        return -1;
+    }
+    size_t result_len = strlen(result);
+    if (result_len > MAX_BATCH_PAYLOAD_SIZE || rpc_output_reserve(rpc_out, result_len + 6) != 0) {
+        return -1;
+    }
+    uint8_t *rpc_o = (uint8_t*)rpc_out->data + rpc_out->len;
+    *rpc_o++ = TYPE_STRING;
+    rpc_o += serialize_int(rpc_o, (int)result_len);
+    if (result_len > 0) {
+        memcpy(rpc_o, result, result_len);
+    }
+    rpc_o[result_len] = '\0';
+    rpc_out->len += result_len + 6;
+    return 0;
+}
+
+static int calc_checksum_skeleton(rpc_context *ctx, const char *rpc_args, size_t rpc_args_len, rpc_output *rpc_out) {
+    const uint8_t *rpc_p = (const uint8_t*)rpc_args;
+    const uint8_t *rpc_end = rpc_p + rpc_args_len;
+    int rpc_n;
+
+    if (rpc_args_len < 6 || *rpc_p++ != 1) {
+        return -1;
+    }
+    if (*rpc_p++ != TYPE_BYTES) {
+        return -1;
+    }
+    rpc_p += deserialize_int(rpc_p, &rpc_n);
+    if (rpc_n < 0 || (size_t)(rpc_end - rpc_p) < (size_t)rpc_n) {
+        return -1;
+    }
+    const void *data = rpc_p;
+    size_t data_len = (size_t)rpc_n;
+    rpc_p += rpc_n;
+    if (rpc_p != rpc_end) {
+        return -1;
+    }
+
+    int32_t result;
+    if (calc_checksum_impl(ctx, data, data_len, &result) != 0) {
+        return -1;
+    }
+
+    if (rpc_output_reserve(rpc_out, 5) != 0) {
+        return -1;
+    }
+    uint8_t *rpc_o = (uint8_t*)rpc_out->data + rpc_out->len;
+    *rpc_o++ = TYPE_INT;
+    serialize_int(rpc_o, result);
+    rpc_out->len += 5;
+    return 0;
+}
+
+static int calc_reverse_skeleton(rpc_context *ctx, const char *rpc_args, size_t rpc_args_len, rpc_output *rpc_out) {
+    const uint8_t *rpc_p = (const uint8_t*)rpc_args;
+    const uint8_t *rpc_end = rpc_p + rpc_args_len;
+    int rpc_n;
+
+    if (rpc_args_len < 6 || *rpc_p++ != 1) {
+        return -1;
+    }
+    if (*rpc_p++ != TYPE_BYTES) {
+        return -1;
+    }
+    rpc_p += deserialize_int(rpc_p, &rpc_n);
+    if (rpc_n < 0 || (size_t)(rpc_end - rpc_p) < (size_t)rpc_n) {
+        return -1;
+    }
+    const void *data = rpc_p;
+    size_t data_len = (size_t)rpc_n;
+    rpc_p += rpc_n;
+    if (rpc_p != rpc_end) {
+        return -1;
+    }
+
+    const void *result = NULL;
+    size_t result_len = 0;
+    if (calc_reverse_impl(ctx, data, data_len, &result, &result_len) != 0) {
+        return -1;
+    }
+
+    if (result == NULL && result_len > 0) {
+        return -1;
+    }
+    if (result_len > MAX_BATCH_PAYLOAD_SIZE || rpc_output_reserve(rpc_out, result_len + 5) != 0) {
+        return -1;
+    }
+    uint8_t *rpc_o = (uint8_t*)rpc_out->data + rpc_out->len;
+    *rpc_o++ = TYPE_BYTES;
+    rpc_o += serialize_int(rpc_o, (int)result_len);
+    if (result_len > 0) {
+        memcpy(rpc_o, result, result_len);
+    }
+    rpc_out->len += result_len + 5;
+    return 0;
+}
+
+static int calc_reset_skeleton(rpc_context *ctx, const char *rpc_args, size_t rpc_args_len, rpc_output *rpc_out) {
+    const uint8_t *rpc_p = (const uint8_t*)rpc_args;
+
+    if (rpc_args_len != 1 || *rpc_p++ != 0) {
+        return -1;
+    }
+
+    if (calc_reset_impl(ctx) != 0) {
+        return -1;
+    }
+
+    const char rpc_void = TYPE_VOID;
+    return rpc_output_append(rpc_out, &rpc_void, 1);
+}
+
+static int calc_calls_skeleton(rpc_context *ctx, const char *rpc_args, size_t rpc_args_len, rpc_output *rpc_out) {
+    const uint8_t *rpc_p = (const uint8_t*)rpc_args;
+
+    if (rpc_args_len != 1 || *rpc_p++ != 0) {
+        return -1;
+    }
+
+    int32_t result;
+    if (calc_calls_impl(ctx, &result) != 0) {
+        return -1;
+    }
+
+    if (rpc_output_reserve(rpc_out, 5) != 0) {
+        return -1;
+    }
+    uint8_t *rpc_o = (uint8_t*)rpc_out->data + rpc_out->len;
+    *rpc_o++ = TYPE_INT;
+    serialize_int(rpc_o, result);
+    rpc_out->len += 5;
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    rpc_raw_func skeleton;
+} calc_methods[CALC_NUM_METHODS] = {
+    { "calc.add", calc_add_skeleton },
+    { "calc.scale", calc_scale_skeleton },
+    { "calc.repeat", calc_repeat_skeleton },
+    { "calc.checksum", calc_checksum_skeleton },
+    { "calc.reverse", calc_reverse_skeleton },
+    { "calc.reset", calc_reset_skeleton },
+    { "calc.calls", calc_calls_skeleton },
+};
+
+int calc_server_register(void) {
+    for (uint32_t id = 0; id < CALC_NUM_METHODS; id++) {
+        if (rpc_server_register_function_raw(calc_methods[id].name, calc_methods[id].skeleton, id) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for per-request memory: allocations are never freed one by
+ * one, the whole arena is rewound with arena_reset() once the request is done.
+ */
+typedef struct arena_block arena_block;
+
+typedef struct {
+    arena_block *head;      /* first block, kept across resets */
+    arena_block *current;   /* block allocations are bumped from */
+    size_t block_size;
+    size_t used;            /* bytes handed out since the last reset */
+    size_t peak;            /* largest per-request usage seen */
+} arena;
+
+/* API */
+void arena_init(arena *a, size_t block_size);
+void *arena_alloc(arena *a, size_t size);
+void arena_reset(arena *a);
+void arena_destroy(arena *a);
+
+#endif
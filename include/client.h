@@ -3,6 +3,11 @@
 
 #include <stddef.h>
 
+/* Independent connections, as many as the caller likes */
+int client_open(const char* server_ip, int port);
+void client_close(int sock);
+
+/* The process-wide connection */
 int client_connect(const char* server_ip, int port);
 int client_send(const char* data, size_t len);
 int client_receive(char* buffer, size_t buffer_size);
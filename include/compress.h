@@ -0,0 +1,80 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+
+/*
+ * LZ77 block compressor in the LZ4 style: a token byte with literal and match
+ * lengths, the literals, then a 16-bit offset into the last 64 KiB. Greedy
+ * matching on a 4-byte hash keeps it fast enough to run on every large frame.
+ */
+
+/* Matches reach back at most this far, which also caps a useful dictionary */
+#define COMPRESS_WINDOW   65535
+#define COMPRESS_DICT_MAX (64 * 1024)
+
+/* Compressed payload: u32 original length, then the block */
+#define COMPRESS_PREFIX_SIZE sizeof(uint32_t)
+
+/* Shared history both ends prepend to every payload, so small frames find matches too */
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    uint32_t id;        /* content hash, compared during negotiation; 0 = no dictionary */
+    uint32_t *table;    /* match finder state after indexing data, copied for every frame */
+} compress_dict;
+
+/* Output buffer reused across frames, grown on demand */
+typedef struct {
+    uint8_t *data;
+    size_t capacity;
+} compress_buffer;
+
+typedef struct {
+    unsigned long long frames_compressed;
+    unsigned long long frames_skipped;      /* over the threshold but not worth compressing */
+    unsigned long long frames_decompressed;
+    unsigned long long bytes_in;            /* payload bytes before compression */
+    unsigned long long bytes_out;           /* the same payloads on the wire */
+    unsigned long long compress_ns;         /* thread CPU time spent compressing */
+    unsigned long long decompress_ns;
+    double ratio;                           /* bytes_in / bytes_out, 0 if nothing was compressed */
+} compress_stats;
+
+/* Block API: returns the compressed size, 0 if it would not fit in dst_capacity */
+size_t compress_block(const void *src, size_t src_len, void *dst, size_t dst_capacity, const compress_dict *dict);
+/* Inflates exactly dst_len bytes; 0 on success, -1 on corrupt input */
+int decompress_block(const void *src, size_t src_len, void *dst, size_t dst_len, const compress_dict *dict);
+
+/* Dictionaries */
+int compress_dict_init(compress_dict *dict, const void *data, size_t len);
+void compress_dict_free(compress_dict *dict);
+/* Collect substrings common to the samples into dict; returns the dictionary size */
+size_t compress_train_dictionary(const void *const *samples, const size_t *sample_sizes, size_t count,
+                                 void *dict, size_t capacity);
+
+/*
+ * Frame helpers. compress_frame replaces a payload of at least threshold bytes
+ * by its compressed form in out when that is smaller, sets MSG_FLAG_COMPRESSED
+ * (and MSG_FLAG_DICTIONARY) in header->msg_type and returns 1; otherwise the
+ * frame is left alone and 0 is returned.
+ */
+int compress_frame(MessageHeader *header, const void *payload, compress_buffer *out,
+                   size_t threshold, const compress_dict *dict);
+/* Undo compress_frame: inflate into out (with a spare byte past the payload) and
+ * point *payload at it. 0 on success, -1 for corrupt or oversized data or a
+ * dictionary frame without the dictionary */
+int decompress_frame(MessageHeader *header, uint8_t **payload, compress_buffer *out,
+                     size_t max_payload, const compress_dict *dict);
+void compress_buffer_free(compress_buffer *buffer);
+
+/* The calling thread's buffers for compress_frame and decompress_frame; each is
+ * reused by the next frame, so send or consume the contents first */
+compress_buffer *compress_output_buffer(void);
+compress_buffer *compress_input_buffer(void);
+
+void compress_get_stats(compress_stats *stats);
+
+#endif
@@ -1,21 +1,105 @@
 #ifndef DL_HANDLER_H
 #define DL_HANDLER_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+
+/* Calling conventions a registered function may use */
+#define FUNC_ABI_PLAIN   0  /* char *f(const char *params); result is malloc'd and freed by the server */
+#define FUNC_ABI_CONTEXT 1  /* char *f(rpc_context *ctx, const char *params); result lives in ctx's arena */
+#define FUNC_ABI_BUFFER  2  /* int f(const char *params, rpc_output *out); result written into the response frame */
+#define FUNC_ABI_STREAM  3  /* int f(rpc_stream *stream); params and result flow through the stream in chunks */
+#define FUNC_ABI_TYPED   4  /* int f(rpc_context *ctx, const rpc_value *args, rpc_value *result); see signature */
+#define FUNC_ABI_RAW     5  /* int f(rpc_context *ctx, const char *args, size_t args_len, rpc_output *out); encoded typed args */
+
+#define MAX_LIBRARIES 32
+
+/*
+ * A loaded function library. Functions from a named library are registered
+ * as "name.symbol"; those of the default library (name NULL, the one given
+ * to function_table_init) under their symbol alone.
+ */
+struct FunctionLibrary {
+    char *name;
+    char *path;
+    void *handle;
+};
+
 struct Registery {
-    const char *name;
+    char *name;
     void *function;
-    struct Registery *next;
+    int abi;
+    size_t name_len;
+    uint64_t hash;      /* function_name_hash(name), compared before the name */
+    uint32_t id;        /* dense registration-order index, used as the wire function ID */
+    RPCRequest *signature;  /* argument and return types, FUNC_ABI_TYPED only */
+    struct FunctionLibrary *library;    /* where the function came from, NULL if linked in */
+    int pure;           /* result depends on the params alone, so it may be cached */
+    uint32_t cache_ttl_ms;  /* how long a cached result is reused, 0 = until evicted */
+    uint32_t generation;    /* reloads of its library so far, part of its cached results' key */
 };
 
-struct RegisteryList {
-    struct Registery *head;
-    struct Registery *tail;
+/*
+ * Open-addressing table (linear probing, power-of-two capacity). After
+ * freeze_registery() lookups go through a minimal perfect hash instead:
+ * hash -> bucket seed -> one slot in the flat array.
+ */
+struct RegisteryTable {
+    struct Registery *slots;
+    size_t capacity;
+    size_t count;
+
+    int frozen;
+    uint32_t *seeds;
+    size_t num_buckets;
+    struct Registery *flat;
+
+    /* Dispatch array indexed by function ID */
+    struct Registery *by_id;
+    size_t by_id_capacity;
 };
 
+/*
+ * Registration and freezing happen before serving. While calls run, the one
+ * change allowed is reload_function_table(), which publishes a new table and
+ * frees the old one (and unloads its library) only after every reader that
+ * might still see it is done.
+ *
+ * Readers bracket each use of an entry or function pointer, up to the end of
+ * the call, with a read guard. Taking and dropping one never blocks; the guard
+ * may be dropped on another thread than the one that took it. A thread holding
+ * a guard must not reload.
+ */
+typedef uint32_t registery_guard;
+registery_guard registery_read_lock(void);
+void registery_read_unlock(registery_guard guard);
+
 /* API */
 int function_table_init(const char *lib_path);
+int add_library(const char *name, const char *lib_path);
+/* Reload the library loaded as name (NULL for the default one) from lib_path,
+ * or from where it was loaded if lib_path is NULL; other libraries are untouched */
+int reload_library(const char *name, const char *lib_path);
+int reload_function_table(const char *lib_path);
 int add_function(const char *func_name);
+int add_function_abi(const char *func_name, int abi);
+int add_function_typed(const RPCRequest *signature);
+int add_function_ptr(const char *func_name, void *function, int abi);
+/* add_function_ptr, refused without registering anything unless the function gets ID id */
+int add_function_ptr_at(const char *func_name, void *function, int abi, uint32_t id);
+int set_function_pure(const char *func_name, uint32_t ttl_ms);
 void *get_function(char *s_name);
+void *get_function_hashed(const char *s_name, uint64_t hash);
+void *get_function_len(const char *s_name, size_t len);
+uint64_t function_name_hash(const char *s_name);
+uint64_t function_name_hash_len(const char *s_name, size_t len);
+void *get_function_by_id(uint32_t id);
+const struct Registery *get_registery_entry(const char *s_name, size_t len);
+const struct Registery *get_registery_entry_by_id(uint32_t id);
+const char *get_function_name(uint32_t id);
+size_t registery_count(void);
+int freeze_registery(void);
 void destroy_registery(void);
 
 #endif
@@ -6,7 +6,45 @@ typedef struct {
     char *params;      
 } Message;
 
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+
 char *serialize_message(Message *mes);
-Message *deserialize_message(char *buffer);
+size_t serialized_message_size(Message *mes);
+Message *deserialize_message(char *buffer, size_t len);
+void free_message(Message *mes);
+
+/* Calls by numeric function ID: u32 ID followed by the raw params */
+char *serialize_id_message(uint32_t func_id, const char *params, size_t *out_len);
+Message *deserialize_id_message(char *buffer, size_t len, uint32_t *func_id);
+
+/*
+ * Zero-copy view of a request: the slices point into the decoded buffer and
+ * are not NUL-terminated. params always runs to the end of the buffer.
+ */
+typedef struct {
+    const char *func_name;
+    size_t func_name_len;
+    const char *params;
+    size_t params_len;
+} MessageView;
+
+int deserialize_message_view(const char *buffer, size_t len, MessageView *view);
+int deserialize_id_message_view(const char *buffer, size_t len, uint32_t *func_id, MessageView *view);
+
+/* Encode into a caller-provided buffer; returns bytes written, 0 if it doesn't fit */
+size_t serialize_message_into(char *buffer, size_t capacity, const char *func_name, const char *params);
+size_t serialize_id_message_into(char *buffer, size_t capacity, uint32_t func_id, const char *params);
+
+/*
+ * Typed calls (MSG_TYPED_REQUEST): u32 function ID (BATCH_NO_FUNC_ID is
+ * followed by a u32 name length and the name), then u8 argument count and the values.
+ * The view's params are the argument block, count byte included.
+ */
+size_t serialized_typed_message_size(const char *func_name, uint32_t func_id, const rpc_value *args, int num_args);
+size_t serialize_typed_message_into(char *buffer, size_t capacity, const char *func_name, uint32_t func_id,
+                                    const rpc_value *args, int num_args);
+int deserialize_typed_message_view(const char *buffer, size_t len, uint32_t *func_id, MessageView *view);
 
 #endif
@@ -3,11 +3,40 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/uio.h>
 
 /* Message types */
 #define MSG_REQUEST  0x01
 #define MSG_RESPONSE 0x02
 #define MSG_ERROR    0x03
+#define MSG_FUNC_TABLE_REQUEST 0x04  /* client asks for the name -> ID table */
+#define MSG_FUNC_TABLE         0x05  /* u32 count, then u32 id + u32 name_len + name per entry */
+#define MSG_REQUEST_BY_ID      0x06  /* u32 function ID followed by the raw params */
+#define MSG_BATCH_REQUEST      0x07  /* u32 count, u8 flags, then per call: u32 ID, u32 name_len, name, u32 params_len, params */
+#define MSG_BATCH_RESPONSE     0x08  /* u32 count, then per call: u8 error_code, u32 len, result */
+#define MSG_STREAM_REQUEST     0x09  /* u32 function ID, u32 name_len, name; params follow as MSG_STREAM_DATA */
+#define MSG_STREAM_DATA        0x0A  /* up to STREAM_CHUNK_SIZE bytes of params (to server) or result (to client) */
+#define MSG_STREAM_END         0x0B  /* sender has no more data for this stream */
+#define MSG_STREAM_CREDIT      0x0C  /* u32: receiver consumed that many bytes, the sender may send as many more */
+#define MSG_STREAM_CANCEL      0x0D  /* client abandons the stream */
+#define MSG_TYPED_REQUEST      0x0E  /* u32 function ID [u32 name_len, name], u8 argc, argc values; reply is one value */
+#define MSG_CANCEL             0x0F  /* client no longer wants the reply; a call not yet started is skipped */
+
+/* Flags carried in the top bits of msg_type */
+#define MSG_FLAG_COMPRESSED 0x80    /* payload is compress_frame() output */
+#define MSG_FLAG_DICTIONARY 0x40    /* ... compressed against the negotiated dictionary */
+#define MSG_TYPE_MASK       0x3F
+
+/* Capabilities exchanged in the function table handshake */
+#define FEATURE_COMPRESSION 0x01    /* peer can decode compressed frames */
+
+/* Batch calls */
+#define BATCH_FLAG_PARALLEL 0x01        /* server may spread the calls over its workers */
+#define BATCH_NO_FUNC_ID    0xFFFFFFFFu /* entry is called by name instead of ID (streams too) */
+
+/* Streamed calls: each direction has at most STREAM_WINDOW bytes in flight */
+#define STREAM_CHUNK_SIZE MAX_PAYLOAD_SIZE
+#define STREAM_WINDOW     (64 * 1024)
 
 /* Error codes */
 #define ERR_NONE               0
@@ -16,16 +45,20 @@
 #define ERR_SERIALIZATION      3
 #define ERR_NETWORK            4
 #define ERR_TIMEOUT            5
+#define ERR_SERVER_BUSY        6
+#define ERR_CANCELLED          7
 
 /* Data types */
 #define TYPE_INT    0x01
 #define TYPE_FLOAT  0x02
 #define TYPE_STRING 0x03
 #define TYPE_VOID   0x04
+#define TYPE_BYTES  0x05
 
 #define MAX_FUNCTION_NAME 64
 #define MAX_ARGS          10
 #define MAX_PAYLOAD_SIZE  4096
+#define MAX_BATCH_PAYLOAD_SIZE (1024 * 1024)
 
 typedef struct {
     uint8_t  msg_type;
@@ -34,6 +67,9 @@ typedef struct {
     uint8_t  error_code;
 } __attribute__((packed)) MessageHeader;
 
+/* Size of a header on the wire (fields in network byte order) */
+#define MESSAGE_HEADER_SIZE sizeof(MessageHeader)
+
 /* RPC request/response metadata (optional future use) */
 typedef struct {
     char    function_name[MAX_FUNCTION_NAME];
@@ -47,11 +83,55 @@ typedef struct {
     uint8_t error_code;
 } __attribute__((packed)) RPCResponse;
 
+/*
+ * A typed argument or result. On the wire it is a u8 TYPE_* tag followed by
+ * the value: TYPE_INT and TYPE_FLOAT take 4 bytes in network order,
+ * TYPE_STRING is laid out as by serialize_string (so it arrives
+ * NUL-terminated), TYPE_BYTES is a u32 length and the bytes, TYPE_VOID is
+ * the tag alone. data is not owned by the value.
+ */
+typedef struct {
+    uint8_t     type;
+    int32_t     i;
+    float       f;
+    const char *data;   /* TYPE_STRING, TYPE_BYTES */
+    size_t      len;
+} rpc_value;
+
+static inline rpc_value rpc_int(int32_t i)
+{
+    rpc_value value = { TYPE_INT, i, 0, NULL, 0 };
+    return value;
+}
+
+static inline rpc_value rpc_float(float f)
+{
+    rpc_value value = { TYPE_FLOAT, 0, f, NULL, 0 };
+    return value;
+}
+
+static inline rpc_value rpc_string(const char *s)
+{
+    rpc_value value = { TYPE_STRING, 0, 0, s, 0 };
+    while (s != NULL && s[value.len] != '\0')
+        value.len++;
+    return value;
+}
+
+static inline rpc_value rpc_bytes(const void *data, size_t len)
+{
+    rpc_value value = { TYPE_BYTES, 0, 0, (const char *)data, len };
+    return value;
+}
+
 /* Header helpers */
 MessageHeader create_message_header(uint8_t type,
                                     uint32_t req_id,
                                     uint32_t payload_len);
 
+void encode_message_header(const MessageHeader *header, uint8_t *buffer);
+void decode_message_header(const uint8_t *buffer, MessageHeader *header);
+
 /* Serialization helpers */
 int serialize_int(uint8_t *buffer, int value);
 int deserialize_int(const uint8_t *buffer, int *value);
@@ -62,14 +142,57 @@ int deserialize_float(const uint8_t *buffer, float *value);
 int serialize_string(uint8_t *buffer, const char *str, size_t max_len);
 int deserialize_string(const uint8_t *buffer, char *str, size_t max_len);
 
+/* Typed values: serialize_value writes serialized_value_size(value) bytes.
+ * deserialize_value returns the bytes consumed, or -1 if the value is
+ * malformed or runs past len; strings and bytes point into buffer */
+size_t serialized_value_size(const rpc_value *value);
+int serialize_value(uint8_t *buffer, const rpc_value *value);
+int deserialize_value(const uint8_t *buffer, size_t len, rpc_value *value);
+
 /* Network helpers */
 int send_message(int sockfd,
                  const MessageHeader *header,
                  const void *payload);
 
+/* Send a frame already encoded as header + payload in one buffer */
+int send_frame(int sockfd, const void *frame, size_t len);
+
+/* Gather-write every iovec with as few sendmsg calls as possible (iov is modified) */
+int send_iov(int sockfd, struct iovec *iov, int iovcnt);
+
 int recv_message(int sockfd,
                  MessageHeader *header,
                  void *payload,
                  size_t max_payload);
 
+/* Like recv_message, but grows *payload (realloc) up to max_payload as needed */
+int recv_message_alloc(int sockfd,
+                       MessageHeader *header,
+                       uint8_t **payload,
+                       size_t *capacity,
+                       size_t max_payload);
+
+struct shm_channel;
+
+/*
+ * Buffered reader: each recv pulls in as much as the buffer holds, so
+ * pipelined frames are parsed out of one read instead of two reads apiece.
+ */
+typedef struct {
+    int      sockfd;
+    struct shm_channel *channel;    /* read from these rings instead of sockfd if set */
+    uint8_t *buffer;
+    size_t   capacity;      /* grows to fit frames up to max_payload */
+    size_t   start;         /* first unparsed byte */
+    size_t   end;           /* end of received data */
+    size_t   max_payload;
+} frame_reader;
+
+int  frame_reader_init(frame_reader *reader, int sockfd, size_t capacity, size_t max_payload);
+/* *payload points into the buffer until the next call; the byte after it may be overwritten */
+int  frame_reader_next(frame_reader *reader, MessageHeader *header, uint8_t **payload);
+/* Non-zero if another complete frame is already buffered (no recv needed) */
+int  frame_reader_buffered(const frame_reader *reader);
+void frame_reader_free(frame_reader *reader);
+
 #endif /* PROTOCOL_H */
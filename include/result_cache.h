@@ -0,0 +1,51 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Results of pure functions, keyed on (function, params). The cache is
+ * split into shards by key hash, each with its own lock, a share of the
+ * memory budget and a CLOCK ring for eviction. A new result only displaces
+ * the CLOCK victim if its key has been asked for more often lately, going by
+ * a per-shard count-min sketch that halves itself now and then (TinyLFU), so
+ * a scan over many one-off keys cannot flush the hot ones.
+ */
+#define RESULT_CACHE_SHARDS 16
+
+typedef struct result_cache result_cache;
+
+typedef struct {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long inserts;
+    unsigned long long rejected;    /* not admitted: colder than what it would evict, or too large */
+    unsigned long long evictions;
+    unsigned long long expired;     /* dropped when their function's TTL ran out */
+    size_t entries;
+    size_t bytes;                   /* keys, results and per-entry overhead */
+    size_t max_bytes;
+    double hit_ratio;               /* hits / (hits + misses), 0 before any lookup */
+} result_cache_stats;
+
+/* Memory for a hit's copy of the result */
+typedef void *(*result_cache_alloc)(void *arg, size_t size);
+
+result_cache *result_cache_create(size_t max_bytes);
+void result_cache_destroy(result_cache *cache);
+
+/* On a hit copy the result into memory from alloc (len + 1 bytes, NUL-terminated)
+ * and return 0; -1 on a miss or if alloc fails. params may be NULL, which is a
+ * different key from empty params. func_key names the function and the build
+ * of its code, so results of code since replaced are never returned */
+int result_cache_get(result_cache *cache, uint64_t func_key, const char *params, size_t params_len,
+                     result_cache_alloc alloc, void *alloc_arg, char **result, size_t *result_len);
+/* Offer a fresh result; ttl_ms 0 keeps it until evicted */
+void result_cache_put(result_cache *cache, uint64_t func_key, const char *params, size_t params_len,
+                      const char *result, size_t result_len, uint32_t ttl_ms);
+/* Forget every result, e.g. after the functions changed */
+void result_cache_clear(result_cache *cache);
+void result_cache_get_stats(result_cache *cache, result_cache_stats *stats);
+
+#endif
@@ -1,8 +1,195 @@
 #ifndef RPC_CLIENT_H
 #define RPC_CLIENT_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+#include "compress.h"
+
+/* Handle for a call that is in flight; many may share the connection */
+typedef struct rpc_future rpc_future;
+
+/* Completion callback: result is NULL when error_code != ERR_NONE and is
+ * freed after the callback returns, so copy it to keep it. */
+typedef void (*rpc_callback)(const char *result, int error_code, void *user_data);
+
+/* One entry of rpc_call_batch: result (caller frees) is set when error_code == ERR_NONE */
+typedef struct {
+    const char *func_name;
+    const char *params;
+    char *result;
+    int error_code;
+} rpc_batch_call;
+
+/* Receives a streamed result chunk by chunk; return non-zero to cancel the call */
+typedef int (*rpc_stream_callback)(const char *data, size_t len, void *user_data);
+
+/* Let the server execute the batch's calls in parallel (BATCH_FLAG_PARALLEL) */
+#define RPC_BATCH_PARALLEL 0x01
+
 int rpc_client_init(const char *server_ip, int port);
 char* rpc_call(const char *func_name, const char *params);
+int rpc_last_error();
+
+/* Calls by the numeric ID negotiated at connect time (see rpc_function_id) */
+long rpc_function_id(const char *func_name);
+char* rpc_call_by_id(uint32_t func_id, const char *params);
+rpc_future *rpc_call_by_id_async(uint32_t func_id, const char *params);
+
+/* Typed call (see rpc_server_register_function_typed): args are sent as binary
+ * values and checked against the function's signature. A string or bytes
+ * *result is malloc'd, release it with rpc_value_free. Returns 0, or -1 (see rpc_last_error) */
+int rpc_call_typed(const char *func_name, const rpc_value *args, int num_args, rpc_value *result);
+void rpc_value_free(rpc_value *value);
+
+/* For generated stubs (see rpcgen): send the payload_len bytes already encoded
+ * at frame + MESSAGE_HEADER_SIZE as a msg_type request and wait for the reply,
+ * returned as a malloc'd *reply of *reply_len bytes with a spare byte after it.
+ * Returns 0, or -1 (see rpc_last_error) */
+int rpc_call_frame(uint8_t msg_type, char *frame, size_t payload_len, char **reply, size_t *reply_len);
+/* Lets a stub report a reply it could not decode */
+void rpc_set_last_error(int error_code);
+
+/* Many calls in one frame and one response; returns -1 if the batch as a whole failed */
+int rpc_call_batch(rpc_batch_call *calls, size_t count, int flags);
+
+/* Params of any size go out as a flow-controlled sequence of chunks, and the
+ * result is handed to callback as it arrives or, with callback NULL, collected
+ * into a malloc'd NUL-terminated *result of *result_len bytes. Other calls keep
+ * flowing on the connection meanwhile. Returns 0, or -1 (see rpc_last_error) */
+int rpc_call_stream(const char *func_name, const void *params, size_t params_len,
+                    rpc_stream_callback callback, void *user_data,
+                    char **result, size_t *result_len);
 void rpc_client_disconnect();
 
-#endif
\ No newline at end of file
+/* Compression: requests of at least threshold bytes (0 = off, the default) are
+ * compressed if the server supports it; replies are decoded either way. A
+ * dictionary only helps when the server loaded the same one, and must be set
+ * before rpc_client_init */
+void rpc_client_set_compression(size_t threshold);
+int rpc_client_set_dictionary(const void *data, size_t len);
+void rpc_client_get_compression_stats(compress_stats *stats);
+
+/* Asynchronous API: responses are matched by request ID and may complete in any order */
+rpc_future *rpc_call_async(const char *func_name, const char *params);
+int rpc_call_async_cb(const char *func_name, const char *params,
+                      rpc_callback callback, void *user_data);
+int rpc_future_poll(rpc_future *future);
+int rpc_future_wait(rpc_future *future, int timeout_ms);
+char *rpc_future_result(rpc_future *future);
+int rpc_future_error(rpc_future *future);
+void rpc_future_free(rpc_future *future);
+
+/*
+ * Client handles. Each rpc_client owns a pool of connections to one server,
+ * or to each of several replicas of it, and is safe to share between threads;
+ * the rpc_* calls above all go through a process-wide handle created by
+ * rpc_client_init. Connections beyond min_connections are opened lazily, up
+ * to max_connections per endpoint.
+ */
+typedef struct rpc_client rpc_client;
+
+typedef enum {
+    RPC_POOL_AFFINITY = 0,  /* each thread sticks to one connection, assigned round robin */
+    RPC_POOL_LEAST_BUSY     /* each call takes the connection with the fewest calls in flight */
+} rpc_pool_policy;
+
+/* How calls are spread over replicas. Endpoints that fail to connect are
+ * ejected and probed again every probe_interval_ms, backing off while they
+ * stay down */
+typedef enum {
+    RPC_BALANCE_ROUND_ROBIN = 0,
+    RPC_BALANCE_P2C,        /* fewer calls in flight of two random endpoints */
+    RPC_BALANCE_EWMA        /* as P2C, with calls in flight weighted by average latency */
+} rpc_balance_policy;
+
+typedef struct {
+    const char *host;
+    int port;
+} rpc_endpoint;
+
+/* Initialize with designators ({ .max_connections = 4 }); fields left out are 0 */
+typedef struct {
+    int min_connections;        /* opened by rpc_client_create; 0 defers even the first */
+    int max_connections;
+    rpc_pool_policy policy;
+    size_t compress_threshold;  /* as rpc_client_set_compression */
+    const void *dictionary;     /* as rpc_client_set_dictionary, copied */
+    size_t dictionary_len;
+    rpc_balance_policy balance;
+    int probe_interval_ms;      /* 0 for the default of one second */
+    int hedge_budget_percent;   /* hedge at most this share of idempotent calls; 0 = never */
+    int hedge_delay_us;         /* wait before hedging; 0 = the recent 95th percentile latency */
+    int shm_spin_us;            /* shm: endpoints: spin this long for a reply before sleeping; 0 sleeps at once */
+} rpc_client_config;
+
+typedef struct {
+    int connections;            /* currently open */
+    int max_connections;
+    int in_flight;              /* calls awaiting a response, across the pool */
+    unsigned long long connects;  /* connections opened over the handle's life */
+} rpc_pool_stats;
+
+typedef struct {
+    char host[128];             /* "unix:/path" for a local socket endpoint */
+    int port;
+    int connections;
+    int in_flight;
+    double latency_us;          /* average round trip, measured under RPC_BALANCE_EWMA only */
+    int ejected;
+} rpc_endpoint_stats;
+
+/* config may be NULL for one connection. Returns NULL if the initial connections fail */
+rpc_client *rpc_client_create(const char *server_ip, int port, const rpc_client_config *config);
+/* Up to 64 endpoints; fails only if none of them can be reached */
+rpc_client *rpc_client_create_multi(const rpc_endpoint *endpoints, int count, const rpc_client_config *config);
+/* As rpc_client_init, for the process-wide handle, over replicas of the server */
+int rpc_client_init_multi(const rpc_endpoint *endpoints, int count, rpc_balance_policy balance);
+/* Outstanding futures of the handle must be freed first */
+void rpc_client_destroy(rpc_client *client);
+void rpc_client_get_pool_stats(rpc_client *client, rpc_pool_stats *stats);
+/* Fills at most max entries, returns how many */
+int rpc_client_get_endpoint_stats(rpc_client *client, rpc_endpoint_stats *stats, int max);
+
+char *rpc_client_call(rpc_client *client, const char *func_name, const char *params);
+char *rpc_client_call_by_id(rpc_client *client, uint32_t func_id, const char *params);
+long rpc_client_function_id(rpc_client *client, const char *func_name);
+rpc_future *rpc_client_call_async(rpc_client *client, const char *func_name, const char *params);
+rpc_future *rpc_client_call_by_id_async(rpc_client *client, uint32_t func_id, const char *params);
+int rpc_client_call_async_cb(rpc_client *client, const char *func_name, const char *params,
+                             rpc_callback callback, void *user_data);
+int rpc_client_call_typed(rpc_client *client, const char *func_name, const rpc_value *args, int num_args,
+                          rpc_value *result);
+int rpc_client_call_frame(rpc_client *client, uint8_t msg_type, char *frame, size_t payload_len,
+                          char **reply, size_t *reply_len);
+int rpc_client_call_batch(rpc_client *client, rpc_batch_call *calls, size_t count, int flags);
+int rpc_client_call_stream(rpc_client *client, const char *func_name, const void *params, size_t params_len,
+                           rpc_stream_callback callback, void *user_data,
+                           char **result, size_t *result_len);
+
+/*
+ * Hedged requests. A blocking call (rpc_call, rpc_call_by_id, rpc_call_typed
+ * or a generated stub) to a function marked idempotent that has no reply
+ * within the hedge delay is sent a second time, to another replica if there
+ * is one or else over another pooled connection. The first successful reply
+ * wins and the other attempt is cancelled. Asynchronous, batched and streamed
+ * calls are never hedged.
+ */
+typedef struct {
+    unsigned long long calls;   /* calls that could have been hedged */
+    unsigned long long hedged;  /* ... and were */
+    unsigned long long won;     /* ... where the hedge answered first */
+    unsigned long long denied;  /* slow calls not hedged because the budget was spent */
+    double delay_us;            /* current hedge delay */
+} rpc_hedge_stats;
+
+int rpc_client_mark_idempotent(rpc_client *client, const char *func_name);
+void rpc_client_get_hedge_stats(rpc_client *client, rpc_hedge_stats *stats);
+
+/* The same for the rpc_call family: rpc_client_set_hedging applies from the
+ * next rpc_client_init, marks go on the current connection */
+void rpc_client_set_hedging(int budget_percent, int delay_us);
+int rpc_mark_idempotent(const char *func_name);
+void rpc_get_hedge_stats(rpc_hedge_stats *stats);
+
+#endif
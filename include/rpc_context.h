@@ -0,0 +1,117 @@
+#ifndef RPC_CONTEXT_H
+#define RPC_CONTEXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "protocol.h"
+
+/*
+ * Handed to functions registered with rpc_server_register_function_ctx().
+ * Memory from rpc_alloc() belongs to the request: it must not be freed and is
+ * released all at once after the response has been sent, so a function can
+ * return a result allocated from it.
+ */
+typedef struct rpc_context rpc_context;
+
+struct rpc_context {
+    void *(*alloc)(rpc_context *ctx, size_t size);
+    void *allocator;        /* server-side arena behind alloc */
+    uint32_t request_id;
+};
+
+/* Arena-aware function: char *f(rpc_context *ctx, const char *params) */
+typedef char *(*rpc_ctx_func)(rpc_context *ctx, const char *params);
+
+static inline void *rpc_alloc(rpc_context *ctx, size_t size) {
+    return ctx->alloc(ctx, size);
+}
+
+static inline char *rpc_strdup(rpc_context *ctx, const char *s) {
+    size_t len = strlen(s);
+    char *copy = rpc_alloc(ctx, len + 1);
+    if (copy != NULL) {
+        memcpy(copy, s, len + 1);
+    }
+    return copy;
+}
+
+/*
+ * Output buffer for functions registered with rpc_server_register_function_buf().
+ * data points just past the response header in the frame the server will
+ * send, so bytes written here go to the socket without another copy. Set len
+ * to the number of bytes produced; call grow() (or rpc_output_reserve) before
+ * writing past capacity, which may move data.
+ */
+typedef struct rpc_output rpc_output;
+
+struct rpc_output {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int (*grow)(rpc_output *out, size_t min_capacity);    /* 0 on success */
+    void *allocator;
+};
+
+/* Buffer-ABI function: int f(const char *params, rpc_output *out), 0 on success */
+typedef int (*rpc_buf_func)(const char *params, rpc_output *out);
+
+static inline int rpc_output_reserve(rpc_output *out, size_t extra) {
+    if (out->capacity - out->len >= extra) {
+        return 0;
+    }
+    return out->grow(out, out->len + extra);
+}
+
+static inline int rpc_output_append(rpc_output *out, const void *data, size_t len) {
+    if (rpc_output_reserve(out, len) != 0) {
+        return -1;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return 0;
+}
+
+/*
+ * Byte stream for functions registered with rpc_server_register_function_stream().
+ * Such a call runs on its own thread. read() blocks until params arrive and
+ * returns the number of bytes copied, 0 once the client has sent everything,
+ * or -1 if the call was cancelled. write() blocks while the client's window is
+ * full and returns 0, or -1 if the call was cancelled. Neither direction holds
+ * more than STREAM_WINDOW bytes, however large the transfer.
+ */
+typedef struct rpc_stream rpc_stream;
+
+struct rpc_stream {
+    long (*read)(rpc_stream *stream, void *buf, size_t len);
+    int (*write)(rpc_stream *stream, const void *data, size_t len);
+    void *state;    /* server-side stream behind read/write */
+};
+
+/* Streaming function: int f(rpc_stream *stream), 0 on success */
+typedef int (*rpc_stream_func)(rpc_stream *stream);
+
+/*
+ * Typed function, registered with rpc_server_register_function_typed(): args
+ * holds the arguments the signature lists, already type-checked, with strings
+ * and bytes pointing into the request. Fill in result's field for the return
+ * type (string and bytes data may come from rpc_alloc) and return 0.
+ */
+typedef int (*rpc_typed_func)(rpc_context *ctx, const rpc_value *args, rpc_value *result);
+
+/*
+ * Raw typed function, the form rpcgen skeletons take: args is the encoded
+ * argument block of a typed request (u8 count, then tagged values), decoded
+ * by the function itself, and the encoded result value goes into out.
+ */
+typedef int (*rpc_raw_func)(rpc_context *ctx, const char *args, size_t args_len, rpc_output *out);
+
+static inline long rpc_stream_read(rpc_stream *stream, void *buf, size_t len) {
+    return stream->read(stream, buf, len);
+}
+
+static inline int rpc_stream_write(rpc_stream *stream, const void *data, size_t len) {
+    return stream->write(stream, data, len);
+}
+
+#endif
@@ -1,10 +1,87 @@
 #ifndef RPC_SERVER_H
 #define RPC_SERVER_H
 
+#include "server.h"
+#include "thread_pool.h"
+#include "compress.h"
+#include "result_cache.h"
+#include "rpc_context.h"
+
+typedef struct {
+    server_mode mode;   /* SERVER_MODE_THREADED (default), SERVER_MODE_EPOLL or SERVER_MODE_URING */
+    int io_threads;     /* event loop threads for SERVER_MODE_EPOLL/URING, 0 = one per CPU */
+
+    /* Function executor for the event loop modes. With max_workers == 0 functions
+     * run inline on the I/O thread that decoded the request. */
+    thread_pool_config executor;
+    
+    /* Replies and stream chunks at least this large are compressed for clients
+     * that negotiated it; 0 never compresses (compressed requests are still accepted) */
+    size_t compress_threshold;
+    
+    /* Connections on shm: addresses spin up to this long waiting for the next
+     * request before they sleep; 0 sleeps at once */
+    int shm_spin_us;
+    
+    /* Event loop modes: one I/O thread per CPU, pinned to it and accepting on its
+     * own SO_REUSEPORT socket, so a connection stays on the core that accepted it */
+    int sharded;
+    
+    /* Memory for cached results of functions marked with rpc_server_set_pure;
+     * 0 caches nothing */
+    size_t cache_bytes;
+} rpc_server_config;
+
 int rpc_server_init(int port, const char *lib_path);
+int rpc_server_init_ex(int port, const char *lib_path, const rpc_server_config *config);
+/* Accept connections on another address too, e.g. "unix:/run/rpc.sock" or
+ * "shm:/run/rpc.sock"; call before rpc_server_start */
+int rpc_server_listen(const char *address);
+/* Load another function library under name: its functions are registered, and
+ * called, as "name.function". Call after rpc_server_init */
+int rpc_server_add_library(const char *name, const char *lib_path);
 int rpc_server_register_function(const char *func_name);
+/* Register a char *f(rpc_context *ctx, const char *params) function, see rpc_context.h */
+int rpc_server_register_function_ctx(const char *func_name);
+/* Register an int f(const char *params, rpc_output *out) function writing straight into the reply */
+int rpc_server_register_function_buf(const char *func_name);
+/* Register an int f(rpc_stream *stream) function reading params and writing its result in chunks */
+int rpc_server_register_function_stream(const char *func_name);
+/* Register an int f(rpc_context *ctx, const rpc_value *args, rpc_value *result) function
+ * whose argument and return types are given by signature (function_name names it) */
+int rpc_server_register_function_typed(const RPCRequest *signature);
+/* Register a function linked into the server, under the ID func_id it must
+ * receive (as rpcgen's registration tables do); fails, registering nothing, if
+ * another ID would come up */
+int rpc_server_register_function_raw(const char *func_name, rpc_raw_func func, uint32_t func_id);
+/* Mark a registered function pure: its result depends on its params alone, so
+ * repeated calls may be answered from the result cache. A cached result is
+ * reused for at most ttl_ms (0 = until evicted) */
+int rpc_server_set_pure(const char *func_name, unsigned int ttl_ms);
+/* Result cache counters, all zero without a cache */
+void rpc_server_get_cache_stats(result_cache_stats *stats);
+int rpc_server_freeze_functions();
+/* Swap in a new build of a function library while serving: its registered functions
+ * keep their IDs, calls in flight finish on the old code before it is unloaded.
+ * Blocks until they have; must not be called from a registered function.
+ * name NULL is the library given to rpc_server_init, lib_path NULL reloads the
+ * library from where it was loaded. Other libraries are not touched */
+int rpc_server_reload_library(const char *name, const char *lib_path);
+/* rpc_server_reload_library(NULL, lib_path) */
+int rpc_server_reload(const char *lib_path);
 void rpc_server_start();
+/* Make rpc_server_start return. Only sets a flag and wakes the loops, so it may
+ * be called from a signal handler; rpc_server_shutdown closes the listeners and
+ * releases the rest */
+void rpc_server_stop();
 void rpc_server_shutdown();
 void rpc_handle_client(int client_socket);
+/* As rpc_handle_client, for the control socket of a shm: connection */
+void rpc_handle_shm_client(int control_socket);
+int rpc_server_get_executor_stats(thread_pool_stats *stats);
+/* Offer a shared dictionary (see compress_train_dictionary) to clients holding the same one */
+int rpc_server_set_dictionary(const void *data, size_t len);
+/* Compression counters for this process */
+void rpc_server_get_compression_stats(compress_stats *stats);
 
-#endif
\ No newline at end of file
+#endif
@@ -2,13 +2,60 @@
 #define SERVER_H
 
 #include <stddef.h>
+#include <sys/uio.h>
 
 typedef void (*client_handler_func)(int client_socket);
 
+/* Connection handling strategy, chosen at init time */
+typedef enum {
+    SERVER_MODE_THREADED = 0,   /* one blocking thread per connection */
+    SERVER_MODE_EPOLL,          /* edge-triggered epoll reactor on a fixed set of I/O threads */
+    SERVER_MODE_URING           /* io_uring completion loop per I/O thread, epoll if unavailable */
+} server_mode;
+
+/* A connection owned by the event loop */
+typedef struct server_conn server_conn;
+
+/* Called with the bytes buffered for a connection. Returns the number of bytes
+ * consumed (one frame), 0 if the frame is not complete yet, or -1 to drop the
+ * connection. The buffer is only valid during the call; it is writable and
+ * has one spare byte past len, so a frame can be NUL-terminated in place. */
+typedef long (*frame_handler_func)(server_conn *conn, char *data, size_t len);
+
 int server_init(int port);
+/* Also accept on address: "unix:/path" or "[host]:port" */
+int server_listen(const char *address);
 int server_accept_clients(client_handler_func handler);
+/* Handler for connections on shm: addresses, run on a thread per connection in either mode */
+void server_set_channel_handler(client_handler_func handler);
+/* Event loop modes: pin each I/O thread to a CPU (default one thread per CPU) and give
+ * each its own SO_REUSEPORT TCP listener. Call before server_init */
+void server_set_sharded(int enabled);
 int server_send(int client_socket, const char* data, size_t len);
 int server_receive(int client_socket, char* buffer, size_t buffer_size);
+/* Make the accept and event loops return; async-signal-safe */
+void server_stop();
+/* After the loops have returned: server_stop, then close the listeners */
 void server_shutdown();
 
-#endif
\ No newline at end of file
+/* Event loop API */
+int server_run_event_loop(frame_handler_func handler, int io_threads);
+/* Same contract on io_uring: multishot accept and recv, batched submission.
+ * Falls back to server_run_event_loop where the kernel lacks it */
+int server_run_uring_loop(frame_handler_func handler, int io_threads);
+int server_conn_send(server_conn *conn, const char *data, size_t len);
+/* Gather variant of server_conn_send (at most 8 iovecs), e.g. header and payload without a copy */
+int server_conn_sendv(server_conn *conn, const struct iovec *iov, int iovcnt);
+int server_conn_fd(const server_conn *conn);
+
+/* Per-connection state for the frame handler (I/O thread only). on_close runs
+ * on the I/O thread once the connection is closed, before its last release. */
+void server_conn_set_data(server_conn *conn, void *data, void (*on_close)(void *data));
+void *server_conn_get_data(const server_conn *conn);
+
+/* Connections are reference counted so other threads can send on them after
+ * the event loop has let go; server_conn_send is safe from any thread. */
+void server_conn_retain(server_conn *conn);
+void server_conn_release(server_conn *conn);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef SHM_CHANNEL_H
+#define SHM_CHANNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Shared-memory transport for a client on the same host. The server creates
+ * a memfd holding two single-producer/single-consumer byte rings, requests
+ * one way and replies the other, and passes it over the connection's Unix
+ * domain control socket. Frames then travel through the rings exactly as
+ * they would through a socket.
+ *
+ * A side waiting for data (or for room) spins for a while before it sleeps on
+ * a futex, and the other side only makes the wake-up syscall when someone is
+ * actually asleep. With both sides busy a call costs no syscalls at all. The
+ * control socket stays open to show the peer is alive.
+ */
+#define SHM_RING_SIZE        (1024 * 1024)   /* bytes per direction, a power of two */
+#define SHM_DEFAULT_SPIN_US  50              /* spin budget for callers that pass no config */
+
+typedef struct shm_channel shm_channel;
+
+/* Server side: map new rings and hand them to the client on control_fd */
+shm_channel *shm_channel_serve(int control_fd, size_t ring_size, int spin_us);
+/* Client side: map the rings the server sent over control_fd */
+shm_channel *shm_channel_join(int control_fd, int spin_us);
+
+/* Write every byte, waiting for room as needed; callers serialize writers */
+int shm_channel_sendv(shm_channel *channel, const struct iovec *iov, int iovcnt);
+/* Read what is available, up to len bytes, waiting for at least one.
+ * Returns 0 once the channel is shut down or the peer is gone, -1 on error */
+ssize_t shm_channel_recv(shm_channel *channel, void *buf, size_t len);
+/* Read exactly len bytes */
+int shm_channel_read(shm_channel *channel, void *buf, size_t len);
+
+/* Fail waiting and future reads and writes on both sides */
+void shm_channel_shutdown(shm_channel *channel);
+/* Unmap the rings; the control socket is left to the caller */
+void shm_channel_close(shm_channel *channel);
+
+static inline void shm_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+
+typedef void (*task_func)(void *arg);
+
+typedef struct thread_pool thread_pool;
+
+typedef struct {
+    int min_workers;        /* workers kept alive at all times */
+    int max_workers;        /* upper bound, equal to min_workers for a fixed pool */
+    size_t queue_capacity;  /* pending task slots, rounded up to a power of two */
+    int idle_timeout_ms;    /* extra workers above min_workers exit after this long idle */
+} thread_pool_config;
+
+typedef struct {
+    size_t queue_depth;             /* tasks waiting for a worker */
+    size_t queue_capacity;
+    int workers;                    /* live worker threads */
+    int busy_workers;               /* workers currently running a task */
+    double utilization;             /* busy share of worker time since the previous call, 0.0 - 1.0 */
+    unsigned long tasks_completed;
+    unsigned long tasks_rejected;   /* submits refused because the queue was full */
+} thread_pool_stats;
+
+/* API */
+thread_pool *thread_pool_create(const thread_pool_config *config);
+int thread_pool_submit(thread_pool *pool, task_func fn, void *arg);
+void thread_pool_get_stats(thread_pool *pool, thread_pool_stats *stats);
+void thread_pool_destroy(thread_pool *pool);
+
+#endif
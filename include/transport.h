@@ -0,0 +1,42 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+#include <sys/un.h>
+
+/*
+ * Stream socket transports. An address is either "unix:/path/to/socket" for
+ * an AF_UNIX socket on this host, or "host" / "host:port" for TCP. Both carry
+ * the same framing; only connection setup differs. "shm:/path/to/socket" is
+ * a Unix domain control socket whose connections switch to shared-memory
+ * rings once connected (see shm_channel.h).
+ */
+#define TRANSPORT_UNIX_PREFIX "unix:"
+#define TRANSPORT_SHM_PREFIX  "shm:"
+#define TRANSPORT_ADDR_MAX    128   /* longest address string, "unix:" plus a full sun_path */
+
+/* transport_listen flags */
+#define TRANSPORT_LISTEN_REUSEPORT 1    /* TCP: let further sockets bind the same port and share its connections */
+
+typedef enum {
+    TRANSPORT_TCP = 0,
+    TRANSPORT_UNIX,
+    TRANSPORT_SHM       /* set up over AF_UNIX like TRANSPORT_UNIX */
+} transport_kind;
+
+typedef struct {
+    transport_kind kind;
+    char host[64];      /* TCP: dotted quad, or empty / "*" for every interface when listening */
+    int port;
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+} transport_addr;
+
+/* API */
+int transport_parse(const char *address, int default_port, transport_addr *addr);
+int transport_connect(const transport_addr *addr);
+int transport_listen(const transport_addr *addr, int backlog, int flags);
+void transport_close_listener(int fd, const transport_addr *addr);
+void transport_tune(int fd, transport_kind kind);
+const char *transport_describe(const transport_addr *addr, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "arena.h"
+
+#define DEFAULT_BLOCK_SIZE 8192
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+struct arena_block {
+    arena_block *next;
+    size_t capacity;
+    size_t offset;
+    _Alignas(max_align_t) char data[];
+};
+
+static arena_block *block_create(size_t capacity) {
+    arena_block *block = malloc(sizeof(arena_block) + capacity);
+    if (block == NULL) {
+        printf("Error unable to allocate arena block\n");
+        return NULL;
+    }
+    block->next = NULL;
+    block->capacity = capacity;
+    block->offset = 0;
+    return block;
+}
+
+void arena_init(arena *a, size_t block_size) {
+    a->head = NULL;
+    a->current = NULL;
+    a->block_size = block_size > 0 ? block_size : DEFAULT_BLOCK_SIZE;
+    a->used = 0;
+    a->peak = 0;
+}
+
+void *arena_alloc(arena *a, size_t size) {
+    size_t rounded = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (rounded < size) {
+        return NULL;
+    }
+
+    // Bump within the current block, then any block kept from earlier requests
+    while (a->current != NULL) {
+        arena_block *block = a->current;
+        if (block->capacity - block->offset >= rounded) {
+            void *ptr = block->data + block->offset;
+            block->offset += rounded;
+            a->used += rounded;
+            return ptr;
+        }
+        if (block->next == NULL) {
+            break;
+        }
+        a->current = block->next;
+        a->current->offset = 0;
+    }
+
+    // Out of room: chain a new block, oversized requests get a block of their own
+    arena_block *block = block_create(rounded > a->block_size ? rounded : a->block_size);
+    if (block == NULL) {
+        return NULL;
+    }
+    if (a->current != NULL) {
+        a->current->next = block;
+    } else {
+        a->head = block;
+    }
+    a->current = block;
+
+    block->offset = rounded;
+    a->used += rounded;
+    return block->data;
+}
+
+void arena_reset(arena *a) {
+    if (a->used > a->peak) {
+        a->peak = a->used;
+    }
+    a->used = 0;
+
+    // Keep regular blocks for the next request, give oversized ones back
+    arena_block **link = &a->head;
+    while (*link != NULL) {
+        arena_block *block = *link;
+        if (block->capacity > a->block_size) {
+            *link = block->next;
+            free(block);
+            continue;
+        }
+        block->offset = 0;
+        link = &block->next;
+    }
+    a->current = a->head;
+}
+
+void arena_destroy(arena *a) {
+    arena_block *block = a->head;
+    while (block != NULL) {
+        arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    a->head = NULL;
+    a->current = NULL;
+}
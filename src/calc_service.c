@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "calc_rpc.h"
+
+/* Implementation of idl/calc.idl; the skeletons in the generated calc_server.c
+ * decode the arguments and call these */
+
+static atomic_int calc_call_count;
+
+int calc_add_impl(rpc_context *ctx, int32_t a, int32_t b, int32_t *result)
+{
+    (void)ctx;
+    atomic_fetch_add(&calc_call_count, 1);
+    *result = a + b;
+    return 0;
+}
+
+int calc_scale_impl(rpc_context *ctx, float x, float factor, float *result)
+{
+    (void)ctx;
+    atomic_fetch_add(&calc_call_count, 1);
+    *result = x * factor;
+    return 0;
+}
+
+int calc_repeat_impl(rpc_context *ctx, const char *text, int32_t count, const char **result)
+{
+    atomic_fetch_add(&calc_call_count, 1);
+    size_t text_len = strlen(text);
+    if (count < 0 || (text_len > 0 && (size_t)count > MAX_BATCH_PAYLOAD_SIZE / text_len)) return -1;
+
+    size_t len = text_len * (size_t)count;
+    char *out = rpc_alloc(ctx, len + 1);
+    if (!out) return -1;
+
+    for (int32_t i = 0; i < count; i++)
+        memcpy(out + i * text_len, text, text_len);
+
+    out[len] = '\0';
+    *result = out;
+    return 0;
+}
+
+/* Adler-32 */
+int calc_checksum_impl(rpc_context *ctx, const void *data, size_t data_len, int32_t *result)
+{
+    (void)ctx;
+    atomic_fetch_add(&calc_call_count, 1);
+
+    const uint8_t *bytes = data;
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < data_len; i++)
+    {
+        a = (a + bytes[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    *result = (int32_t)((b << 16) | a);
+    return 0;
+}
+
+int calc_reverse_impl(rpc_context *ctx, const void *data, size_t data_len, const void **result, size_t *result_len)
+{
+    atomic_fetch_add(&calc_call_count, 1);
+
+    const uint8_t *in = data;
+    uint8_t *out = rpc_alloc(ctx, data_len + 1);
+    if (!out) return -1;
+
+    for (size_t i = 0; i < data_len; i++)
+        out[i] = in[data_len - 1 - i];
+
+    *result = out;
+    *result_len = data_len;
+    return 0;
+}
+
+int calc_reset_impl(rpc_context *ctx)
+{
+    (void)ctx;
+    atomic_store(&calc_call_count, 0);
+    return 0;
+}
+
+int calc_calls_impl(rpc_context *ctx, int32_t *result)
+{
+    (void)ctx;
+    *result = atomic_load(&calc_call_count);
+    return 0;
+}
@@ -3,44 +3,45 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include <errno.h>
 #include "client.h"
+#include "transport.h"
 
 #define BUFFER_SIZE 4096
 
 static int client_socket = -1;
 
-int client_connect(const char* server_ip, int port) {
-    struct sockaddr_in server_addr;
+// Open a connection of our own; returns the socket or -1. server_ip may
+// also be a "unix:/path" address, in which case port is ignored
+
+int client_open(const char* server_ip, int port) {
+    transport_addr addr;
+    char name[TRANSPORT_ADDR_MAX];
     
-    client_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_socket < 0) {
-        perror("Error creating socket");
+    if (transport_parse(server_ip, port, &addr) != 0) {
         return -1;
     }
     
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;// IPv4
-    server_addr.sin_port = htons(port);             
-
-    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-        perror("Invalid address or address not supported");
-        close(client_socket);
-        client_socket = -1;
+    int sock = transport_connect(&addr);
+    if (sock < 0) {
         return -1;
     }
+    
+    printf("[Client] Connected to %s\n", transport_describe(&addr, name, sizeof(name)));
+    return sock;
+}
 
-    if (connect(client_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection failed");
-        close(client_socket);
-        client_socket = -1;
-        return -1;
+void client_close(int sock) {
+    if (sock >= 0) {
+        close(sock);
+
+        printf("[Client] Disconnected\n");
     }
-    
-    printf("[Client] Connected to %s:%d\n", server_ip, port);
-    return 0;
+}
+
+int client_connect(const char* server_ip, int port) {
+    client_socket = client_open(server_ip, port);
+    return client_socket >= 0 ? 0 : -1;
 }
 
 int client_send(const char* data, size_t len) {
@@ -97,11 +98,8 @@ int client_receive(char* buffer, size_t buffer_size) {
 }
 
 void client_disconnect() {
-    if (client_socket >= 0) {
-        close(client_socket);
-
-        printf("[Client] Disconnected\n");
-    }
+    client_close(client_socket);
+    client_socket = -1;
 }
 
 int client_get_socket() {
@@ -0,0 +1,572 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "compress.h"
+
+#define HASH_LOG      13
+#define HASH_SIZE     (1u << HASH_LOG)
+#define MIN_MATCH     4
+#define LAST_LITERALS 5     /* a block always ends with literals */
+#define MATCH_LIMIT   12    /* no match starts this close to the end */
+#define SKIP_TRIGGER  6     /* widen the search stride after 2^6 misses in a row */
+
+#define TRAIN_KMER     8
+#define TRAIN_HASH_LOG 16
+
+static atomic_ullong frames_compressed;
+static atomic_ullong frames_skipped;
+static atomic_ullong frames_decompressed;
+static atomic_ullong bytes_in;
+static atomic_ullong bytes_out;
+static atomic_ullong compress_ns;
+static atomic_ullong decompress_ns;
+
+/* Per-thread scratch, released when the thread exits */
+typedef struct {
+    uint8_t *work;              /* dictionary followed by the payload being compressed */
+    size_t work_capacity;
+    compress_buffer output;
+    compress_buffer input;
+} thread_scratch;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_key_once = PTHREAD_ONCE_INIT;
+
+static void free_thread_scratch(void *ptr) {
+    thread_scratch *scratch = (thread_scratch*)ptr;
+    free(scratch->work);
+    compress_buffer_free(&scratch->output);
+    compress_buffer_free(&scratch->input);
+    free(scratch);
+}
+
+static void create_scratch_key(void) {
+    pthread_key_create(&scratch_key, free_thread_scratch);
+}
+
+static thread_scratch *get_thread_scratch(void) {
+    pthread_once(&scratch_key_once, create_scratch_key);
+
+    thread_scratch *scratch = pthread_getspecific(scratch_key);
+    if (scratch == NULL) {
+        scratch = calloc(1, sizeof(thread_scratch));
+        if (scratch == NULL) {
+            return NULL;
+        }
+        pthread_setspecific(scratch_key, scratch);
+    }
+    return scratch;
+}
+
+static uint8_t *thread_work_buffer(size_t size) {
+    thread_scratch *scratch = get_thread_scratch();
+    if (scratch == NULL) {
+        return NULL;
+    }
+
+    if (scratch->work_capacity < size) {
+        uint8_t *grown = realloc(scratch->work, size);
+        if (grown == NULL) {
+            return NULL;
+        }
+        scratch->work = grown;
+        scratch->work_capacity = size;
+    }
+    return scratch->work;
+}
+
+compress_buffer *compress_output_buffer(void) {
+    thread_scratch *scratch = get_thread_scratch();
+    return scratch != NULL ? &scratch->output : NULL;
+}
+
+compress_buffer *compress_input_buffer(void) {
+    thread_scratch *scratch = get_thread_scratch();
+    return scratch != NULL ? &scratch->input : NULL;
+}
+
+static unsigned long long cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash4(uint32_t value) {
+    return (value * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// Length continuation bytes: 255 while more follows, then the remainder
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static int read_length(const uint8_t **ip, const uint8_t *end, size_t *len) {
+    unsigned byte;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+// Literals-only sequence that ends every block
+static uint8_t *put_last_literals(uint8_t *op, uint8_t *op_end, const uint8_t *anchor, size_t lit_len) {
+    if (op + 1 + (lit_len / 255) + 1 + lit_len > op_end) {
+        return NULL;
+    }
+
+    if (lit_len >= 15) {
+        *op++ = 15 << 4;
+        op = put_length(op, lit_len - 15);
+    } else {
+        *op++ = (uint8_t)(lit_len << 4);
+    }
+    memcpy(op, anchor, lit_len);
+    return op + lit_len;
+}
+
+/*
+ * Compress base[start, total): bytes before start are history (the
+ * dictionary) that matches may point into but which is not emitted. table
+ * holds the match finder state for that history.
+ */
+static size_t compress_range(const uint8_t *base, size_t start, size_t total, uint32_t *table,
+                             uint8_t *dst, size_t dst_capacity) {
+    const uint8_t *ip = base + start;
+    const uint8_t *anchor = ip;
+    const uint8_t *end = base + total;
+    const uint8_t *match_limit = total > MATCH_LIMIT ? end - MATCH_LIMIT : base;
+    const uint8_t *extend_limit = end - LAST_LITERALS;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_capacity;
+    unsigned misses = 0;
+
+    while (ip < match_limit) {
+        uint32_t sequence = read32(ip);
+        uint32_t h = hash4(sequence);
+        const uint8_t *ref = base + table[h];
+        table[h] = (uint32_t)(ip - base);
+
+        if (ref >= ip || ip - ref > COMPRESS_WINDOW || read32(ref) != sequence) {
+            // Incompressible stretches are skipped over faster and faster
+            ip += 1 + (misses++ >> SKIP_TRIGGER);
+            continue;
+        }
+        misses = 0;
+
+        // Grow the match backwards into the pending literals
+        while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+
+        const uint8_t *match_end = ip + MIN_MATCH;
+        const uint8_t *ref_end = ref + MIN_MATCH;
+        while (match_end < extend_limit && *match_end == *ref_end) {
+            match_end++;
+            ref_end++;
+        }
+
+        size_t lit_len = ip - anchor;
+        size_t match_len = (match_end - ip) - MIN_MATCH;
+        if (op + 1 + (lit_len / 255) + 1 + lit_len + 2 + (match_len / 255) + 1 > op_end) {
+            return 0;
+        }
+
+        uint8_t *token = op++;
+        if (lit_len >= 15) {
+            *token = 15 << 4;
+            op = put_length(op, lit_len - 15);
+        } else {
+            *token = (uint8_t)(lit_len << 4);
+        }
+        memcpy(op, anchor, lit_len);
+        op += lit_len;
+
+        size_t offset = ip - ref;
+        *op++ = (uint8_t)(offset & 0xFF);
+        *op++ = (uint8_t)(offset >> 8);
+
+        if (match_len >= 15) {
+            *token |= 15;
+            op = put_length(op, match_len - 15);
+        } else {
+            *token |= (uint8_t)match_len;
+        }
+
+        ip = match_end;
+        anchor = ip;
+
+        // Index a position inside the match so the next sequence can refer to it
+        if (ip < match_limit) {
+            table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+        }
+    }
+
+    op = put_last_literals(op, op_end, anchor, end - anchor);
+    return op != NULL ? (size_t)(op - dst) : 0;
+}
+
+size_t compress_block(const void *src, size_t src_len, void *dst, size_t dst_capacity, const compress_dict *dict) {
+    uint32_t table[HASH_SIZE];
+
+    if (dict == NULL || dict->len == 0) {
+        memset(table, 0, sizeof(table));
+        return compress_range(src, 0, src_len, table, dst, dst_capacity);
+    }
+
+    // Matches into the dictionary are plain back references once it sits in front of the payload
+    uint8_t *work = thread_work_buffer(dict->len + src_len);
+    if (work == NULL) {
+        return 0;
+    }
+    memcpy(work, dict->data, dict->len);
+    memcpy(work + dict->len, src, src_len);
+    memcpy(table, dict->table, sizeof(table));
+
+    return compress_range(work, dict->len, dict->len + src_len, table, dst, dst_capacity);
+}
+
+int decompress_block(const void *src, size_t src_len, void *dst, size_t dst_len, const compress_dict *dict) {
+    const uint8_t *ip = src;
+    const uint8_t *ip_end = ip + src_len;
+    uint8_t *out = dst;
+    uint8_t *op = out;
+    uint8_t *op_end = out + dst_len;
+    size_t dict_len = dict != NULL ? dict->len : 0;
+
+    while (ip < ip_end) {
+        unsigned token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && read_length(&ip, ip_end, &lit_len) != 0) {
+            return -1;
+        }
+        if (lit_len > (size_t)(ip_end - ip) || lit_len > (size_t)(op_end - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+
+        // The last sequence has no match
+        if (ip == ip_end) {
+            break;
+        }
+
+        if (ip_end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && read_length(&ip, ip_end, &match_len) != 0) {
+            return -1;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || match_len > (size_t)(op_end - op)) {
+            return -1;
+        }
+
+        // Reaching back past the start of the output continues in the dictionary
+        size_t produced = op - out;
+        if (offset > produced) {
+            size_t back = offset - produced;
+            if (back > dict_len) {
+                return -1;
+            }
+            size_t n = back < match_len ? back : match_len;
+            memcpy(op, dict->data + dict_len - back, n);
+            op += n;
+            match_len -= n;
+        }
+
+        const uint8_t *from = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, from, match_len);
+            op += match_len;
+        } else {
+            // Overlapping copy repeats the last offset bytes
+            while (match_len-- > 0) {
+                *op++ = *from++;
+            }
+        }
+    }
+
+    return op == op_end ? 0 : -1;
+}
+
+int compress_dict_init(compress_dict *dict, const void *data, size_t len) {
+    memset(dict, 0, sizeof(*dict));
+    if (data == NULL || len == 0) {
+        return 0;
+    }
+
+    // Only the last window's worth can ever be referenced
+    if (len > COMPRESS_DICT_MAX) {
+        data = (const uint8_t*)data + (len - COMPRESS_DICT_MAX);
+        len = COMPRESS_DICT_MAX;
+    }
+
+    dict->data = malloc(len);
+    dict->table = calloc(HASH_SIZE, sizeof(uint32_t));
+    if (dict->data == NULL || dict->table == NULL) {
+        printf("Error allocating compression dictionary\n");
+        compress_dict_free(dict);
+        return -1;
+    }
+    memcpy(dict->data, data, len);
+    dict->len = len;
+
+    for (size_t pos = 0; pos + MIN_MATCH <= len; pos++) {
+        dict->table[hash4(read32(dict->data + pos))] = (uint32_t)pos;
+    }
+
+    // FNV-1a over the contents: both ends compare this to agree on the dictionary
+    uint32_t id = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        id = (id ^ dict->data[i]) * 16777619u;
+    }
+    dict->id = id != 0 ? id : 1;
+    return 0;
+}
+
+void compress_dict_free(compress_dict *dict) {
+    free(dict->data);
+    free(dict->table);
+    memset(dict, 0, sizeof(*dict));
+}
+
+/* A run of bytes shared between samples, scored by how widely its k-mers occur */
+typedef struct {
+    const uint8_t *start;
+    size_t len;
+    unsigned long long score;
+} train_segment;
+
+static inline uint32_t kmer_hash(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return (uint32_t)((value * 0x9E3779B97F4A7C15ULL) >> (64 - TRAIN_HASH_LOG));
+}
+
+static int compare_segments(const void *a, const void *b) {
+    const train_segment *x = a;
+    const train_segment *y = b;
+    return x->score < y->score ? 1 : (x->score > y->score ? -1 : 0);
+}
+
+size_t compress_train_dictionary(const void *const *samples, const size_t *sample_sizes, size_t count,
+                                 void *dict, size_t capacity) {
+    uint32_t *counts = calloc(1u << TRAIN_HASH_LOG, sizeof(uint32_t));
+    uint32_t *seen = calloc(1u << TRAIN_HASH_LOG, sizeof(uint32_t));
+    train_segment *segments = NULL;
+    size_t num_segments = 0;
+    size_t segments_capacity = 0;
+    size_t dict_len = 0;
+
+    if (counts == NULL || seen == NULL || samples == NULL || sample_sizes == NULL) {
+        goto done;
+    }
+
+    // In how many samples does each k-mer occur?
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *sample = samples[i];
+        for (size_t pos = 0; pos + TRAIN_KMER <= sample_sizes[i]; pos++) {
+            uint32_t h = kmer_hash(sample + pos);
+            if (seen[h] != i + 1) {
+                seen[h] = i + 1;
+                counts[h]++;
+            }
+        }
+    }
+
+    // Candidates: maximal runs of k-mers that show up in at least two samples
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *sample = samples[i];
+        size_t pos = 0;
+
+        while (pos + TRAIN_KMER <= sample_sizes[i]) {
+            if (counts[kmer_hash(sample + pos)] < 2) {
+                pos++;
+                continue;
+            }
+
+            train_segment segment = { sample + pos, 0, 0 };
+            while (pos + TRAIN_KMER <= sample_sizes[i] && counts[kmer_hash(sample + pos)] >= 2) {
+                segment.score += counts[kmer_hash(sample + pos)];
+                pos++;
+            }
+            segment.len = (size_t)(sample + pos - segment.start) + TRAIN_KMER - 1;
+
+            if (num_segments == segments_capacity) {
+                size_t new_capacity = segments_capacity > 0 ? segments_capacity * 2 : 64;
+                train_segment *grown = realloc(segments, new_capacity * sizeof(train_segment));
+                if (grown == NULL) {
+                    goto done;
+                }
+                segments = grown;
+                segments_capacity = new_capacity;
+            }
+            segments[num_segments++] = segment;
+        }
+    }
+
+    qsort(segments, num_segments, sizeof(train_segment), compare_segments);
+
+    // Best segments first; a segment mostly covered by earlier picks adds nothing
+    for (size_t i = 0; i < num_segments && dict_len < capacity; i++) {
+        train_segment *segment = &segments[i];
+        size_t kmers = segment->len - TRAIN_KMER + 1;
+        size_t fresh = 0;
+
+        for (size_t k = 0; k < kmers; k++) {
+            fresh += counts[kmer_hash(segment->start + k)] > 0;
+        }
+        if (fresh * 2 < kmers) {
+            continue;
+        }
+
+        size_t len = segment->len < capacity - dict_len ? segment->len : capacity - dict_len;
+        memcpy((uint8_t*)dict + dict_len, segment->start, len);
+        dict_len += len;
+
+        for (size_t k = 0; k < kmers; k++) {
+            counts[kmer_hash(segment->start + k)] = 0;
+        }
+    }
+
+done:
+    free(counts);
+    free(seen);
+    free(segments);
+    return dict_len;
+}
+
+static int buffer_reserve(compress_buffer *buffer, size_t size) {
+    if (buffer->capacity >= size) {
+        return 0;
+    }
+
+    uint8_t *grown = realloc(buffer->data, size);
+    if (grown == NULL) {
+        return -1;
+    }
+    buffer->data = grown;
+    buffer->capacity = size;
+    return 0;
+}
+
+int compress_frame(MessageHeader *header, const void *payload, compress_buffer *out,
+                   size_t threshold, const compress_dict *dict) {
+    size_t len = header->payload_length;
+    if (out == NULL || threshold == 0 || len < threshold || len <= COMPRESS_PREFIX_SIZE + 1) {
+        return 0;
+    }
+    if (buffer_reserve(out, len) != 0) {
+        return 0;
+    }
+
+    const compress_dict *used = dict != NULL && dict->len > 0 ? dict : NULL;
+    unsigned long long start = cpu_ns();
+
+    // Only keep the result if it is smaller than the payload, prefix included
+    size_t compressed = compress_block(payload, len, out->data + COMPRESS_PREFIX_SIZE,
+                                       len - COMPRESS_PREFIX_SIZE - 1, used);
+
+    atomic_fetch_add(&compress_ns, cpu_ns() - start);
+    if (compressed == 0) {
+        atomic_fetch_add(&frames_skipped, 1);
+        return 0;
+    }
+
+    serialize_int(out->data, (int)len);
+    header->msg_type |= MSG_FLAG_COMPRESSED | (used != NULL ? MSG_FLAG_DICTIONARY : 0);
+    header->payload_length = COMPRESS_PREFIX_SIZE + compressed;
+
+    atomic_fetch_add(&frames_compressed, 1);
+    atomic_fetch_add(&bytes_in, len);
+    atomic_fetch_add(&bytes_out, header->payload_length);
+    return 1;
+}
+
+int decompress_frame(MessageHeader *header, uint8_t **payload, compress_buffer *out,
+                     size_t max_payload, const compress_dict *dict) {
+    if (!(header->msg_type & MSG_FLAG_COMPRESSED)) {
+        return 0;
+    }
+    if (out == NULL || header->payload_length < COMPRESS_PREFIX_SIZE) {
+        return -1;
+    }
+
+    int raw_len;
+    deserialize_int(*payload, &raw_len);
+    if (raw_len < 0 || (size_t)raw_len > max_payload) {
+        return -1;
+    }
+
+    const compress_dict *used = NULL;
+    if (header->msg_type & MSG_FLAG_DICTIONARY) {
+        if (dict == NULL || dict->len == 0) {
+            return -1;
+        }
+        used = dict;
+    }
+
+    if (buffer_reserve(out, (size_t)raw_len + 1) != 0) {
+        return -1;
+    }
+
+    unsigned long long start = cpu_ns();
+    int rc = decompress_block(*payload + COMPRESS_PREFIX_SIZE, header->payload_length - COMPRESS_PREFIX_SIZE,
+                              out->data, raw_len, used);
+    atomic_fetch_add(&decompress_ns, cpu_ns() - start);
+    if (rc != 0) {
+        return -1;
+    }
+
+    header->msg_type &= MSG_TYPE_MASK;
+    header->payload_length = raw_len;
+    *payload = out->data;
+    atomic_fetch_add(&frames_decompressed, 1);
+    return 0;
+}
+
+void compress_buffer_free(compress_buffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->capacity = 0;
+}
+
+void compress_get_stats(compress_stats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+
+    stats->frames_compressed = atomic_load(&frames_compressed);
+    stats->frames_skipped = atomic_load(&frames_skipped);
+    stats->frames_decompressed = atomic_load(&frames_decompressed);
+    stats->bytes_in = atomic_load(&bytes_in);
+    stats->bytes_out = atomic_load(&bytes_out);
+    stats->compress_ns = atomic_load(&compress_ns);
+    stats->decompress_ns = atomic_load(&decompress_ns);
+    stats->ratio = stats->bytes_out > 0 ? (double)stats->bytes_in / (double)stats->bytes_out : 0.0;
+}
@@ -1,14 +1,54 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "../include/rpc_client.h"
+#include "calc_rpc.h"
 #define DEFAULT_SERVER "127.0.0.1"
 #define DEFAULT_PORT 8080
+#define COMPRESS_THRESHOLD 1024
+#define SCAN_CALLS 4096
 
 void print_separator() {
     printf("-------------------------------------------\n");
 }
 
+typedef struct {
+    size_t received;
+    int mismatch;
+} stream_check;
+
+// Streamed result chunks arrive here as they come in, nothing is buffered whole
+static int check_stream_chunk(const char *data, size_t len, void *user_data) {
+    stream_check *check = (stream_check*)user_data;
+    
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != 'A' + (char)((check->received + i) % 26)) {
+            check->mismatch = 1;
+        }
+    }
+    check->received += len;
+    return 0;
+}
+
+// The server's result cache counters, served by a demo server started with "admin".
+// Printed unless when is NULL; 0 if the server has them
+static int print_cache_stats(const char *when, size_t *entries) {
+    rpc_value stats;
+    if (rpc_call_typed("admin.cache_stats", NULL, 0, &stats) != 0) {
+        return -1;
+    }
+    
+    if (when != NULL) {
+        printf("Cache %s: %s\n", when, stats.data);
+    }
+    if (entries != NULL) {
+        sscanf(stats.data, "%*u hits, %*u misses, %zu entries", entries);
+    }
+    rpc_value_free(&stats);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     char *server_ip = DEFAULT_SERVER;
     int port = DEFAULT_PORT;
@@ -28,7 +68,14 @@ int main(int argc, char *argv[]) {
     printf("===========================================\n\n");
     
     
-    printf("[Demo Client] Connecting to %s:%d...\n", server_ip, port);
+    // Large requests go out compressed if the server supports it
+    rpc_client_set_compression(COMPRESS_THRESHOLD);
+    
+    if (strncmp(server_ip, "unix:", 5) == 0 || strncmp(server_ip, "shm:", 4) == 0) {
+        printf("[Demo Client] Connecting to %s...\n", server_ip);
+    } else {
+        printf("[Demo Client] Connecting to %s:%d...\n", server_ip, port);
+    }
     if (rpc_client_init(server_ip, port) != 0) {
         fprintf(stderr, "[Demo Client] Failed to connect to server\n");
         return EXIT_FAILURE;
@@ -88,7 +135,260 @@ int main(int argc, char *argv[]) {
         printf("Result: %s\n", result5);
         free(result5);
     } else {
-        printf("Error: Call failed (expected behavior)\n");
+        printf("Error: Call failed with code %d (expected behavior)\n", rpc_last_error());
+    }
+    print_separator();
+    
+    // Test 6: Pipelined asynchronous calls sharing the connection
+    printf("Test 6: Pipelining asynchronous calls\n");
+    const char *words[] = { "alpha", "beta", "gamma", "delta" };
+    rpc_future *futures[4];
+    for (int i = 0; i < 4; i++) {
+        futures[i] = rpc_call_async("uppercase", words[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        if (futures[i] != NULL && rpc_future_wait(futures[i], 5000) == 0) {
+            char *result = rpc_future_result(futures[i]);
+            printf("Result %d: %s\n", i + 1, result != NULL ? result : "(error)");
+            free(result);
+        } else {
+            printf("Error: Call %d failed\n", i + 1);
+        }
+        rpc_future_free(futures[i]);
+    }
+    print_separator();
+    
+    // Test 7: Several calls in a single batch request
+    printf("Test 7: Batching calls into one request\n");
+    rpc_batch_call batch[] = {
+        { "echo", "first", NULL, 0 },
+        { "uppercase", "second", NULL, 0 },
+        { "non_existent_function", "third", NULL, 0 },
+    };
+    size_t batch_size = sizeof(batch) / sizeof(batch[0]);
+    if (rpc_call_batch(batch, batch_size, RPC_BATCH_PARALLEL) == 0) {
+        for (size_t i = 0; i < batch_size; i++) {
+            if (batch[i].result != NULL) {
+                printf("Result %zu: %s\n", i + 1, batch[i].result);
+                free(batch[i].result);
+            } else {
+                printf("Result %zu: error code %d\n", i + 1, batch[i].error_code);
+            }
+        }
+    } else {
+        printf("Error: Batch failed (error code %d)\n", rpc_last_error());
+    }
+    print_separator();
+    
+    // Test 8: Function using the per-request arena ABI
+    printf("Test 8: Calling 'reverse_ctx' function\n");
+    char *result8 = rpc_call("reverse_ctx", "Arena allocated");
+    if (result8 != NULL) {
+        printf("Result: %s\n", result8);
+        free(result8);
+    } else {
+        printf("Error: Call failed\n");
+    }
+    print_separator();
+    
+    // Test 9: Function writing into the server's output buffer
+    printf("Test 9: Calling 'repeat_buf' function\n");
+    char *result9 = rpc_call("repeat_buf", "3 ab");
+    if (result9 != NULL) {
+        printf("Result: %s\n", result9);
+        free(result9);
+    } else {
+        printf("Error: Call failed\n");
+    }
+    print_separator();
+    
+    // Test 10: Streaming a payload far beyond MAX_PAYLOAD_SIZE through a chunked call
+    printf("Test 10: Streaming 8 MB through 'uppercase_stream'\n");
+    size_t blob_len = 8 * 1024 * 1024;
+    char *blob = malloc(blob_len);
+    if (blob != NULL) {
+        for (size_t i = 0; i < blob_len; i++) {
+            blob[i] = 'a' + (i % 26);
+        }
+        
+        stream_check check = { 0, 0 };
+        if (rpc_call_stream("uppercase_stream", blob, blob_len, check_stream_chunk, &check, NULL, NULL) == 0) {
+            printf("Result: %zu bytes received, %s\n", check.received, check.mismatch ? "mismatch" : "all uppercase");
+        } else {
+            printf("Error: Stream failed (error code %d)\n", rpc_last_error());
+        }
+        
+        // A regular function called through a stream, result collected into one buffer
+        char *result10 = NULL;
+        size_t result10_len = 0;
+        if (rpc_call_stream("reverse", blob, 100000, NULL, NULL, &result10, &result10_len) == 0) {
+            printf("Result: reversed %zu bytes, ends with '%c'\n", result10_len, result10[result10_len - 1]);
+            free(result10);
+        } else {
+            printf("Error: Stream failed (error code %d)\n", rpc_last_error());
+        }
+        free(blob);
+    }
+    print_separator();
+    
+    // Test 11: Repetitive payload above the threshold travels compressed both ways
+    printf("Test 11: Echoing a compressible 3 KB payload\n");
+    char records[3072];
+    size_t records_len = 0;
+    for (int i = 0; records_len + 64 < sizeof(records); i++) {
+        records_len += snprintf(records + records_len, sizeof(records) - records_len,
+                                "{\"id\": %d, \"status\": \"active\", \"role\": \"reader\"},", i);
+    }
+    char *result11 = rpc_call("echo", records);
+    if (result11 != NULL) {
+        compress_stats stats;
+        rpc_client_get_compression_stats(&stats);
+        printf("Result: %s, %llu frames compressed (ratio %.2f, %.3f ms CPU)\n",
+               strcmp(result11, records) == 0 ? "echo matches" : "echo differs",
+               stats.frames_compressed, stats.ratio, stats.compress_ns / 1e6);
+        free(result11);
+    } else {
+        printf("Error: Call failed\n");
+    }
+    print_separator();
+    
+    // Test 12: Typed calls with binary arguments and results
+    printf("Test 12: Calling typed functions\n");
+    rpc_value value;
+    rpc_value add_args[] = { rpc_int(40), rpc_int(2) };
+    if (rpc_call_typed("add_typed", add_args, 2, &value) == 0) {
+        printf("Result: add_typed(40, 2) = %d\n", value.i);
+    } else {
+        printf("Error: Typed call failed (error code %d)\n", rpc_last_error());
+    }
+    
+    rpc_value scale_args[] = { rpc_float(1.5f), rpc_float(4.0f) };
+    if (rpc_call_typed("scale_typed", scale_args, 2, &value) == 0) {
+        printf("Result: scale_typed(1.5, 4.0) = %g\n", value.f);
+    } else {
+        printf("Error: Typed call failed (error code %d)\n", rpc_last_error());
+    }
+    
+    rpc_value repeat_args[] = { rpc_string("ab"), rpc_int(3) };
+    if (rpc_call_typed("repeat_typed", repeat_args, 2, &value) == 0) {
+        printf("Result: repeat_typed(\"ab\", 3) = %s\n", value.data);
+        rpc_value_free(&value);
+    } else {
+        printf("Error: Typed call failed (error code %d)\n", rpc_last_error());
+    }
+    
+    // Wrong argument types are refused before the function runs
+    if (rpc_call_typed("add_typed", scale_args, 2, &value) != 0) {
+        printf("Result: add_typed(1.5, 4.0) rejected with code %d (expected behavior)\n", rpc_last_error());
+    }
+    print_separator();
+    
+    // Test 13: Generated stubs with pre-assigned function IDs (see idl/calc.idl)
+    printf("Test 13: Calling the calc service through rpcgen stubs\n");
+    if (calc_client_check() != 0) {
+        printf("Error: Server does not serve calc under the expected IDs\n");
+    } else {
+        int32_t sum;
+        float scaled;
+        char *repeated;
+        int32_t checksum;
+        
+        if (calc_add(40, 2, &sum) == 0) {
+            printf("Result: calc_add(40, 2) = %d\n", sum);
+        } else {
+            printf("Error: Stub call failed (error code %d)\n", rpc_last_error());
+        }
+        if (calc_scale(1.5f, 4.0f, &scaled) == 0) {
+            printf("Result: calc_scale(1.5, 4.0) = %g\n", scaled);
+        } else {
+            printf("Error: Stub call failed (error code %d)\n", rpc_last_error());
+        }
+        if (calc_repeat("ab", 3, &repeated) == 0) {
+            printf("Result: calc_repeat(\"ab\", 3) = %s\n", repeated);
+            free(repeated);
+        } else {
+            printf("Error: Stub call failed (error code %d)\n", rpc_last_error());
+        }
+        if (calc_checksum("Wikipedia", 9, &checksum) == 0) {
+            printf("Result: calc_checksum(\"Wikipedia\") = 0x%08x\n", (unsigned)checksum);
+        } else {
+            printf("Error: Stub call failed (error code %d)\n", rpc_last_error());
+        }
+    }
+    print_separator();
+    
+    // Test 14: A client handle of its own, spreading calls over a small pool
+    printf("Test 14: Pipelining calls over a pooled client handle\n");
+    rpc_client_config pool_config = { .min_connections = 1, .max_connections = 4, .policy = RPC_POOL_LEAST_BUSY,
+                                      .balance = RPC_BALANCE_ROUND_ROBIN };
+    rpc_client *pool = rpc_client_create(server_ip, port, &pool_config);
+    if (pool == NULL) {
+        printf("Error: Could not create pooled client\n");
+    } else {
+        const char *numbers[] = { "one", "two", "three", "four" };
+        rpc_future *calls[4];
+        
+        for (int i = 0; i < 4; i++) {
+            calls[i] = rpc_client_call_async(pool, "uppercase", numbers[i]);
+        }
+        
+        rpc_pool_stats stats;
+        rpc_client_get_pool_stats(pool, &stats);
+        
+        for (int i = 0; i < 4; i++) {
+            rpc_future_wait(calls[i], -1);
+            char *result = rpc_future_result(calls[i]);
+            printf("Result %d: %s\n", i + 1, result != NULL ? result : "(error)");
+            free(result);
+            rpc_future_free(calls[i]);
+        }
+        printf("Result: %d of %d connections opened for 4 concurrent calls\n",
+               stats.connections, stats.max_connections);
+        rpc_client_destroy(pool);
+    }
+    print_separator();
+    
+    // Test 15: Repeated calls to a pure function come from the server's result cache,
+    // a scan of one-off calls does not push them out, and a reload clears the cache
+    printf("Test 15: Repeating calls to the pure function 'reverse'\n");
+    int admin = print_cache_stats("before", NULL) == 0;
+    for (int i = 0; i < 5; i++) {
+        char *result = rpc_call("reverse", "Cached result");
+        if (i == 0) {
+            printf("Result: %s (called 5 times)\n", result != NULL ? result : "(error)");
+        }
+        free(result);
+    }
+    if (admin) {
+        print_cache_stats("after repeats", NULL);
+    }
+    
+    char scan_params[256];
+    for (int i = 0; i < SCAN_CALLS; i++) {
+        snprintf(scan_params, sizeof(scan_params), "one-off %0240d", i);
+        free(rpc_call("uppercase", scan_params));
+    }
+    free(rpc_call("reverse", "Cached result"));
+    if (admin) {
+        print_cache_stats("after the one-off calls and 'reverse' again", NULL);
+    }
+    
+    // The reload runs on the server's reload thread; wait for it to clear the cache
+    rpc_value reloaded;
+    if (!admin) {
+        printf("Result: Start the server with 'admin' to see the cache counters and a reload\n");
+    } else if (rpc_call_typed("admin.reload", NULL, 0, &reloaded) != 0) {
+        printf("Error: Server did not take the reload (error code %d)\n", rpc_last_error());
+    } else {
+        size_t entries = 1;
+        for (int i = 0; i < 100 && entries > 0; i++) {
+            usleep(10000);
+            if (print_cache_stats(NULL, &entries) != 0) {
+                break;
+            }
+        }
+        free(rpc_call("reverse", "Cached result"));
+        print_cache_stats("after reload and 'reverse' again", NULL);
     }
     print_separator();
     
@@ -1,22 +1,105 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "../include/rpc_server.h"
+#include "calc_rpc.h"
 
 #define DEFAULT_PORT 8080
 #define LIB_PATH "./bin/libexample.so"
+#define TEXT_LIB_NAME "text"
+#define COMPRESS_THRESHOLD 1024
+#define SHM_SPIN_US 50
+// Small enough for the demo client's scan of one-off calls to fill it
+#define CACHE_BYTES (1024 * 1024)
 
 volatile sig_atomic_t keep_running = 1;
+volatile sig_atomic_t stop_signal = 0;
+static pthread_t reloader;
 
+// Only async-signal-safe work here: main reports the signal and unloads the
+// functions, which may still be running, once rpc_server_start has returned
 void signal_handler(int signum) {
-    printf("\n[Demo Server] Received signal %d, shutting down...\n", signum);
+    stop_signal = signum;
     keep_running = 0;
-    rpc_server_shutdown();
+    rpc_server_stop();
+}
+
+// SIGHUP reloads both libraries. It is taken on a thread of its own, since a
+// reload waits for the calls still running on the old code
+static void *reload_thread(void *arg) {
+    const sigset_t *signals = arg;
+    int signum;
+    
+    while (sigwait(signals, &signum) == 0) {
+        printf("\n[Demo Server] Received signal %d, reloading functions...\n", signum);
+        rpc_server_reload(LIB_PATH);
+        rpc_server_reload_library(TEXT_LIB_NAME, NULL);
+    }
+    return NULL;
+}
+
+// Admin functions, registered only when the server is started with "admin": they
+// let the demo client read the result cache counters and ask for a reload
+static int admin_cache_stats(rpc_context *ctx, const char *args, size_t args_len, rpc_output *out) {
+    (void)ctx;
+    if (args_len != 1 || args[0] != 0) {
+        return -1;
+    }
+    
+    result_cache_stats stats;
+    char text[128];
+    rpc_server_get_cache_stats(&stats);
+    snprintf(text, sizeof(text), "%llu hits, %llu misses, %zu entries, %llu not admitted",
+             stats.hits, stats.misses, stats.entries, stats.rejected);
+    
+    rpc_value result = rpc_string(text);
+    if (rpc_output_reserve(out, serialized_value_size(&result)) != 0) {
+        return -1;
+    }
+    out->len += serialize_value((uint8_t*)out->data + out->len, &result);
+    return 0;
+}
+
+// A function cannot reload the library itself, since the reload waits for the calls
+// running, this one included. It hands the reload to the reload thread and returns
+static int admin_reload(rpc_context *ctx, const char *args, size_t args_len, rpc_output *out) {
+    (void)ctx;
+    if (args_len != 1 || args[0] != 0 || pthread_kill(reloader, SIGHUP) != 0) {
+        return -1;
+    }
+    
+    const char result = TYPE_VOID;
+    return rpc_output_append(out, &result, 1);
 }
 
 int main(int argc, char *argv[]) {
     int port = DEFAULT_PORT;
+    rpc_server_config config = { .mode = SERVER_MODE_THREADED, .compress_threshold = COMPRESS_THRESHOLD,
+                                 .shm_spin_us = SHM_SPIN_US, .cache_bytes = CACHE_BYTES };
+    
+    // "unix:/path" and "shm:/path" arguments add local listeners, "sharded" pins
+    // one event loop per CPU and "admin" serves the admin functions; the rest are positional
+    const char *local_addrs[8];
+    int num_local = 0;
+    int positional = 1;
+    int admin = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "unix:", 5) == 0 || strncmp(argv[i], "shm:", 4) == 0) {
+            if (num_local < 8) {
+                local_addrs[num_local++] = argv[i];
+            }
+        } else if (strcmp(argv[i], "sharded") == 0) {
+            config.sharded = 1;
+        } else if (strcmp(argv[i], "admin") == 0) {
+            admin = 1;
+        } else {
+            argv[positional++] = argv[i];
+        }
+    }
+    argc = positional;
     
     if (argc > 1) {
         port = atoi(argv[1]);
@@ -26,20 +109,81 @@ int main(int argc, char *argv[]) {
         }
     }
     
+    // Optional second argument selects the connection model
+    if (argc > 2 && (strcmp(argv[2], "epoll") == 0 || strcmp(argv[2], "uring") == 0)) {
+        config.mode = strcmp(argv[2], "uring") == 0 ? SERVER_MODE_URING : SERVER_MODE_EPOLL;
+        
+        // Optional third argument caps concurrent function executions
+        if (argc > 3) {
+            int workers = atoi(argv[3]);
+            if (workers > 0) {
+                config.executor.min_workers = 1;
+                config.executor.max_workers = workers;
+            }
+        }
+    }
+    
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     
+    // Every thread started from here on leaves SIGHUP to the reload thread, which
+    // itself never runs signal_handler
+    static sigset_t reload_signals;
+    sigset_t stop_signals;
+    sigemptyset(&reload_signals);
+    sigaddset(&reload_signals, SIGHUP);
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    
+    pthread_sigmask(SIG_BLOCK, &reload_signals, NULL);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    if (pthread_create(&reloader, NULL, reload_thread, &reload_signals) == 0) {
+        pthread_detach(reloader);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
+    
     printf("===========================================\n");
     printf("    Mini RPC Framework - Demo Server\n");
     printf("===========================================\n\n");
     
-    if (rpc_server_init(port, LIB_PATH) != 0) {
+    if (rpc_server_init_ex(port, LIB_PATH, &config) != 0) {
         fprintf(stderr, "[Demo Server] Failed to initialize RPC server\n");
         return EXIT_FAILURE;
     }
     
+    for (int i = 0; i < num_local; i++) {
+        if (rpc_server_listen(local_addrs[i]) != 0) {
+            fprintf(stderr, "[Demo Server] Failed to listen on %s\n", local_addrs[i]);
+            rpc_server_shutdown();
+            return EXIT_FAILURE;
+        }
+    }
+    
+    // The same library loaded again under a namespace, as a second team's library would be
+    if (rpc_server_add_library(TEXT_LIB_NAME, LIB_PATH) != 0) {
+        fprintf(stderr, "[Demo Server] Failed to load library '%s'\n", TEXT_LIB_NAME);
+    }
+    
     printf("[Demo Server] Registering functions...\n");
     
+    // Generated services go first so they get the function IDs their stubs were built with
+    if (calc_server_register() != 0) {
+        fprintf(stderr, "[Demo Server] Failed to register service 'calc'\n");
+    } else {
+        printf("[Demo Server] Registered: calc (%d methods)\n", CALC_NUM_METHODS);
+    }
+    
+    // Linked into the server as well, so they take the IDs right after the service's
+    if (admin) {
+        if (rpc_server_register_function_raw("admin.cache_stats", admin_cache_stats, CALC_NUM_METHODS) != 0 ||
+            rpc_server_register_function_raw("admin.reload", admin_reload, CALC_NUM_METHODS + 1) != 0) {
+            fprintf(stderr, "[Demo Server] Failed to register the admin functions\n");
+        } else {
+            printf("[Demo Server] Registered: admin.cache_stats, admin.reload\n");
+        }
+    }
+    
     if (rpc_server_register_function("hello") != 0) {
         fprintf(stderr, "[Demo Server] Failed to register function 'hello'\n");
     } else {
@@ -64,11 +208,106 @@ int main(int argc, char *argv[]) {
         printf("[Demo Server] Registered: uppercase\n");
     }
     
+    // Arena-aware variants allocate their results from the per-request arena
+    if (rpc_server_register_function_ctx("reverse_ctx") != 0) {
+        fprintf(stderr, "[Demo Server] Failed to register function 'reverse_ctx'\n");
+    } else {
+        printf("[Demo Server] Registered: reverse_ctx\n");
+    }
+    
+    if (rpc_server_register_function_ctx("uppercase_ctx") != 0) {
+        fprintf(stderr, "[Demo Server] Failed to register function 'uppercase_ctx'\n");
+    } else {
+        printf("[Demo Server] Registered: uppercase_ctx\n");
+    }
+    
+    // Output-buffer variants write their results straight into the response frame
+    if (rpc_server_register_function_buf("reverse_buf") != 0) {
+        fprintf(stderr, "[Demo Server] Failed to register function 'reverse_buf'\n");
+    } else {
+        printf("[Demo Server] Registered: reverse_buf\n");
+    }
+    
+    if (rpc_server_register_function_buf("repeat_buf") != 0) {
+        fprintf(stderr, "[Demo Server] Failed to register function 'repeat_buf'\n");
+    } else {
+        printf("[Demo Server] Registered: repeat_buf\n");
+    }
+    
+    // Streaming variant reads params and writes its result in chunks of any total size
+    if (rpc_server_register_function_stream("uppercase_stream") != 0) {
+        fprintf(stderr, "[Demo Server] Failed to register function 'uppercase_stream'\n");
+    } else {
+        printf("[Demo Server] Registered: uppercase_stream\n");
+    }
+    
+    // Typed variants take binary arguments checked against their signature
+    if (rpc_server_register_function("add") != 0) {
+        fprintf(stderr, "[Demo Server] Failed to register function 'add'\n");
+    } else {
+        printf("[Demo Server] Registered: add\n");
+    }
+    
+    RPCRequest typed_functions[] = {
+        { "add_typed",    2, { TYPE_INT, TYPE_INT },      TYPE_INT },
+        { "scale_typed",  2, { TYPE_FLOAT, TYPE_FLOAT },  TYPE_FLOAT },
+        { "repeat_typed", 2, { TYPE_STRING, TYPE_INT },   TYPE_STRING },
+    };
+    for (size_t i = 0; i < sizeof(typed_functions) / sizeof(typed_functions[0]); i++) {
+        if (rpc_server_register_function_typed(&typed_functions[i]) != 0) {
+            fprintf(stderr, "[Demo Server] Failed to register function '%s'\n", typed_functions[i].function_name);
+        } else {
+            printf("[Demo Server] Registered: %s\n", typed_functions[i].function_name);
+        }
+    }
+    
+    // Namespaced functions resolve in their own library, independently reloadable
+    const char *text_functions[] = { TEXT_LIB_NAME ".uppercase", TEXT_LIB_NAME ".reverse" };
+    for (size_t i = 0; i < sizeof(text_functions) / sizeof(text_functions[0]); i++) {
+        if (rpc_server_register_function(text_functions[i]) != 0) {
+            fprintf(stderr, "[Demo Server] Failed to register function '%s'\n", text_functions[i]);
+        } else {
+            printf("[Demo Server] Registered: %s\n", text_functions[i]);
+        }
+    }
+    
+    // Deterministic transforms: repeated params are answered from the result cache
+    const char *pure_functions[] = {
+        "reverse", "uppercase", "reverse_ctx", "uppercase_ctx", "reverse_buf", "add_typed", "scale_typed",
+        TEXT_LIB_NAME ".uppercase", TEXT_LIB_NAME ".reverse",
+    };
+    for (size_t i = 0; i < sizeof(pure_functions) / sizeof(pure_functions[0]); i++) {
+        if (rpc_server_set_pure(pure_functions[i], 0) != 0) {
+            fprintf(stderr, "[Demo Server] Failed to mark function '%s' pure\n", pure_functions[i]);
+        }
+    }
+    
+    // Registration is done: switch lookups to the perfect-hash table
+    if (rpc_server_freeze_functions() != 0) {
+        fprintf(stderr, "[Demo Server] Failed to freeze function registry\n");
+    }
+    
     printf("\n[Demo Server] Server ready on port %d\n", port);
-    printf("[Demo Server] Press Ctrl+C to stop\n\n");
+    printf("[Demo Server] Press Ctrl+C to stop, send SIGHUP to reload the libraries\n\n");
     
     rpc_server_start();
     
+    if (stop_signal != 0) {
+        printf("\n[Demo Server] Received signal %d, shutting down...\n", (int)stop_signal);
+    }
+    
+    compress_stats stats;
+    rpc_server_get_compression_stats(&stats);
+    printf("\n[Demo Server] Compressed %llu frames, %llu -> %llu bytes (ratio %.2f, %.3f ms CPU)\n",
+           stats.frames_compressed, stats.bytes_in, stats.bytes_out, stats.ratio, stats.compress_ns / 1e6);
+    
+    result_cache_stats cache_stats;
+    rpc_server_get_cache_stats(&cache_stats);
+    printf("[Demo Server] Result cache: %llu hits, %llu misses (hit ratio %.2f), %zu entries in %zu bytes, "
+           "%llu evicted, %llu not admitted\n",
+           cache_stats.hits, cache_stats.misses, cache_stats.hit_ratio, cache_stats.entries, cache_stats.bytes,
+           cache_stats.evictions, cache_stats.rejected);
+    
     printf("\n[Demo Server] Cleaning up...\n");
     rpc_server_shutdown();
     
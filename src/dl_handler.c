@@ -2,159 +2,943 @@
 #include <dlfcn.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "dl_handler.h"
 
-void *dl_handler = NULL;
-struct RegisteryList *funcs = NULL;
+#define INITIAL_CAPACITY 16
+#define KEYS_PER_BUCKET 2           //average perfect-hash bucket size
+#define MAX_SEED_ATTEMPTS (1u << 20)
+#define READER_STRIPES 64           //reader counters, threads beyond this share them
+#define READER_DRAIN_SLEEP_US 100
 
-//if you want to create an empty registry node both name and func have to empty 
-struct Registery *create_registery_node(const char *n, void *f){
-    if(!((n == NULL && f == NULL) || (n != NULL && f != NULL))){
-        printf("Error function name and function pointer must either not null or both null\n");
-        return NULL;
+static struct FunctionLibrary libraries[MAX_LIBRARIES];
+static int num_libraries = 0;
+static struct RegisteryTable *_Atomic funcs = NULL;
+
+//writers (registration, freeze, reload, destroy) take turns; readers never take it
+static pthread_mutex_t registery_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned reload_count = 0;
+
+//in-flight readers per epoch parity, one cache line per stripe
+struct reader_stripe {
+    atomic_long active[2];
+} __attribute__((aligned(64)));
+
+static struct reader_stripe readers[READER_STRIPES];
+static atomic_uint reader_epoch;
+static atomic_uint next_stripe;
+static __thread int my_stripe = -1;
+
+//FNV-1a, computed once per name so lookups compare hashes before strings
+uint64_t function_name_hash_len(const char *s_name, size_t len){
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)s_name[i];
+        hash *= 0x100000001b3ULL;
     }
-    struct Registery *ret_item = malloc(sizeof(struct Registery));
+
+    //final avalanche: FNV leaves the high bits poorly mixed for short names
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+uint64_t function_name_hash(const char *s_name){
+    return function_name_hash_len(s_name, strlen(s_name));
+}
+
+//names need not be NUL-terminated, so compare lengths before bytes
+static inline int name_matches(const struct Registery *entry, const char *name, size_t len, uint64_t hash){
+    return entry->hash == hash && entry->name_len == len && !memcmp(entry->name, name, len);
+}
+
+//remix the name hash with a bucket seed to pick a slot in the frozen table
+static inline uint64_t seeded_hash(uint64_t hash, uint32_t seed){
+    uint64_t x = hash ^ ((uint64_t)seed * 0x9e3779b97f4a7c15ULL);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+//map a 64 bit hash onto [0, range) without a division
+static inline size_t reduce(uint64_t hash, size_t range){
+    return (size_t)(((hash >> 32) * (uint64_t)range) >> 32);
+}
+
+struct RegisteryTable *create_function_registery(size_t capacity){
+    struct RegisteryTable *ret_item = calloc(1, sizeof(struct RegisteryTable));
     if(ret_item == NULL){
-        printf("Error unable to allocate memory to create a new entry in the funcs list\n");
+        printf("Error unable to allocate new memory to create function registry table\n");
         return NULL;
     }
 
-    if(n != NULL && f != NULL){
-        ret_item->name = n;
-        ret_item->function = f;
-    }else{
-        ret_item->name = NULL;
-        ret_item->function = NULL;
+    ret_item->slots = calloc(capacity, sizeof(struct Registery));
+    if(ret_item->slots == NULL){
+        printf("Error unable to allocate new memory for function registry slots\n");
+        free(ret_item);
+        return NULL;
     }
-
-    ret_item->next = NULL;
+    ret_item->capacity = capacity;
     return ret_item;
 }
 
-struct RegisteryList *create_function_registery(struct Registery *head){
-    struct RegisteryList *ret_item = malloc(sizeof(struct RegisteryList));
-    if (ret_item == NULL){
-        printf("Error unable to allocate new memory to create function registry list\n");
-        return NULL;
-    }
-    ret_item->head = ret_item->tail = head;
-    return ret_item;
+//drop the perfect hash; the open-addressing table stays authoritative
+static void thaw_registery(struct RegisteryTable *table){
+    free(table->seeds);
+    free(table->flat);
+    table->seeds = NULL;
+    table->flat = NULL;
+    table->num_buckets = 0;
+    table->frozen = 0;
 }
 
+static struct Registery *find_slot(struct RegisteryTable *table, const char *name, size_t len, uint64_t hash){
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
 
-int function_table_init(const char *lib_path){
-    if(dl_handler != NULL){
-        printf("Warning dl_handler no null clearing it\n");
-        dlclose(dl_handler);
+    while(table->slots[i].name != NULL){
+        if(name_matches(&table->slots[i], name, len, hash)){
+            return &table->slots[i];
+        }
+        i = (i + 1) & mask;
     }
+    return &table->slots[i];
+}
 
-    dl_handler = dlopen(lib_path, RTLD_NOW);
-
-    if(dl_handler == NULL){
-        printf("Error failed to open %s\n", lib_path);
-        printf("%s\n", dlerror());
+static int grow_registery(struct RegisteryTable *table){
+    size_t new_capacity = table->capacity * 2;
+    struct Registery *new_slots = calloc(new_capacity, sizeof(struct Registery));
+    if(new_slots == NULL){
+        printf("Error unable to grow function registry\n");
         return -1;
     }
 
+    struct Registery *old_slots = table->slots;
+    size_t old_capacity = table->capacity;
+    table->slots = new_slots;
+    table->capacity = new_capacity;
+
+    for(size_t i = 0; i < old_capacity; i++){
+        if(old_slots[i].name != NULL){
+            *find_slot(table, old_slots[i].name, old_slots[i].name_len, old_slots[i].hash) = old_slots[i];
+        }
+    }
+
+    free(old_slots);
     return 0;
 }
 
+
+//caller holds registery_lock; a NULL name finds the default library
+static struct FunctionLibrary *find_library(const char *name, size_t len){
+    for(int i = 0; i < num_libraries; i++){
+        struct FunctionLibrary *library = &libraries[i];
+        if(name == NULL ? library->name == NULL :
+           (library->name != NULL && strlen(library->name) == len && !memcmp(library->name, name, len))){
+            return library;
+        }
+    }
+    return NULL;
+}
+
+//the library's symbol behind a registered name
+static const char *symbol_name(const struct Registery *entry){
+    if(entry->library->name == NULL){
+        return entry->name;
+    }
+    return entry->name + strlen(entry->library->name) + 1;
+}
+
+//RTLD_LOCAL keeps each library's symbols out of the others' way
+static int load_library(const char *name, const char *lib_path){
+    pthread_mutex_lock(&registery_lock);
+
+    int rc = -1;
+    if(find_library(name, name != NULL ? strlen(name) : 0) != NULL){
+        printf("Error library %s is already loaded\n", name != NULL ? name : "(default)");
+    }else if(num_libraries == MAX_LIBRARIES){
+        printf("Error unable to load more than %d libraries\n", MAX_LIBRARIES);
+    }else{
+        struct FunctionLibrary *library = &libraries[num_libraries];
+        library->handle = dlopen(lib_path, RTLD_NOW | RTLD_LOCAL);
+
+        if(library->handle == NULL){
+            printf("Error failed to open %s\n", lib_path);
+            printf("%s\n", dlerror());
+        }else{
+            library->name = name != NULL ? strdup(name) : NULL;
+            library->path = lib_path != NULL ? strdup(lib_path) : NULL;
+            num_libraries++;
+            rc = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&registery_lock);
+    return rc;
+}
+
+int function_table_init(const char *lib_path){
+    pthread_mutex_lock(&registery_lock);
+    int loaded = find_library(NULL, 0) != NULL;
+    pthread_mutex_unlock(&registery_lock);
+
+    if(loaded){
+        //functions already registered still point into the open library
+        return reload_library(NULL, lib_path);
+    }
+    return load_library(NULL, lib_path);
+}
+
+//further libraries, whose functions are registered as "name.function"
+int add_library(const char *name, const char *lib_path){
+    if(name == NULL || *name == '\0' || strchr(name, '.') != NULL){
+        printf("Error library name must be non-empty and without dots\n");
+        return -1;
+    }
+    return load_library(name, lib_path);
+}
+
+static int add_function_entry(const char *func_name, void *look_up_func, int abi, RPCRequest *signature,
+                              struct FunctionLibrary *library);
+static int table_insert(struct RegisteryTable *table, const char *func_name, void *look_up_func, int abi,
+                        RPCRequest *signature, struct FunctionLibrary *library);
+
 int add_function(const char *func_name){
-    if(dl_handler == NULL){
+    return add_function_abi(func_name, FUNC_ABI_PLAIN);
+}
+
+//"name.function" comes from the library loaded as name, anything else from the default one
+static void *lookup_symbol(const char *func_name, struct FunctionLibrary **library){
+    if(num_libraries == 0){
         printf("Error please call the init function first!\n");
-        return -1;
+        return NULL;
     }
-    
+
     if(func_name == NULL){
         printf("Error function look up name is null\n");
-        return -1;
+        return NULL;
+    }
+
+    const char *symbol = func_name;
+    const char *dot = strchr(func_name, '.');
+    *library = dot != NULL ? find_library(func_name, dot - func_name) : NULL;
+    if(*library != NULL){
+        symbol = dot + 1;
+    }else{
+        *library = find_library(NULL, 0);
     }
 
-    void *look_up_func = dlsym(dl_handler, func_name);
+    if(*library == NULL){
+        printf("Error no library loaded for function %s\n", func_name);
+        return NULL;
+    }
+
+    void *look_up_func = dlsym((*library)->handle, symbol);
     if(look_up_func == NULL){
         printf("Error can not find function with name %s\n", func_name);
+    }
+    return look_up_func;
+}
+
+int add_function_abi(const char *func_name, int abi){
+    pthread_mutex_lock(&registery_lock);
+    struct FunctionLibrary *library;
+    void *look_up_func = lookup_symbol(func_name, &library);
+    int rc = -1;
+    if(look_up_func != NULL){
+        rc = add_function_entry(func_name, look_up_func, abi, NULL, library);
+    }
+    pthread_mutex_unlock(&registery_lock);
+    return rc;
+}
+
+//functions linked into the program itself (generated skeletons) skip the library
+int add_function_ptr(const char *func_name, void *function, int abi){
+    if(func_name == NULL || function == NULL){
+        printf("Error function name and pointer are required\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&registery_lock);
+    int rc = add_function_entry(func_name, function, abi, NULL, NULL);
+    pthread_mutex_unlock(&registery_lock);
+    return rc;
+}
+
+//for callers that already hand out the function's ID: nothing is registered unless it gets that one
+int add_function_ptr_at(const char *func_name, void *function, int abi, uint32_t id){
+    if(func_name == NULL || function == NULL){
+        printf("Error function name and pointer are required\n");
         return -1;
     }
 
-    if(funcs == NULL){
-        struct Registery *new_node = create_registery_node(func_name, look_up_func);
+    pthread_mutex_lock(&registery_lock);
+    struct RegisteryTable *table = atomic_load(&funcs);
+    size_t next_id = table != NULL ? table->count : 0;
+    if(table != NULL){
+        size_t name_len = strlen(func_name);
+        const struct Registery *slot = find_slot(table, func_name, name_len, function_name_hash_len(func_name, name_len));
+        if(slot != NULL && slot->name != NULL){
+            next_id = slot->id;
+        }
+    }
+
+    int rc = -1;
+    if(next_id != id){
+        printf("Error function %s would get ID %zu but expects %u\n", func_name, next_id, id);
+    }else{
+        rc = add_function_entry(func_name, function, abi, NULL, NULL);
+    }
+    pthread_mutex_unlock(&registery_lock);
+    return rc;
+}
+
+//typed functions keep a copy of their signature for the server to check arguments against
+int add_function_typed(const RPCRequest *signature){
+    if(signature == NULL || signature->num_args > MAX_ARGS){
+        printf("Error typed function needs a signature with at most %d arguments\n", MAX_ARGS);
+        return -1;
+    }
 
-        if(new_node == NULL){
-            printf("Error unable create function registry while creating node\n");
+    for(int i = 0; i < signature->num_args; i++){
+        uint8_t type = signature->arg_types[i];
+        if(type != TYPE_INT && type != TYPE_FLOAT && type != TYPE_STRING && type != TYPE_BYTES){
+            printf("Error argument %d of %.*s has invalid type %d\n", i, MAX_FUNCTION_NAME, signature->function_name, type);
             return -1;
         }
-        
-        funcs = create_function_registery(new_node);
-        
-        if(funcs == NULL){
+    }
+    if(signature->return_type < TYPE_INT || signature->return_type > TYPE_BYTES){
+        printf("Error %.*s has invalid return type %d\n", MAX_FUNCTION_NAME, signature->function_name, signature->return_type);
+        return -1;
+    }
+
+    char name[MAX_FUNCTION_NAME + 1];
+    snprintf(name, sizeof(name), "%.*s", MAX_FUNCTION_NAME, signature->function_name);
+
+    RPCRequest *copy = malloc(sizeof(RPCRequest));
+    if(copy == NULL){
+        printf("Error unable to store signature of %s\n", name);
+        return -1;
+    }
+    *copy = *signature;
+
+    pthread_mutex_lock(&registery_lock);
+    struct FunctionLibrary *library;
+    void *look_up_func = lookup_symbol(name, &library);
+    int rc = -1;
+    if(look_up_func != NULL){
+        rc = add_function_entry(name, look_up_func, FUNC_ABI_TYPED, copy, library);
+    }
+    pthread_mutex_unlock(&registery_lock);
+
+    if(rc != 0){
+        free(copy);
+    }
+    return rc;
+}
+
+//caller holds registery_lock
+static int add_function_entry(const char *func_name, void *look_up_func, int abi, RPCRequest *signature,
+                              struct FunctionLibrary *library){
+    struct RegisteryTable *table = atomic_load(&funcs);
+    if(table == NULL){
+        table = create_function_registery(INITIAL_CAPACITY);
+        if(table == NULL){
             printf("Error unable create function registry\n");
             return -1;
         }
+        atomic_store(&funcs, table);
+    }
 
-        funcs->head = funcs->tail = new_node;  
+    if(table->frozen){
+        printf("Warning registry modified after freeze, falling back to hashed lookup\n");
+        thaw_registery(table);
+    }
 
-    }else{
-        struct Registery *new_node = create_registery_node(func_name, look_up_func);
+    return table_insert(table, func_name, look_up_func, abi, signature, library);
+}
 
-        if(new_node == NULL){
-            printf("Error unable to add new function to registery with name %s\n", func_name);
+static int table_insert(struct RegisteryTable *table, const char *func_name, void *look_up_func, int abi,
+                        RPCRequest *signature, struct FunctionLibrary *library){
+    //keep load factor at or below one half so probe chains stay short
+    if((table->count + 1) * 2 > table->capacity && grow_registery(table) != 0){
+        return -1;
+    }
+
+    size_t name_len = strlen(func_name);
+    uint64_t hash = function_name_hash_len(func_name, name_len);
+    struct Registery *slot = find_slot(table, func_name, name_len, hash);
+
+    if(slot->name != NULL){
+        //re-registering a name just rebinds it, keeping its ID but not its cached results
+        free(slot->signature);
+        slot->function = look_up_func;
+        slot->generation++;
+        slot->abi = abi;
+        slot->signature = signature;
+        slot->library = library;
+        table->by_id[slot->id] = *slot;
+        return 0;
+    }
+
+    if(table->count == table->by_id_capacity){
+        size_t new_capacity = table->by_id_capacity ? table->by_id_capacity * 2 : INITIAL_CAPACITY;
+        struct Registery *grown = realloc(table->by_id, new_capacity * sizeof(struct Registery));
+        if(grown == NULL){
+            printf("Error unable to grow function dispatch array\n");
             return -1;
         }
+        table->by_id = grown;
+        table->by_id_capacity = new_capacity;
+    }
 
-        funcs->tail->next = new_node;
-        funcs->tail = new_node;
+    slot->name = strdup(func_name);
+    if(slot->name == NULL){
+        printf("Error unable to add new function to registery with name %s\n", func_name);
+        return -1;
     }
+    slot->function = look_up_func;
+    slot->abi = abi;
+    slot->signature = signature;
+    slot->library = library;
+    slot->name_len = name_len;
+    slot->hash = hash;
+    slot->id = table->count;
+    table->by_id[slot->id] = *slot;
+    table->count++;
 
     return 0;
 
 }
 
-void *get_function(char *s_name){
-    if(funcs == NULL){
+static struct Registery *lookup_entry(struct RegisteryTable *table, const char *s_name, size_t len, uint64_t hash);
+
+//entries are copied into the dispatch array and the perfect-hash table, so every copy changes
+static void mark_pure(struct RegisteryTable *table, struct Registery *slot, uint32_t ttl_ms){
+    slot->pure = 1;
+    slot->cache_ttl_ms = ttl_ms;
+    table->by_id[slot->id] = *slot;
+
+    if(table->frozen){
+        *lookup_entry(table, slot->name, slot->name_len, slot->hash) = *slot;
+    }
+}
+
+int set_function_pure(const char *func_name, uint32_t ttl_ms){
+    if(func_name == NULL){
+        printf("Error function look up name is null\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&registery_lock);
+    struct RegisteryTable *table = atomic_load(&funcs);
+    size_t name_len = strlen(func_name);
+    struct Registery *slot = NULL;
+    if(table != NULL){
+        slot = find_slot(table, func_name, name_len, function_name_hash_len(func_name, name_len));
+    }
+
+    int rc = -1;
+    if(slot == NULL || slot->name == NULL){
+        printf("Error can not find function with name %s\n", func_name);
+    }else{
+        mark_pure(table, slot, ttl_ms);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&registery_lock);
+    return rc;
+}
+
+static struct Registery *lookup_entry(struct RegisteryTable *table, const char *s_name, size_t len, uint64_t hash){
+    if(table->frozen){
+        uint32_t seed = table->seeds[reduce(hash, table->num_buckets)];
+        struct Registery *entry = &table->flat[reduce(seeded_hash(hash, seed), table->count)];
+        return name_matches(entry, s_name, len, hash) ? entry : NULL;
+    }
+
+    struct Registery *slot = find_slot(table, s_name, len, hash);
+    return slot->name != NULL ? slot : NULL;
+}
+
+static void *lookup_function(struct RegisteryTable *table, const char *s_name, size_t len, uint64_t hash){
+    struct Registery *entry = lookup_entry(table, s_name, len, hash);
+    return entry != NULL ? entry->function : NULL;
+}
+
+void *get_function_hashed(const char *s_name, uint64_t hash){
+    struct RegisteryTable *table = atomic_load(&funcs);
+    if(table == NULL){
         printf("Error create function registry first\n");
         return NULL;
     }
-    
+
     if(s_name == NULL){
         printf("Error look up name is null please use valid string\n");
         return NULL;
     }
 
-    struct Registery *cur = funcs->head;
+    return lookup_function(table, s_name, strlen(s_name), hash);
+}
 
-    while(cur != NULL){
-        if(!strcmp(cur->name, s_name)){
-            return cur->function;
+void *get_function(char *s_name){
+    if(s_name == NULL){
+        printf("Error look up name is null please use valid string\n");
+        return NULL;
+    }
+
+    return get_function_hashed(s_name, function_name_hash(s_name));
+}
+
+//lookup by a (pointer, length) slice straight out of a received frame
+void *get_function_len(const char *s_name, size_t len){
+    struct RegisteryTable *table = atomic_load(&funcs);
+    if(table == NULL){
+        printf("Error create function registry first\n");
+        return NULL;
+    }
+
+    if(s_name == NULL && len > 0){
+        printf("Error look up name is null please use valid string\n");
+        return NULL;
+    }
+
+    return lookup_function(table, s_name, len, function_name_hash_len(s_name, len));
+}
+
+//direct index into the dispatch array, no hashing or string compare
+void *get_function_by_id(uint32_t id){
+    struct RegisteryTable *table = atomic_load(&funcs);
+    if(table == NULL || id >= table->count){
+        return NULL;
+    }
+    return table->by_id[id].function;
+}
+
+//full entries (function and calling convention); valid while a read guard is held
+const struct Registery *get_registery_entry(const char *s_name, size_t len){
+    struct RegisteryTable *table = atomic_load(&funcs);
+    if(table == NULL || (s_name == NULL && len > 0)){
+        return NULL;
+    }
+    return lookup_entry(table, s_name, len, function_name_hash_len(s_name, len));
+}
+
+const struct Registery *get_registery_entry_by_id(uint32_t id){
+    struct RegisteryTable *table = atomic_load(&funcs);
+    if(table == NULL || id >= table->count){
+        return NULL;
+    }
+    return &table->by_id[id];
+}
+
+const char *get_function_name(uint32_t id){
+    struct RegisteryTable *table = atomic_load(&funcs);
+    if(table == NULL || id >= table->count){
+        return NULL;
+    }
+    return table->by_id[id].name;
+}
+
+size_t registery_count(void){
+    struct RegisteryTable *table = atomic_load(&funcs);
+    return table != NULL ? table->count : 0;
+}
+
+//order bucket indices by descending size, biggest buckets are placed first
+static size_t *sort_sizes;
+static int compare_bucket_size(const void *a, const void *b){
+    size_t sa = sort_sizes[*(const size_t *)a];
+    size_t sb = sort_sizes[*(const size_t *)b];
+    return (sa < sb) - (sa > sb);
+}
+
+/*
+ * Build a minimal perfect hash (hash-and-displace) over the registered names:
+ * names are grouped into buckets by their hash, then each bucket, largest
+ * first, searches for a seed that sends all its names to unused slots of a
+ * flat array with exactly one slot per function.
+ */
+static int freeze_table(struct RegisteryTable *table){
+    if(table == NULL || table->count == 0){
+        printf("Error nothing registered to freeze\n");
+        return -1;
+    }
+
+    thaw_registery(table);
+
+    size_t n = table->count;
+    size_t num_buckets = (n + KEYS_PER_BUCKET - 1) / KEYS_PER_BUCKET;
+
+    struct Registery **entries = malloc(n * sizeof(struct Registery *));
+    size_t *bucket_of = malloc(n * sizeof(size_t));
+    size_t *sizes = calloc(num_buckets, sizeof(size_t));
+    size_t *starts = calloc(num_buckets + 1, sizeof(size_t));
+    size_t *order = malloc(num_buckets * sizeof(size_t));
+    size_t *members = malloc(n * sizeof(size_t));
+    size_t *attempt = malloc(n * sizeof(size_t));
+    char *taken = calloc(n, 1);
+    uint32_t *seeds = calloc(num_buckets, sizeof(uint32_t));
+    struct Registery *flat = calloc(n, sizeof(struct Registery));
+
+    int rc = -1;
+    if(entries == NULL || bucket_of == NULL || sizes == NULL || starts == NULL || order == NULL ||
+       members == NULL || attempt == NULL || taken == NULL || seeds == NULL || flat == NULL){
+        printf("Error unable to allocate memory to freeze function registry\n");
+        goto cleanup;
+    }
+
+    size_t k = 0;
+    for(size_t i = 0; i < table->capacity; i++){
+        if(table->slots[i].name != NULL){
+            entries[k] = &table->slots[i];
+            bucket_of[k] = reduce(table->slots[i].hash, num_buckets);
+            sizes[bucket_of[k]]++;
+            k++;
+        }
+    }
+
+    //counting sort of entries into their buckets
+    for(size_t b = 0; b < num_buckets; b++){
+        starts[b + 1] = starts[b] + sizes[b];
+        order[b] = b;
+    }
+    size_t *fill = attempt;
+    memcpy(fill, starts, num_buckets * sizeof(size_t));
+    for(size_t i = 0; i < n; i++){
+        members[fill[bucket_of[i]]++] = i;
+    }
+
+    sort_sizes = sizes;
+    qsort(order, num_buckets, sizeof(size_t), compare_bucket_size);
+
+    for(size_t o = 0; o < num_buckets; o++){
+        size_t b = order[o];
+        size_t size = sizes[b];
+        if(size == 0){
             break;
         }
-        cur = cur->next;
+
+        size_t *bucket = &members[starts[b]];
+        uint32_t seed;
+        for(seed = 0; seed < MAX_SEED_ATTEMPTS; seed++){
+            size_t placed = 0;
+            for(; placed < size; placed++){
+                size_t slot = reduce(seeded_hash(entries[bucket[placed]]->hash, seed), n);
+                if(taken[slot]){
+                    break;
+                }
+                taken[slot] = 1;
+                attempt[placed] = slot;
+            }
+            if(placed == size){
+                break;
+            }
+            //undo the partial placement and try the next seed
+            while(placed > 0){
+                taken[attempt[--placed]] = 0;
+            }
+        }
+
+        if(seed == MAX_SEED_ATTEMPTS){
+            printf("Warning unable to build perfect hash, keeping hashed lookup\n");
+            goto cleanup;
+        }
+
+        seeds[b] = seed;
+        for(size_t i = 0; i < size; i++){
+            flat[attempt[i]] = *entries[bucket[i]];
+        }
     }
 
-    return NULL;
+    table->seeds = seeds;
+    table->flat = flat;
+    table->num_buckets = num_buckets;
+    table->frozen = 1;
+    seeds = NULL;
+    flat = NULL;
+    rc = 0;
+
+cleanup:
+    free(entries);
+    free(bucket_of);
+    free(sizes);
+    free(starts);
+    free(order);
+    free(members);
+    free(attempt);
+    free(taken);
+    free(seeds);
+    free(flat);
+    return rc;
 }
 
-void destroy_registery(){
-    if(funcs != NULL){
-        struct Registery *cur = funcs->head;
-        struct Registery *next = funcs->head->next;
-
-        if(next != NULL){
-            while(next != NULL){
-                //free(cur->name);
-                //free(cur->function);
-                free(cur);
-                cur = next;
-                next = cur->next;
+int freeze_registery(void){
+    pthread_mutex_lock(&registery_lock);
+    int rc = freeze_table(atomic_load(&funcs));
+    pthread_mutex_unlock(&registery_lock);
+    return rc;
+}
+
+static void destroy_table(struct RegisteryTable *table){
+    if(table == NULL){
+        return;
+    }
+
+    for(size_t i = 0; i < table->capacity; i++){
+        //function pointers belong to the library, only names and signatures are ours
+        free(table->slots[i].name);
+        free(table->slots[i].signature);
+    }
+
+    thaw_registery(table);
+    free(table->slots);
+    free(table->by_id);
+    free(table);
+}
+
+/*
+ * Sleepable RCU over striped counters. A reader bumps the counter of the
+ * current epoch's parity on its own stripe, and checks the epoch did not move
+ * meanwhile: if it did, a writer may already have looked at that counter, so
+ * the reader backs out and tries again. A writer that has published a new
+ * table bumps the epoch and waits for the old parity's counters to drop to
+ * zero; every reader left there may hold the old table, none that comes later
+ * can.
+ */
+registery_guard registery_read_lock(void){
+    if(my_stripe < 0){
+        my_stripe = (int)(atomic_fetch_add_explicit(&next_stripe, 1, memory_order_relaxed) % READER_STRIPES);
+    }
+
+    struct reader_stripe *stripe = &readers[my_stripe];
+    for(;;){
+        unsigned epoch = atomic_load(&reader_epoch);
+        atomic_fetch_add(&stripe->active[epoch & 1], 1);
+        if(atomic_load(&reader_epoch) == epoch){
+            return ((registery_guard)my_stripe << 1) | (epoch & 1);
+        }
+        atomic_fetch_sub(&stripe->active[epoch & 1], 1);
+    }
+}
+
+void registery_read_unlock(registery_guard guard){
+    atomic_fetch_sub(&readers[guard >> 1].active[guard & 1], 1);
+}
+
+//caller holds registery_lock, so epochs move one at a time
+static void wait_for_readers(void){
+    unsigned old_parity = atomic_fetch_add(&reader_epoch, 1) & 1;
+
+    for(int i = 0; i < READER_STRIPES; i++){
+        while(atomic_load(&readers[i].active[old_parity]) != 0){
+            usleep(READER_DRAIN_SLEEP_US);
+        }
+    }
+}
+
+//copy a library file to a private path; NULL if that is not possible
+static char *copy_library(const char *lib_path){
+    const char *dir = getenv("TMPDIR");
+    if(dir == NULL || *dir == '\0'){
+        dir = "/tmp";
+    }
+
+    size_t len = strlen(dir) + 64;
+    char *copy_path = malloc(len);
+    if(copy_path == NULL){
+        printf("Error unable to allocate path to copy %s\n", lib_path);
+        return NULL;
+    }
+    snprintf(copy_path, len, "%s/rpc-lib-%d-%u-XXXXXX", dir, (int)getpid(), ++reload_count);
+
+    int in = open(lib_path, O_RDONLY);
+    int out = in >= 0 ? mkstemp(copy_path) : -1;
+    if(in < 0 || out < 0){
+        printf("Error unable to copy %s for reloading\n", lib_path);
+        if(in >= 0){
+            close(in);
+        }
+        free(copy_path);
+        return NULL;
+    }
+
+    char buf[65536];
+    ssize_t n;
+    int rc = 0;
+    while((n = read(in, buf, sizeof(buf))) > 0){
+        if(write(out, buf, n) != n){
+            rc = -1;
+            break;
+        }
+    }
+    close(in);
+    close(out);
+
+    if(n < 0 || rc != 0){
+        printf("Error unable to copy %s for reloading\n", lib_path);
+        unlink(copy_path);
+        free(copy_path);
+        return NULL;
+    }
+    return copy_path;
+}
+
+/*
+ * dlopen hands back the object already loaded from a path, however the file
+ * changed since. A new build at the path in use is opened from a copy under
+ * another name instead; the copy can go once it is mapped.
+ */
+static void *open_library(const char *lib_path){
+    void *loaded = dlopen(lib_path, RTLD_NOW | RTLD_NOLOAD);
+    void *handle;
+
+    if(loaded == NULL){
+        handle = dlopen(lib_path, RTLD_NOW | RTLD_LOCAL);
+    }else{
+        dlclose(loaded);
+
+        char *copy_path = copy_library(lib_path);
+        if(copy_path == NULL){
+            return NULL;
+        }
+        handle = dlopen(copy_path, RTLD_NOW | RTLD_LOCAL);
+        unlink(copy_path);
+        free(copy_path);
+    }
+
+    if(handle == NULL){
+        printf("Error failed to open %s\n", lib_path);
+        printf("%s\n", dlerror());
+    }
+    return handle;
+}
+
+//same names, IDs and conventions, with the functions of library looked up again in handle
+static struct RegisteryTable *rebind_table(struct RegisteryTable *old, struct FunctionLibrary *library, void *handle){
+    struct RegisteryTable *table = create_function_registery(old != NULL ? old->capacity : INITIAL_CAPACITY);
+    if(table == NULL || old == NULL){
+        return table;
+    }
+
+    for(size_t id = 0; id < old->count; id++){
+        const struct Registery *entry = &old->by_id[id];
+        void *function = entry->function;
+
+        if(entry->library == library){
+            function = dlsym(handle, symbol_name(entry));
+            if(function == NULL){
+                printf("Error new library has no function %s\n", entry->name);
+                destroy_table(table);
+                return NULL;
             }
         }
 
-        //free(cur->name);
-        //free(cur->function);
-        free(cur);
-        free(funcs);
+        RPCRequest *signature = NULL;
+        if(entry->signature != NULL){
+            signature = malloc(sizeof(RPCRequest));
+            if(signature == NULL){
+                printf("Error unable to copy signature of %s\n", entry->name);
+                destroy_table(table);
+                return NULL;
+            }
+            *signature = *entry->signature;
+        }
+
+        if(table_insert(table, entry->name, function, entry->abi, signature, entry->library) != 0){
+            free(signature);
+            destroy_table(table);
+            return NULL;
+        }
+
+        //results cached from the old code are already on their way out under the old generation
+        struct Registery *slot = find_slot(table, entry->name, entry->name_len, entry->hash);
+        slot->generation = entry->generation + (entry->library == library);
+        slot->pure = entry->pure;
+        slot->cache_ttl_ms = entry->cache_ttl_ms;
+        table->by_id[slot->id] = *slot;
+    }
+
+    if(old->frozen && freeze_table(table) != 0){
+        printf("Warning reloaded registry keeps hashed lookup\n");
+    }
+    return table;
+}
+
+/*
+ * Swap in a new build of one library without stopping: registered names keep
+ * their IDs and calling conventions, the library's functions come from
+ * lib_path. Calls already running finish on the old code, which is unloaded
+ * once they have. If any of its registered functions is missing from the new
+ * build nothing changes.
+ */
+int reload_library(const char *name, const char *lib_path){
+    pthread_mutex_lock(&registery_lock);
+
+    struct FunctionLibrary *library = find_library(name, name != NULL ? strlen(name) : 0);
+    if(library == NULL){
+        printf("Error no library loaded as %s\n", name != NULL ? name : "(default)");
+        pthread_mutex_unlock(&registery_lock);
+        return -1;
+    }
+
+    char *path = lib_path != NULL ? strdup(lib_path) : library->path != NULL ? strdup(library->path) : NULL;
+    void *handle = path != NULL ? open_library(path) : NULL;
+    if(handle == NULL){
+        if(path == NULL){
+            printf("Error no path to reload %s from\n", name != NULL ? name : "(default)");
+        }
+        free(path);
+        pthread_mutex_unlock(&registery_lock);
+        return -1;
+    }
+
+    struct RegisteryTable *old = atomic_load(&funcs);
+    struct RegisteryTable *table = rebind_table(old, library, handle);
+    if(table == NULL){
+        printf("Error keeping the loaded library\n");
+        dlclose(handle);
+        free(path);
+        pthread_mutex_unlock(&registery_lock);
+        return -1;
     }
 
-    if(dl_handler != NULL){
-        dlclose(dl_handler);
+    void *old_handle = library->handle;
+    atomic_store(&funcs, table);
+    library->handle = handle;
+    free(library->path);
+    library->path = path;
+
+    //from here on no reader can reach the old table or old library
+    wait_for_readers();
+    destroy_table(old);
+    dlclose(old_handle);
+
+    pthread_mutex_unlock(&registery_lock);
+    return 0;
+}
+
+int reload_function_table(const char *lib_path){
+    return reload_library(NULL, lib_path);
+}
+
+//for after serving has stopped: readers are not waited for
+void destroy_registery(){
+    pthread_mutex_lock(&registery_lock);
+
+    destroy_table(atomic_exchange(&funcs, NULL));
+
+    for(int i = 0; i < num_libraries; i++){
+        dlclose(libraries[i].handle);
+        free(libraries[i].name);
+        free(libraries[i].path);
     }
-}
\ No newline at end of file
+    memset(libraries, 0, sizeof(libraries));
+    num_libraries = 0;
+
+    pthread_mutex_unlock(&registery_lock);
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include "rpc_context.h"
 
 char* hello(const char *name)
 {
@@ -42,3 +43,134 @@ char* uppercase(const char *msg)
     return out;
 }
 
+
+/* Arena-aware variants: results come from the request arena, nothing to free */
+
+char* reverse_ctx(rpc_context *ctx, const char *msg)
+{
+    if (!msg) return NULL;
+
+    size_t len = strlen(msg);
+    char *out = rpc_alloc(ctx, len + 1);
+    if (!out) return NULL;
+
+    for (size_t i = 0; i < len; i++)
+        out[i] = msg[len - 1 - i];
+
+    out[len] = '\0';
+    return out;
+}
+
+char* uppercase_ctx(rpc_context *ctx, const char *msg)
+{
+    if (!msg) return NULL;
+
+    char *out = rpc_strdup(ctx, msg);
+    if (!out) return NULL;
+
+    for (size_t i = 0; out[i]; i++)
+        out[i] = toupper((unsigned char)out[i]);
+
+    return out;
+}
+
+/* Output-buffer variants: the result is written straight into the reply frame */
+
+int reverse_buf(const char *msg, rpc_output *out)
+{
+    if (!msg) return 0;
+
+    size_t len = strlen(msg);
+    if (rpc_output_reserve(out, len) != 0) return -1;
+
+    for (size_t i = 0; i < len; i++)
+        out->data[i] = msg[len - 1 - i];
+
+    out->len = len;
+    return 0;
+}
+
+int repeat_buf(const char *msg, rpc_output *out)
+{
+    if (!msg) return 0;
+
+    // "<count> <text>": count copies of text, may grow past the initial buffer
+    char *text;
+    long count = strtol(msg, &text, 10);
+    if (count < 0 || *text != ' ') return -1;
+    text++;
+
+    size_t len = strlen(text);
+    for (long i = 0; i < count; i++)
+        if (rpc_output_append(out, text, len) != 0) return -1;
+
+    return 0;
+}
+
+/* Streaming variant: uppercases any amount of data a chunk at a time */
+
+int uppercase_stream(rpc_stream *stream)
+{
+    char chunk[4096];
+    long n;
+
+    while ((n = rpc_stream_read(stream, chunk, sizeof(chunk))) > 0) {
+        for (long i = 0; i < n; i++)
+            chunk[i] = toupper((unsigned char)chunk[i]);
+
+        if (rpc_stream_write(stream, chunk, n) != 0) return -1;
+    }
+
+    return n < 0 ? -1 : 0;
+}
+
+/* Typed variants: binary arguments in, a binary value out, no text parsing */
+
+int add_typed(rpc_context *ctx, const rpc_value *args, rpc_value *result)
+{
+    (void)ctx;
+    result->i = args[0].i + args[1].i;
+    return 0;
+}
+
+int scale_typed(rpc_context *ctx, const rpc_value *args, rpc_value *result)
+{
+    (void)ctx;
+    result->f = args[0].f * args[1].f;
+    return 0;
+}
+
+int repeat_typed(rpc_context *ctx, const rpc_value *args, rpc_value *result)
+{
+    // (string text, int count) -> text repeated count times
+    if (args[1].i < 0) return -1;
+    if (args[0].len > 0 && (size_t)args[1].i > MAX_BATCH_PAYLOAD_SIZE / args[0].len) return -1;
+
+    size_t len = args[0].len * (size_t)args[1].i;
+    char *out = rpc_alloc(ctx, len + 1);
+    if (!out) return -1;
+
+    for (int i = 0; i < args[1].i; i++)
+        memcpy(out + i * args[0].len, args[0].data, args[0].len);
+
+    out[len] = '\0';
+    result->data = out;
+    result->len = len;
+    return 0;
+}
+
+/* Text counterpart of add_typed: "<a> <b>" -> "<a + b>" */
+
+char* add(const char *msg)
+{
+    if (!msg) return NULL;
+
+    char *end;
+    long a = strtol(msg, &end, 10);
+    long b = strtol(end, NULL, 10);
+
+    char *out = malloc(24);
+    if (!out) return NULL;
+    snprintf(out, 24, "%ld", a + b);
+    return out;
+}
@@ -37,11 +37,25 @@ char* serialize_message(Message *mes){
     return buffer;
 }
 
-Message* deserialize_message(char *buffer){
+size_t serialized_message_size(Message *mes){
+    if(mes == NULL || mes->func_name == NULL){
+        return 0;
+    }
+
+    size_t params_len = mes->params != NULL? strlen(mes->params): 0;
+    return (sizeof(uint32_t) * 2) + strlen(mes->func_name) + params_len;
+}
+
+Message* deserialize_message(char *buffer, size_t len){
     if(buffer == NULL){
         printf("Buffer is NULL!\n");
         return NULL;
     }
+
+    if(len < sizeof(uint32_t) * 2){
+        printf("Buffer too short for a message!\n");
+        return NULL;
+    }
     
     uint32_t func_name_len = 0;
     uint32_t params_len = 0;
@@ -51,28 +65,270 @@ Message* deserialize_message(char *buffer){
 
     memcpy(&func_name_len, buffer, sizeof(uint32_t));
     func_name_len = ntohl(func_name_len);
-    func_name = malloc(func_name_len);
+    if(func_name_len > len - (sizeof(uint32_t) * 2)){
+        printf("Function name length exceeds buffer!\n");
+        return NULL;
+    }
+    func_name = malloc(func_name_len + 1);
     if(func_name == NULL){
         printf("Unable to allocate memory to func_name!\n");
         return NULL;
     }
     memcpy(func_name, buffer + sizeof(uint32_t), func_name_len);
+    func_name[func_name_len] = '\0';
     
     memcpy(&params_len, (buffer + (sizeof(uint32_t) + func_name_len)), sizeof(uint32_t));
     params_len = ntohl(params_len);
+    if(params_len > len - (sizeof(uint32_t) * 2) - func_name_len){
+        printf("Params length exceeds buffer!\n");
+        free(func_name);
+        return NULL;
+    }
     if(params_len){
-        params = malloc(params_len);
+        params = malloc(params_len + 1);
         if(params == NULL){
             printf("Unable to allocate memory to params!\n");
+            free(func_name);
             return NULL;
         }
         memcpy(params, (buffer + ((sizeof(uint32_t) * 2) + func_name_len)), params_len);
+        params[params_len] = '\0';
     }
 
     Message *ret_item = malloc(sizeof(Message));
+    if(ret_item == NULL){
+        printf("Unable to allocate memory to message!\n");
+        free(func_name);
+        free(params);
+        return NULL;
+    }
 
     ret_item->func_name = func_name;
     ret_item->params = params;
     
     return ret_item;
-}
\ No newline at end of file
+}
+
+void free_message(Message *mes){
+    if(mes == NULL){
+        return;
+    }
+
+    free(mes->func_name);
+    free(mes->params);
+    free(mes);
+}
+
+char *serialize_id_message(uint32_t func_id, const char *params, size_t *out_len){
+    size_t params_len = params != NULL? strlen(params): 0;
+    char *buffer = malloc(sizeof(uint32_t) + params_len);
+
+    if(buffer == NULL){
+        printf("Unable to allocate memory to buffer!\n");
+        return NULL;
+    }
+
+    uint32_t net_order_func_id = htonl(func_id);
+    memcpy(buffer, &net_order_func_id, sizeof(uint32_t));
+    if(params_len){
+        memcpy(buffer + sizeof(uint32_t), params, params_len);
+    }
+
+    *out_len = sizeof(uint32_t) + params_len;
+    return buffer;
+}
+
+//func_name is left NULL, the caller resolves the ID
+Message* deserialize_id_message(char *buffer, size_t len, uint32_t *func_id){
+    if(buffer == NULL || len < sizeof(uint32_t)){
+        printf("Buffer too short for a message!\n");
+        return NULL;
+    }
+
+    memcpy(func_id, buffer, sizeof(uint32_t));
+    *func_id = ntohl(*func_id);
+
+    Message *ret_item = malloc(sizeof(Message));
+    if(ret_item == NULL){
+        printf("Unable to allocate memory to message!\n");
+        return NULL;
+    }
+    ret_item->func_name = NULL;
+    ret_item->params = NULL;
+
+    size_t params_len = len - sizeof(uint32_t);
+    if(params_len){
+        ret_item->params = malloc(params_len + 1);
+        if(ret_item->params == NULL){
+            printf("Unable to allocate memory to params!\n");
+            free(ret_item);
+            return NULL;
+        }
+        memcpy(ret_item->params, buffer + sizeof(uint32_t), params_len);
+        ret_item->params[params_len] = '\0';
+    }
+
+    return ret_item;
+}
+
+int deserialize_message_view(const char *buffer, size_t len, MessageView *view){
+    if(buffer == NULL || len < sizeof(uint32_t) * 2){
+        printf("Buffer too short for a message!\n");
+        return -1;
+    }
+
+    uint32_t func_name_len;
+    uint32_t params_len;
+
+    memcpy(&func_name_len, buffer, sizeof(uint32_t));
+    func_name_len = ntohl(func_name_len);
+    if(func_name_len > len - (sizeof(uint32_t) * 2)){
+        printf("Function name length exceeds buffer!\n");
+        return -1;
+    }
+
+    memcpy(&params_len, buffer + sizeof(uint32_t) + func_name_len, sizeof(uint32_t));
+    params_len = ntohl(params_len);
+    if(params_len != len - (sizeof(uint32_t) * 2) - func_name_len){
+        printf("Params length does not match buffer!\n");
+        return -1;
+    }
+
+    view->func_name = buffer + sizeof(uint32_t);
+    view->func_name_len = func_name_len;
+    view->params = buffer + (sizeof(uint32_t) * 2) + func_name_len;
+    view->params_len = params_len;
+    return 0;
+}
+
+//func_name is left empty, the caller resolves the ID
+int deserialize_id_message_view(const char *buffer, size_t len, uint32_t *func_id, MessageView *view){
+    if(buffer == NULL || len < sizeof(uint32_t)){
+        printf("Buffer too short for a message!\n");
+        return -1;
+    }
+
+    memcpy(func_id, buffer, sizeof(uint32_t));
+    *func_id = ntohl(*func_id);
+
+    view->func_name = NULL;
+    view->func_name_len = 0;
+    view->params = buffer + sizeof(uint32_t);
+    view->params_len = len - sizeof(uint32_t);
+    return 0;
+}
+
+size_t serialize_message_into(char *buffer, size_t capacity, const char *func_name, const char *params){
+    if(func_name == NULL){
+        printf("Message requires Function name and serialized parameters\n");
+        return 0;
+    }
+
+    size_t func_name_len = strlen(func_name);
+    size_t params_len = params != NULL? strlen(params): 0;
+    size_t total = (sizeof(uint32_t) * 2) + func_name_len + params_len;
+    if(total > capacity){
+        return 0;
+    }
+
+    uint32_t net_order_len = htonl(func_name_len);
+    memcpy(buffer, &net_order_len, sizeof(uint32_t));
+    memcpy(buffer + sizeof(uint32_t), func_name, func_name_len);
+
+    net_order_len = htonl(params_len);
+    memcpy(buffer + sizeof(uint32_t) + func_name_len, &net_order_len, sizeof(uint32_t));
+    if(params_len){
+        memcpy(buffer + (sizeof(uint32_t) * 2) + func_name_len, params, params_len);
+    }
+
+    return total;
+}
+
+size_t serialize_id_message_into(char *buffer, size_t capacity, uint32_t func_id, const char *params){
+    size_t params_len = params != NULL? strlen(params): 0;
+    size_t total = sizeof(uint32_t) + params_len;
+    if(total > capacity){
+        return 0;
+    }
+
+    uint32_t net_order_func_id = htonl(func_id);
+    memcpy(buffer, &net_order_func_id, sizeof(uint32_t));
+    if(params_len){
+        memcpy(buffer + sizeof(uint32_t), params, params_len);
+    }
+
+    return total;
+}
+
+size_t serialized_typed_message_size(const char *func_name, uint32_t func_id, const rpc_value *args, int num_args){
+    size_t total = sizeof(uint32_t) + 1;
+    if(func_id == BATCH_NO_FUNC_ID){
+        total += sizeof(uint32_t) + (func_name != NULL? strlen(func_name): 0);
+    }
+    for(int i = 0; i < num_args; i++){
+        total += serialized_value_size(&args[i]);
+    }
+    return total;
+}
+
+size_t serialize_typed_message_into(char *buffer, size_t capacity, const char *func_name, uint32_t func_id,
+                                    const rpc_value *args, int num_args){
+    if(num_args < 0 || num_args > MAX_ARGS || (func_id == BATCH_NO_FUNC_ID && func_name == NULL)){
+        printf("Typed message requires a function and at most %d arguments\n", MAX_ARGS);
+        return 0;
+    }
+
+    size_t total = serialized_typed_message_size(func_name, func_id, args, num_args);
+    if(total > capacity){
+        return 0;
+    }
+
+    uint8_t *cursor = (uint8_t*)buffer;
+    cursor += serialize_int(cursor, (int)func_id);
+    if(func_id == BATCH_NO_FUNC_ID){
+        size_t name_len = strlen(func_name);
+        cursor += serialize_int(cursor, (int)name_len);
+        memcpy(cursor, func_name, name_len);
+        cursor += name_len;
+    }
+
+    *cursor++ = (uint8_t)num_args;
+    for(int i = 0; i < num_args; i++){
+        cursor += serialize_value(cursor, &args[i]);
+    }
+
+    return total;
+}
+
+int deserialize_typed_message_view(const char *buffer, size_t len, uint32_t *func_id, MessageView *view){
+    if(buffer == NULL || len < sizeof(uint32_t) + 1){
+        printf("Buffer too short for a message!\n");
+        return -1;
+    }
+
+    int id;
+    size_t offset = deserialize_int((const uint8_t*)buffer, &id);
+    *func_id = (uint32_t)id;
+    view->func_name = NULL;
+    view->func_name_len = 0;
+
+    if(*func_id == BATCH_NO_FUNC_ID){
+        int name_len;
+        if(len < offset + sizeof(uint32_t)){
+            printf("Buffer too short for a message!\n");
+            return -1;
+        }
+        offset += deserialize_int((const uint8_t*)buffer + offset, &name_len);
+        if(name_len < 0 || offset + (size_t)name_len + 1 > len){
+            printf("Function name runs past the message!\n");
+            return -1;
+        }
+        view->func_name = buffer + offset;
+        view->func_name_len = name_len;
+        offset += name_len;
+    }
+
+    view->params = buffer + offset;
+    view->params_len = len - offset;
+    return 0;
+}
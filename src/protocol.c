@@ -1,6 +1,10 @@
 #include "protocol.h"
+#include "shm_channel.h"
+#include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -18,6 +22,31 @@ MessageHeader create_message_header(uint8_t type,
     return header;
 }
 
+void encode_message_header(const MessageHeader *header, uint8_t *buffer)
+{
+    uint32_t request_id = htonl(header->request_id);
+    uint32_t payload_length = htonl(header->payload_length);
+
+    buffer[0] = header->msg_type;
+    memcpy(buffer + 1, &request_id, sizeof(uint32_t));
+    memcpy(buffer + 5, &payload_length, sizeof(uint32_t));
+    buffer[9] = header->error_code;
+}
+
+void decode_message_header(const uint8_t *buffer, MessageHeader *header)
+{
+    uint32_t request_id;
+    uint32_t payload_length;
+
+    memcpy(&request_id, buffer + 1, sizeof(uint32_t));
+    memcpy(&payload_length, buffer + 5, sizeof(uint32_t));
+
+    header->msg_type = buffer[0];
+    header->request_id = ntohl(request_id);
+    header->payload_length = ntohl(payload_length);
+    header->error_code = buffer[9];
+}
+
 /* ---------------- Serialization Helpers ---------------- */
 
 int serialize_int(uint8_t *buffer, int value)
@@ -27,15 +56,30 @@ int serialize_int(uint8_t *buffer, int value)
     return sizeof(uint32_t);
 }
 
+int deserialize_int(const uint8_t *buffer, int *value)
+{
+    uint32_t network_value;
+    memcpy(&network_value, buffer, sizeof(uint32_t));
+    *value = (int)ntohl(network_value);
+    return sizeof(uint32_t);
+}
+
+/* IEEE 754 bits in network order, like the integers */
 int serialize_float(uint8_t *buffer, float value)
 {
-    memcpy(buffer, &value, sizeof(float));
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+    bits = htonl(bits);
+    memcpy(buffer, &bits, sizeof(float));
     return sizeof(float);
 }
 
 int deserialize_float(const uint8_t *buffer, float *value)
 {
-    memcpy(value, buffer, sizeof(float));
+    uint32_t bits;
+    memcpy(&bits, buffer, sizeof(float));
+    bits = ntohl(bits);
+    memcpy(value, &bits, sizeof(float));
     return sizeof(float);
 }
 
@@ -68,58 +112,194 @@ int deserialize_string(const uint8_t *buffer, char *str, size_t max_len)
     return sizeof(uint32_t) + len + 1;
 }
 
-/* ---------------- Send / Receive ---------------- */
+/* ---------------- Typed Values ---------------- */
 
-int send_message(int sockfd,
-                 const MessageHeader *header,
-                 const void *payload)
+size_t serialized_value_size(const rpc_value *value)
 {
-    ssize_t sent = send(sockfd, header, sizeof(MessageHeader), 0);
-    if (sent != sizeof(MessageHeader))
-        return -1;
+    switch (value->type)
+    {
+    case TYPE_INT:
+    case TYPE_FLOAT:
+        return 1 + sizeof(uint32_t);
+    case TYPE_STRING:
+        return 1 + sizeof(uint32_t) + value->len + 1;
+    case TYPE_BYTES:
+        return 1 + sizeof(uint32_t) + value->len;
+    default:
+        return 1;
+    }
+}
+
+int serialize_value(uint8_t *buffer, const rpc_value *value)
+{
+    buffer[0] = value->type;
 
-    if (header->payload_length > 0 && payload != NULL)
+    switch (value->type)
     {
-        size_t total_sent = 0;
-        const uint8_t *data = (const uint8_t *)payload;
+    case TYPE_INT:
+        return 1 + serialize_int(buffer + 1, value->i);
+    case TYPE_FLOAT:
+        return 1 + serialize_float(buffer + 1, value->f);
+    case TYPE_STRING:
+    case TYPE_BYTES:
+    {
+        /* Not serialize_string: the length is known and strings may hold NULs */
+        uint32_t network_len = htonl((uint32_t)value->len);
+        memcpy(buffer + 1, &network_len, sizeof(uint32_t));
+        if (value->len > 0)
+            memcpy(buffer + 1 + sizeof(uint32_t), value->data, value->len);
+        if (value->type == TYPE_STRING)
+            buffer[1 + sizeof(uint32_t) + value->len] = '\0';
+        return (int)serialized_value_size(value);
+    }
+    default:
+        buffer[0] = TYPE_VOID;
+        return 1;
+    }
+}
 
-        while (total_sent < header->payload_length)
+int deserialize_value(const uint8_t *buffer, size_t len, rpc_value *value)
+{
+    uint32_t network_len;
+    size_t data_len;
+
+    if (len < 1)
+        return -1;
+
+    memset(value, 0, sizeof(*value));
+    value->type = buffer[0];
+
+    switch (value->type)
+    {
+    case TYPE_INT:
+    case TYPE_FLOAT:
+        if (len < 1 + sizeof(uint32_t))
+            return -1;
+        if (value->type == TYPE_INT)
         {
-            sent = send(sockfd,
-                        data + total_sent,
-                        header->payload_length - total_sent,
-                        0);
+            int i;
+            deserialize_int(buffer + 1, &i);
+            value->i = i;
+        }
+        else
+        {
+            deserialize_float(buffer + 1, &value->f);
+        }
+        return 1 + sizeof(uint32_t);
+    case TYPE_STRING:
+    case TYPE_BYTES:
+        if (len < 1 + sizeof(uint32_t))
+            return -1;
+        memcpy(&network_len, buffer + 1, sizeof(uint32_t));
+        data_len = ntohl(network_len);
+        if (data_len > len - 1 - sizeof(uint32_t))
+            return -1;
+        value->data = (const char *)buffer + 1 + sizeof(uint32_t);
+        value->len = data_len;
+        if (value->type == TYPE_BYTES)
+            return 1 + sizeof(uint32_t) + data_len;
 
-            if (sent <= 0)
-                return -1;
+        /* Strings carry their terminator, so they can be used in place */
+        if (data_len == len - 1 - sizeof(uint32_t) || value->data[data_len] != '\0')
+            return -1;
+        return 1 + sizeof(uint32_t) + data_len + 1;
+    case TYPE_VOID:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+/* ---------------- Send / Receive ---------------- */
+
+int send_iov(int sockfd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 || (sent == 0 && msg.msg_iov->iov_len > 0))
+            return -1;
 
-            total_sent += sent;
+        /* Partial write: skip what went out and resume mid-vector */
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len)
+        {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
         }
     }
     return 0;
 }
 
-int recv_message(int sockfd,
-                 MessageHeader *header,
-                 void *payload,
-                 size_t max_payload)
+int send_frame(int sockfd, const void *frame, size_t len)
+{
+    struct iovec iov = { (void *)frame, len };
+    return send_iov(sockfd, &iov, 1);
+}
+
+int send_message(int sockfd,
+                 const MessageHeader *header,
+                 const void *payload)
+{
+    uint8_t header_buf[MESSAGE_HEADER_SIZE];
+    encode_message_header(header, header_buf);
+
+    /* Header and payload leave in one sendmsg, so they share a segment */
+    struct iovec iov[2];
+    iov[0].iov_base = header_buf;
+    iov[0].iov_len = MESSAGE_HEADER_SIZE;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = payload != NULL ? header->payload_length : 0;
+
+    return send_iov(sockfd, iov, iov[1].iov_len > 0 ? 2 : 1);
+}
+
+static int recv_all(int sockfd, uint8_t *buffer, size_t len)
 {
     size_t total_received = 0;
-    uint8_t *header_buf = (uint8_t *)header;
 
-    /* Receive header */
-    while (total_received < sizeof(MessageHeader))
+    while (total_received < len)
     {
         ssize_t received = recv(sockfd,
-                                header_buf + total_received,
-                                sizeof(MessageHeader) - total_received,
+                                buffer + total_received,
+                                len - total_received,
                                 0);
 
+        if (received < 0 && errno == EINTR)
+            continue;
         if (received <= 0)
             return -1;
 
         total_received += received;
     }
+    return 0;
+}
+
+int recv_message(int sockfd,
+                 MessageHeader *header,
+                 void *payload,
+                 size_t max_payload)
+{
+    uint8_t header_buf[MESSAGE_HEADER_SIZE];
+
+    /* Receive header */
+    if (recv_all(sockfd, header_buf, MESSAGE_HEADER_SIZE) != 0)
+        return -1;
+
+    decode_message_header(header_buf, header);
 
     /* Receive payload */
     if (header->payload_length > 0)
@@ -127,21 +307,142 @@ int recv_message(int sockfd,
         if (header->payload_length > max_payload)
             return -1;
 
-        total_received = 0;
-        uint8_t *payload_buf = (uint8_t *)payload;
+        if (recv_all(sockfd, (uint8_t *)payload, header->payload_length) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int recv_message_alloc(int sockfd,
+                       MessageHeader *header,
+                       uint8_t **payload,
+                       size_t *capacity,
+                       size_t max_payload)
+{
+    uint8_t header_buf[MESSAGE_HEADER_SIZE];
+
+    if (recv_all(sockfd, header_buf, MESSAGE_HEADER_SIZE) != 0)
+        return -1;
+
+    decode_message_header(header_buf, header);
+
+    if (header->payload_length > max_payload)
+        return -1;
+
+    /* One spare byte lets callers NUL-terminate string payloads */
+    if (*payload == NULL || *capacity < (size_t)header->payload_length + 1)
+    {
+        uint8_t *grown = realloc(*payload, header->payload_length + 1);
+        if (grown == NULL)
+            return -1;
+
+        *payload = grown;
+        *capacity = header->payload_length + 1;
+    }
+
+    if (header->payload_length > 0 &&
+        recv_all(sockfd, *payload, header->payload_length) != 0)
+        return -1;
+
+    return 0;
+}
 
-        while (total_received < header->payload_length)
+/* ---------------- Buffered Frame Reader ---------------- */
+
+int frame_reader_init(frame_reader *reader, int sockfd, size_t capacity, size_t max_payload)
+{
+    /* One spare byte lets callers NUL-terminate the last payload in place */
+    reader->buffer = malloc(capacity + 1);
+    if (reader->buffer == NULL)
+        return -1;
+
+    reader->sockfd = sockfd;
+    reader->channel = NULL;
+    reader->capacity = capacity;
+    reader->start = 0;
+    reader->end = 0;
+    reader->max_payload = max_payload;
+    return 0;
+}
+
+/* Length of the frame at the read position, 0 if its header isn't in yet */
+static size_t buffered_frame_length(const frame_reader *reader, MessageHeader *header)
+{
+    if (reader->end - reader->start < MESSAGE_HEADER_SIZE)
+        return 0;
+
+    decode_message_header(reader->buffer + reader->start, header);
+    return MESSAGE_HEADER_SIZE + (size_t)header->payload_length;
+}
+
+int frame_reader_buffered(const frame_reader *reader)
+{
+    MessageHeader header;
+    size_t frame_len = buffered_frame_length(reader, &header);
+    return frame_len > 0 && reader->end - reader->start >= frame_len;
+}
+
+int frame_reader_next(frame_reader *reader, MessageHeader *header, uint8_t **payload)
+{
+    for (;;)
+    {
+        size_t frame_len = buffered_frame_length(reader, header);
+
+        if (frame_len > 0)
         {
-            ssize_t received = recv(sockfd,
-                                    payload_buf + total_received,
-                                    header->payload_length - total_received,
-                                    0);
+            if (header->payload_length > reader->max_payload)
+                return -1;
+
+            if (reader->end - reader->start >= frame_len)
+            {
+                *payload = reader->buffer + reader->start + MESSAGE_HEADER_SIZE;
+                reader->start += frame_len;
+                return 0;
+            }
+        }
+
+        size_t needed = frame_len > 0 ? frame_len : MESSAGE_HEADER_SIZE;
 
-            if (received <= 0)
+        /* Make room for the rest of the frame: slide it to the front, grow if still short */
+        if (reader->start > 0 && reader->capacity - reader->start < needed)
+        {
+            memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->capacity - reader->start < needed)
+        {
+            uint8_t *grown = realloc(reader->buffer, reader->start + needed + 1);
+            if (grown == NULL)
                 return -1;
 
-            total_received += received;
+            reader->buffer = grown;
+            reader->capacity = reader->start + needed;
         }
+
+        /* Pull in as much as is available, possibly several frames */
+        ssize_t received;
+        if (reader->channel != NULL)
+            received = shm_channel_recv(reader->channel,
+                                        reader->buffer + reader->end,
+                                        reader->capacity - reader->end);
+        else
+            received = recv(reader->sockfd,
+                            reader->buffer + reader->end,
+                            reader->capacity - reader->end,
+                            0);
+
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return -1;
+
+        reader->end += received;
     }
-    return 0;
+}
+
+void frame_reader_free(frame_reader *reader)
+{
+    free(reader->buffer);
+    reader->buffer = NULL;
 }
@@ -0,0 +1,414 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "result_cache.h"
+
+#define SKETCH_DEPTH      4
+#define SKETCH_WIDTH      4096                  /* counters per row, a power of two */
+#define SKETCH_WIDTH_BITS 12
+#define SKETCH_MAX_COUNT  15
+#define SKETCH_SAMPLE     (10 * SKETCH_WIDTH)   /* lookups between halvings */
+#define INITIAL_BUCKETS   64
+#define MAX_ENTRY_SHARE   8                     /* one entry takes at most this fraction of a shard */
+
+typedef struct cache_entry {
+    struct cache_entry *next;           /* hash chain */
+    struct cache_entry *clock_prev;
+    struct cache_entry *clock_next;
+    uint64_t hash;
+    uint64_t expires_ns;                /* 0 = never */
+    uint64_t func_key;
+    int has_params;
+    int referenced;                     /* hit since the CLOCK hand last passed */
+    size_t params_len;
+    size_t result_len;
+    char data[];                        /* params, then result */
+} cache_entry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    cache_entry **buckets;
+    size_t num_buckets;
+    size_t count;
+    cache_entry *hand;                  /* next CLOCK candidate, NULL when empty */
+    size_t bytes;
+    size_t max_bytes;
+
+    uint8_t sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+    size_t sketch_increments;
+
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long inserts;
+    unsigned long long rejected;
+    unsigned long long evictions;
+    unsigned long long expired;
+} __attribute__((aligned(64))) cache_shard;
+
+struct result_cache {
+    size_t max_bytes;
+    cache_shard shards[RESULT_CACHE_SHARDS];
+};
+
+static const uint64_t sketch_seeds[SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Eight bytes at a time: params can be large, and this runs on every call to a pure function
+static uint64_t key_hash(uint64_t func_key, const char *params, size_t len) {
+    uint64_t hash = (func_key * 0xc2b2ae3d27d4eb4fULL ^ (params != NULL)) * 0x9e3779b97f4a7c15ULL ^ len;
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, params + i, sizeof(word));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    if (i < len) {
+        uint64_t tail = 0;
+        memcpy(&tail, params + i, len - i);
+        hash = (hash ^ tail) * 0xff51afd7ed558ccdULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static cache_shard *shard_for(result_cache *cache, uint64_t hash) {
+    return &cache->shards[hash >> 60 & (RESULT_CACHE_SHARDS - 1)];
+}
+
+static size_t entry_size(const cache_entry *entry) {
+    return sizeof(cache_entry) + entry->params_len + entry->result_len;
+}
+
+/* ---------------- Frequency sketch (TinyLFU) ---------------- */
+
+static size_t sketch_index(uint64_t hash, int row) {
+    return (size_t)((hash * sketch_seeds[row]) >> (64 - SKETCH_WIDTH_BITS));
+}
+
+// Halving every so often makes the counts follow recent popularity
+static void sketch_age(cache_shard *shard) {
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        for (size_t i = 0; i < SKETCH_WIDTH; i++) {
+            shard->sketch[row][i] >>= 1;
+        }
+    }
+    shard->sketch_increments = 0;
+}
+
+static void sketch_increment(cache_shard *shard, uint64_t hash) {
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint8_t *counter = &shard->sketch[row][sketch_index(hash, row)];
+        if (*counter < SKETCH_MAX_COUNT) {
+            (*counter)++;
+        }
+    }
+    if (++shard->sketch_increments >= SKETCH_SAMPLE) {
+        sketch_age(shard);
+    }
+}
+
+static unsigned sketch_estimate(const cache_shard *shard, uint64_t hash) {
+    unsigned estimate = SKETCH_MAX_COUNT;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        unsigned count = shard->sketch[row][sketch_index(hash, row)];
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+    return estimate;
+}
+
+/* ---------------- Entries (shard lock held) ---------------- */
+
+static cache_entry *find_entry(cache_shard *shard, uint64_t hash, uint64_t func_key, const char *params,
+                               size_t params_len) {
+    if (shard->buckets == NULL) {
+        return NULL;
+    }
+
+    cache_entry *entry = shard->buckets[hash & (shard->num_buckets - 1)];
+    for (; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->func_key == func_key && entry->params_len == params_len &&
+            entry->has_params == (params != NULL) && (params_len == 0 || !memcmp(entry->data, params, params_len))) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void remove_entry(cache_shard *shard, cache_entry *entry) {
+    cache_entry **link = &shard->buckets[entry->hash & (shard->num_buckets - 1)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    if (entry->clock_next == entry) {
+        shard->hand = NULL;
+    } else {
+        entry->clock_prev->clock_next = entry->clock_next;
+        entry->clock_next->clock_prev = entry->clock_prev;
+        if (shard->hand == entry) {
+            shard->hand = entry->clock_next;
+        }
+    }
+
+    shard->bytes -= entry_size(entry);
+    shard->count--;
+    free(entry);
+}
+
+static int grow_buckets(cache_shard *shard) {
+    size_t num_buckets = shard->num_buckets ? shard->num_buckets * 2 : INITIAL_BUCKETS;
+    cache_entry **buckets = calloc(num_buckets, sizeof(cache_entry*));
+    if (buckets == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < shard->num_buckets; i++) {
+        cache_entry *entry = shard->buckets[i];
+        while (entry != NULL) {
+            cache_entry *next = entry->next;
+            cache_entry **head = &buckets[entry->hash & (num_buckets - 1)];
+            entry->next = *head;
+            *head = entry;
+            entry = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->num_buckets = num_buckets;
+    return 0;
+}
+
+// New entries go just behind the hand, the last place it reaches
+static void insert_entry(cache_shard *shard, cache_entry *entry) {
+    cache_entry **head = &shard->buckets[entry->hash & (shard->num_buckets - 1)];
+    entry->next = *head;
+    *head = entry;
+
+    if (shard->hand == NULL) {
+        entry->clock_prev = entry;
+        entry->clock_next = entry;
+        shard->hand = entry;
+    } else {
+        entry->clock_next = shard->hand;
+        entry->clock_prev = shard->hand->clock_prev;
+        entry->clock_prev->clock_next = entry;
+        shard->hand->clock_prev = entry;
+    }
+
+    shard->bytes += entry_size(entry);
+    shard->count++;
+}
+
+// Second chance: referenced entries lose their bit and are passed over once
+static cache_entry *clock_victim(cache_shard *shard) {
+    for (;;) {
+        cache_entry *entry = shard->hand;
+        shard->hand = entry->clock_next;
+        if (!entry->referenced) {
+            return entry;
+        }
+        entry->referenced = 0;
+    }
+}
+
+static void clear_shard(cache_shard *shard) {
+    for (size_t i = 0; i < shard->num_buckets; i++) {
+        cache_entry *entry = shard->buckets[i];
+        while (entry != NULL) {
+            cache_entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        shard->buckets[i] = NULL;
+    }
+    shard->hand = NULL;
+    shard->bytes = 0;
+    shard->count = 0;
+}
+
+/* ---------------- API ---------------- */
+
+result_cache *result_cache_create(size_t max_bytes) {
+    result_cache *cache = calloc(1, sizeof(result_cache));
+    if (cache == NULL) {
+        printf("Error unable to allocate result cache\n");
+        return NULL;
+    }
+
+    cache->max_bytes = max_bytes;
+    for (int i = 0; i < RESULT_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+        cache->shards[i].max_bytes = max_bytes / RESULT_CACHE_SHARDS;
+    }
+    return cache;
+}
+
+void result_cache_destroy(result_cache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < RESULT_CACHE_SHARDS; i++) {
+        clear_shard(&cache->shards[i]);
+        free(cache->shards[i].buckets);
+        pthread_mutex_destroy(&cache->shards[i].lock);
+    }
+    free(cache);
+}
+
+int result_cache_get(result_cache *cache, uint64_t func_key, const char *params, size_t params_len,
+                     result_cache_alloc alloc, void *alloc_arg, char **result, size_t *result_len) {
+    uint64_t hash = key_hash(func_key, params, params_len);
+    cache_shard *shard = shard_for(cache, hash);
+    int rc = -1;
+
+    pthread_mutex_lock(&shard->lock);
+
+    // Misses count too: admission asks how often a key was wanted, not how often it was found
+    sketch_increment(shard, hash);
+
+    cache_entry *entry = find_entry(shard, hash, func_key, params, params_len);
+    if (entry != NULL && entry->expires_ns != 0 && now_ns() >= entry->expires_ns) {
+        remove_entry(shard, entry);
+        shard->expired++;
+        entry = NULL;
+    }
+
+    if (entry != NULL) {
+        char *copy = alloc(alloc_arg, entry->result_len + 1);
+        if (copy != NULL) {
+            memcpy(copy, entry->data + entry->params_len, entry->result_len);
+            copy[entry->result_len] = '\0';
+            *result = copy;
+            *result_len = entry->result_len;
+            entry->referenced = 1;
+            rc = 0;
+        }
+    }
+
+    if (rc == 0) {
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return rc;
+}
+
+void result_cache_put(result_cache *cache, uint64_t func_key, const char *params, size_t params_len,
+                      const char *result, size_t result_len, uint32_t ttl_ms) {
+    uint64_t hash = key_hash(func_key, params, params_len);
+    cache_shard *shard = shard_for(cache, hash);
+    size_t size = sizeof(cache_entry) + params_len + result_len;
+
+    if (size > shard->max_bytes / MAX_ENTRY_SHARE) {
+        pthread_mutex_lock(&shard->lock);
+        shard->rejected++;
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    // Built before taking the lock, and thrown away if not admitted
+    cache_entry *entry = malloc(size);
+    if (entry == NULL) {
+        return;
+    }
+    entry->hash = hash;
+    entry->func_key = func_key;
+    entry->has_params = params != NULL;
+    entry->referenced = 0;
+    entry->params_len = params_len;
+    entry->result_len = result_len;
+    if (params_len > 0) {
+        memcpy(entry->data, params, params_len);
+    }
+    memcpy(entry->data + params_len, result, result_len);
+
+    uint64_t now = now_ns();
+    entry->expires_ns = ttl_ms > 0 ? now + (uint64_t)ttl_ms * 1000000ULL : 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    // Another thread computed the same result meanwhile
+    if (find_entry(shard, hash, func_key, params, params_len) != NULL ||
+        (shard->count >= shard->num_buckets && grow_buckets(shard) != 0)) {
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        return;
+    }
+
+    // Make room, but only at the expense of entries wanted less often than this one
+    unsigned frequency = sketch_estimate(shard, hash);
+    while (shard->bytes + size > shard->max_bytes) {
+        cache_entry *victim = clock_victim(shard);
+
+        if (victim->expires_ns != 0 && now >= victim->expires_ns) {
+            remove_entry(shard, victim);
+            shard->expired++;
+            continue;
+        }
+        if (sketch_estimate(shard, victim->hash) >= frequency) {
+            shard->rejected++;
+            pthread_mutex_unlock(&shard->lock);
+            free(entry);
+            return;
+        }
+        remove_entry(shard, victim);
+        shard->evictions++;
+    }
+
+    insert_entry(shard, entry);
+    shard->inserts++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void result_cache_clear(result_cache *cache) {
+    for (int i = 0; i < RESULT_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        clear_shard(&cache->shards[i]);
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+}
+
+void result_cache_get_stats(result_cache *cache, result_cache_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (cache == NULL) {
+        return;
+    }
+
+    stats->max_bytes = cache->max_bytes;
+    for (int i = 0; i < RESULT_CACHE_SHARDS; i++) {
+        cache_shard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->inserts += shard->inserts;
+        stats->rejected += shard->rejected;
+        stats->evictions += shard->evictions;
+        stats->expired += shard->expired;
+        stats->entries += shard->count;
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    unsigned long long lookups = stats->hits + stats->misses;
+    stats->hit_ratio = lookups > 0 ? (double)stats->hits / lookups : 0;
+}
@@ -2,90 +2,2333 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
 #include "rpc_client.h"
 #include "client.h"
+#include "protocol.h"
 #include "message_handler.h"
+#include "dl_handler.h"
+#include "compress.h"
+#include "transport.h"
+#include "shm_channel.h"
 
-#define BUFFER_SIZE 4096
+#define PENDING_BUCKETS 256
+#define MAX_FUNC_TABLE_SIZE (1024 * 1024)
+#define NO_FUNCTION_ID UINT32_MAX
+#define RECEIVE_BUFFER_SIZE (64 * 1024)
+
+#define MAX_ENDPOINTS 64
+#define DEFAULT_PROBE_INTERVAL_MS 1000
+#define MAX_PROBE_BACKOFF_SHIFT 5
+#define EWMA_WEIGHT_SHIFT 3         /* each latency sample moves the average by 1/8 */
+#define HEDGE_BURST 10              /* hedges the budget may save up */
+#define HEDGE_INITIAL_DELAY_NS (10 * 1000000ULL)   /* adaptive delay until enough calls were timed */
+#define HEDGE_SAMPLES 256           /* recent call latencies the adaptive delay is taken from */
+#define HEDGE_RECOMPUTE_EVERY 64
+#define HEDGE_PERCENTILE 95
+
+typedef struct rpc_conn rpc_conn;
+typedef struct pool_endpoint pool_endpoint;
+
+/* Server's name -> ID table from the connect-time handshake (open addressing) */
+typedef struct {
+    char *name;
+    uint64_t hash;
+    uint32_t id;
+} func_id_entry;
+
+typedef struct func_id_table {
+    func_id_entry *entries;
+    size_t capacity;
+    uint64_t digest;            /* of every (name, ID) pair: equal digests give IDs the same meaning */
+    struct func_id_table *next_retired;
+} func_id_table;
+
+/* Result side of a streamed call, filled by the receiver thread (guarded by pending_lock) */
+typedef struct {
+    char *ring;             /* STREAM_WINDOW bytes: the server never has more unacknowledged */
+    size_t ring_start;
+    size_t ring_len;
+    size_t send_credit;     /* params bytes the server will still accept */
+} client_stream;
+
+struct rpc_future {
+    rpc_conn *conn;
+    uint32_t request_id;
+    uint64_t sent_ns;           /* for the endpoint's latency average, 0 if not measured */
+    atomic_int done;            /* set under pending_lock, may be watched without it */
+    int error_code;
+    char *result;
+    size_t result_len;
+
+    /* Callback completion: the receiver thread frees the future after calling it */
+    rpc_callback callback;
+    void *user_data;
+
+    client_stream *stream;      /* set for rpc_call_stream calls */
+
+    /* Set while this call races a hedge: completion also marks group_bit in group */
+    struct hedge_group *group;
+    int group_bit;
+
+    pthread_cond_t cond;
+    struct rpc_future *next;    /* pending table chain */
+};
+
+/* One connection of a pool. Requests share it: writers take send_lock, the
+ * receiver thread matches responses to pending futures by request ID. */
+struct rpc_conn {
+    rpc_client *client;
+    pool_endpoint *endpoint;
+    int socket;
+    shm_channel *shm;           /* shm: endpoints: frames go through its rings, socket only holds the connection */
+    uint64_t spin_ns;           /* how long a caller watches for its reply before sleeping */
+    uint32_t next_request_id;   /* guarded by send_lock */
+
+    pthread_mutex_t send_lock;
+    pthread_mutex_t pending_lock;
+    struct rpc_future *pending[PENDING_BUCKETS];
+    atomic_int in_flight;       /* calls in the pending table */
+
+    pthread_t receiver_thread;
+    int receiver_running;
+    atomic_int lost;
+
+    /* Negotiated in this connection's handshake */
+    int peer_compression;
+    int peer_dictionary;
+    func_id_table *func_ids;    /* name -> ID, NULL if the server has no handshake */
+
+    atomic_int refs;            /* its slot's while in one, plus one per future and per caller holding it */
+    rpc_conn *next_retired;
+};
+
+/* One server replica with its own connections. An endpoint that cannot be
+ * connected to is ejected: calls avoid it until retry_at_ns, when one call
+ * probes it again, backing off while it keeps failing. */
+struct pool_endpoint {
+    char host[TRANSPORT_ADDR_MAX];   /* or "unix:/path", see transport.h */
+    int port;
+
+    /* Connections by slot, NULL until first needed; pool_lock serializes opening them */
+    _Atomic(rpc_conn *) *slots;
+
+    atomic_ullong latency_ns;   /* EWMA of call round trips, 0 until the first sample */
+    atomic_int ejected;
+    atomic_ullong retry_at_ns;
+    int failures;               /* consecutive failed connects, guarded by pool_lock */
+};
+
+struct rpc_client {
+    pool_endpoint *endpoints;
+    int num_endpoints;
+    rpc_balance_policy balance;
+    uint64_t probe_interval_ns;
+    atomic_uint next_endpoint;  /* round robin position */
+
+    rpc_pool_policy policy;
+    int max_connections;        /* per endpoint */
+    pthread_mutex_t pool_lock;
+    rpc_conn *retired;          /* lost connections, each freed once nothing holds it */
+    atomic_int slot_readers;    /* threads reading slots without pool_lock, see slots_enter */
+    atomic_ullong connects;
+
+    /* Affinity: each thread's slot, handed out round-robin */
+    pthread_key_t affinity_key;
+    atomic_uint next_affinity;
+
+    int shm_spin_us;
+
+    /* Requests and stream chunks at least compress_threshold bytes are compressed
+     * once the handshake shows the server decodes them (and holds our dictionary) */
+    size_t compress_threshold;
+    compress_dict dict;
+
+    /* Hedging of idempotent calls. Each one earns hedge_budget hundredths of a
+     * hedge, and a hedge spends a whole one */
+    int hedge_budget;
+    uint64_t hedge_delay_ns;    /* fixed delay, 0 to adapt it to recent latency */
+    atomic_int hedge_tokens;
+    _Atomic(func_id_table *) idempotent;   /* names, replaced whole under pool_lock */
+    func_id_table *retired_idempotent;
+    atomic_uint latency_samples[HEDGE_SAMPLES];     /* microseconds */
+    atomic_uint next_sample;
+    atomic_ullong adaptive_delay_ns;
+    pthread_mutex_t sample_lock;
+    atomic_ullong hedge_calls;
+    atomic_ullong hedges_sent;
+    atomic_ullong hedges_won;
+    atomic_ullong hedges_denied;
+};
+
+/* The two attempts of a hedged call report here, whichever finishes first */
+typedef struct hedge_group {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int completed;              /* group_bit of every attempt that finished */
+} hedge_group;
+
+static __thread int last_error = ERR_NONE;
+static __thread char send_buffer[MESSAGE_HEADER_SIZE + MAX_PAYLOAD_SIZE];
+static __thread uint32_t pick_state;    /* xorshift state for two-choice picks */
+
+/* The client behind the rpc_call family, and the settings it is created with */
+static rpc_client *default_client = NULL;
+static size_t default_compress_threshold = 0;
+static void *default_dictionary = NULL;
+static size_t default_dictionary_len = 0;
+static int default_hedge_budget = 0;
+static int default_hedge_delay_us = 0;
+
+// Caller holds pending_lock
+static void pending_insert(rpc_conn *conn, struct rpc_future *future) {
+    struct rpc_future **bucket = &conn->pending[future->request_id % PENDING_BUCKETS];
+    future->next = *bucket;
+    *bucket = future;
+    atomic_fetch_add(&conn->in_flight, 1);
+}
+
+// Caller holds pending_lock
+static struct rpc_future *pending_remove(rpc_conn *conn, uint32_t request_id) {
+    struct rpc_future **cur = &conn->pending[request_id % PENDING_BUCKETS];
+
+    while (*cur != NULL) {
+        if ((*cur)->request_id == request_id) {
+            struct rpc_future *found = *cur;
+            *cur = found->next;
+            found->next = NULL;
+            atomic_fetch_sub(&conn->in_flight, 1);
+            return found;
+        }
+        cur = &(*cur)->next;
+    }
+
+    return NULL;
+}
+
+// Caller holds pending_lock
+static struct rpc_future *pending_find(rpc_conn *conn, uint32_t request_id) {
+    struct rpc_future *future = conn->pending[request_id % PENDING_BUCKETS];
+
+    while (future != NULL && future->request_id != request_id) {
+        future = future->next;
+    }
+    return future;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// Fold one round trip into the endpoint's average. Connections to the same
+// endpoint may race here and drop a sample, which the average shrugs off
+static void record_latency(pool_endpoint *endpoint, uint64_t sample_ns) {
+    uint64_t average = atomic_load_explicit(&endpoint->latency_ns, memory_order_relaxed);
+    if (average == 0) {
+        average = sample_ns;
+    } else {
+        average = average - (average >> EWMA_WEIGHT_SHIFT) + (sample_ns >> EWMA_WEIGHT_SHIFT);
+    }
+    atomic_store_explicit(&endpoint->latency_ns, average > 0 ? average : 1, memory_order_relaxed);
+}
+
+static void connection_release(rpc_conn *conn);
+
+static void future_destroy(struct rpc_future *future) {
+    connection_release(future->conn);
+    pthread_cond_destroy(&future->cond);
+    free(future->result);
+    free(future);
+}
+
+// Deliver a result; takes ownership of result. Caller holds pending_lock
+static void future_complete(struct rpc_future *future, char *result, size_t result_len, int error_code) {
+    if (future->sent_ns != 0 && error_code == ERR_NONE) {
+        record_latency(future->conn->endpoint, monotonic_ns() - future->sent_ns);
+    }
+
+    future->result = result;
+    future->result_len = result_len;
+    future->error_code = error_code;
+    future->done = 1;
+
+    if (future->group != NULL) {
+        pthread_mutex_lock(&future->group->lock);
+        future->group->completed |= future->group_bit;
+        pthread_cond_broadcast(&future->group->cond);
+        pthread_mutex_unlock(&future->group->lock);
+    }
+
+    if (future->callback != NULL) {
+        // Run the callback without the table lock so it may issue new calls
+        rpc_conn *conn = future->conn;
+        pthread_mutex_unlock(&conn->pending_lock);
+        future->callback(future->result, future->error_code, future->user_data);
+        future_destroy(future);
+        pthread_mutex_lock(&conn->pending_lock);
+        return;
+    }
+
+    pthread_cond_broadcast(&future->cond);
+}
+
+// Fail every outstanding call, used once the connection is gone
+static void fail_all_pending(rpc_conn *conn, int error_code) {
+    pthread_mutex_lock(&conn->pending_lock);
+    atomic_store(&conn->lost, 1);
+
+    for (int i = 0; i < PENDING_BUCKETS; i++) {
+        while (conn->pending[i] != NULL) {
+            struct rpc_future *future = conn->pending[i];
+            conn->pending[i] = future->next;
+            future->next = NULL;
+            atomic_fetch_sub(&conn->in_flight, 1);
+            future_complete(future, NULL, 0, error_code);
+        }
+    }
+
+    pthread_mutex_unlock(&conn->pending_lock);
+}
+
+// Caller holds pending_lock
+static void stream_deliver(rpc_conn *conn, struct rpc_future *future, const MessageHeader *header,
+                           const uint8_t *payload) {
+    client_stream *stream = future->stream;
+    size_t len = header->payload_length;
+
+    if (header->msg_type == MSG_STREAM_CREDIT) {
+        int credit;
+        if (len >= sizeof(uint32_t)) {
+            deserialize_int(payload, &credit);
+            if (credit > 0) {
+                stream->send_credit += credit;
+            }
+        }
+    } else if (len > STREAM_WINDOW - stream->ring_len) {
+        // The server overran the window it was given: give up on the call
+        pending_remove(conn, future->request_id);
+        future_complete(future, NULL, 0, ERR_SERIALIZATION);
+        return;
+    } else {
+        size_t tail = (stream->ring_start + stream->ring_len) % STREAM_WINDOW;
+        size_t first = STREAM_WINDOW - tail;
+        if (first > len) {
+            first = len;
+        }
+        memcpy(stream->ring + tail, payload, first);
+        memcpy(stream->ring, payload + first, len - first);
+        stream->ring_len += len;
+    }
+
+    pthread_cond_broadcast(&future->cond);
+}
+
+// Background reader: responses may arrive in any order, and one recv
+// usually carries several of them under pipelined load
+static void* receiver_loop(void *arg) {
+    rpc_conn *conn = arg;
+    frame_reader reader;
+    uint8_t *payload;
+    MessageHeader header;
+
+    if (frame_reader_init(&reader, conn->socket, RECEIVE_BUFFER_SIZE, MAX_BATCH_PAYLOAD_SIZE) != 0) {
+        printf("[RPC Client] Unable to allocate receive buffer\n");
+        fail_all_pending(conn, ERR_NETWORK);
+        return NULL;
+    }
+    reader.channel = conn->shm;
+
+    while (frame_reader_next(&reader, &header, &payload) == 0) {
+        int inflate_failed = (header.msg_type & MSG_FLAG_COMPRESSED) &&
+            decompress_frame(&header, &payload, compress_input_buffer(), MAX_BATCH_PAYLOAD_SIZE,
+                             &conn->client->dict) != 0;
+
+        pthread_mutex_lock(&conn->pending_lock);
+
+        if (inflate_failed) {
+            printf("[RPC Client] Failed to decompress response\n");
+            struct rpc_future *future = pending_remove(conn, header.request_id);
+            if (future != NULL) {
+                future_complete(future, NULL, 0, ERR_SERIALIZATION);
+            }
+            pthread_mutex_unlock(&conn->pending_lock);
+            continue;
+        }
+
+        // Streamed results and credit go to the still-pending call; MSG_STREAM_END completes it below
+        if (header.msg_type == MSG_STREAM_DATA || header.msg_type == MSG_STREAM_CREDIT) {
+            struct rpc_future *future = pending_find(conn, header.request_id);
+            if (future != NULL && future->stream != NULL) {
+                stream_deliver(conn, future, &header, payload);
+            }
+            pthread_mutex_unlock(&conn->pending_lock);
+            continue;
+        }
+
+        struct rpc_future *future = pending_remove(conn, header.request_id);
+
+        if (future == NULL) {
+            // Caller gave up on this request already
+            pthread_mutex_unlock(&conn->pending_lock);
+            continue;
+        }
+
+        if (header.msg_type == MSG_ERROR || header.error_code != ERR_NONE) {
+            printf("[RPC Client] Server error %d: %.*s\n", header.error_code, (int)header.payload_length, (char*)payload);
+            future_complete(future, NULL, 0, header.error_code != ERR_NONE ? header.error_code : ERR_NETWORK);
+        } else {
+            // Copy with the terminator so both strings and packed batch replies survive
+            char *result = malloc(header.payload_length + 1);
+            if (result != NULL) {
+                memcpy(result, payload, header.payload_length);
+                result[header.payload_length] = '\0';
+            }
+            future_complete(future, result, header.payload_length, result != NULL ? ERR_NONE : ERR_SERIALIZATION);
+        }
+
+        pthread_mutex_unlock(&conn->pending_lock);
+    }
+
+    frame_reader_free(&reader);
+    fail_all_pending(conn, ERR_NETWORK);
+    return NULL;
+}
+
+static void free_function_table(func_id_table *table) {
+    if (table == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < table->capacity; i++) {
+        free(table->entries[i].name);
+    }
+    free(table->entries);
+    free(table);
+}
+
+// Look up the ID the server assigned to func_name, NO_FUNCTION_ID if unknown
+static uint32_t table_lookup(const func_id_table *table, const char *func_name) {
+    if (table == NULL) {
+        return NO_FUNCTION_ID;
+    }
+
+    uint64_t hash = function_name_hash(func_name);
+    size_t mask = table->capacity - 1;
+
+    for (size_t i = hash & mask; table->entries[i].name != NULL; i = (i + 1) & mask) {
+        if (table->entries[i].hash == hash && strcmp(table->entries[i].name, func_name) == 0) {
+            return table->entries[i].id;
+        }
+    }
+
+    return NO_FUNCTION_ID;
+}
+
+// IDs are only good on the connection whose handshake handed them out: a replica
+// that restarted may have registered its functions in another order
+static uint32_t lookup_function_id(const rpc_conn *conn, const char *func_name) {
+    return table_lookup(conn->func_ids, func_name);
+}
+
+static int same_function_ids(const rpc_conn *a, const rpc_conn *b) {
+    uint64_t digest_a = a->func_ids != NULL ? a->func_ids->digest : 0;
+    uint64_t digest_b = b->func_ids != NULL ? b->func_ids->digest : 0;
+    return digest_a == digest_b;
+}
+
+// Build the name -> ID table from a MSG_FUNC_TABLE payload; *offset ends past it
+static func_id_table *parse_function_table(const uint8_t *payload, size_t len, size_t *offset) {
+    int count;
+    *offset = deserialize_int(payload, &count);
+
+    size_t capacity = 16;
+    while (capacity < (size_t)count * 2) {
+        capacity <<= 1;
+    }
+
+    func_id_table *table = malloc(sizeof(func_id_table));
+    func_id_entry *entries = calloc(capacity, sizeof(func_id_entry));
+    if (table == NULL || entries == NULL) {
+        free(table);
+        free(entries);
+        return NULL;
+    }
+    table->entries = entries;
+    table->capacity = capacity;
+    table->digest = 0;
+
+    for (int i = 0; i < count; i++) {
+        int id;
+        int name_len;
+
+        if (*offset + (2 * sizeof(uint32_t)) > len) {
+            break;
+        }
+        *offset += deserialize_int(payload + *offset, &id);
+        *offset += deserialize_int(payload + *offset, &name_len);
+        if (name_len < 0 || *offset + name_len > len) {
+            break;
+        }
+
+        char *name = strndup((const char*)payload + *offset, name_len);
+        *offset += name_len;
+        if (name == NULL) {
+            break;
+        }
+
+        uint64_t hash = function_name_hash(name);
+        size_t slot = hash & (capacity - 1);
+        while (entries[slot].name != NULL) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        entries[slot].name = name;
+        entries[slot].hash = hash;
+        entries[slot].id = (uint32_t)id;
+        // Summed so that the order the server listed its functions in does not matter
+        table->digest += (hash ^ ((uint64_t)(uint32_t)id * 0x9E3779B97F4A7C15ULL)) * 0xFF51AFD7ED558CCDULL;
+    }
+    return table;
+}
+
+// Put a frame on conn's transport. Caller holds send_lock
+static int conn_send(rpc_conn *conn, const MessageHeader *header, const void *payload) {
+    if (conn->shm == NULL) {
+        return send_message(conn->socket, header, payload);
+    }
+
+    uint8_t header_buf[MESSAGE_HEADER_SIZE];
+    encode_message_header(header, header_buf);
+    struct iovec iov[2] = { { header_buf, MESSAGE_HEADER_SIZE }, { (void*)payload, header->payload_length } };
+    return shm_channel_sendv(conn->shm, iov, header->payload_length > 0 ? 2 : 1);
+}
+
+// As conn_send, for a frame already encoded as header + payload
+static int conn_send_frame(rpc_conn *conn, const void *frame, size_t len) {
+    if (conn->shm == NULL) {
+        return send_frame(conn->socket, frame, len);
+    }
+
+    struct iovec iov = { (void*)frame, len };
+    return shm_channel_sendv(conn->shm, &iov, 1);
+}
+
+// Read one frame before the receiver thread runs
+static int conn_recv_message(rpc_conn *conn, MessageHeader *header, void *payload, size_t max_payload) {
+    if (conn->shm == NULL) {
+        return recv_message(conn->socket, header, payload, max_payload);
+    }
+
+    uint8_t header_buf[MESSAGE_HEADER_SIZE];
+    if (shm_channel_read(conn->shm, header_buf, MESSAGE_HEADER_SIZE) != 0) {
+        return -1;
+    }
+    decode_message_header(header_buf, header);
+    if (header->payload_length > max_payload) {
+        return -1;
+    }
+    return shm_channel_read(conn->shm, payload, header->payload_length);
+}
+
+// Handshake: fetch the server's function table so calls can carry IDs instead of
+// names, and agree on compression. We always decode compressed replies. Every
+// connection negotiates and keeps its own table, fresh from the server it reached
+static int fetch_function_table(rpc_conn *conn) {
+    rpc_client *client = conn->client;
+    uint8_t features[2 * sizeof(uint32_t)];
+    serialize_int(features, FEATURE_COMPRESSION);
+    serialize_int(features + sizeof(uint32_t), (int)client->dict.id);
+
+    conn->peer_compression = 0;
+    conn->peer_dictionary = 0;
+
+    MessageHeader header = create_message_header(MSG_FUNC_TABLE_REQUEST, 0, sizeof(features));
+    if (conn_send(conn, &header, features) != 0) {
+        return -1;
+    }
+
+    uint8_t *payload = malloc(MAX_FUNC_TABLE_SIZE);
+    if (payload == NULL) {
+        return -1;
+    }
+
+    if (conn_recv_message(conn, &header, payload, MAX_FUNC_TABLE_SIZE) != 0) {
+        free(payload);
+        return -1;
+    }
+
+    // Servers without the handshake answer with an error; calls then go by name
+    if (header.msg_type != MSG_FUNC_TABLE || header.payload_length < sizeof(uint32_t)) {
+        free(payload);
+        return 0;
+    }
+
+    size_t offset;
+    func_id_table *table = parse_function_table(payload, header.payload_length, &offset);
+    if (table == NULL) {
+        free(payload);
+        return -1;
+    }
+
+    // Set before the receiver starts and the connection is published, never changed after
+    conn->func_ids = table;
+
+    // Servers with compression follow the table with their features and dictionary
+    if (offset + (2 * sizeof(uint32_t)) <= header.payload_length) {
+        int server_features;
+        int server_dict;
+        offset += deserialize_int(payload + offset, &server_features);
+        deserialize_int(payload + offset, &server_dict);
+
+        conn->peer_compression = (server_features & FEATURE_COMPRESSION) != 0;
+        conn->peer_dictionary = client->dict.id != 0 && (uint32_t)server_dict == client->dict.id;
+    }
+
+    free(payload);
+    return 0;
+}
+
+// Connect one more socket to an endpoint, handshake and start its receiver.
+// Caller holds pool_lock
+
+static rpc_conn *connection_open(rpc_client *client, pool_endpoint *endpoint) {
+    rpc_conn *conn = calloc(1, sizeof(rpc_conn));
+    if (conn == NULL) {
+        printf("[RPC Client] Unable to allocate connection\n");
+        return NULL;
+    }
+    conn->client = client;
+    conn->endpoint = endpoint;
+    conn->next_request_id = 1;
+    pthread_mutex_init(&conn->send_lock, NULL);
+    pthread_mutex_init(&conn->pending_lock, NULL);
+
+    conn->socket = client_open(endpoint->host, endpoint->port);
+    if (conn->socket >= 0 && strncmp(endpoint->host, TRANSPORT_SHM_PREFIX, strlen(TRANSPORT_SHM_PREFIX)) == 0) {
+        // The server answers the connection with the rings to use from now on
+        conn->shm = shm_channel_join(conn->socket, client->shm_spin_us);
+        conn->spin_ns = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? (uint64_t)client->shm_spin_us * 1000ULL : 0;
+        if (conn->shm == NULL) {
+            client_close(conn->socket);
+            conn->socket = -1;
+        }
+    }
+    if (conn->socket < 0) {
+        printf("[RPC Client] Failed to connect to server\n");
+        pthread_mutex_destroy(&conn->send_lock);
+        pthread_mutex_destroy(&conn->pending_lock);
+        free(conn);
+        return NULL;
+    }
+
+    if (fetch_function_table(conn) != 0) {
+        printf("[RPC Client] Failed to fetch function table, calling by name\n");
+    }
+
+    if (pthread_create(&conn->receiver_thread, NULL, receiver_loop, conn) != 0) {
+        perror("[RPC Client] Failed to start receiver thread");
+        shm_channel_close(conn->shm);
+        client_close(conn->socket);
+        pthread_mutex_destroy(&conn->send_lock);
+        pthread_mutex_destroy(&conn->pending_lock);
+        free(conn);
+        return NULL;
+    }
+    conn->receiver_running = 1;
+    atomic_fetch_add(&client->connects, 1);
+    return conn;
+}
+
+// Stop the receiver (failing whatever is still pending) and close the socket
+static void connection_close(rpc_conn *conn) {
+    if (conn->receiver_running) {
+        if (conn->shm != NULL) {
+            shm_channel_shutdown(conn->shm);
+        } else {
+            shutdown(conn->socket, SHUT_RDWR);
+        }
+        pthread_join(conn->receiver_thread, NULL);
+        conn->receiver_running = 0;
+    }
+
+    // A sender that picked this connection before it was lost may still hold send_lock
+    pthread_mutex_lock(&conn->send_lock);
+    if (conn->shm != NULL) {
+        shm_channel_close(conn->shm);
+        conn->shm = NULL;
+    }
+    if (conn->socket >= 0) {
+        client_close(conn->socket);
+        conn->socket = -1;
+    }
+    pthread_mutex_unlock(&conn->send_lock);
+}
+
+static void connection_free(rpc_conn *conn) {
+    connection_close(conn);
+    pthread_mutex_destroy(&conn->send_lock);
+    pthread_mutex_destroy(&conn->pending_lock);
+    free_function_table(conn->func_ids);
+    free(conn);
+}
+
+// Slots are read without pool_lock, so a thread may load a connection just as
+// it is retired. Readers announce themselves, and retired connections are only
+// freed while there are none
+
+static void slots_enter(rpc_client *client) {
+    atomic_fetch_add(&client->slot_readers, 1);
+}
+
+static void slots_leave(rpc_client *client) {
+    atomic_fetch_sub(&client->slot_readers, 1);
+}
+
+// Free the retired connections no future or caller holds any more. Caller
+// holds pool_lock and is itself one of readers slot readers; with others about,
+// they are left for a later call
+
+static void free_retired(rpc_client *client, int readers) {
+    if (atomic_load(&client->slot_readers) > readers) {
+        return;
+    }
+
+    rpc_conn **link = &client->retired;
+    while (*link != NULL) {
+        rpc_conn *conn = *link;
+        if (atomic_load(&conn->refs) == 0) {
+            *link = conn->next_retired;
+            connection_free(conn);
+        } else {
+            link = &conn->next_retired;
+        }
+    }
+}
+
+// Drop a reference from pick_slot or a future. Only a retired connection runs
+// out of them, since its slot holds one until then
+static void connection_release(rpc_conn *conn) {
+    if (atomic_fetch_sub(&conn->refs, 1) == 1) {
+        rpc_client *client = conn->client;
+        pthread_mutex_lock(&client->pool_lock);
+        free_retired(client, 0);
+        pthread_mutex_unlock(&client->pool_lock);
+    }
+}
+
+// Open the connection for slot, replacing one that was lost. A failed connect
+// ejects the endpoint until its next probe, a successful one reinstates it.
+// Caller is a slot reader
+
+static rpc_conn *open_slot(rpc_client *client, pool_endpoint *endpoint, int slot) {
+    pthread_mutex_lock(&client->pool_lock);
+
+    rpc_conn *conn = atomic_load(&endpoint->slots[slot]);
+    if (conn != NULL && atomic_load(&conn->lost)) {
+        connection_close(conn);
+        conn->next_retired = client->retired;
+        client->retired = conn;
+        atomic_store(&endpoint->slots[slot], NULL);
+        atomic_fetch_sub(&conn->refs, 1);
+        free_retired(client, 1);
+        conn = NULL;
+    }
+    if (conn == NULL) {
+        conn = connection_open(client, endpoint);
+        if (conn != NULL) {
+            atomic_store(&conn->refs, 1);
+            atomic_store(&endpoint->slots[slot], conn);
+            endpoint->failures = 0;
+            atomic_store(&endpoint->ejected, 0);
+        } else {
+            int shift = endpoint->failures < MAX_PROBE_BACKOFF_SHIFT ? endpoint->failures : MAX_PROBE_BACKOFF_SHIFT;
+            endpoint->failures++;
+            atomic_store(&endpoint->retry_at_ns, monotonic_ns() + (client->probe_interval_ns << shift));
+            if (!atomic_exchange(&endpoint->ejected, 1) && client->num_endpoints > 1) {
+                printf("[RPC Client] Ejected %s:%d\n", endpoint->host, endpoint->port);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&client->pool_lock);
+    return conn;
+}
+
+// Affinity: a thread gets the next slot the first time it calls through this client
+static int affinity_slot(rpc_client *client) {
+    uintptr_t slot = (uintptr_t)pthread_getspecific(client->affinity_key);
+    if (slot == 0 || slot > (uintptr_t)client->max_connections) {
+        slot = atomic_fetch_add(&client->next_affinity, 1) % (unsigned)client->max_connections + 1;
+        pthread_setspecific(client->affinity_key, (void*)slot);
+    }
+    return (int)slot - 1;
+}
+
+// Calls in flight on the endpoint's open connections
+static int endpoint_load(rpc_client *client, pool_endpoint *endpoint) {
+    int load = 0;
+    for (int i = 0; i < client->max_connections; i++) {
+        rpc_conn *conn = atomic_load(&endpoint->slots[i]);
+        if (conn != NULL && !atomic_load(&conn->lost)) {
+            load += atomic_load(&conn->in_flight);
+        }
+    }
+    return load;
+}
+
+// Least busy: the open connection with the fewest calls in flight, or a new
+// one while every open connection has some and the pool has room
+static int least_busy_slot(rpc_client *client, pool_endpoint *endpoint) {
+    int best = -1;
+    int best_load = 0;
+    int free_slot = -1;
+
+    for (int i = 0; i < client->max_connections; i++) {
+        rpc_conn *conn = atomic_load(&endpoint->slots[i]);
+        if (conn == NULL || atomic_load(&conn->lost)) {
+            if (free_slot < 0) {
+                free_slot = i;
+            }
+            continue;
+        }
+        int load = atomic_load(&conn->in_flight);
+        if (best < 0 || load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+
+    if (best < 0 || (best_load > 0 && free_slot >= 0)) {
+        return free_slot;
+    }
+    return best;
+}
+
+static uint32_t next_pick(void) {
+    if (pick_state == 0) {
+        pick_state = (uint32_t)monotonic_ns() | 1;
+        pick_state ^= (uint32_t)(uintptr_t)&pick_state;
+    }
+    pick_state ^= pick_state << 13;
+    pick_state ^= pick_state >> 17;
+    pick_state ^= pick_state << 5;
+    return pick_state;
+}
+
+// Expected cost of sending one more call to an endpoint. EWMA weighs the load by
+// the endpoint's latency; endpoints without a sample yet look free so they get one
+static uint64_t endpoint_cost(rpc_client *client, pool_endpoint *endpoint) {
+    uint64_t load = (uint64_t)endpoint_load(client, endpoint) + 1;
+    if (client->balance != RPC_BALANCE_EWMA) {
+        return load;
+    }
+    return load * atomic_load_explicit(&endpoint->latency_ns, memory_order_relaxed);
+}
+
+// Choose the endpoint for the next call. An ejected endpoint whose probe is due
+// goes to exactly one caller, whose call doubles as the probe; with everything
+// ejected the one due soonest is tried anyway rather than failing outright
+
+static pool_endpoint *select_endpoint(rpc_client *client) {
+    int count = client->num_endpoints;
+    if (count == 1) {
+        return &client->endpoints[0];
+    }
+
+    pool_endpoint *healthy[MAX_ENDPOINTS];
+    int num_healthy = 0;
+    pool_endpoint *soonest = NULL;
+    uint64_t now = 0;
+
+    for (int i = 0; i < count; i++) {
+        pool_endpoint *endpoint = &client->endpoints[i];
+        if (!atomic_load(&endpoint->ejected)) {
+            healthy[num_healthy++] = endpoint;
+            continue;
+        }
+
+        if (now == 0) {
+            now = monotonic_ns();
+        }
+        unsigned long long retry_at = atomic_load(&endpoint->retry_at_ns);
+        if (retry_at <= now &&
+            atomic_compare_exchange_strong(&endpoint->retry_at_ns, &retry_at, now + client->probe_interval_ns)) {
+            return endpoint;
+        }
+        if (soonest == NULL || retry_at < atomic_load(&soonest->retry_at_ns)) {
+            soonest = endpoint;
+        }
+    }
+
+    if (num_healthy == 0) {
+        return soonest;
+    }
+    if (num_healthy == 1) {
+        return healthy[0];
+    }
+
+    if (client->balance == RPC_BALANCE_ROUND_ROBIN) {
+        return healthy[atomic_fetch_add(&client->next_endpoint, 1) % (unsigned)num_healthy];
+    }
+
+    // Power of two choices: the cheaper of two distinct random endpoints
+    uint32_t pick = next_pick();
+    pool_endpoint *first = healthy[pick % (unsigned)num_healthy];
+    pool_endpoint *second = healthy[(pick % (unsigned)num_healthy + 1 + (pick >> 16) % (unsigned)(num_healthy - 1)) %
+                                    (unsigned)num_healthy];
+    return endpoint_cost(client, second) < endpoint_cost(client, first) ? second : first;
+}
+
+// The connection in slot, connected if needed, with a reference for the caller
+// to release. Caller is a slot reader
+static rpc_conn *pick_slot(rpc_client *client, pool_endpoint *endpoint, int slot) {
+    rpc_conn *conn = atomic_load(&endpoint->slots[slot]);
+    if (conn == NULL || atomic_load(&conn->lost)) {
+        conn = open_slot(client, endpoint, slot);
+    }
+    if (conn != NULL) {
+        atomic_fetch_add(&conn->refs, 1);
+    }
+    return conn;
+}
+
+// Pick the connection for the next call, connecting it if needed. An endpoint
+// that fails to connect is ejected and the call moves on to another. The
+// caller releases the connection when done with it
+
+static rpc_conn *acquire_connection(rpc_client *client) {
+    if (client == NULL) {
+        printf("[RPC Client] Not connected\n");
+        last_error = ERR_NETWORK;
+        return NULL;
+    }
+
+    slots_enter(client);
+    for (int attempt = 0; attempt < client->num_endpoints; attempt++) {
+        pool_endpoint *endpoint = select_endpoint(client);
+        int slot = client->policy == RPC_POOL_LEAST_BUSY ? least_busy_slot(client, endpoint) : affinity_slot(client);
+
+        rpc_conn *conn = pick_slot(client, endpoint, slot);
+        if (conn != NULL) {
+            slots_leave(client);
+            return conn;
+        }
+    }
+    slots_leave(client);
+
+    last_error = ERR_NETWORK;
+    return NULL;
+}
+
+// Create a client for a set of replicas of one server; min_connections are
+// opened to each right away. Fails only if no endpoint could be reached
+
+rpc_client *rpc_client_create_multi(const rpc_endpoint *endpoints, int count, const rpc_client_config *config) {
+    rpc_client_config defaults = { .min_connections = 1, .max_connections = 1, .policy = RPC_POOL_AFFINITY,
+                                   .balance = RPC_BALANCE_ROUND_ROBIN, .shm_spin_us = SHM_DEFAULT_SPIN_US };
+    if (config == NULL) {
+        config = &defaults;
+    }
+    if (endpoints == NULL || count <= 0 || count > MAX_ENDPOINTS ||
+        config->min_connections < 0 || config->max_connections < 0 || config->probe_interval_ms < 0 ||
+        config->hedge_budget_percent < 0 || config->hedge_budget_percent > 100 || config->hedge_delay_us < 0 ||
+        config->shm_spin_us < 0) {
+        printf("[RPC Client] Invalid client configuration\n");
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        if (endpoints[i].host == NULL || strlen(endpoints[i].host) >= sizeof(((pool_endpoint*)NULL)->host)) {
+            printf("[RPC Client] Invalid client configuration\n");
+            return NULL;
+        }
+    }
+
+    rpc_client *client = calloc(1, sizeof(rpc_client));
+    if (client == NULL) {
+        printf("[RPC Client] Unable to allocate client\n");
+        return NULL;
+    }
+    client->balance = config->balance;
+    client->probe_interval_ns = (uint64_t)(config->probe_interval_ms > 0 ? config->probe_interval_ms
+                                                                          : DEFAULT_PROBE_INTERVAL_MS) * 1000000ULL;
+    client->policy = config->policy;
+    client->max_connections = config->max_connections > 0 ? config->max_connections : 1;
+    if (client->max_connections < config->min_connections) {
+        client->max_connections = config->min_connections;
+    }
+    client->compress_threshold = config->compress_threshold;
+    client->shm_spin_us = config->shm_spin_us;
+    client->hedge_budget = config->hedge_budget_percent;
+    client->hedge_delay_ns = (uint64_t)config->hedge_delay_us * 1000ULL;
+    client->hedge_tokens = 100;     /* the first slow call may hedge straight away */
+    pthread_mutex_init(&client->pool_lock, NULL);
+    pthread_mutex_init(&client->sample_lock, NULL);
+
+    client->endpoints = calloc(count, sizeof(pool_endpoint));
+    if (client->endpoints == NULL || pthread_key_create(&client->affinity_key, NULL) != 0) {
+        printf("[RPC Client] Unable to allocate client\n");
+        free(client->endpoints);
+        pthread_mutex_destroy(&client->pool_lock);
+        pthread_mutex_destroy(&client->sample_lock);
+        free(client);
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        pool_endpoint *endpoint = &client->endpoints[i];
+        strcpy(endpoint->host, endpoints[i].host);
+        endpoint->port = endpoints[i].port;
+        endpoint->slots = calloc(client->max_connections, sizeof(*endpoint->slots));
+        client->num_endpoints++;
+        if (endpoint->slots == NULL) {
+            printf("[RPC Client] Unable to allocate client\n");
+            rpc_client_destroy(client);
+            return NULL;
+        }
+    }
+
+    if (config->dictionary != NULL && compress_dict_init(&client->dict, config->dictionary, config->dictionary_len) != 0) {
+        printf("[RPC Client] Unable to load compression dictionary\n");
+        rpc_client_destroy(client);
+        return NULL;
+    }
+
+    int reachable = config->min_connections == 0;
+    slots_enter(client);
+    for (int e = 0; e < count; e++) {
+        int opened = 1;
+        for (int i = 0; i < config->min_connections && opened; i++) {
+            opened = open_slot(client, &client->endpoints[e], i) != NULL;
+        }
+        reachable |= opened;
+    }
+    slots_leave(client);
+    if (!reachable) {
+        rpc_client_destroy(client);
+        return NULL;
+    }
+    return client;
+}
+
+rpc_client *rpc_client_create(const char *server_ip, int port, const rpc_client_config *config) {
+    rpc_endpoint endpoint = { server_ip, port };
+    return rpc_client_create_multi(&endpoint, 1, config);
+}
+
+// Close every connection; calls still in flight fail with ERR_NETWORK. Futures
+// must be freed before the client is
+
+void rpc_client_destroy(rpc_client *client) {
+    if (client == NULL) {
+        return;
+    }
+
+    for (int e = 0; e < client->num_endpoints; e++) {
+        pool_endpoint *endpoint = &client->endpoints[e];
+        for (int i = 0; endpoint->slots != NULL && i < client->max_connections; i++) {
+            rpc_conn *conn = atomic_load(&endpoint->slots[i]);
+            if (conn != NULL) {
+                connection_free(conn);
+            }
+        }
+        free(endpoint->slots);
+    }
+    while (client->retired != NULL) {
+        rpc_conn *conn = client->retired;
+        client->retired = conn->next_retired;
+        connection_free(conn);
+    }
+
+    free_function_table(atomic_load(&client->idempotent));
+    while (client->retired_idempotent != NULL) {
+        func_id_table *table = client->retired_idempotent;
+        client->retired_idempotent = table->next_retired;
+        free_function_table(table);
+    }
+
+    free(client->endpoints);
+    compress_dict_free(&client->dict);
+    pthread_key_delete(client->affinity_key);
+    pthread_mutex_destroy(&client->pool_lock);
+    pthread_mutex_destroy(&client->sample_lock);
+    free(client);
+}
+
+void rpc_client_get_pool_stats(rpc_client *client, rpc_pool_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (client == NULL) {
+        return;
+    }
+
+    stats->max_connections = client->max_connections * client->num_endpoints;
+    slots_enter(client);
+    for (int e = 0; e < client->num_endpoints; e++) {
+        for (int i = 0; i < client->max_connections; i++) {
+            rpc_conn *conn = atomic_load(&client->endpoints[e].slots[i]);
+            if (conn != NULL && !atomic_load(&conn->lost)) {
+                stats->connections++;
+                stats->in_flight += atomic_load(&conn->in_flight);
+            }
+        }
+    }
+    slots_leave(client);
+    stats->connects = atomic_load(&client->connects);
+}
+
+int rpc_client_get_endpoint_stats(rpc_client *client, rpc_endpoint_stats *stats, int max) {
+    if (client == NULL || stats == NULL) {
+        return 0;
+    }
+
+    int count = client->num_endpoints < max ? client->num_endpoints : max;
+    slots_enter(client);
+    for (int e = 0; e < count; e++) {
+        pool_endpoint *endpoint = &client->endpoints[e];
+        memset(&stats[e], 0, sizeof(stats[e]));
+        strcpy(stats[e].host, endpoint->host);
+        stats[e].port = endpoint->port;
+        for (int i = 0; i < client->max_connections; i++) {
+            rpc_conn *conn = atomic_load(&endpoint->slots[i]);
+            if (conn != NULL && !atomic_load(&conn->lost)) {
+                stats[e].connections++;
+            }
+        }
+        stats[e].in_flight = endpoint_load(client, endpoint);
+        stats[e].latency_us = atomic_load(&endpoint->latency_ns) / 1000.0;
+        stats[e].ejected = atomic_load(&endpoint->ejected);
+    }
+    slots_leave(client);
+    return count;
+}
 
 // Initialize RPC client and establish connection to server
 
-int rpc_client_init(const char *server_ip, int port) {
-    if (client_connect(server_ip, port) != 0) {
-        printf("[RPC Client] Failed to connect to server\n");
-        return -1;
+int rpc_client_init_multi(const rpc_endpoint *endpoints, int count, rpc_balance_policy balance) {
+    rpc_client_config config = { .min_connections = 1, .max_connections = 1, .policy = RPC_POOL_AFFINITY,
+                                 .compress_threshold = default_compress_threshold,
+                                 .dictionary = default_dictionary, .dictionary_len = default_dictionary_len,
+                                 .balance = balance, .hedge_budget_percent = default_hedge_budget,
+                                 .hedge_delay_us = default_hedge_delay_us, .shm_spin_us = SHM_DEFAULT_SPIN_US };
+
+    rpc_client_destroy(default_client);
+    default_client = rpc_client_create_multi(endpoints, count, &config);
+    if (default_client == NULL) {
+        return -1;
+    }
+
+    printf("[RPC Client] Connected to RPC server\n");
+    return 0;
+}
+
+int rpc_client_init(const char *server_ip, int port) {
+    rpc_endpoint endpoint = { server_ip, port };
+    return rpc_client_init_multi(&endpoint, 1, RPC_BALANCE_ROUND_ROBIN);
+}
+
+// Register a pending call and put a ready-made request on the wire. The payload
+// sits at frame + MESSAGE_HEADER_SIZE; the header is filled in once the ID is known
+
+static struct rpc_future *start_request(rpc_conn *conn, uint8_t msg_type, char *frame, size_t request_size,
+                                        rpc_callback callback, void *user_data, client_stream *stream) {
+    rpc_client *client = conn->client;
+    struct rpc_future *future = calloc(1, sizeof(struct rpc_future));
+    if (future == NULL) {
+        printf("[RPC Client] Unable to allocate call state\n");
+        last_error = ERR_SERIALIZATION;
+        return NULL;
+    }
+    pthread_cond_init(&future->cond, NULL);
+    future->conn = conn;
+    atomic_fetch_add(&conn->refs, 1);
+    future->callback = callback;
+    future->user_data = user_data;
+    future->stream = stream;
+
+    // Compress before taking the lock; the request ID goes in once it is assigned
+    MessageHeader header = create_message_header(msg_type, 0, request_size);
+    const void *payload = frame + MESSAGE_HEADER_SIZE;
+    if (conn->peer_compression) {
+        compress_buffer *out = compress_output_buffer();
+        if (compress_frame(&header, payload, out, client->compress_threshold,
+                           conn->peer_dictionary ? &client->dict : NULL)) {
+            payload = out->data;
+        }
+    }
+
+    pthread_mutex_lock(&conn->send_lock);
+
+    // Register before sending so a fast response always finds its future
+    pthread_mutex_lock(&conn->pending_lock);
+    if (atomic_load(&conn->lost) || !conn->receiver_running) {
+        pthread_mutex_unlock(&conn->pending_lock);
+        pthread_mutex_unlock(&conn->send_lock);
+        printf("[RPC Client] Not connected\n");
+        future_destroy(future);
+        last_error = ERR_NETWORK;
+        return NULL;
+    }
+    uint32_t request_id = conn->next_request_id++;
+    future->request_id = request_id;
+    if (client->balance == RPC_BALANCE_EWMA && stream == NULL) {
+        future->sent_ns = monotonic_ns();
+    }
+    pending_insert(conn, future);
+    pthread_mutex_unlock(&conn->pending_lock);
+
+    // From here a callback future may be completed and freed by the receiver at any time
+    header.request_id = request_id;
+    int rc;
+    if (payload == frame + MESSAGE_HEADER_SIZE) {
+        encode_message_header(&header, (uint8_t*)frame);
+        rc = conn_send_frame(conn, frame, MESSAGE_HEADER_SIZE + request_size);
+    } else {
+        rc = conn_send(conn, &header, payload);
+    }
+
+    pthread_mutex_unlock(&conn->send_lock);
+
+    if (rc != 0) {
+        printf("[RPC Client] Failed to send request\n");
+        last_error = ERR_NETWORK;
+
+        pthread_mutex_lock(&conn->pending_lock);
+        struct rpc_future *removed = pending_remove(conn, request_id);
+        pthread_mutex_unlock(&conn->pending_lock);
+
+        if (removed == NULL) {
+            // The receiver already failed the call (and ran its callback)
+            return future;
+        }
+        future_destroy(removed);
+        return NULL;
+    }
+
+    return future;
+}
+
+static size_t encode_call(char *buffer, size_t capacity, const char *func_name, uint32_t func_id,
+                          const char *params) {
+    if (func_id != NO_FUNCTION_ID) {
+        return serialize_id_message_into(buffer, capacity, func_id, params);
+    }
+    return serialize_message_into(buffer, capacity, func_name, params);
+}
+
+// Encode a call by ID or by name, straight into this thread's send buffer; only
+// oversized calls get a malloc'd frame. NULL on failure
+
+static char *encode_request(const char *func_name, uint32_t func_id, const char *params, size_t *request_size) {
+    char *frame = send_buffer;
+    *request_size = encode_call(frame + MESSAGE_HEADER_SIZE, sizeof(send_buffer) - MESSAGE_HEADER_SIZE,
+                                func_name, func_id, params);
+
+    if (*request_size == 0) {
+        size_t capacity = (2 * sizeof(uint32_t)) + (func_name != NULL ? strlen(func_name) : 0) +
+                          (params != NULL ? strlen(params) : 0);
+        frame = malloc(MESSAGE_HEADER_SIZE + capacity);
+        if (frame != NULL) {
+            *request_size = encode_call(frame + MESSAGE_HEADER_SIZE, capacity, func_name, func_id, params);
+        }
+    }
+
+    if (*request_size == 0) {
+        printf("[RPC Client] Failed to serialize request\n");
+        last_error = ERR_SERIALIZATION;
+        if (frame != send_buffer) {
+            free(frame);
+        }
+        return NULL;
+    }
+    return frame;
+}
+
+// Encode a call by ID or by name and start it
+
+static struct rpc_future *start_call(rpc_client *client, const char *func_name, uint32_t func_id,
+                                     const char *params, rpc_callback callback, void *user_data) {
+    if (func_name == NULL && func_id == NO_FUNCTION_ID) {
+        printf("[RPC Client] Function name cannot be NULL\n");
+        last_error = ERR_INVALID_ARGS;
+        return NULL;
+    }
+
+    rpc_conn *conn = acquire_connection(client);
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    // Prefer the compact ID form; names the server didn't list still go by name
+    if (func_id == NO_FUNCTION_ID) {
+        func_id = lookup_function_id(conn, func_name);
+    }
+
+    uint8_t msg_type = func_id != NO_FUNCTION_ID ? MSG_REQUEST_BY_ID : MSG_REQUEST;
+    size_t request_size;
+    char *frame = encode_request(func_name, func_id, params, &request_size);
+    if (frame == NULL) {
+        connection_release(conn);
+        return NULL;
+    }
+
+    struct rpc_future *future = start_request(conn, msg_type, frame, request_size, callback, user_data, NULL);
+    connection_release(conn);
+    if (frame != send_buffer) {
+        free(frame);
+    }
+    return future;
+}
+
+// Issue a call without waiting; the response is collected through the future
+
+rpc_future *rpc_client_call_async(rpc_client *client, const char *func_name, const char *params) {
+    return start_call(client, func_name, NO_FUNCTION_ID, params, NULL, NULL);
+}
+
+rpc_future *rpc_client_call_by_id_async(rpc_client *client, uint32_t func_id, const char *params) {
+    return start_call(client, NULL, func_id, params, NULL, NULL);
+}
+
+rpc_future *rpc_call_async(const char *func_name, const char *params) {
+    return rpc_client_call_async(default_client, func_name, params);
+}
+
+rpc_future *rpc_call_by_id_async(uint32_t func_id, const char *params) {
+    return rpc_client_call_by_id_async(default_client, func_id, params);
+}
+
+// Issue a call whose completion runs callback on the client's receiver thread
+
+int rpc_client_call_async_cb(rpc_client *client, const char *func_name, const char *params,
+                             rpc_callback callback, void *user_data) {
+    if (callback == NULL) {
+        last_error = ERR_INVALID_ARGS;
+        return -1;
+    }
+
+    return start_call(client, func_name, NO_FUNCTION_ID, params, callback, user_data) != NULL ? 0 : -1;
+}
+
+int rpc_call_async_cb(const char *func_name, const char *params,
+                      rpc_callback callback, void *user_data) {
+    return rpc_client_call_async_cb(default_client, func_name, params, callback, user_data);
+}
+
+int rpc_future_poll(rpc_future *future) {
+    if (future == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&future->conn->pending_lock);
+    int done = future->done;
+    pthread_mutex_unlock(&future->conn->pending_lock);
+
+    return done;
+}
+
+// Wait at most timeout_ns for a future, forever if negative; 0 once it is done
+static int future_wait_ns(rpc_future *future, int64_t timeout_ns) {
+    struct timespec deadline;
+    if (timeout_ns >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ns / 1000000000LL;
+        deadline.tv_nsec += timeout_ns % 1000000000LL;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    // Over shared memory the reply is often only microseconds away: watch for it before sleeping
+    uint64_t spin_ns = future->conn->spin_ns;
+    if (spin_ns > 0 && !atomic_load(&future->done)) {
+        if (timeout_ns >= 0 && (uint64_t)timeout_ns < spin_ns) {
+            spin_ns = (uint64_t)timeout_ns;
+        }
+        uint64_t spin_until = monotonic_ns() + spin_ns;
+        for (unsigned i = 1; !atomic_load(&future->done); i++) {
+            if ((i & 63) == 0 && monotonic_ns() >= spin_until) {
+                break;
+            }
+            shm_cpu_relax();
+        }
+    }
+
+    pthread_mutex_lock(&future->conn->pending_lock);
+    while (!future->done) {
+        if (timeout_ns < 0) {
+            pthread_cond_wait(&future->cond, &future->conn->pending_lock);
+        } else if (pthread_cond_timedwait(&future->cond, &future->conn->pending_lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    int done = future->done;
+    pthread_mutex_unlock(&future->conn->pending_lock);
+
+    return done ? 0 : -1;
+}
+
+int rpc_future_wait(rpc_future *future, int timeout_ms) {
+    if (future == NULL) {
+        return -1;
+    }
+    return future_wait_ns(future, timeout_ms >= 0 ? (int64_t)timeout_ms * 1000000LL : -1);
+}
+
+char *rpc_future_result(rpc_future *future) {
+    if (future == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&future->conn->pending_lock);
+    char *result = future->done ? future->result : NULL;
+    if (result != NULL) {
+        future->result = NULL;
+    }
+    pthread_mutex_unlock(&future->conn->pending_lock);
+
+    return result;
+}
+
+int rpc_future_error(rpc_future *future) {
+    if (future == NULL) {
+        return ERR_INVALID_ARGS;
+    }
+
+    pthread_mutex_lock(&future->conn->pending_lock);
+    int error_code = future->done ? future->error_code : ERR_TIMEOUT;
+    pthread_mutex_unlock(&future->conn->pending_lock);
+
+    return error_code;
+}
+
+void rpc_future_free(rpc_future *future) {
+    if (future == NULL) {
+        return;
+    }
+
+    // An abandoned call is dropped from the table; a late response is ignored
+    pthread_mutex_lock(&future->conn->pending_lock);
+    if (!future->done) {
+        pending_remove(future->conn, future->request_id);
+    }
+    pthread_mutex_unlock(&future->conn->pending_lock);
+
+    future_destroy(future);
+}
+
+// Whether a call may be hedged: hedging is on and the function was marked idempotent.
+// Calls by ID match a marked name through the connection's function table
+
+static int hedgeable(rpc_conn *conn, const char *func_name, uint32_t func_id) {
+    rpc_client *client = conn->client;
+    if (client->hedge_budget == 0) {
+        return 0;
+    }
+
+    func_id_table *marked = atomic_load_explicit(&client->idempotent, memory_order_acquire);
+    if (marked == NULL) {
+        return 0;
+    }
+    if (func_name != NULL) {
+        return table_lookup(marked, func_name) != NO_FUNCTION_ID;
+    }
+
+    for (size_t i = 0; func_id != NO_FUNCTION_ID && i < marked->capacity; i++) {
+        if (marked->entries[i].name != NULL && lookup_function_id(conn, marked->entries[i].name) == func_id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    unsigned x = *(const unsigned*)a;
+    unsigned y = *(const unsigned*)b;
+    return (x > y) - (x < y);
+}
+
+// Time a hedgeable call; every HEDGE_RECOMPUTE_EVERY samples the adaptive delay
+// is moved to the HEDGE_PERCENTILE of the recent ones
+static void record_call_latency(rpc_client *client, uint64_t latency_ns) {
+    uint64_t us = latency_ns / 1000;
+    unsigned index = atomic_fetch_add(&client->next_sample, 1);
+    atomic_store_explicit(&client->latency_samples[index % HEDGE_SAMPLES], us < UINT32_MAX ? (unsigned)us : UINT32_MAX,
+                          memory_order_relaxed);
+
+    if (client->hedge_delay_ns != 0 || (index + 1) % HEDGE_RECOMPUTE_EVERY != 0 ||
+        pthread_mutex_trylock(&client->sample_lock) != 0) {
+        return;
+    }
+
+    unsigned samples[HEDGE_SAMPLES];
+    size_t count = index + 1 < HEDGE_SAMPLES ? index + 1 : HEDGE_SAMPLES;
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = atomic_load_explicit(&client->latency_samples[i], memory_order_relaxed);
+    }
+    qsort(samples, count, sizeof(unsigned), compare_samples);
+    atomic_store(&client->adaptive_delay_ns, (uint64_t)samples[count * HEDGE_PERCENTILE / 100] * 1000ULL + 1);
+
+    pthread_mutex_unlock(&client->sample_lock);
+}
+
+static uint64_t hedge_delay(rpc_client *client) {
+    if (client->hedge_delay_ns != 0) {
+        return client->hedge_delay_ns;
+    }
+    uint64_t adaptive = atomic_load(&client->adaptive_delay_ns);
+    return adaptive != 0 ? adaptive : HEDGE_INITIAL_DELAY_NS;
+}
+
+// Spend one hedge from the budget, if there is one to spend
+static int take_hedge_token(rpc_client *client) {
+    int tokens = atomic_load(&client->hedge_tokens);
+    while (tokens >= 100) {
+        if (atomic_compare_exchange_weak(&client->hedge_tokens, &tokens, tokens - 100)) {
+            return 1;
+        }
     }
-    
-    printf("[RPC Client] Connected to RPC server\n");
     return 0;
 }
 
+static void earn_hedge_tokens(rpc_client *client) {
+    int tokens = atomic_load(&client->hedge_tokens);
+    while (tokens < HEDGE_BURST * 100) {
+        int earned = tokens + client->hedge_budget;
+        if (atomic_compare_exchange_weak(&client->hedge_tokens, &tokens,
+                                         earned < HEDGE_BURST * 100 ? earned : HEDGE_BURST * 100)) {
+            return;
+        }
+    }
+}
+
+// A connection for the hedge other than primary: another replica if there is
+// one, otherwise another connection of the same pool. NULL if there is none,
+// else the caller releases it
+
+static rpc_conn *hedge_connection(rpc_client *client, rpc_conn *primary) {
+    slots_enter(client);
+    for (int attempt = 0; client->num_endpoints > 1 && attempt < client->num_endpoints; attempt++) {
+        pool_endpoint *endpoint = select_endpoint(client);
+        if (endpoint == primary->endpoint) {
+            continue;
+        }
+        int slot = client->policy == RPC_POOL_LEAST_BUSY ? least_busy_slot(client, endpoint) : affinity_slot(client);
+        rpc_conn *conn = pick_slot(client, endpoint, slot);
+        if (conn != NULL) {
+            slots_leave(client);
+            return conn;
+        }
+    }
+
+    pool_endpoint *endpoint = primary->endpoint;
+    int own = 0;
+    while (own < client->max_connections && atomic_load(&endpoint->slots[own]) != primary) {
+        own++;
+    }
+    for (int i = 1; i < client->max_connections; i++) {
+        int slot = (own + i) % client->max_connections;
+        rpc_conn *conn = pick_slot(client, endpoint, slot);
+        if (conn == primary) {
+            connection_release(conn);
+        } else if (conn != NULL) {
+            slots_leave(client);
+            return conn;
+        }
+    }
+    slots_leave(client);
+    return NULL;
+}
+
+// Let future report its completion to group as bit; it may have finished already
+static void join_group(rpc_future *future, hedge_group *group, int bit) {
+    pthread_mutex_lock(&future->conn->pending_lock);
+    pthread_mutex_lock(&group->lock);
+    future->group = bit != 0 ? group : NULL;
+    future->group_bit = bit;
+    if (future->done && bit != 0) {
+        group->completed |= bit;
+    }
+    pthread_mutex_unlock(&group->lock);
+    pthread_mutex_unlock(&future->conn->pending_lock);
+}
+
+// Drop the losing attempt: the reply is ignored if it comes, and a server that
+// has not started the call yet is told to skip it
+static void cancel_attempt(rpc_future *future) {
+    pthread_mutex_lock(&future->conn->pending_lock);
+    int pending = !future->done && pending_remove(future->conn, future->request_id) != NULL;
+    future->group = NULL;
+    pthread_mutex_unlock(&future->conn->pending_lock);
+
+    if (pending) {
+        MessageHeader header = create_message_header(MSG_CANCEL, future->request_id, 0);
+        pthread_mutex_lock(&future->conn->send_lock);
+        conn_send(future->conn, &header, NULL);
+        pthread_mutex_unlock(&future->conn->send_lock);
+    }
+    future_destroy(future);
+}
+
+// Wait for a hedgeable call. If no reply came within the hedge delay and the
+// budget allows, the same frame goes out again on another connection and the
+// first successful reply wins. Returns the future holding the answer
+
+static rpc_future *hedged_wait(rpc_future *primary, uint8_t msg_type, char *frame, size_t payload_len,
+                               uint64_t started) {
+    rpc_client *client = primary->conn->client;
+    atomic_fetch_add(&client->hedge_calls, 1);
+    earn_hedge_tokens(client);
+
+    uint64_t delay = hedge_delay(client);
+    if (future_wait_ns(primary, (int64_t)delay) == 0) {
+        record_call_latency(client, monotonic_ns() - started);
+        return primary;
+    }
+
+    rpc_conn *conn = NULL;
+    if (!take_hedge_token(client)) {
+        atomic_fetch_add(&client->hedges_denied, 1);
+    } else {
+        conn = hedge_connection(client, primary->conn);
+    }
+    // An ID in the frame names the same function only to a server with the same table
+    if (conn != NULL && msg_type != MSG_REQUEST && !same_function_ids(conn, primary->conn)) {
+        connection_release(conn);
+        conn = NULL;
+    }
+    rpc_future *backup = conn != NULL ? start_request(conn, msg_type, frame, payload_len, NULL, NULL, NULL) : NULL;
+    if (conn != NULL) {
+        connection_release(conn);
+    }
+    if (backup == NULL) {
+        future_wait_ns(primary, -1);
+        record_call_latency(client, monotonic_ns() - started);
+        return primary;
+    }
+    atomic_fetch_add(&client->hedges_sent, 1);
+
+    hedge_group group;
+    pthread_mutex_init(&group.lock, NULL);
+    pthread_cond_init(&group.cond, NULL);
+    group.completed = 0;
+    join_group(primary, &group, 1);
+    join_group(backup, &group, 2);
+
+    // Attempts finish under their own connection's lock, before they mark the group
+    rpc_future *winner = NULL;
+    pthread_mutex_lock(&group.lock);
+    while (winner == NULL) {
+        if ((group.completed & 1) && primary->error_code == ERR_NONE) {
+            winner = primary;
+        } else if ((group.completed & 2) && backup->error_code == ERR_NONE) {
+            winner = backup;
+        } else if (group.completed == 3) {
+            winner = primary;
+        } else {
+            pthread_cond_wait(&group.cond, &group.lock);
+        }
+    }
+    pthread_mutex_unlock(&group.lock);
+
+    rpc_future *loser = winner == primary ? backup : primary;
+    join_group(winner, &group, 0);
+    cancel_attempt(loser);
+    if (winner == backup) {
+        atomic_fetch_add(&client->hedges_won, 1);
+    }
+
+    pthread_cond_destroy(&group.cond);
+    pthread_mutex_destroy(&group.lock);
+    record_call_latency(client, monotonic_ns() - started);
+    return winner;
+}
+
+// Send an encoded request on conn and wait for its reply payload, hedging it if allowed
+static int call_frame(rpc_conn *conn, uint8_t msg_type, char *frame, size_t payload_len, int hedge,
+                      char **reply, size_t *reply_len) {
+    last_error = ERR_NONE;
+    *reply = NULL;
+    *reply_len = 0;
+
+    uint64_t started = hedge ? monotonic_ns() : 0;
+    rpc_future *future = start_request(conn, msg_type, frame, payload_len, NULL, NULL, NULL);
+    if (future == NULL) {
+        return -1;
+    }
+
+    if (hedge) {
+        future = hedged_wait(future, msg_type, frame, payload_len, started);
+    } else {
+        future_wait_ns(future, -1);
+    }
+
+    last_error = future->error_code;
+    if (last_error == ERR_NONE) {
+        *reply = future->result;
+        *reply_len = future->result_len;
+        future->result = NULL;
+    }
+
+    rpc_future_free(future);
+    return last_error == ERR_NONE ? 0 : -1;
+}
+
 // Make a remote procedure call to the server
 
-char* rpc_call(const char *func_name, const char *params) {
-    if (func_name == NULL) {
+static char *sync_call(rpc_client *client, const char *func_name, uint32_t func_id, const char *params) {
+    last_error = ERR_NONE;
+    if (func_name == NULL && func_id == NO_FUNCTION_ID) {
         printf("[RPC Client] Function name cannot be NULL\n");
+        last_error = ERR_INVALID_ARGS;
         return NULL;
     }
-    
-    Message request;
-    request.func_name = strdup(func_name);
-    request.params = (char*)params;
-    
-    char *request_buffer = serialize_message(&request);
-    if (request_buffer == NULL) {
-        printf("[RPC Client] Failed to serialize request\n");
+
+    rpc_conn *conn = acquire_connection(client);
+    if (conn == NULL) {
         return NULL;
     }
-    
-    int name_len = strlen(func_name);
-    int params_len = params != NULL ? strlen(params) : 0;
-    int total_size = (2 * sizeof(uint32_t)) + name_len + params_len;
-    
-    if (client_send(request_buffer, total_size) < 0) {
-        printf("[RPC Client] Failed to send request\n");
-        free(request_buffer);
-        return NULL;
-    }
-    
-    free(request_buffer);
-    
-    char response_buffer[BUFFER_SIZE];
-    memset(response_buffer, 0, BUFFER_SIZE);
-    
-    int bytes_received = client_receive(response_buffer, BUFFER_SIZE);
-    if (bytes_received <= 0) {
-        printf("[RPC Client] Failed to receive response\n");
-        return NULL;
-    }
-    
-    Message *response = deserialize_message(response_buffer);
-    if (response == NULL) {
-        printf("[RPC Client] Failed to deserialize response\n");
-        return NULL;
-    }
-    
-    if (strcmp(response->func_name, "ERROR") == 0) {
-        printf("[RPC Client] Server error: %s\n", response->params);
-        char *error_copy = response->params != NULL ? strdup(response->params) : NULL;
-        free(response->func_name);
-        if (response->params != NULL) free(response->params);
-        free(response);
-        return error_copy;
-    }
-    
-    char *result = response->params != NULL ? strdup(response->params) : NULL;
-    
-    free(response->func_name);
-    if (response->params != NULL) free(response->params);
-    free(response);
-    
-    return result;
+
+    int hedge = hedgeable(conn, func_name, func_id);
+    if (func_id == NO_FUNCTION_ID) {
+        func_id = lookup_function_id(conn, func_name);
+    }
+
+    size_t request_size;
+    char *frame = encode_request(func_name, func_id, params, &request_size);
+    if (frame == NULL) {
+        connection_release(conn);
+        return NULL;
+    }
+
+    char *reply;
+    size_t reply_len;
+    call_frame(conn, func_id != NO_FUNCTION_ID ? MSG_REQUEST_BY_ID : MSG_REQUEST, frame, request_size, hedge,
+               &reply, &reply_len);
+    connection_release(conn);
+    if (frame != send_buffer) {
+        free(frame);
+    }
+    return reply;
+}
+
+char *rpc_client_call(rpc_client *client, const char *func_name, const char *params) {
+    return sync_call(client, func_name, NO_FUNCTION_ID, params);
+}
+
+char *rpc_client_call_by_id(rpc_client *client, uint32_t func_id, const char *params) {
+    return sync_call(client, NULL, func_id, params);
+}
+
+char* rpc_call(const char *func_name, const char *params) {
+    return rpc_client_call(default_client, func_name, params);
+}
+
+char* rpc_call_by_id(uint32_t func_id, const char *params) {
+    return rpc_client_call_by_id(default_client, func_id, params);
+}
+
+// Run many calls in one request frame; per-call status lands in calls[i].error_code
+
+int rpc_client_call_batch(rpc_client *client, rpc_batch_call *calls, size_t count, int flags) {
+    last_error = ERR_NONE;
+
+    if (calls == NULL || count == 0) {
+        last_error = ERR_INVALID_ARGS;
+        return -1;
+    }
+
+    rpc_conn *conn = acquire_connection(client);
+    if (conn == NULL) {
+        return -1;
+    }
+
+    size_t request_size = sizeof(uint32_t) + 1;
+    for (size_t i = 0; i < count; i++) {
+        calls[i].result = NULL;
+        calls[i].error_code = ERR_NETWORK;
+        if (calls[i].func_name == NULL) {
+            last_error = ERR_INVALID_ARGS;
+            connection_release(conn);
+            return -1;
+        }
+
+        request_size += 3 * sizeof(uint32_t);
+        if (lookup_function_id(conn, calls[i].func_name) == NO_FUNCTION_ID) {
+            request_size += strlen(calls[i].func_name);
+        }
+        request_size += calls[i].params != NULL ? strlen(calls[i].params) : 0;
+    }
+
+    if (request_size > MAX_BATCH_PAYLOAD_SIZE) {
+        printf("[RPC Client] Batch exceeds %d bytes\n", MAX_BATCH_PAYLOAD_SIZE);
+        last_error = ERR_INVALID_ARGS;
+        connection_release(conn);
+        return -1;
+    }
+
+    char *frame = malloc(MESSAGE_HEADER_SIZE + request_size);
+    if (frame == NULL) {
+        printf("[RPC Client] Failed to serialize batch\n");
+        last_error = ERR_SERIALIZATION;
+        connection_release(conn);
+        return -1;
+    }
+
+    char *cursor = frame + MESSAGE_HEADER_SIZE;
+    cursor += serialize_int((uint8_t*)cursor, (int)count);
+    *cursor++ = (char)(flags & BATCH_FLAG_PARALLEL);
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t func_id = lookup_function_id(conn, calls[i].func_name);
+        size_t name_len = func_id == NO_FUNCTION_ID ? strlen(calls[i].func_name) : 0;
+        size_t params_len = calls[i].params != NULL ? strlen(calls[i].params) : 0;
+
+        cursor += serialize_int((uint8_t*)cursor, (int)func_id);
+        cursor += serialize_int((uint8_t*)cursor, (int)name_len);
+        memcpy(cursor, calls[i].func_name, name_len);
+        cursor += name_len;
+        cursor += serialize_int((uint8_t*)cursor, (int)params_len);
+        if (params_len > 0) {
+            memcpy(cursor, calls[i].params, params_len);
+        }
+        cursor += params_len;
+    }
+
+    rpc_future *future = start_request(conn, MSG_BATCH_REQUEST, frame, request_size, NULL, NULL, NULL);
+    connection_release(conn);
+    free(frame);
+    if (future == NULL) {
+        return -1;
+    }
+
+    rpc_future_wait(future, -1);
+    last_error = future->error_code;
+
+    const uint8_t *packed = (const uint8_t*)future->result;
+    size_t len = future->result_len;
+    size_t offset = sizeof(uint32_t);
+    int reply_count = 0;
+
+    if (last_error == ERR_NONE && (packed == NULL || len < sizeof(uint32_t) ||
+        (deserialize_int(packed, &reply_count), (size_t)reply_count != count))) {
+        last_error = ERR_SERIALIZATION;
+    }
+
+    for (size_t i = 0; last_error == ERR_NONE && i < count; i++) {
+        int result_len;
+
+        if (offset + 1 + sizeof(uint32_t) > len) {
+            last_error = ERR_SERIALIZATION;
+            break;
+        }
+        calls[i].error_code = packed[offset++];
+        offset += deserialize_int(packed + offset, &result_len);
+        if (result_len < 0 || offset + result_len > len) {
+            last_error = ERR_SERIALIZATION;
+            break;
+        }
+
+        if (calls[i].error_code == ERR_NONE) {
+            calls[i].result = strndup((const char*)packed + offset, result_len);
+        }
+        offset += result_len;
+    }
+
+    rpc_future_free(future);
+    return last_error == ERR_NONE ? 0 : -1;
+}
+
+int rpc_call_batch(rpc_batch_call *calls, size_t count, int flags) {
+    return rpc_client_call_batch(default_client, calls, count, flags);
+}
+
+// Call a typed function: the arguments travel as binary values, and so does the result
+
+int rpc_client_call_typed(rpc_client *client, const char *func_name, const rpc_value *args, int num_args,
+                          rpc_value *result) {
+    last_error = ERR_NONE;
+    if (result != NULL) {
+        memset(result, 0, sizeof(*result));
+    }
+    if (func_name == NULL || num_args < 0 || num_args > MAX_ARGS || (args == NULL && num_args > 0)) {
+        printf("[RPC Client] Invalid typed call\n");
+        last_error = ERR_INVALID_ARGS;
+        return -1;
+    }
+
+    rpc_conn *conn = acquire_connection(client);
+    if (conn == NULL) {
+        return -1;
+    }
+
+    uint32_t func_id = lookup_function_id(conn, func_name);
+    size_t request_size = serialized_typed_message_size(func_name, func_id, args, num_args);
+    if (request_size > MAX_PAYLOAD_SIZE) {
+        printf("[RPC Client] Typed call exceeds %d bytes\n", MAX_PAYLOAD_SIZE);
+        last_error = ERR_INVALID_ARGS;
+        connection_release(conn);
+        return -1;
+    }
+
+    char *frame = send_buffer;
+    if (serialize_typed_message_into(frame + MESSAGE_HEADER_SIZE, MAX_PAYLOAD_SIZE, func_name, func_id,
+                                     args, num_args) == 0) {
+        last_error = ERR_SERIALIZATION;
+        connection_release(conn);
+        return -1;
+    }
+
+    char *reply;
+    size_t reply_len;
+    int rc = call_frame(conn, MSG_TYPED_REQUEST, frame, request_size, hedgeable(conn, func_name, NO_FUNCTION_ID),
+                        &reply, &reply_len);
+    connection_release(conn);
+    if (rc != 0) {
+        return -1;
+    }
+
+    rpc_value value;
+    if (deserialize_value((const uint8_t*)reply, reply_len, &value) != (int)reply_len) {
+        free(reply);
+        last_error = ERR_SERIALIZATION;
+        return -1;
+    }
+
+    if (result != NULL && (value.type == TYPE_STRING || value.type == TYPE_BYTES)) {
+        // Hand over the received buffer with the data moved to its start
+        *result = value;
+        memmove(reply, value.data, value.len);
+        reply[value.len] = '\0';
+        result->data = reply;
+        return 0;
+    }
+    if (result != NULL) {
+        *result = value;
+    }
+    free(reply);
+    return 0;
+}
+
+int rpc_call_typed(const char *func_name, const rpc_value *args, int num_args, rpc_value *result) {
+    return rpc_client_call_typed(default_client, func_name, args, num_args, result);
+}
+
+int rpc_client_call_frame(rpc_client *client, uint8_t msg_type, char *frame, size_t payload_len,
+                          char **reply, size_t *reply_len) {
+    *reply = NULL;
+    *reply_len = 0;
+
+    rpc_conn *conn = acquire_connection(client);
+    if (conn == NULL) {
+        return -1;
+    }
+
+    // Stub frames lead with the function ID
+    int hedge = 0;
+    if ((msg_type == MSG_TYPED_REQUEST || msg_type == MSG_REQUEST_BY_ID) && payload_len >= sizeof(uint32_t)) {
+        int func_id;
+        deserialize_int((const uint8_t*)frame + MESSAGE_HEADER_SIZE, &func_id);
+        hedge = hedgeable(conn, NULL, (uint32_t)func_id);
+    }
+    int rc = call_frame(conn, msg_type, frame, payload_len, hedge, reply, reply_len);
+    connection_release(conn);
+    return rc;
+}
+
+int rpc_call_frame(uint8_t msg_type, char *frame, size_t payload_len, char **reply, size_t *reply_len) {
+    return rpc_client_call_frame(default_client, msg_type, frame, payload_len, reply, reply_len);
+}
+
+void rpc_set_last_error(int error_code) {
+    last_error = error_code;
+}
+
+void rpc_value_free(rpc_value *value) {
+    if (value != NULL && (value->type == TYPE_STRING || value->type == TYPE_BYTES)) {
+        free((char*)value->data);
+        value->data = NULL;
+        value->len = 0;
+    }
+}
+
+// Frame for an already started stream; chunks interleave with other calls' frames
+static int send_stream_frame(rpc_conn *conn, uint8_t msg_type, uint32_t request_id, const void *data, size_t len) {
+    MessageHeader header = create_message_header(msg_type, request_id, len);
+
+    if (msg_type == MSG_STREAM_DATA && conn->peer_compression) {
+        compress_buffer *out = compress_output_buffer();
+        if (compress_frame(&header, data, out, conn->client->compress_threshold,
+                           conn->peer_dictionary ? &conn->client->dict : NULL)) {
+            data = out->data;
+        }
+    }
+
+    pthread_mutex_lock(&conn->send_lock);
+    int rc = conn_send(conn, &header, data);
+    pthread_mutex_unlock(&conn->send_lock);
+    return rc;
+}
+
+// Append a result chunk to the caller's growable buffer (kept NUL-terminated)
+static int stream_collect(char **buffer, size_t *len, size_t *capacity, const char *data, size_t n) {
+    if (*len + n + 1 > *capacity) {
+        size_t new_capacity = *capacity > 0 ? *capacity : STREAM_CHUNK_SIZE;
+        while (new_capacity < *len + n + 1) {
+            new_capacity *= 2;
+        }
+        char *grown = realloc(*buffer, new_capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        *buffer = grown;
+        *capacity = new_capacity;
+    }
+    memcpy(*buffer + *len, data, n);
+    *len += n;
+    (*buffer)[*len] = '\0';
+    return 0;
+}
+
+// Call a function with params of any size, streamed in flow-controlled chunks
+
+int rpc_client_call_stream(rpc_client *client, const char *func_name, const void *params, size_t params_len,
+                           rpc_stream_callback callback, void *user_data,
+                           char **result, size_t *result_len) {
+    if (result != NULL) {
+        *result = NULL;
+    }
+    if (result_len != NULL) {
+        *result_len = 0;
+    }
+    if (func_name == NULL || (params == NULL && params_len > 0) || (callback == NULL && result == NULL)) {
+        printf("[RPC Client] Invalid stream call\n");
+        last_error = ERR_INVALID_ARGS;
+        return -1;
+    }
+
+    rpc_conn *conn = acquire_connection(client);
+    if (conn == NULL) {
+        return -1;
+    }
+
+    // Opening frame: function ID, or the name when the server didn't list one
+    uint32_t func_id = lookup_function_id(conn, func_name);
+    size_t name_len = func_id != NO_FUNCTION_ID ? 0 : strlen(func_name);
+    size_t request_size = (2 * sizeof(uint32_t)) + name_len;
+    if (request_size > MAX_PAYLOAD_SIZE) {
+        printf("[RPC Client] Function name too long\n");
+        last_error = ERR_INVALID_ARGS;
+        connection_release(conn);
+        return -1;
+    }
+
+    client_stream *stream = calloc(1, sizeof(client_stream));
+    char *chunk = malloc(STREAM_CHUNK_SIZE);
+    if (stream == NULL || chunk == NULL || (stream->ring = malloc(STREAM_WINDOW)) == NULL) {
+        printf("[RPC Client] Unable to allocate stream\n");
+        if (stream != NULL) {
+            free(stream->ring);
+        }
+        free(stream);
+        free(chunk);
+        last_error = ERR_SERIALIZATION;
+        connection_release(conn);
+        return -1;
+    }
+    stream->send_credit = STREAM_WINDOW;
+
+    char *frame = send_buffer;
+    uint8_t *cursor = (uint8_t*)frame + MESSAGE_HEADER_SIZE;
+    cursor += serialize_int(cursor, (int)func_id);
+    cursor += serialize_int(cursor, (int)name_len);
+    memcpy(cursor, func_name, name_len);
+
+    last_error = ERR_NONE;
+    struct rpc_future *future = start_request(conn, MSG_STREAM_REQUEST, frame, request_size, NULL, NULL, stream);
+    connection_release(conn);
+    if (future == NULL) {
+        free(stream->ring);
+        free(stream);
+        free(chunk);
+        return -1;
+    }
+
+    const char *next = params;
+    size_t remaining = params_len;
+    int end_sent = 0;
+    size_t unacked = 0;
+    int error_code = ERR_NONE;
+    char *collected = NULL;
+    size_t collected_len = 0;
+    size_t collected_capacity = 0;
+
+    /*
+     * One loop drives both directions, so a function that answers before it
+     * has read all its params never deadlocks against us: deliver buffered
+     * result bytes first, then send params while the server has room.
+     */
+    pthread_mutex_lock(&conn->pending_lock);
+    for (;;) {
+        if (stream->ring_len > 0) {
+            size_t n = stream->ring_len < STREAM_CHUNK_SIZE ? stream->ring_len : STREAM_CHUNK_SIZE;
+            size_t first = STREAM_WINDOW - stream->ring_start;
+            if (first > n) {
+                first = n;
+            }
+            memcpy(chunk, stream->ring + stream->ring_start, first);
+            memcpy(chunk + first, stream->ring, n - first);
+            stream->ring_start = (stream->ring_start + n) % STREAM_WINDOW;
+            stream->ring_len -= n;
+            int done = future->done;
+            pthread_mutex_unlock(&conn->pending_lock);
+
+            int rc;
+            if (callback != NULL) {
+                rc = callback(chunk, n, user_data) != 0 ? ERR_CANCELLED : ERR_NONE;
+            } else {
+                rc = stream_collect(&collected, &collected_len, &collected_capacity, chunk, n) != 0 ? ERR_SERIALIZATION : ERR_NONE;
+            }
+            if (rc != ERR_NONE) {
+                error_code = rc;
+                if (!done) {
+                    send_stream_frame(conn, MSG_STREAM_CANCEL, future->request_id, NULL, 0);
+                }
+                break;
+            }
+
+            // Hand the space back in half-window steps
+            unacked += n;
+            if (unacked >= STREAM_WINDOW / 2 && !done) {
+                uint8_t credit[sizeof(uint32_t)];
+                serialize_int(credit, (int)unacked);
+                send_stream_frame(conn, MSG_STREAM_CREDIT, future->request_id, credit, sizeof(credit));
+                unacked = 0;
+            }
+
+            pthread_mutex_lock(&conn->pending_lock);
+            continue;
+        }
+
+        if (future->done) {
+            error_code = future->error_code;
+            pthread_mutex_unlock(&conn->pending_lock);
+            break;
+        }
+
+        if (!end_sent && (stream->send_credit > 0 || remaining == 0)) {
+            size_t n = remaining < stream->send_credit ? remaining : stream->send_credit;
+            if (n > STREAM_CHUNK_SIZE) {
+                n = STREAM_CHUNK_SIZE;
+            }
+            stream->send_credit -= n;
+            pthread_mutex_unlock(&conn->pending_lock);
+
+            // A failed send loses the connection; the receiver then fails this call
+            if (n > 0) {
+                send_stream_frame(conn, MSG_STREAM_DATA, future->request_id, next, n);
+                next += n;
+                remaining -= n;
+            } else {
+                send_stream_frame(conn, MSG_STREAM_END, future->request_id, NULL, 0);
+                end_sent = 1;
+            }
+
+            pthread_mutex_lock(&conn->pending_lock);
+            continue;
+        }
+
+        pthread_cond_wait(&future->cond, &conn->pending_lock);
+    }
+
+    // Drops the call from the pending table if it was cancelled early
+    rpc_future_free(future);
+    free(stream->ring);
+    free(stream);
+    free(chunk);
+
+    last_error = error_code;
+    if (error_code != ERR_NONE) {
+        free(collected);
+        return -1;
+    }
+
+    if (callback == NULL) {
+        if (collected == NULL && stream_collect(&collected, &collected_len, &collected_capacity, "", 0) != 0) {
+            last_error = ERR_SERIALIZATION;
+            return -1;
+        }
+        *result = collected;
+        if (result_len != NULL) {
+            *result_len = collected_len;
+        }
+    }
+    return 0;
+}
+
+int rpc_call_stream(const char *func_name, const void *params, size_t params_len,
+                    rpc_stream_callback callback, void *user_data,
+                    char **result, size_t *result_len) {
+    return rpc_client_call_stream(default_client, func_name, params, params_len, callback, user_data,
+                                  result, result_len);
+}
+
+// ID the server assigned to func_name during the handshake, -1 if it has none
+
+long rpc_client_function_id(rpc_client *client, const char *func_name) {
+    if (client == NULL || func_name == NULL) {
+        return -1;
+    }
+
+    // Replicas are expected to serve the same functions; the ID comes from whichever
+    // connection is picked, and a server that assigned it differently gets it wrong
+    rpc_conn *conn = acquire_connection(client);
+    if (conn == NULL) {
+        return -1;
+    }
+
+    uint32_t func_id = lookup_function_id(conn, func_name);
+    connection_release(conn);
+    return func_id != NO_FUNCTION_ID ? (long)func_id : -1;
+}
+
+long rpc_function_id(const char *func_name) {
+    return rpc_client_function_id(default_client, func_name);
+}
+
+// Allow calls to func_name to be hedged. The set is copied on every change, so
+// readers never lock; old copies are kept until the client goes
+
+int rpc_client_mark_idempotent(rpc_client *client, const char *func_name) {
+    if (client == NULL || func_name == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&client->pool_lock);
+
+    func_id_table *old = atomic_load(&client->idempotent);
+    size_t count = 1;
+    for (size_t i = 0; old != NULL && i < old->capacity; i++) {
+        count += old->entries[i].name != NULL;
+    }
+    size_t capacity = 16;
+    while (capacity < count * 2) {
+        capacity <<= 1;
+    }
+
+    func_id_table *table = calloc(1, sizeof(func_id_table));
+    func_id_entry *entries = calloc(capacity, sizeof(func_id_entry));
+    if (table == NULL || entries == NULL) {
+        pthread_mutex_unlock(&client->pool_lock);
+        free(table);
+        free(entries);
+        return -1;
+    }
+    table->entries = entries;
+    table->capacity = capacity;
+
+    for (size_t i = 0; i <= (old != NULL ? old->capacity : 0); i++) {
+        const char *name = old != NULL && i < old->capacity ? old->entries[i].name : func_name;
+        if (name == NULL || table_lookup(table, name) != NO_FUNCTION_ID) {
+            continue;
+        }
+        uint64_t hash = function_name_hash(name);
+        size_t slot = hash & (capacity - 1);
+        while (entries[slot].name != NULL) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        entries[slot].name = strdup(name);
+        entries[slot].hash = hash;
+        entries[slot].id = 0;
+        if (entries[slot].name == NULL) {
+            pthread_mutex_unlock(&client->pool_lock);
+            free_function_table(table);
+            return -1;
+        }
+    }
+
+    atomic_store_explicit(&client->idempotent, table, memory_order_release);
+    if (old != NULL) {
+        old->next_retired = client->retired_idempotent;
+        client->retired_idempotent = old;
+    }
+
+    pthread_mutex_unlock(&client->pool_lock);
+    return 0;
+}
+
+int rpc_mark_idempotent(const char *func_name) {
+    return rpc_client_mark_idempotent(default_client, func_name);
+}
+
+void rpc_client_get_hedge_stats(rpc_client *client, rpc_hedge_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (client == NULL) {
+        return;
+    }
+
+    stats->calls = atomic_load(&client->hedge_calls);
+    stats->hedged = atomic_load(&client->hedges_sent);
+    stats->won = atomic_load(&client->hedges_won);
+    stats->denied = atomic_load(&client->hedges_denied);
+    stats->delay_us = client->hedge_budget > 0 ? hedge_delay(client) / 1000.0 : 0;
+}
+
+void rpc_get_hedge_stats(rpc_hedge_stats *stats) {
+    rpc_client_get_hedge_stats(default_client, stats);
+}
+
+// Hedging for the rpc_call family, taking effect with the next rpc_client_init
+
+void rpc_client_set_hedging(int budget_percent, int delay_us) {
+    default_hedge_budget = budget_percent < 0 ? 0 : budget_percent > 100 ? 100 : budget_percent;
+    default_hedge_delay_us = delay_us < 0 ? 0 : delay_us;
+}
+
+// Compress requests of at least threshold bytes when the server supports it; 0 turns it off
+
+void rpc_client_set_compression(size_t threshold) {
+    default_compress_threshold = threshold;
+    if (default_client != NULL) {
+        default_client->compress_threshold = threshold;
+    }
+}
+
+// Dictionary shared with the server; takes effect with the next rpc_client_init
+
+int rpc_client_set_dictionary(const void *data, size_t len) {
+    void *copy = len > 0 ? malloc(len) : NULL;
+    if (len > 0 && copy == NULL) {
+        printf("[RPC Client] Unable to load compression dictionary\n");
+        return -1;
+    }
+    if (len > 0) {
+        memcpy(copy, data, len);
+    }
+
+    free(default_dictionary);
+    default_dictionary = copy;
+    default_dictionary_len = len;
+    return 0;
+}
+
+void rpc_client_get_compression_stats(compress_stats *stats) {
+    compress_get_stats(stats);
+}
+
+// Error code (ERR_*) of the most recent rpc_call on this thread
+
+int rpc_last_error() {
+    return last_error;
 }
 
 //Disconnect from RPC server and cleanup
 
 void rpc_client_disconnect() {
-    client_disconnect();
+    rpc_client_destroy(default_client);
+    default_client = NULL;
     printf("[RPC Client] Disconnected\n");
-}
\ No newline at end of file
+}
@@ -3,99 +3,1744 @@
 #include <string.h>
 #include <dlfcn.h>
 #include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include "rpc_server.h"
 #include "server.h"
+#include "protocol.h"
 #include "message_handler.h"
+#include "dl_handler.h"
+#include "arena.h"
+#include "rpc_context.h"
+#include "shm_channel.h"
 
-#define BUFFER_SIZE 4096
+#define REQUEST_ARENA_BLOCK_SIZE (2 * MAX_PAYLOAD_SIZE)
+#define CONN_READ_BUFFER_SIZE    (4 * MAX_PAYLOAD_SIZE)
+#define REPLY_QUEUE_LIMIT        65536
+#define MAX_STREAMS_PER_CONN     64
+#define MAX_STREAM_PARAMS_SIZE   (64 * 1024 * 1024)   /* params assembled for non-streaming functions */
+#define MAX_CANCELLED_CALLS      16
+#define CANCEL_HORIZON           4096                 /* request IDs older than this are long done */
+#define STREAM_STALL_TIMEOUT_SEC 30                   /* a stream waiting this long on its client is cancelled */
 
-extern void *dl_handler;
-extern struct RegisteryList *funcs;
+static rpc_server_config server_config = { .mode = SERVER_MODE_THREADED, .shm_spin_us = SHM_DEFAULT_SPIN_US };
+static thread_pool *executor = NULL;
+static compress_dict server_dict;
+static result_cache *results = NULL;    /* pure functions' results, when cache_bytes is set */
 
-int function_table_init(const char *lib_path);
-int add_function(const char *func_name);
-void *get_function(char *s_name);
-void destroy_registery();
+typedef struct {
+    MessageHeader header;
+    const char *payload;
+    char *owned;    /* heap-allocated result to free once sent */
+    char *frame;    /* header room right before payload, so the frame goes out without a copy */
+} rpc_response;
 
-void rpc_handle_client(int client_socket) {
-    char buffer[BUFFER_SIZE];
+/* Replies held back while more pipelined requests are already buffered (threaded mode) */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} rpc_reply_queue;
+
+/* What a function call produced */
+typedef struct {
+    char *data;
+    size_t len;
+    char *frame;    /* set when data was written in place after MESSAGE_HEADER_SIZE bytes of room */
+    int failed;     /* buffer-ABI or typed function reported an error, or RESULT_BAD_ARGS */
+} rpc_result;
+
+/* Typed call whose arguments did not match the signature */
+#define RESULT_BAD_ARGS 2
+
+/* A resolved function and the calling convention it was registered with */
+typedef struct {
+    void *func;
+    int abi;
+    const RPCRequest *signature;    /* FUNC_ABI_TYPED */
+    uint32_t id;
+    int pure;                       /* results may come from the result cache */
+    uint32_t cache_ttl_ms;
+    uint32_t generation;            /* of the code the function was resolved to */
+} rpc_target;
+
+/* Per-connection state shared with the threads running streamed calls */
+typedef struct rpc_connection {
+    server_conn *conn;          /* event loop connection, NULL in threaded mode */
+    int fd;                     /* threaded mode socket, written under send_lock */
+    shm_channel *shm;           /* ... or the rings written in its place */
+    pthread_mutex_t send_lock;
+    
+    pthread_mutex_t lock;       /* guards everything below and the streams' state */
+    pthread_cond_t drained;
+    struct rpc_server_stream *streams;
+    int num_streams;
+    int refs;                   /* the connection itself plus one per running stream, job and batch */
+    atomic_int closed;          /* also read without the lock by queued executor jobs */
+    
+    /* Settled by the function table handshake */
+    int compress;               /* the client decodes compressed frames */
+    int use_dict;               /* ... and holds the server's dictionary */
+    
+    /* MSG_CANCEL'd request IDs, checked by queued executor jobs before they run */
+    uint32_t cancelled[MAX_CANCELLED_CALLS];
+    atomic_int num_cancelled;
+} rpc_connection;
+
+/* A streamed call: params arrive into ring, results leave as MSG_STREAM_DATA as credit allows */
+typedef struct rpc_server_stream {
+    rpc_connection *connection;
+    uint32_t request_id;
+    rpc_target target;
+    pthread_cond_t cond;        /* waits on connection->lock */
+    char *ring;                 /* STREAM_WINDOW bytes, as much as the client may send unacknowledged */
+    size_t ring_start;
+    size_t ring_len;
+    size_t unacked;             /* params consumed but not yet returned as credit */
+    size_t send_credit;         /* result bytes the client will still accept */
+    int input_done;
+    int cancelled;
+    registery_guard guard;      /* held for the whole call */
+    struct rpc_server_stream *next;
+} rpc_server_stream;
+
+/* A call handed to the executor; params are copied since the receive buffer is reused */
+typedef struct {
+    struct rpc_connection *connection; /* referenced until the call is done */
+    uint32_t request_id;
+    rpc_target target;
+    registery_guard guard;      /* taken when target was resolved, dropped once the call is done */
+    int has_params;
+    size_t params_len;
+    char params[];
+} rpc_job;
+
+/* One call inside a batch frame */
+typedef struct {
+    rpc_target target;
+    Message *request;
+    size_t params_len;
+    char *result;
+    size_t result_len;
+    uint8_t error_code;
+} rpc_batch_entry;
+
+/* Slice of a batch run by one worker; its arena holds the slice's results until the reply is sent */
+typedef struct {
+    struct rpc_batch *batch;
+    size_t begin;
+    size_t end;
+    arena arena;
+} rpc_batch_chunk;
+
+typedef struct rpc_batch {
+    struct rpc_connection *connection;  /* referenced until the reply is sent; NULL in threaded mode */
+    uint32_t request_id;
+    uint8_t flags;
+    size_t count;
+    atomic_size_t remaining;    /* entries not yet executed; the last worker sends the reply */
+    rpc_batch_entry *entries;
+    rpc_batch_chunk *chunks;
+    size_t num_chunks;
+    registery_guard guard;      /* keeps the entries' functions loaded until the batch is freed */
+} rpc_batch;
+
+/* Every thread that runs functions gets its own request arena, so there is no
+ * allocator contention between them. Released when the thread exits. */
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void free_thread_arena(void *ptr) {
+    arena_destroy((arena*)ptr);
+    free(ptr);
+}
+
+static void create_arena_key(void) {
+    pthread_key_create(&arena_key, free_thread_arena);
+}
+
+static arena *thread_arena(void) {
+    pthread_once(&arena_key_once, create_arena_key);
+    
+    arena *a = pthread_getspecific(arena_key);
+    if (a == NULL) {
+        a = malloc(sizeof(arena));
+        if (a == NULL) {
+            return NULL;
+        }
+        arena_init(a, REQUEST_ARENA_BLOCK_SIZE);
+        pthread_setspecific(arena_key, a);
+    }
+    return a;
+}
+
+// Memory handed out is released wholesale by arena_reset() after the reply is sent
+static void *rpc_context_alloc(rpc_context *ctx, size_t size) {
+    return ctx->allocator != NULL ? arena_alloc((arena*)ctx->allocator, size) : NULL;
+}
+
+// Move the output to a bigger frame in the same arena; the old one is reclaimed on reset
+static int rpc_output_grow(rpc_output *out, size_t min_capacity) {
+    // Clients refuse frames beyond MAX_BATCH_PAYLOAD_SIZE, so never grow past it
+    if (min_capacity > MAX_BATCH_PAYLOAD_SIZE) {
+        return -1;
+    }
+    
+    size_t capacity = out->capacity * 2;
+    if (capacity < min_capacity) {
+        capacity = min_capacity;
+    }
+    if (capacity > MAX_BATCH_PAYLOAD_SIZE) {
+        capacity = MAX_BATCH_PAYLOAD_SIZE;
+    }
+    
+    char *frame = out->allocator != NULL ? arena_alloc((arena*)out->allocator, MESSAGE_HEADER_SIZE + capacity) : NULL;
+    if (frame == NULL) {
+        return -1;
+    }
+    memcpy(frame + MESSAGE_HEADER_SIZE, out->data, out->len);
+    out->data = frame + MESSAGE_HEADER_SIZE;
+    out->capacity = capacity;
+    return 0;
+}
+
+// Typed ABI: check the binary arguments against the signature, call, and encode
+// the result value in place in an arena frame
+static void rpc_call_typed(const rpc_target *target, uint32_t request_id, const char *params, size_t params_len,
+                           arena *a, rpc_result *result) {
+    const RPCRequest *signature = target->signature;
+    rpc_value args[MAX_ARGS];
+    rpc_value ret;
+    
+    result->data = NULL;
+    result->len = 0;
+    result->failed = RESULT_BAD_ARGS;
+    
+    if (params == NULL || params_len < 1 || (uint8_t)params[0] != signature->num_args) {
+        return;
+    }
+    size_t offset = 1;
+    for (int i = 0; i < signature->num_args; i++) {
+        int n = deserialize_value((const uint8_t*)params + offset, params_len - offset, &args[i]);
+        if (n < 0 || args[i].type != signature->arg_types[i]) {
+            return;
+        }
+        offset += n;
+    }
+    if (offset != params_len) {
+        return;
+    }
+    result->failed = 1;
+    
+    memset(&ret, 0, sizeof(ret));
+    ret.type = signature->return_type;
+    rpc_context ctx = { rpc_context_alloc, a, request_id };
+    if (((rpc_typed_func)target->func)(&ctx, args, &ret) != 0) {
+        return;
+    }
+    ret.type = signature->return_type;
+    
+    size_t size = serialized_value_size(&ret);
+    if (size > MAX_BATCH_PAYLOAD_SIZE || (ret.len > 0 && ret.data == NULL)) {
+        return;
+    }
+    char *frame = a != NULL ? arena_alloc(a, MESSAGE_HEADER_SIZE + size) : NULL;
+    if (frame == NULL) {
+        return;
+    }
+    serialize_value((uint8_t*)frame + MESSAGE_HEADER_SIZE, &ret);
+    
+    result->data = frame + MESSAGE_HEADER_SIZE;
+    result->len = size;
+    result->frame = frame;
+    result->failed = 0;
+}
+
+// Call a function through its registered ABI; params_len only matters to typed
+// and raw functions, the others take params as a C string
+static void rpc_invoke_function(const rpc_target *target, uint32_t request_id, const char *params, size_t params_len,
+                              arena *a, rpc_result *result) {
+    result->frame = NULL;
+    result->failed = 0;
+    
+    // A streaming function takes an rpc_stream, which only a streamed call sets up
+    if (target->abi == FUNC_ABI_STREAM) {
+        result->data = NULL;
+        result->len = 0;
+        result->failed = 1;
+        return;
+    }
+    
+    if (target->abi == FUNC_ABI_TYPED) {
+        rpc_call_typed(target, request_id, params, params_len, a, result);
+        return;
+    }
+    
+    if (target->abi == FUNC_ABI_BUFFER || target->abi == FUNC_ABI_RAW) {
+        // The output starts as a regular-sized frame from the arena, header room first
+        char *frame = a != NULL ? arena_alloc(a, MESSAGE_HEADER_SIZE + MAX_PAYLOAD_SIZE) : NULL;
+        if (frame == NULL) {
+            result->data = NULL;
+            result->len = 0;
+            result->failed = 1;
+            return;
+        }
+        
+        rpc_output out = { frame + MESSAGE_HEADER_SIZE, 0, MAX_PAYLOAD_SIZE, rpc_output_grow, a };
+        if (target->abi == FUNC_ABI_RAW) {
+            rpc_context ctx = { rpc_context_alloc, a, request_id };
+            result->failed = ((rpc_raw_func)target->func)(&ctx, params, params != NULL ? params_len : 0, &out) != 0 ||
+                             out.len > out.capacity;
+        } else {
+            result->failed = ((rpc_buf_func)target->func)(params, &out) != 0 || out.len > out.capacity;
+        }
+        result->data = out.data;
+        result->len = result->failed ? 0 : out.len;
+        result->frame = out.data - MESSAGE_HEADER_SIZE;
+        return;
+    }
+    
+    if (target->abi == FUNC_ABI_CONTEXT) {
+        rpc_context ctx = { rpc_context_alloc, a, request_id };
+        result->data = ((rpc_ctx_func)target->func)(&ctx, params);
+    } else {
+        typedef char* (*rpc_func)(const char*);
+        result->data = ((rpc_func)target->func)(params);
+    }
+    result->len = result->data != NULL ? strlen(result->data) : 0;
+}
+
+// A hit is copied to where the function's own result would be: the heap for
+// plain functions, whose results are freed, otherwise an arena frame
+static void *rpc_cache_alloc_heap(void *arg, size_t size) {
+    (void)arg;
+    return malloc(size);
+}
+
+static void *rpc_cache_alloc_frame(void *arg, size_t size) {
+    char *frame = arena_alloc((arena*)arg, MESSAGE_HEADER_SIZE + size);
+    return frame != NULL ? frame + MESSAGE_HEADER_SIZE : NULL;
+}
+
+// As rpc_invoke_function, answering pure functions from the result cache when it can
+static void rpc_call_function(const rpc_target *target, uint32_t request_id, const char *params, size_t params_len,
+                              arena *a, rpc_result *result) {
+    int plain = target->abi == FUNC_ABI_PLAIN;
+    // A reload publishes new code while calls on the old code still run and store
+    // their results; the generation keeps the two apart
+    uint64_t func_key = (uint64_t)target->generation << 32 | target->id;
+    
+    if (results == NULL || !target->pure || (!plain && a == NULL)) {
+        rpc_invoke_function(target, request_id, params, params_len, a, result);
+        return;
+    }
+    
+    if (result_cache_get(results, func_key, params, params_len, plain ? rpc_cache_alloc_heap : rpc_cache_alloc_frame,
+                         a, &result->data, &result->len) == 0) {
+        result->frame = plain ? NULL : result->data - MESSAGE_HEADER_SIZE;
+        result->failed = 0;
+        return;
+    }
+    
+    rpc_invoke_function(target, request_id, params, params_len, a, result);
+    if (!result->failed && result->data != NULL) {
+        result_cache_put(results, func_key, params, params_len, result->data, result->len, target->cache_ttl_ms);
+    }
+}
+
+static void rpc_set_target(rpc_target *target, const struct Registery *entry) {
+    target->func = entry->function;
+    target->abi = entry->abi;
+    target->signature = entry->signature;
+    target->id = entry->id;
+    target->pure = entry->pure;
+    target->cache_ttl_ms = entry->cache_ttl_ms;
+    target->generation = entry->generation;
+}
+
+static void rpc_error_response(rpc_response *response, uint32_t request_id, uint8_t error_code, const char *text) {
+    response->header = create_message_header(MSG_ERROR, request_id, strlen(text));
+    response->header.error_code = error_code;
+    response->payload = text;
+    response->owned = NULL;
+    response->frame = NULL;
+}
+
+// Run an already resolved function and fill in the response for request_id.
+// Arena-backed results stay valid until the caller resets the arena
+static void rpc_execute(uint32_t request_id, const rpc_target *target, const char *params, size_t params_len,
+                        arena *a, rpc_response *response) {
+    rpc_result result;
+    rpc_call_function(target, request_id, params, params_len, a, &result);
+    
+    if (result.failed) {
+        rpc_error_response(response, request_id, ERR_INVALID_ARGS,
+                           result.failed == RESULT_BAD_ARGS ? "Arguments do not match the signature" : "Function failed");
+        return;
+    }
+    
+    response->header = create_message_header(MSG_RESPONSE, request_id, result.len);
+    response->payload = result.data;
+    response->owned = (target->abi == FUNC_ABI_PLAIN && result.data != params) ? result.data : NULL;
+    response->frame = result.frame;
+}
+
+// A context-ABI result may be the library's own data. Copied to the heap, the reply
+// no longer needs the registry guard, which is then dropped before the send: a
+// client slow to read must not hold up a reload
+static void rpc_detach_response(rpc_response *response) {
+    if (response->header.msg_type != MSG_RESPONSE || response->owned != NULL || response->frame != NULL ||
+        response->header.payload_length == 0) {
+        return;
+    }
+    
+    char *copy = malloc(response->header.payload_length);
+    if (copy == NULL) {
+        rpc_error_response(response, response->header.request_id, ERR_SERIALIZATION, "Unable to copy result");
+        return;
+    }
+    memcpy(copy, response->payload, response->header.payload_length);
+    response->payload = copy;
+    response->owned = copy;
+}
+
+// Handshake request: the client's feature bits and dictionary, absent from older clients
+static void rpc_negotiate(rpc_connection *connection, const MessageHeader *header, const char *payload) {
+    int features;
+    int dict_id;
+    
+    if (connection == NULL || header->payload_length < 2 * sizeof(uint32_t)) {
+        return;
+    }
+    deserialize_int((const uint8_t*)payload, &features);
+    deserialize_int((const uint8_t*)payload + sizeof(uint32_t), &dict_id);
+    
+    connection->compress = (features & FEATURE_COMPRESSION) && server_config.compress_threshold > 0;
+    connection->use_dict = connection->compress && server_dict.id != 0 && (uint32_t)dict_id == server_dict.id;
+}
+
+// Handshake reply: every registered function with the ID clients should call it by,
+// then the features and dictionary this server offers
+static void rpc_function_table_response(uint32_t request_id, rpc_response *response) {
+    size_t count = registery_count();
+    size_t total_size = 3 * sizeof(uint32_t);
+    
+    for (size_t id = 0; id < count; id++) {
+        total_size += (2 * sizeof(uint32_t)) + strlen(get_function_name(id));
+    }
+    
+    char *table = malloc(total_size);
+    if (table == NULL) {
+        printf("[RPC Server] Unable to allocate function table\n");
+        rpc_error_response(response, request_id, ERR_SERIALIZATION, "Unable to build function table");
+        return;
+    }
+    
+    char *cursor = table + serialize_int((uint8_t*)table, (int)count);
+    for (size_t id = 0; id < count; id++) {
+        const char *name = get_function_name(id);
+        size_t name_len = strlen(name);
+        
+        cursor += serialize_int((uint8_t*)cursor, (int)id);
+        cursor += serialize_int((uint8_t*)cursor, (int)name_len);
+        memcpy(cursor, name, name_len);
+        cursor += name_len;
+    }
+    cursor += serialize_int((uint8_t*)cursor, FEATURE_COMPRESSION);
+    serialize_int((uint8_t*)cursor, (int)server_dict.id);
+    
+    response->header = create_message_header(MSG_FUNC_TABLE, request_id, total_size);
+    response->payload = table;
+    response->owned = table;
+    response->frame = NULL;
+}
+
+/*
+ * Decode a received frame and resolve the function it calls. On success *view
+ * points into payload and 0 is returned; -1 means *response already holds the
+ * reply (an error, or the function table for a handshake).
+ */
+static int rpc_decode_request(rpc_connection *connection, const MessageHeader *header, const char *payload,
+                              rpc_target *target, MessageView *view, rpc_response *response) {
+    const struct Registery *entry = NULL;
+    const char *name = NULL;
+    int name_len = 0;
+    int rc = -1;
+    
+    switch (header->msg_type) {
+    case MSG_REQUEST:
+        rc = deserialize_message_view(payload, header->payload_length, view);
+        if (rc == 0) {
+            name = view->func_name;
+            name_len = (int)view->func_name_len;
+            entry = get_registery_entry(view->func_name, view->func_name_len);
+        }
+        break;
+        
+    case MSG_REQUEST_BY_ID: {
+        uint32_t func_id;
+        rc = deserialize_id_message_view(payload, header->payload_length, &func_id, view);
+        if (rc == 0) {
+            name = get_function_name(func_id);
+            name_len = name != NULL ? (int)strlen(name) : 0;
+            entry = get_registery_entry_by_id(func_id);
+        }
+        break;
+    }
+        
+    case MSG_TYPED_REQUEST: {
+        uint32_t func_id;
+        rc = deserialize_typed_message_view(payload, header->payload_length, &func_id, view);
+        if (rc == 0 && func_id != BATCH_NO_FUNC_ID) {
+            name = get_function_name(func_id);
+            name_len = name != NULL ? (int)strlen(name) : 0;
+            entry = get_registery_entry_by_id(func_id);
+        } else if (rc == 0) {
+            name = view->func_name;
+            name_len = (int)view->func_name_len;
+            entry = get_registery_entry(view->func_name, view->func_name_len);
+        }
+        break;
+    }
+        
+    case MSG_FUNC_TABLE_REQUEST:
+        rpc_negotiate(connection, header, payload);
+        rpc_function_table_response(header->request_id, response);
+        return -1;
+        
+    default:
+        printf("[RPC Server] Unexpected message type %d\n", header->msg_type);
+        rpc_error_response(response, header->request_id, ERR_INVALID_ARGS, "Unexpected message type");
+        return -1;
+    }
+    
+    if (rc != 0) {
+        printf("[RPC Server] Failed to deserialize message\n");
+        rpc_error_response(response, header->request_id, ERR_SERIALIZATION, "Malformed request");
+        return -1;
+    }
+    
+    if (entry == NULL) {
+        if (name != NULL) {
+            printf("[RPC Server] Function '%.*s' not found\n", name_len, name);
+        } else {
+            printf("[RPC Server] Function '(unknown id)' not found\n");
+        }
+        rpc_error_response(response, header->request_id, ERR_FUNCTION_NOT_FOUND, "Function not found");
+        return -1;
+    }
+    
+    // Binary arguments only make sense to a typed function (text ones fail its argument check)
+    if (header->msg_type == MSG_TYPED_REQUEST && entry->abi != FUNC_ABI_TYPED && entry->abi != FUNC_ABI_RAW) {
+        printf("[RPC Server] Function '%.*s' does not take typed arguments\n", name_len, name);
+        rpc_error_response(response, header->request_id, ERR_INVALID_ARGS, "Function does not take typed arguments");
+        return -1;
+    }
+    
+    // Streaming functions read their params from an rpc_stream, opened by MSG_STREAM_REQUEST only
+    if (entry->abi == FUNC_ABI_STREAM) {
+        printf("[RPC Server] Function '%.*s' must be called as a stream\n", name_len, name);
+        rpc_error_response(response, header->request_id, ERR_INVALID_ARGS, "Function must be called as a stream");
+        return -1;
+    }
+    
+    rpc_set_target(target, entry);
+    printf("[RPC Server] Received call for function: %.*s\n", name_len, name);
+    return 0;
+}
+
+// Functions take a C string (NULL when no params were sent); params end where the payload does
+static const char *rpc_view_params(const MessageView *view) {
+    return view->params_len > 0 ? view->params : NULL;
+}
+
+/*
+ * Describe the response frame as iovecs: the payload is referenced, not
+ * copied, and an in-place payload carries its header right in front of it.
+ * Returns the number of iovecs used (at most 2).
+ */
+static int rpc_response_iov(rpc_response *response, uint8_t *header_buf, struct iovec *iov) {
+    size_t payload_length = response->header.payload_length;
+    
+    if (response->frame != NULL) {
+        encode_message_header(&response->header, (uint8_t*)response->frame);
+        iov[0].iov_base = response->frame;
+        iov[0].iov_len = MESSAGE_HEADER_SIZE + payload_length;
+        return 1;
+    }
+    
+    encode_message_header(&response->header, header_buf);
+    iov[0].iov_base = header_buf;
+    iov[0].iov_len = MESSAGE_HEADER_SIZE;
+    if (payload_length == 0) {
+        return 1;
+    }
+    iov[1].iov_base = (void*)response->payload;
+    iov[1].iov_len = payload_length;
+    return 2;
+}
+
+// Swap in the compressed payload (this thread's output buffer) if the client negotiated it
+static void rpc_compress_response(const rpc_connection *connection, rpc_response *response) {
+    uint8_t msg_type = response->header.msg_type;
+    if (connection == NULL || !connection->compress || (msg_type != MSG_RESPONSE && msg_type != MSG_BATCH_RESPONSE)) {
+        return;
+    }
+    
+    compress_buffer *out = compress_output_buffer();
+    if (compress_frame(&response->header, response->payload, out, server_config.compress_threshold,
+                       connection->use_dict ? &server_dict : NULL)) {
+        response->payload = (const char*)out->data;
+        response->frame = NULL;
+    }
+}
+
+// Undo the client's compression, into this thread's input buffer; -1 if the frame does not decode
+static int rpc_inflate_request(MessageHeader *header, uint8_t **payload) {
+    uint8_t msg_type = header->msg_type & MSG_TYPE_MASK;
+    size_t max_payload = msg_type == MSG_BATCH_REQUEST ? MAX_BATCH_PAYLOAD_SIZE : MAX_PAYLOAD_SIZE;
+    
+    if (decompress_frame(header, payload, compress_input_buffer(), max_payload, &server_dict) != 0) {
+        printf("[RPC Server] Failed to decompress frame\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Header and payload go out in one gathered write so concurrent senders never interleave frames
+static int rpc_send_response(rpc_connection *connection, rpc_response *response) {
+    uint8_t header_buf[MESSAGE_HEADER_SIZE];
+    rpc_compress_response(connection, response);
+    struct iovec iov[2];
+    int iovcnt = rpc_response_iov(response, header_buf, iov);
+    
+    return server_conn_sendv(connection->conn, iov, iovcnt) < 0 ? -1 : 0;
+}
+
+static void rpc_connection_retain(rpc_connection *connection);
+static void rpc_connection_release(rpc_connection *connection);
+
+static void free_batch(rpc_batch *batch) {
+    for (size_t i = 0; i < batch->count; i++) {
+        rpc_batch_entry *entry = &batch->entries[i];
+        if (entry->target.abi == FUNC_ABI_PLAIN && entry->request != NULL && entry->result != entry->request->params) {
+            free(entry->result);
+        }
+        free_message(entry->request);
+    }
+    for (size_t i = 0; i < batch->num_chunks; i++) {
+        arena_destroy(&batch->chunks[i].arena);
+    }
+    free(batch->chunks);
+    free(batch->entries);
+    registery_read_unlock(batch->guard);
+    free(batch);
+}
+
+// Parse a batch frame and resolve every entry's function; NULL if malformed
+static rpc_batch *rpc_decode_batch(const MessageHeader *header, const uint8_t *payload) {
+    size_t len = header->payload_length;
+    if (len < sizeof(uint32_t) + 1) {
+        return NULL;
+    }
+    
+    int count;
+    size_t offset = deserialize_int(payload, &count);
+    uint8_t flags = payload[offset++];
+    
+    // Every entry needs at least its three length/ID fields
+    if (count < 0 || (size_t)count > (len - offset) / (3 * sizeof(uint32_t))) {
+        return NULL;
+    }
+    
+    rpc_batch *batch = calloc(1, sizeof(rpc_batch));
+    if (batch == NULL) {
+        return NULL;
+    }
+    batch->entries = calloc(count > 0 ? count : 1, sizeof(rpc_batch_entry));
+    if (batch->entries == NULL) {
+        free(batch);
+        return NULL;
+    }
+    batch->guard = registery_read_lock();
+    batch->request_id = header->request_id;
+    batch->flags = flags;
+    batch->count = count;
+    atomic_init(&batch->remaining, count);
+    
+    for (size_t i = 0; i < batch->count; i++) {
+        rpc_batch_entry *entry = &batch->entries[i];
+        int func_id;
+        int name_len;
+        int params_len;
+        
+        if (offset + (2 * sizeof(uint32_t)) > len) {
+            goto malformed;
+        }
+        offset += deserialize_int(payload + offset, &func_id);
+        offset += deserialize_int(payload + offset, &name_len);
+        if (name_len < 0 || offset + name_len + sizeof(uint32_t) > len) {
+            goto malformed;
+        }
+        const char *name = (const char*)payload + offset;
+        offset += name_len;
+        offset += deserialize_int(payload + offset, &params_len);
+        if (params_len < 0 || offset + params_len > len) {
+            goto malformed;
+        }
+        
+        entry->request = calloc(1, sizeof(Message));
+        if (entry->request == NULL) {
+            goto malformed;
+        }
+        entry->request->params = malloc(params_len + 1);
+        if (entry->request->params == NULL) {
+            goto malformed;
+        }
+        memcpy(entry->request->params, payload + offset, params_len);
+        entry->request->params[params_len] = '\0';
+        entry->params_len = params_len;
+        offset += params_len;
+        
+        const struct Registery *resolved;
+        if ((uint32_t)func_id != BATCH_NO_FUNC_ID) {
+            resolved = get_registery_entry_by_id((uint32_t)func_id);
+        } else {
+            resolved = get_registery_entry(name, name_len);
+        }
+        
+        if (resolved == NULL) {
+            entry->error_code = ERR_FUNCTION_NOT_FOUND;
+        } else if (resolved->abi == FUNC_ABI_STREAM) {
+            entry->error_code = ERR_INVALID_ARGS;   /* needs a stream, left unresolved so it never runs */
+        } else {
+            rpc_set_target(&entry->target, resolved);
+            entry->error_code = ERR_NONE;
+        }
+    }
+    
+    return batch;
+    
+malformed:
+    free_batch(batch);
+    return NULL;
+}
+
+// Execute entries [begin, end) of a batch, arena-aware functions allocating from a
+static void rpc_run_batch_range(rpc_batch *batch, size_t begin, size_t end, arena *a) {
+    for (size_t i = begin; i < end; i++) {
+        rpc_batch_entry *entry = &batch->entries[i];
+        if (entry->target.func != NULL) {
+            rpc_result result;
+            rpc_call_function(&entry->target, batch->request_id, entry->request->params, entry->params_len, a, &result);
+            entry->result = result.data;
+            entry->result_len = result.len;
+            if (result.failed) {
+                entry->error_code = ERR_INVALID_ARGS;
+            }
+        }
+    }
+}
+
+// Pack every entry's status and result into one MSG_BATCH_RESPONSE
+static void rpc_batch_response(rpc_batch *batch, rpc_response *response) {
+    size_t total_size = sizeof(uint32_t);
+    for (size_t i = 0; i < batch->count; i++) {
+        rpc_batch_entry *entry = &batch->entries[i];
+        total_size += 1 + sizeof(uint32_t) + entry->result_len;
+    }
+    
+    char *packed = malloc(total_size);
+    if (packed == NULL) {
+        printf("[RPC Server] Unable to allocate batch response\n");
+        rpc_error_response(response, batch->request_id, ERR_SERIALIZATION, "Unable to build batch response");
+        return;
+    }
+    
+    char *cursor = packed + serialize_int((uint8_t*)packed, (int)batch->count);
+    for (size_t i = 0; i < batch->count; i++) {
+        rpc_batch_entry *entry = &batch->entries[i];
+        *cursor++ = (char)entry->error_code;
+        cursor += serialize_int((uint8_t*)cursor, (int)entry->result_len);
+        if (entry->result_len > 0) {
+            memcpy(cursor, entry->result, entry->result_len);
+        }
+        cursor += entry->result_len;
+    }
+    
+    response->header = create_message_header(MSG_BATCH_RESPONSE, batch->request_id, total_size);
+    response->payload = packed;
+    response->owned = packed;
+    response->frame = NULL;
+}
+
+// Last chunk of a batch to finish sends the combined reply
+static void rpc_finish_batch(rpc_batch *batch) {
+    rpc_connection *connection = batch->connection;
+    rpc_response response;
+    
+    // The reply is a copy of the results, so the batch and its guard can go before the send
+    rpc_batch_response(batch, &response);
+    free_batch(batch);
+    rpc_send_response(connection, &response);
+    free(response.owned);
+    
+    rpc_connection_release(connection);
+}
+
+static void rpc_run_batch_chunk(void *arg) {
+    rpc_batch_chunk *chunk = (rpc_batch_chunk*)arg;
+    rpc_batch *batch = chunk->batch;
+    size_t done = chunk->end - chunk->begin;
+    
+    rpc_run_batch_range(batch, chunk->begin, chunk->end, &chunk->arena);
+    
+    if (atomic_fetch_sub(&batch->remaining, done) == done) {
+        rpc_finish_batch(batch);
+    }
+}
+
+// Event loop side: run the batch on the executor (split across workers if asked) or inline
+static void rpc_dispatch_batch(rpc_connection *connection, rpc_batch *batch) {
+    batch->connection = connection;
+    rpc_connection_retain(connection);
+    
+    if (batch->count == 0) {
+        rpc_finish_batch(batch);
+        return;
+    }
+    
+    size_t count = batch->count;
+    size_t chunks = 1;
+    if (executor != NULL && (batch->flags & BATCH_FLAG_PARALLEL)) {
+        chunks = server_config.executor.max_workers;
+        if (chunks > count) {
+            chunks = count;
+        }
+    }
+    size_t per_chunk = (count + chunks - 1) / chunks;
+    chunks = (count + per_chunk - 1) / per_chunk;
+    
+    rpc_batch_chunk *chunk_list = calloc(chunks, sizeof(rpc_batch_chunk));
+    if (chunk_list == NULL) {
+        rpc_response response;
+        printf("[RPC Server] Unable to allocate batch chunks\n");
+        rpc_error_response(&response, batch->request_id, ERR_SERIALIZATION, "Unable to run batch");
+        rpc_send_response(connection, &response);
+        rpc_connection_release(connection);
+        free_batch(batch);
+        return;
+    }
+    
+    for (size_t i = 0; i < chunks; i++) {
+        chunk_list[i].batch = batch;
+        chunk_list[i].begin = i * per_chunk;
+        chunk_list[i].end = (i + 1) * per_chunk < count ? (i + 1) * per_chunk : count;
+        arena_init(&chunk_list[i].arena, REQUEST_ARENA_BLOCK_SIZE);
+    }
+    batch->chunks = chunk_list;
+    batch->num_chunks = chunks;
+    
+    // Only chunk_list is used from here: once the last chunk finishes the batch is freed,
+    // and chunks not yet handed off keep it alive until then
+    for (size_t i = 0; i < chunks; i++) {
+        if (executor != NULL && thread_pool_submit(executor, rpc_run_batch_chunk, &chunk_list[i]) == 0) {
+            continue;
+        }
+        
+        // No executor or queue full: run this part on the current thread
+        rpc_run_batch_chunk(&chunk_list[i]);
+    }
+}
+
+static rpc_connection *rpc_connection_create(server_conn *conn, int fd, shm_channel *shm) {
+    rpc_connection *connection = calloc(1, sizeof(rpc_connection));
+    if (connection == NULL) {
+        return NULL;
+    }
+    
+    connection->conn = conn;
+    connection->fd = fd;
+    connection->shm = shm;
+    connection->refs = 1;
+    pthread_mutex_init(&connection->send_lock, NULL);
+    pthread_mutex_init(&connection->lock, NULL);
+    pthread_cond_init(&connection->drained, NULL);
+    return connection;
+}
+
+// Caller holds connection->lock, which is released (and the connection freed on the last reference)
+static void rpc_connection_release_locked(rpc_connection *connection) {
+    int last = --connection->refs == 0;
+    pthread_mutex_unlock(&connection->lock);
+    
+    if (last) {
+        pthread_mutex_destroy(&connection->send_lock);
+        pthread_mutex_destroy(&connection->lock);
+        pthread_cond_destroy(&connection->drained);
+        free(connection);
+    }
+}
+
+// Event loop calls that outlive their frame (executor jobs, batches) hold the
+// connection's state as well as its socket: the event loop drops its own
+// reference to the state when the connection closes
+static void rpc_connection_retain(rpc_connection *connection) {
+    pthread_mutex_lock(&connection->lock);
+    connection->refs++;
+    pthread_mutex_unlock(&connection->lock);
+    server_conn_retain(connection->conn);
+}
+
+static void rpc_connection_release(rpc_connection *connection) {
+    server_conn *conn = connection->conn;
+    
+    pthread_mutex_lock(&connection->lock);
+    rpc_connection_release_locked(connection);
+    server_conn_release(conn);
+}
+
+// Caller holds connection->lock
+static void rpc_connection_cancel_streams(rpc_connection *connection) {
+    connection->closed = 1;
+    for (rpc_server_stream *stream = connection->streams; stream != NULL; stream = stream->next) {
+        stream->cancelled = 1;
+        pthread_cond_broadcast(&stream->cond);
+    }
+}
+
+// Event loop on_close hook: running streams hold their own references
+static void rpc_connection_closed(void *data) {
+    rpc_connection *connection = (rpc_connection*)data;
+    
+    pthread_mutex_lock(&connection->lock);
+    rpc_connection_cancel_streams(connection);
+    rpc_connection_release_locked(connection);
+}
+
+// Threaded mode: the socket is closed once the handler returns, so wait for the streams to finish
+static void rpc_connection_close(rpc_connection *connection) {
+    pthread_mutex_lock(&connection->lock);
+    rpc_connection_cancel_streams(connection);
+    if (connection->num_streams > 0) {
+        // Unblock stream threads stuck writing to a peer that stopped reading
+        if (connection->shm != NULL) {
+            shm_channel_shutdown(connection->shm);
+        } else {
+            shutdown(connection->fd, SHUT_RDWR);
+        }
+    }
+    while (connection->num_streams > 0) {
+        pthread_cond_wait(&connection->drained, &connection->lock);
+    }
+    rpc_connection_release_locked(connection);
+}
+
+static int rpc_connection_sendv(rpc_connection *connection, struct iovec *iov, int iovcnt) {
+    if (connection->conn != NULL) {
+        return server_conn_sendv(connection->conn, iov, iovcnt) < 0 ? -1 : 0;
+    }
+    
+    pthread_mutex_lock(&connection->send_lock);
+    int rc = connection->shm != NULL ? shm_channel_sendv(connection->shm, iov, iovcnt)
+                                     : send_iov(connection->fd, iov, iovcnt);
+    pthread_mutex_unlock(&connection->send_lock);
+    return rc;
+}
+
+static int rpc_connection_send_frame(rpc_connection *connection, uint8_t msg_type, uint32_t request_id,
+                                     uint8_t error_code, const void *data, size_t len) {
+    uint8_t header_buf[MESSAGE_HEADER_SIZE];
+    MessageHeader header = create_message_header(msg_type, request_id, len);
+    header.error_code = error_code;
+    
+    if (msg_type == MSG_STREAM_DATA && connection->compress) {
+        compress_buffer *out = compress_output_buffer();
+        if (compress_frame(&header, data, out, server_config.compress_threshold,
+                           connection->use_dict ? &server_dict : NULL)) {
+            data = out->data;
+            len = header.payload_length;
+        }
+    }
+    encode_message_header(&header, header_buf);
+    
+    struct iovec iov[2] = { { header_buf, MESSAGE_HEADER_SIZE }, { (void*)data, len } };
+    return rpc_connection_sendv(connection, iov, len > 0 ? 2 : 1);
+}
+
+static int rpc_connection_send_error(rpc_connection *connection, uint32_t request_id, uint8_t error_code,
+                                     const char *text) {
+    return rpc_connection_send_frame(connection, MSG_ERROR, request_id, error_code, text, strlen(text));
+}
+
+// Caller holds connection->lock
+static rpc_server_stream *rpc_find_stream(rpc_connection *connection, uint32_t request_id) {
+    for (rpc_server_stream *stream = connection->streams; stream != NULL; stream = stream->next) {
+        if (stream->request_id == request_id) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+// A stream's function holds the registry guard while it waits for the client, so
+// a client that stops sending params or credit would hold up a reload for good.
+// A stream is cancelled instead once it has waited STREAM_STALL_TIMEOUT_SEC
+static struct timespec rpc_stream_deadline(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += STREAM_STALL_TIMEOUT_SEC;
+    return deadline;
+}
+
+// Caller holds connection->lock
+static void rpc_stream_wait(rpc_server_stream *stream, const struct timespec *deadline) {
+    if (pthread_cond_timedwait(&stream->cond, &stream->connection->lock, deadline) == ETIMEDOUT) {
+        stream->cancelled = 1;
+    }
+}
+
+// rpc_stream read(): params as the client sends them; consumed space goes back as credit
+static long rpc_stream_read_params(rpc_stream *io, void *buf, size_t len) {
+    rpc_server_stream *stream = (rpc_server_stream*)io->state;
+    rpc_connection *connection = stream->connection;
+    
+    struct timespec deadline = rpc_stream_deadline();
+    pthread_mutex_lock(&connection->lock);
+    while (stream->ring_len == 0 && !stream->input_done && !stream->cancelled) {
+        rpc_stream_wait(stream, &deadline);
+    }
+    if (stream->cancelled) {
+        pthread_mutex_unlock(&connection->lock);
+        return -1;
+    }
+    
+    size_t n = len < stream->ring_len ? len : stream->ring_len;
+    size_t first = STREAM_WINDOW - stream->ring_start;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(buf, stream->ring + stream->ring_start, first);
+    memcpy((char*)buf + first, stream->ring, n - first);
+    stream->ring_start = (stream->ring_start + n) % STREAM_WINDOW;
+    stream->ring_len -= n;
     
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
+    // Return credit in half-window steps rather than per chunk
+    uint32_t grant = 0;
+    stream->unacked += n;
+    if (stream->unacked >= STREAM_WINDOW / 2 && !stream->input_done) {
+        grant = stream->unacked;
+        stream->unacked = 0;
+    }
+    pthread_mutex_unlock(&connection->lock);
+    
+    if (grant > 0) {
+        uint8_t credit[sizeof(uint32_t)];
+        serialize_int(credit, (int)grant);
+        rpc_connection_send_frame(connection, MSG_STREAM_CREDIT, stream->request_id, ERR_NONE, credit, sizeof(credit));
+    }
+    return n;
+}
+
+// rpc_stream write(): cut into chunks, each sent once the client has room for it
+static int rpc_stream_write_result(rpc_stream *io, const void *data, size_t len) {
+    rpc_server_stream *stream = (rpc_server_stream*)io->state;
+    rpc_connection *connection = stream->connection;
+    const char *cursor = data;
+    
+    while (len > 0) {
+        struct timespec deadline = rpc_stream_deadline();
+        pthread_mutex_lock(&connection->lock);
+        while (stream->send_credit == 0 && !stream->cancelled) {
+            rpc_stream_wait(stream, &deadline);
+        }
+        if (stream->cancelled) {
+            pthread_mutex_unlock(&connection->lock);
+            return -1;
+        }
+        size_t n = len < stream->send_credit ? len : stream->send_credit;
+        if (n > STREAM_CHUNK_SIZE) {
+            n = STREAM_CHUNK_SIZE;
+        }
+        stream->send_credit -= n;
+        pthread_mutex_unlock(&connection->lock);
         
-        int bytes_received = server_receive(client_socket, buffer, BUFFER_SIZE);
+        if (rpc_connection_send_frame(connection, MSG_STREAM_DATA, stream->request_id, ERR_NONE, cursor, n) != 0) {
+            return -1;
+        }
+        cursor += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Non-streaming functions called through a stream: assemble the params, call, stream the result back
+static int rpc_stream_call_whole(rpc_server_stream *stream, rpc_stream *io) {
+    size_t capacity = STREAM_CHUNK_SIZE;
+    size_t params_len = 0;
+    char *params = malloc(capacity + 1);
+    if (params == NULL) {
+        return -1;
+    }
+    
+    for (;;) {
+        if (params_len == capacity) {
+            if (capacity >= MAX_STREAM_PARAMS_SIZE) {
+                free(params);
+                return -1;
+            }
+            char *grown = realloc(params, 2 * capacity + 1);
+            if (grown == NULL) {
+                free(params);
+                return -1;
+            }
+            params = grown;
+            capacity *= 2;
+        }
         
-        if (bytes_received <= 0) {
+        long n = rpc_stream_read(io, params + params_len, capacity - params_len);
+        if (n < 0) {
+            free(params);
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        params_len += n;
+    }
+    params[params_len] = '\0';
+    
+    arena *request_arena = thread_arena();
+    rpc_result result;
+    rpc_call_function(&stream->target, stream->request_id, params_len > 0 ? params : NULL, params_len,
+                      request_arena, &result);
+    
+    int rc = result.failed ? -1 : rpc_stream_write(io, result.data, result.len);
+    
+    if (stream->target.abi == FUNC_ABI_PLAIN && result.data != params) {
+        free(result.data);
+    }
+    if (request_arena != NULL) {
+        arena_reset(request_arena);
+    }
+    free(params);
+    return rc;
+}
+
+// Unlink a stream whose call has ended and drop its references
+static void rpc_stream_finish(rpc_server_stream *stream) {
+    rpc_connection *connection = stream->connection;
+    server_conn *conn = connection->conn;
+    
+    pthread_mutex_lock(&connection->lock);
+    rpc_server_stream **cur = &connection->streams;
+    while (*cur != stream) {
+        cur = &(*cur)->next;
+    }
+    *cur = stream->next;
+    if (--connection->num_streams == 0) {
+        pthread_cond_broadcast(&connection->drained);
+    }
+    rpc_connection_release_locked(connection);
+    
+    if (conn != NULL) {
+        server_conn_release(conn);
+    }
+    registery_read_unlock(stream->guard);
+    pthread_cond_destroy(&stream->cond);
+    free(stream->ring);
+    free(stream);
+}
+
+// Each streamed call gets its own thread: it blocks on flow control, which would stall a worker
+static void *rpc_stream_thread(void *arg) {
+    rpc_server_stream *stream = (rpc_server_stream*)arg;
+    rpc_connection *connection = stream->connection;
+    rpc_stream io = { rpc_stream_read_params, rpc_stream_write_result, stream };
+    
+    int rc;
+    if (stream->target.abi == FUNC_ABI_STREAM) {
+        rc = ((rpc_stream_func)stream->target.func)(&io);
+    } else {
+        rc = rpc_stream_call_whole(stream, &io);
+    }
+    
+    pthread_mutex_lock(&connection->lock);
+    int cancelled = stream->cancelled;
+    pthread_mutex_unlock(&connection->lock);
+    
+    // A cancelled call has nobody waiting for its outcome
+    if (!cancelled) {
+        if (rc == 0) {
+            rpc_connection_send_frame(connection, MSG_STREAM_END, stream->request_id, ERR_NONE, NULL, 0);
+        } else {
+            rpc_connection_send_error(connection, stream->request_id, ERR_INVALID_ARGS, "Function failed");
+        }
+    }
+    
+    rpc_stream_finish(stream);
+    return NULL;
+}
+
+// MSG_STREAM_REQUEST: resolve the function and start the call's thread
+static void rpc_stream_open(rpc_connection *connection, const MessageHeader *header, const uint8_t *payload) {
+    size_t len = header->payload_length;
+    int func_id;
+    int name_len;
+    
+    if (len < 2 * sizeof(uint32_t)) {
+        rpc_connection_send_error(connection, header->request_id, ERR_SERIALIZATION, "Malformed request");
+        return;
+    }
+    deserialize_int(payload, &func_id);
+    deserialize_int(payload + sizeof(uint32_t), &name_len);
+    if (name_len < 0 || 2 * sizeof(uint32_t) + name_len > len) {
+        rpc_connection_send_error(connection, header->request_id, ERR_SERIALIZATION, "Malformed request");
+        return;
+    }
+    
+    const char *name = (const char*)payload + 2 * sizeof(uint32_t);
+    const struct Registery *entry;
+    registery_guard guard = registery_read_lock();
+    if ((uint32_t)func_id != BATCH_NO_FUNC_ID) {
+        entry = get_registery_entry_by_id((uint32_t)func_id);
+    } else {
+        entry = get_registery_entry(name, name_len);
+    }
+    if (entry == NULL) {
+        registery_read_unlock(guard);
+        printf("[RPC Server] Function '%.*s' not found\n", name_len, name);
+        rpc_connection_send_error(connection, header->request_id, ERR_FUNCTION_NOT_FOUND, "Function not found");
+        return;
+    }
+    printf("[RPC Server] Received stream call for function: %s\n", entry->name);
+    
+    rpc_server_stream *stream = calloc(1, sizeof(rpc_server_stream));
+    char *ring = malloc(STREAM_WINDOW);
+    if (stream == NULL || ring == NULL) {
+        registery_read_unlock(guard);
+        free(stream);
+        free(ring);
+        rpc_connection_send_error(connection, header->request_id, ERR_SERIALIZATION, "Unable to start stream");
+        return;
+    }
+    stream->connection = connection;
+    stream->guard = guard;
+    stream->request_id = header->request_id;
+    rpc_set_target(&stream->target, entry);
+    stream->ring = ring;
+    stream->send_credit = STREAM_WINDOW;
+    pthread_cond_init(&stream->cond, NULL);
+    
+    pthread_mutex_lock(&connection->lock);
+    if (connection->closed || connection->num_streams >= MAX_STREAMS_PER_CONN) {
+        pthread_mutex_unlock(&connection->lock);
+        registery_read_unlock(guard);
+        pthread_cond_destroy(&stream->cond);
+        free(ring);
+        free(stream);
+        rpc_connection_send_error(connection, header->request_id, ERR_SERVER_BUSY, "Too many streams");
+        return;
+    }
+    stream->next = connection->streams;
+    connection->streams = stream;
+    connection->num_streams++;
+    connection->refs++;
+    pthread_mutex_unlock(&connection->lock);
+    
+    if (connection->conn != NULL) {
+        server_conn_retain(connection->conn);
+    }
+    
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, rpc_stream_thread, stream) != 0) {
+        perror("Error creating stream thread");
+        rpc_connection_send_error(connection, header->request_id, ERR_SERVER_BUSY, "Unable to start stream");
+        rpc_stream_finish(stream);
+        return;
+    }
+    pthread_detach(thread_id);
+}
+
+static int rpc_is_stream_message(uint8_t msg_type) {
+    return msg_type >= MSG_STREAM_REQUEST && msg_type <= MSG_STREAM_CANCEL;
+}
+
+// Any stream frame from the client; only the copy into the ring happens on the reading thread
+static void rpc_stream_frame(rpc_connection *connection, const MessageHeader *header, const uint8_t *payload) {
+    if (header->msg_type == MSG_STREAM_REQUEST) {
+        rpc_stream_open(connection, header, payload);
+        return;
+    }
+    
+    int overrun = 0;
+    size_t len = header->payload_length;
+    
+    pthread_mutex_lock(&connection->lock);
+    rpc_server_stream *stream = rpc_find_stream(connection, header->request_id);
+    
+    // Frames for a finished or cancelled stream are dropped
+    if (stream == NULL || stream->cancelled) {
+        pthread_mutex_unlock(&connection->lock);
+        return;
+    }
+    
+    switch (header->msg_type) {
+    case MSG_STREAM_DATA: {
+        if (len > STREAM_WINDOW - stream->ring_len) {
+            // The client ignored its window
+            stream->cancelled = 1;
+            overrun = 1;
             break;
         }
+        size_t tail = (stream->ring_start + stream->ring_len) % STREAM_WINDOW;
+        size_t first = STREAM_WINDOW - tail;
+        if (first > len) {
+            first = len;
+        }
+        memcpy(stream->ring + tail, payload, first);
+        memcpy(stream->ring, payload + first, len - first);
+        stream->ring_len += len;
+        break;
+    }
+        
+    case MSG_STREAM_END:
+        stream->input_done = 1;
+        break;
+        
+    case MSG_STREAM_CREDIT:
+        if (len >= sizeof(uint32_t)) {
+            int credit;
+            deserialize_int(payload, &credit);
+            if (credit > 0) {
+                stream->send_credit += credit;
+            }
+        }
+        break;
+        
+    case MSG_STREAM_CANCEL:
+        stream->cancelled = 1;
+        break;
+    }
+    
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&connection->lock);
+    
+    if (overrun) {
+        printf("[RPC Server] Stream %u exceeded its window\n", header->request_id);
+        rpc_connection_send_error(connection, header->request_id, ERR_INVALID_ARGS, "Stream window exceeded");
+    }
+}
+
+// Threaded mode: hold the reply back, or with flush set write it together with
+// every held-back reply in a single sendmsg
+static int rpc_queue_response(rpc_connection *connection, rpc_reply_queue *queue, rpc_response *response, int flush) {
+    uint8_t header_buf[MESSAGE_HEADER_SIZE];
+    struct iovec iov[3];
+    rpc_compress_response(connection, response);
+    iov[0].iov_base = queue->data;
+    iov[0].iov_len = queue->len;
+    int iovcnt = 1 + rpc_response_iov(response, header_buf, iov + 1);
+    
+    size_t needed = queue->len + MESSAGE_HEADER_SIZE + response->header.payload_length;
+    if (!flush && needed <= REPLY_QUEUE_LIMIT) {
+        if (queue->capacity < needed) {
+            char *grown = realloc(queue->data, REPLY_QUEUE_LIMIT);
+            if (grown != NULL) {
+                queue->data = grown;
+                queue->capacity = REPLY_QUEUE_LIMIT;
+            }
+        }
+        if (queue->capacity >= needed) {
+            for (int i = 1; i < iovcnt; i++) {
+                memcpy(queue->data + queue->len, iov[i].iov_base, iov[i].iov_len);
+                queue->len += iov[i].iov_len;
+            }
+            return 0;
+        }
+    }
+    
+    // Stream threads write to the same socket
+    int rc = rpc_connection_sendv(connection, iov, iovcnt);
+    queue->len = 0;
+    return rc;
+}
+
+static int rpc_flush_replies(rpc_connection *connection, rpc_reply_queue *queue) {
+    if (queue->len == 0) {
+        return 0;
+    }
+    
+    struct iovec iov = { queue->data, queue->len };
+    queue->len = 0;
+    return rpc_connection_sendv(connection, &iov, 1);
+}
+
+// Threaded mode: answer a connection's requests until it closes. Frames come
+// from the socket, or from shm's rings when set
+
+static void rpc_serve_connection(int client_socket, shm_channel *shm) {
+    frame_reader reader;
+    rpc_reply_queue replies = { NULL, 0, 0 };
+    uint8_t *payload;
+    MessageHeader header;
+    
+    // One buffered reader per connection: a single recv may bring in many pipelined requests
+    if (frame_reader_init(&reader, client_socket, CONN_READ_BUFFER_SIZE, MAX_BATCH_PAYLOAD_SIZE) != 0) {
+        printf("[RPC Server] Unable to allocate connection buffer\n");
+        return;
+    }
+    reader.channel = shm;
+    
+    // A stream thread blocked sending to a client that stopped reading gives up
+    // like a stalled stream does, rather than keep its registry guard for good
+    if (shm == NULL) {
+        struct timeval timeout = { STREAM_STALL_TIMEOUT_SEC, 0 };
+        setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    
+    rpc_connection *connection = rpc_connection_create(NULL, client_socket, shm);
+    if (connection == NULL) {
+        printf("[RPC Server] Unable to allocate connection state\n");
+        frame_reader_free(&reader);
+        return;
+    }
+    
+    while (frame_reader_next(&reader, &header, &payload) == 0) {
+        if ((header.msg_type & MSG_FLAG_COMPRESSED) && rpc_inflate_request(&header, &payload) != 0) {
+            rpc_response response;
+            rpc_error_response(&response, header.request_id, ERR_SERIALIZATION, "Malformed compressed frame");
+            if (rpc_queue_response(connection, &replies, &response, !frame_reader_buffered(&reader)) != 0) {
+                break;
+            }
+            continue;
+        }
         
-        Message *request = deserialize_message(buffer);
-        if (request == NULL) {
-            printf("[RPC Server] Failed to deserialize message\n");
+        // Stream frames are answered by the stream's own thread
+        if (rpc_is_stream_message(header.msg_type)) {
+            if (header.payload_length <= MAX_PAYLOAD_SIZE) {
+                rpc_stream_frame(connection, &header, payload);
+            }
+            if (!frame_reader_buffered(&reader) && rpc_flush_replies(connection, &replies) != 0) {
+                break;
+            }
             continue;
         }
         
-        printf("[RPC Server] Received call for function: %s\n", request->func_name);
-        
-        void *func_ptr = get_function((char*)request->func_name);
-        
-        if (func_ptr == NULL) {
-            printf("[RPC Server] Function '%s' not found\n", request->func_name);
-            
-            Message error_response;
-            error_response.func_name = "ERROR";
-            error_response.params = "Function not found";
-            
-            char *error_buffer = serialize_message(&error_response);
-            if (error_buffer != NULL) {
-                int name_len = strlen(error_response.func_name);
-                int params_len = strlen(error_response.params);
-                int total_size = (2 * sizeof(uint32_t)) + name_len + params_len;
-                
-                server_send(client_socket, error_buffer, total_size);
-                free(error_buffer);
+        // Calls here run in arrival order, so a cancelled one has already been answered
+        if (header.msg_type == MSG_CANCEL) {
+            if (!frame_reader_buffered(&reader) && rpc_flush_replies(connection, &replies) != 0) {
+                break;
             }
-            
-            free(request->func_name);
-            if (request->params != NULL) free(request->params);
-            free(request);
             continue;
         }
         
-        typedef char* (*rpc_func)(const char*);
-        rpc_func func = (rpc_func)func_ptr;
+        rpc_response response;
+        rpc_target target;
+        MessageView request;
+        rpc_batch *batch = NULL;
+        arena *request_arena = thread_arena();
+        
+        // Params are the tail of the payload: borrow the following byte as their terminator
+        uint8_t saved = payload[header.payload_length];
+        payload[header.payload_length] = '\0';
         
-        char *result = func(request->params);
+        registery_guard guard = registery_read_lock();
+        if (header.msg_type == MSG_BATCH_REQUEST) {
+            batch = rpc_decode_batch(&header, payload);
+            if (batch != NULL) {
+                rpc_run_batch_range(batch, 0, batch->count, request_arena);
+                rpc_batch_response(batch, &response);
+            } else {
+                rpc_error_response(&response, header.request_id, ERR_SERIALIZATION, "Malformed batch");
+            }
+        } else if (header.payload_length > MAX_PAYLOAD_SIZE) {
+            rpc_error_response(&response, header.request_id, ERR_INVALID_ARGS, "Request too large");
+        } else if (rpc_decode_request(connection, &header, (char*)payload, &target, &request, &response) == 0) {
+            rpc_execute(header.request_id, &target, rpc_view_params(&request), request.params_len, request_arena,
+                        &response);
+        }
         
-        Message response;
-        response.func_name = "RESPONSE";
-        response.params = result != NULL ? result : "NULL";
+        // The reply leaves nothing pointing into the library, so the guard is not held
+        // across the send. Write once nothing else is waiting to be answered
+        rpc_detach_response(&response);
+        if (batch != NULL) {
+            free_batch(batch);
+        }
+        registery_read_unlock(guard);
+        int rc = rpc_queue_response(connection, &replies, &response, !frame_reader_buffered(&reader));
+        payload[header.payload_length] = saved;
         
-        char *response_buffer = serialize_message(&response);
-        if (response_buffer != NULL) {
-            int name_len = strlen(response.func_name);
-            int params_len = strlen(response.params);
-            int total_size = (2 * sizeof(uint32_t)) + name_len + params_len;
-            
-            server_send(client_socket, response_buffer, total_size);
-            free(response_buffer);
+        free(response.owned);
+        if (request_arena != NULL) {
+            arena_reset(request_arena);
         }
         
-        if (result != NULL && result != request->params) {
-            free(result);
+        if (rc != 0) {
+            break;
+        }
+    }
+    
+    rpc_flush_replies(connection, &replies);
+    rpc_connection_close(connection);
+    free(replies.data);
+    frame_reader_free(&reader);
+}
+
+void rpc_handle_client(int client_socket) {
+    rpc_serve_connection(client_socket, NULL);
+}
+
+void rpc_handle_shm_client(int control_socket) {
+    shm_channel *shm = shm_channel_serve(control_socket, SHM_RING_SIZE, server_config.shm_spin_us);
+    if (shm == NULL) {
+        printf("[RPC Server] Unable to set up shared memory connection\n");
+        return;
+    }
+    
+    rpc_serve_connection(control_socket, shm);
+    
+    // Lets a client still waiting on the rings see the connection end
+    shm_channel_shutdown(shm);
+    shm_channel_close(shm);
+}
+
+// Event loop mode: remember a cancelled call so the job, if still queued, is dropped.
+// Inline and threaded calls run in arrival order, so theirs have already finished
+static void rpc_note_cancel(rpc_connection *connection, uint32_t request_id) {
+    pthread_mutex_lock(&connection->lock);
+    
+    int count = atomic_load(&connection->num_cancelled);
+    if (count < MAX_CANCELLED_CALLS) {
+        connection->cancelled[count] = request_id;
+        atomic_store(&connection->num_cancelled, count + 1);
+    } else {
+        // Full of IDs whose calls probably ran already: the oldest goes
+        memmove(connection->cancelled, connection->cancelled + 1, (count - 1) * sizeof(uint32_t));
+        connection->cancelled[count - 1] = request_id;
+    }
+    
+    pthread_mutex_unlock(&connection->lock);
+}
+
+// Consume a pending cancellation of request_id; stale entries are dropped on the way.
+// Every call still queued for a connection that has closed counts as cancelled
+static int rpc_take_cancel(rpc_connection *connection, uint32_t request_id) {
+    if (connection == NULL) {
+        return 0;
+    }
+    if (atomic_load_explicit(&connection->closed, memory_order_relaxed)) {
+        return 1;
+    }
+    if (atomic_load_explicit(&connection->num_cancelled, memory_order_relaxed) == 0) {
+        return 0;
+    }
+    
+    int found = 0;
+    pthread_mutex_lock(&connection->lock);
+    
+    int count = atomic_load(&connection->num_cancelled);
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        uint32_t id = connection->cancelled[i];
+        if (id == request_id) {
+            found = 1;
+        } else if ((int32_t)(request_id - id) < CANCEL_HORIZON) {
+            connection->cancelled[kept++] = id;
+        }
+    }
+    atomic_store(&connection->num_cancelled, kept);
+    
+    pthread_mutex_unlock(&connection->lock);
+    return found;
+}
+
+// Worker side of the executor: run the call and post the response back to the connection
+static void rpc_run_job(void *arg) {
+    rpc_job *job = (rpc_job*)arg;
+    rpc_response response;
+    
+    // The client took its answer from elsewhere and expects none from here
+    if (rpc_take_cancel(job->connection, job->request_id)) {
+        registery_read_unlock(job->guard);
+        rpc_connection_release(job->connection);
+        free(job);
+        return;
+    }
+    
+    arena *request_arena = thread_arena();
+    
+    rpc_execute(job->request_id, &job->target, job->has_params ? job->params : NULL, job->params_len, request_arena,
+                &response);
+    rpc_detach_response(&response);
+    registery_read_unlock(job->guard);
+    rpc_send_response(job->connection, &response);
+    
+    free(response.owned);
+    if (request_arena != NULL) {
+        arena_reset(request_arena);
+    }
+    rpc_connection_release(job->connection);
+    free(job);
+}
+
+// Hand a decoded call to the executor, guard and all; 0 if queued
+static int rpc_submit_job(rpc_connection *connection, uint32_t request_id, const rpc_target *target, registery_guard guard,
+                          const MessageView *request) {
+    rpc_job *job = malloc(sizeof(rpc_job) + request->params_len + 1);
+    if (job == NULL) {
+        return -1;
+    }
+    
+    job->connection = connection;
+    job->request_id = request_id;
+    job->target = *target;
+    job->guard = guard;
+    job->has_params = request->params_len > 0;
+    job->params_len = request->params_len;
+    memcpy(job->params, request->params, request->params_len);
+    job->params[request->params_len] = '\0';
+    rpc_connection_retain(connection);
+    
+    if (thread_pool_submit(executor, rpc_run_job, job) != 0) {
+        rpc_connection_release(connection);
+        free(job);
+        return -1;
+    }
+    return 0;
+}
+
+// Frame handler for the event loop: consumes one complete request, if buffered
+static long rpc_handle_frame(server_conn *conn, char *data, size_t len) {
+    MessageHeader header;
+    
+    if (len < MESSAGE_HEADER_SIZE) {
+        return 0;
+    }
+    decode_message_header((const uint8_t*)data, &header);
+    
+    uint8_t msg_type = header.msg_type & MSG_TYPE_MASK;
+    size_t max_payload = msg_type == MSG_BATCH_REQUEST ? MAX_BATCH_PAYLOAD_SIZE : MAX_PAYLOAD_SIZE;
+    if (header.payload_length > max_payload) {
+        printf("[RPC Server] Oversized request, dropping connection\n");
+        return -1;
+    }
+    
+    size_t frame_len = MESSAGE_HEADER_SIZE + header.payload_length;
+    if (len < frame_len) {
+        return 0;
+    }
+    
+    // Negotiated settings and stream state live as long as the connection, created with its first frame
+    rpc_connection *connection = server_conn_get_data(conn);
+    if (connection == NULL) {
+        connection = rpc_connection_create(conn, server_conn_fd(conn), NULL);
+        if (connection == NULL) {
+            printf("[RPC Server] Unable to allocate connection state\n");
+            return -1;
+        }
+        server_conn_set_data(conn, connection, rpc_connection_closed);
+    }
+    
+    rpc_response response;
+    uint8_t *payload = (uint8_t*)data + MESSAGE_HEADER_SIZE;
+    
+    if ((header.msg_type & MSG_FLAG_COMPRESSED) && rpc_inflate_request(&header, &payload) != 0) {
+        rpc_error_response(&response, header.request_id, ERR_SERIALIZATION, "Malformed compressed frame");
+        rpc_send_response(connection, &response);
+        return frame_len;
+    }
+    
+    if (rpc_is_stream_message(header.msg_type)) {
+        rpc_stream_frame(connection, &header, payload);
+        return frame_len;
+    }
+    
+    if (header.msg_type == MSG_CANCEL) {
+        if (executor != NULL) {
+            rpc_note_cancel(connection, header.request_id);
+        }
+        return frame_len;
+    }
+    
+    if (header.msg_type == MSG_BATCH_REQUEST) {
+        rpc_batch *batch = rpc_decode_batch(&header, payload);
+        if (batch == NULL) {
+            rpc_error_response(&response, header.request_id, ERR_SERIALIZATION, "Malformed batch");
+            rpc_send_response(connection, &response);
+        } else {
+            rpc_dispatch_batch(connection, batch);
+        }
+        return frame_len;
+    }
+    
+    rpc_target target;
+    MessageView request;
+    registery_guard guard = registery_read_lock();
+    if (rpc_decode_request(connection, &header, (char*)payload, &target, &request, &response) != 0) {
+        registery_read_unlock(guard);
+        rpc_send_response(connection, &response);
+        free(response.owned);
+        return frame_len;
+    }
+    
+    if (executor != NULL) {
+        if (rpc_submit_job(connection, header.request_id, &target, guard, &request) != 0) {
+            // Queue full: push back on the caller instead of blocking the I/O thread
+            registery_read_unlock(guard);
+            rpc_error_response(&response, header.request_id, ERR_SERVER_BUSY, "Server busy");
+            rpc_send_response(connection, &response);
         }
-        free(request->func_name);
-        if (request->params != NULL) free(request->params);
-        free(request);
+        return frame_len;
+    }
+    
+    // Inline call straight out of the receive buffer: borrow the byte after the
+    // payload (the next frame's first byte, or the spare one) as the terminator
+    uint8_t saved = payload[header.payload_length];
+    payload[header.payload_length] = '\0';
+    
+    arena *request_arena = thread_arena();
+    
+    rpc_execute(header.request_id, &target, rpc_view_params(&request), request.params_len, request_arena, &response);
+    rpc_detach_response(&response);
+    registery_read_unlock(guard);
+    rpc_send_response(connection, &response);
+    
+    payload[header.payload_length] = saved;
+    free(response.owned);
+    if (request_arena != NULL) {
+        arena_reset(request_arena);
     }
+    return frame_len;
 }
 
 int rpc_server_init(int port, const char *lib_path) {
+    return rpc_server_init_ex(port, lib_path, NULL);
+}
+
+int rpc_server_init_ex(int port, const char *lib_path, const rpc_server_config *config) {
+    if (config != NULL) {
+        server_config = *config;
+    }
+    
     if (function_table_init(lib_path) != 0) {
         printf("[RPC Server] Failed to initialize function registry\n");
         return -1;
     }
     
+    // Kept until exit: threaded connections may still be finishing calls after shutdown
+    if (server_config.cache_bytes > 0 && results == NULL) {
+        results = result_cache_create(server_config.cache_bytes);
+        if (results == NULL) {
+            printf("[RPC Server] Failed to create result cache, pure functions run every time\n");
+        }
+    }
+    
+    server_set_sharded(server_config.mode != SERVER_MODE_THREADED && server_config.sharded);
     if (server_init(port) != 0) {
         printf("[RPC Server] Failed to initialize server\n");
         return -1;
@@ -105,17 +1750,140 @@ int rpc_server_init(int port, const char *lib_path) {
     return 0;
 }
 
+int rpc_server_listen(const char *address) {
+    return server_listen(address);
+}
+
+int rpc_server_add_library(const char *name, const char *lib_path) {
+    if (add_library(name, lib_path) != 0) {
+        printf("[RPC Server] Failed to load library '%s'\n", name != NULL ? name : "(null)");
+        return -1;
+    }
+    
+    printf("[RPC Server] Loaded library '%s' from %s\n", name, lib_path);
+    return 0;
+}
+
+int rpc_server_get_executor_stats(thread_pool_stats *stats) {
+    if (executor == NULL || stats == NULL) {
+        return -1;
+    }
+    
+    thread_pool_get_stats(executor, stats);
+    return 0;
+}
+
+int rpc_server_set_dictionary(const void *data, size_t len) {
+    compress_dict_free(&server_dict);
+    if (compress_dict_init(&server_dict, data, len) != 0) {
+        printf("[RPC Server] Unable to load compression dictionary\n");
+        return -1;
+    }
+    return 0;
+}
+
+void rpc_server_get_compression_stats(compress_stats *stats) {
+    compress_get_stats(stats);
+}
+
 int rpc_server_register_function(const char *func_name) {
     return add_function(func_name);
 }
 
+int rpc_server_register_function_ctx(const char *func_name) {
+    return add_function_abi(func_name, FUNC_ABI_CONTEXT);
+}
+
+int rpc_server_register_function_buf(const char *func_name) {
+    return add_function_abi(func_name, FUNC_ABI_BUFFER);
+}
+
+int rpc_server_register_function_stream(const char *func_name) {
+    return add_function_abi(func_name, FUNC_ABI_STREAM);
+}
+
+int rpc_server_register_function_typed(const RPCRequest *signature) {
+    return add_function_typed(signature);
+}
+
+int rpc_server_register_function_raw(const char *func_name, rpc_raw_func func, uint32_t func_id) {
+    // Generated clients send the ID fixed at generation time without asking for it,
+    // so a function that would get another one is not registered at all
+    return add_function_ptr_at(func_name, (void*)func, FUNC_ABI_RAW, func_id);
+}
+
+int rpc_server_set_pure(const char *func_name, unsigned int ttl_ms) {
+    if (results == NULL) {
+        printf("[RPC Server] No result cache, '%s' will not be cached\n", func_name != NULL ? func_name : "(null)");
+    }
+    return set_function_pure(func_name, ttl_ms);
+}
+
+void rpc_server_get_cache_stats(result_cache_stats *stats) {
+    result_cache_get_stats(results, stats);
+}
+
+int rpc_server_freeze_functions() {
+    return freeze_registery();
+}
+
+int rpc_server_reload(const char *lib_path) {
+    return rpc_server_reload_library(NULL, lib_path);
+}
+
+int rpc_server_reload_library(const char *name, const char *lib_path) {
+    const char *label = name != NULL ? name : "default";
+    
+    printf("[RPC Server] Reloading %s library...\n", label);
+    if (reload_library(name, lib_path) != 0) {
+        printf("[RPC Server] Reload failed, still serving the previous %s library\n", label);
+        return -1;
+    }
+    
+    printf("[RPC Server] Reloaded %s library\n", label);
+    
+    // Results of the old code could no longer be hit; now that its calls are done,
+    // none can be stored either, so free them
+    if (results != NULL) {
+        result_cache_clear(results);
+    }
+    return 0;
+}
+
 void rpc_server_start() {
     printf("[RPC Server] Starting server...\n");
-    server_accept_clients(rpc_handle_client);
+    
+    server_set_channel_handler(rpc_handle_shm_client);
+    
+    if (server_config.mode != SERVER_MODE_THREADED) {
+        if (server_config.executor.max_workers > 0) {
+            executor = thread_pool_create(&server_config.executor);
+            if (executor == NULL) {
+                printf("[RPC Server] Failed to create executor, running functions on I/O threads\n");
+            }
+        }
+        
+        if (server_config.mode == SERVER_MODE_URING) {
+            server_run_uring_loop(rpc_handle_frame, server_config.io_threads);
+        } else {
+            server_run_event_loop(rpc_handle_frame, server_config.io_threads);
+        }
+        
+        // Let queued calls finish before the registry goes away
+        thread_pool_destroy(executor);
+        executor = NULL;
+    } else {
+        server_accept_clients(rpc_handle_client);
+    }
+}
+
+void rpc_server_stop() {
+    server_stop();
 }
 
 void rpc_server_shutdown() {
     printf("[RPC Server] Shutting down...\n");
     server_shutdown();
     destroy_registery();
+    compress_dict_free(&server_dict);
 }
\ No newline at end of file
@@ -0,0 +1,879 @@
+/*
+ * rpcgen: turns an interface definition into typed client stubs and server
+ * skeletons.
+ *
+ *     service calc;
+ *
+ *     int    add(int a, int b);
+ *     string repeat(string text, int count);
+ *     void   reset();
+ *
+ * Types are int, float, string and bytes, and void for results; comments run
+ * from # or // to the end of the line. Methods are registered as
+ * "<service>.<method>" and get function IDs in declaration order.
+ *
+ * For each method the generated code encodes and decodes the arguments and
+ * the result in straight-line code with the ID fixed at generation time, so
+ * calls make no name lookup and no per-value type dispatch at runtime:
+ *
+ *   <service>_rpc.h     IDs, client stub and implementation prototypes
+ *   <service>_client.c  stubs sending MSG_TYPED_REQUEST frames (rpc_client)
+ *   <service>_server.c  skeletons and the registration table (rpc_server);
+ *                       the program provides the <service>_<method>_impl functions
+ *
+ * Usage: rpcgen <file.idl> <output directory>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include "protocol.h"
+
+#define MAX_IDENT   48
+#define MAX_METHODS 256
+
+/* Argument prefix and NUL of a stub's frame held on the stack before it falls back to malloc */
+#define STUB_STACK_FRAME 256
+
+typedef enum {
+    IDL_VOID,
+    IDL_INT,
+    IDL_FLOAT,
+    IDL_STRING,
+    IDL_BYTES
+} idl_type;
+
+typedef struct {
+    idl_type type;
+    char name[MAX_IDENT];
+} idl_param;
+
+typedef struct {
+    idl_type result;
+    char name[MAX_IDENT];
+    idl_param params[MAX_ARGS];
+    int num_params;
+    int line;
+} idl_method;
+
+typedef struct {
+    char service[MAX_IDENT];
+    char upper[MAX_IDENT];
+    idl_method methods[MAX_METHODS];
+    int num_methods;
+} idl_file;
+
+typedef struct {
+    const char *path;
+    const char *src;
+    size_t pos;
+    int line;
+    char token[MAX_IDENT + 1];
+} idl_lexer;
+
+static const char *type_names[] = { "void", "int", "float", "string", "bytes" };
+static const char *type_tags[] = { "TYPE_VOID", "TYPE_INT", "TYPE_FLOAT", "TYPE_STRING", "TYPE_BYTES" };
+
+/* Encoded size of a value without its variable part: tag, then 4 bytes or a u32 length (and a NUL for strings) */
+static const size_t type_min_size[] = { 1, 5, 5, 6, 5 };
+
+static void fail(const idl_lexer *lex, const char *fmt, ...) {
+    va_list ap;
+    fprintf(stderr, "%s:%d: ", lex->path, lex->line);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+// ---------------------------------------------------------------------------
+// Parsing
+// ---------------------------------------------------------------------------
+
+// Next token into lex->token: an identifier or one punctuation character, "" at the end
+static void next_token(idl_lexer *lex) {
+    const char *s = lex->src;
+
+    for (;;) {
+        while (isspace((unsigned char)s[lex->pos])) {
+            if (s[lex->pos] == '\n') {
+                lex->line++;
+            }
+            lex->pos++;
+        }
+        if (s[lex->pos] == '#' || (s[lex->pos] == '/' && s[lex->pos + 1] == '/')) {
+            while (s[lex->pos] != '\0' && s[lex->pos] != '\n') {
+                lex->pos++;
+            }
+            continue;
+        }
+        break;
+    }
+
+    if (s[lex->pos] == '\0') {
+        lex->token[0] = '\0';
+        return;
+    }
+
+    if (isalpha((unsigned char)s[lex->pos]) || s[lex->pos] == '_') {
+        size_t len = 0;
+        while (isalnum((unsigned char)s[lex->pos]) || s[lex->pos] == '_') {
+            if (len == MAX_IDENT - 1) {
+                fail(lex, "identifier longer than %d characters", MAX_IDENT - 1);
+            }
+            lex->token[len++] = s[lex->pos++];
+        }
+        lex->token[len] = '\0';
+        return;
+    }
+
+    if (strchr(";(),", s[lex->pos]) == NULL) {
+        fail(lex, "unexpected character '%c'", s[lex->pos]);
+    }
+    lex->token[0] = s[lex->pos++];
+    lex->token[1] = '\0';
+}
+
+static void expect(idl_lexer *lex, const char *token) {
+    if (strcmp(lex->token, token) != 0) {
+        fail(lex, "expected '%s' but found '%s'", token, lex->token[0] ? lex->token : "end of file");
+    }
+    next_token(lex);
+}
+
+static int is_ident(const char *token) {
+    return isalpha((unsigned char)token[0]) || token[0] == '_';
+}
+
+static void take_ident(idl_lexer *lex, char *out, const char *what) {
+    if (!is_ident(lex->token)) {
+        fail(lex, "expected %s but found '%s'", what, lex->token[0] ? lex->token : "end of file");
+    }
+    strcpy(out, lex->token);
+    next_token(lex);
+}
+
+static idl_type take_type(idl_lexer *lex) {
+    for (int t = IDL_VOID; t <= IDL_BYTES; t++) {
+        if (strcmp(lex->token, type_names[t]) == 0) {
+            next_token(lex);
+            return (idl_type)t;
+        }
+    }
+    fail(lex, "unknown type '%s'", lex->token[0] ? lex->token : "end of file");
+    return IDL_VOID;
+}
+
+// Parameter names become C parameters and locals next to the ones the generator adds
+static void check_param_name(idl_lexer *lex, const idl_method *method, const idl_param *param) {
+    static const char *reserved[] = {
+        "ctx", "result", "result_len",
+        "auto", "break", "case", "char", "const", "continue", "default", "do", "double", "else", "enum",
+        "extern", "float", "for", "goto", "if", "inline", "int", "long", "register", "restrict", "return",
+        "short", "signed", "sizeof", "static", "struct", "switch", "typedef", "union", "unsigned", "void",
+        "volatile", "while"
+    };
+    char len_name[MAX_IDENT + 4];
+    char other_len[MAX_IDENT + 4];
+
+    if (strncmp(param->name, "rpc_", 4) == 0) {
+        fail(lex, "parameter names may not start with rpc_");
+    }
+    for (size_t i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++) {
+        if (strcmp(param->name, reserved[i]) == 0) {
+            fail(lex, "'%s' is reserved", param->name);
+        }
+    }
+
+    // Strings and bytes bring a <name>_len along
+    snprintf(len_name, sizeof(len_name), "%s_len", param->name);
+    int has_len = param->type == IDL_STRING || param->type == IDL_BYTES;
+    for (int i = 0; i < method->num_params; i++) {
+        const idl_param *other = &method->params[i];
+        snprintf(other_len, sizeof(other_len), "%s_len", other->name);
+        int other_has_len = other->type == IDL_STRING || other->type == IDL_BYTES;
+        if (strcmp(param->name, other->name) == 0 ||
+            (other_has_len && strcmp(param->name, other_len) == 0) ||
+            (has_len && strcmp(len_name, other->name) == 0)) {
+            fail(lex, "parameter '%s' clashes with another in %s", param->name, method->name);
+        }
+    }
+}
+
+static void parse_method(idl_lexer *lex, idl_file *idl) {
+    if (idl->num_methods == MAX_METHODS) {
+        fail(lex, "more than %d methods", MAX_METHODS);
+    }
+    idl_method *method = &idl->methods[idl->num_methods];
+    memset(method, 0, sizeof(*method));
+    method->line = lex->line;
+    method->result = take_type(lex);
+    take_ident(lex, method->name, "a method name");
+
+    if (strlen(idl->service) + 1 + strlen(method->name) >= MAX_FUNCTION_NAME) {
+        fail(lex, "%s.%s is longer than %d characters", idl->service, method->name, MAX_FUNCTION_NAME - 1);
+    }
+    for (int i = 0; i < idl->num_methods; i++) {
+        if (strcmp(idl->methods[i].name, method->name) == 0) {
+            fail(lex, "method '%s' is declared twice", method->name);
+        }
+    }
+
+    expect(lex, "(");
+    while (strcmp(lex->token, ")") != 0) {
+        if (method->num_params > 0) {
+            expect(lex, ",");
+        }
+        if (method->num_params == MAX_ARGS) {
+            fail(lex, "%s takes more than %d arguments", method->name, MAX_ARGS);
+        }
+        idl_param *param = &method->params[method->num_params];
+        param->type = take_type(lex);
+        if (param->type == IDL_VOID) {
+            fail(lex, "void is only valid as a result");
+        }
+        take_ident(lex, param->name, "a parameter name");
+        check_param_name(lex, method, param);
+        method->num_params++;
+    }
+    expect(lex, ")");
+    expect(lex, ";");
+    idl->num_methods++;
+}
+
+static void parse_idl(const char *path, const char *src, idl_file *idl) {
+    idl_lexer lex = { path, src, 0, 1, "" };
+
+    next_token(&lex);
+    expect(&lex, "service");
+    take_ident(&lex, idl->service, "a service name");
+    expect(&lex, ";");
+    for (size_t i = 0; i <= strlen(idl->service); i++) {
+        idl->upper[i] = (char)toupper((unsigned char)idl->service[i]);
+    }
+
+    while (lex.token[0] != '\0') {
+        parse_method(&lex, idl);
+    }
+    if (idl->num_methods == 0) {
+        fail(&lex, "service %s declares no methods", idl->service);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Prototypes
+// ---------------------------------------------------------------------------
+
+static void upper_name(char *out, const char *name) {
+    while (*name) {
+        *out++ = (char)toupper((unsigned char)*name++);
+    }
+    *out = '\0';
+}
+
+// Arguments as C parameters: strings are NUL-terminated, bytes come with a length
+static void emit_params(FILE *out, const idl_method *method, int with_ctx) {
+    int first = 1;
+
+    if (with_ctx) {
+        fprintf(out, "rpc_context *ctx");
+        first = 0;
+    }
+    for (int i = 0; i < method->num_params; i++) {
+        const idl_param *param = &method->params[i];
+        fprintf(out, first ? "" : ", ");
+        first = 0;
+        switch (param->type) {
+        case IDL_INT:
+            fprintf(out, "int32_t %s", param->name);
+            break;
+        case IDL_FLOAT:
+            fprintf(out, "float %s", param->name);
+            break;
+        case IDL_STRING:
+            fprintf(out, "const char *%s", param->name);
+            break;
+        default:
+            fprintf(out, "const void *%s, size_t %s_len", param->name, param->name);
+            break;
+        }
+    }
+
+    // Client results are malloc'd, implementation results only have to outlive the call
+    const char *constness = with_ctx ? "const " : "";
+    switch (method->result) {
+    case IDL_INT:
+        fprintf(out, "%sint32_t *result", first ? "" : ", ");
+        break;
+    case IDL_FLOAT:
+        fprintf(out, "%sfloat *result", first ? "" : ", ");
+        break;
+    case IDL_STRING:
+        fprintf(out, "%s%schar **result", first ? "" : ", ", constness);
+        break;
+    case IDL_BYTES:
+        fprintf(out, "%s%svoid **result, size_t *result_len", first ? "" : ", ", constness);
+        break;
+    default:
+        if (first) {
+            fprintf(out, "void");
+        }
+        break;
+    }
+}
+
+static void emit_header(FILE *out, const char *idl_path, const idl_file *idl) {
+    char upper[MAX_IDENT];
+
+    fprintf(out, "/* Generated by rpcgen from %s; do not edit */\n\n", idl_path);
+    fprintf(out, "#ifndef %s_RPC_H\n#define %s_RPC_H\n\n", idl->upper, idl->upper);
+    fprintf(out, "#include <stddef.h>\n#include <stdint.h>\n#include \"rpc_context.h\"\n\n");
+
+    fprintf(out, "/* Function IDs, in declaration order; %s_server_register() claims them */\n", idl->service);
+    for (int i = 0; i < idl->num_methods; i++) {
+        upper_name(upper, idl->methods[i].name);
+        fprintf(out, "#define %s_%s_ID %d\n", idl->upper, upper, i);
+    }
+    fprintf(out, "#define %s_NUM_METHODS %d\n\n", idl->upper, idl->num_methods);
+
+    fprintf(out, "/* Client stubs: 0 on success, -1 on failure (see rpc_last_error).\n");
+    fprintf(out, " * String and bytes results are malloc'd for the caller to free */\n");
+    for (int i = 0; i < idl->num_methods; i++) {
+        fprintf(out, "int %s_%s(", idl->service, idl->methods[i].name);
+        emit_params(out, &idl->methods[i], 0);
+        fprintf(out, ");\n");
+    }
+    fprintf(out, "/* 0 if the connected server registered this interface under the same IDs */\n");
+    fprintf(out, "int %s_client_check(void);\n\n", idl->service);
+
+    fprintf(out, "/* Server side: the program implements these, returning 0 on success. String\n");
+    fprintf(out, " * and bytes results may point into rpc_alloc(ctx) memory */\n");
+    for (int i = 0; i < idl->num_methods; i++) {
+        fprintf(out, "int %s_%s_impl(", idl->service, idl->methods[i].name);
+        emit_params(out, &idl->methods[i], 1);
+        fprintf(out, ");\n");
+    }
+    fprintf(out, "/* Register every method under its ID, before any other function is registered */\n");
+    fprintf(out, "int %s_server_register(void);\n\n", idl->service);
+    fprintf(out, "#endif\n");
+}
+
+// ---------------------------------------------------------------------------
+// Client stubs
+// ---------------------------------------------------------------------------
+
+static int has_variable_args(const idl_method *method) {
+    for (int i = 0; i < method->num_params; i++) {
+        if (method->params[i].type == IDL_STRING || method->params[i].type == IDL_BYTES) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function ID, argument count and the fixed part of every argument
+static size_t fixed_request_size(const idl_method *method) {
+    size_t size = sizeof(uint32_t) + 1;
+    for (int i = 0; i < method->num_params; i++) {
+        size += type_min_size[method->params[i].type];
+    }
+    return size;
+}
+
+static void emit_stub_encode(FILE *out, const idl_method *method) {
+    for (int i = 0; i < method->num_params; i++) {
+        const idl_param *param = &method->params[i];
+        fprintf(out, "    *rpc_p++ = %s;\n", type_tags[param->type]);
+        switch (param->type) {
+        case IDL_INT:
+            fprintf(out, "    rpc_p += serialize_int(rpc_p, %s);\n", param->name);
+            break;
+        case IDL_FLOAT:
+            fprintf(out, "    rpc_p += serialize_float(rpc_p, %s);\n", param->name);
+            break;
+        case IDL_STRING:
+            fprintf(out, "    rpc_p += serialize_int(rpc_p, (int)%s_len);\n", param->name);
+            fprintf(out, "    memcpy(rpc_p, %s, %s_len);\n", param->name, param->name);
+            fprintf(out, "    rpc_p += %s_len;\n", param->name);
+            fprintf(out, "    *rpc_p++ = '\\0';\n");
+            break;
+        default:
+            fprintf(out, "    rpc_p += serialize_int(rpc_p, (int)%s_len);\n", param->name);
+            fprintf(out, "    if (%s_len > 0) {\n", param->name);
+            fprintf(out, "        memcpy(rpc_p, %s, %s_len);\n", param->name, param->name);
+            fprintf(out, "    }\n");
+            fprintf(out, "    rpc_p += %s_len;\n", param->name);
+            break;
+        }
+    }
+}
+
+// Check the reply holds exactly one value of the result type and hand it over
+static void emit_stub_decode(FILE *out, const idl_method *method) {
+    switch (method->result) {
+    case IDL_VOID:
+        fprintf(out, "    if (rpc_reply_len != 1 || (uint8_t)rpc_reply[0] != TYPE_VOID) {\n");
+        fprintf(out, "        free(rpc_reply);\n");
+        fprintf(out, "        rpc_set_last_error(ERR_SERIALIZATION);\n");
+        fprintf(out, "        return -1;\n");
+        fprintf(out, "    }\n");
+        fprintf(out, "    free(rpc_reply);\n");
+        break;
+    case IDL_INT:
+    case IDL_FLOAT:
+        fprintf(out, "    if (rpc_reply_len != 5 || (uint8_t)rpc_reply[0] != %s) {\n", type_tags[method->result]);
+        fprintf(out, "        free(rpc_reply);\n");
+        fprintf(out, "        rpc_set_last_error(ERR_SERIALIZATION);\n");
+        fprintf(out, "        return -1;\n");
+        fprintf(out, "    }\n");
+        if (method->result == IDL_INT) {
+            fprintf(out, "    int rpc_result;\n");
+            fprintf(out, "    deserialize_int((const uint8_t*)rpc_reply + 1, &rpc_result);\n");
+        } else {
+            fprintf(out, "    float rpc_result;\n");
+            fprintf(out, "    deserialize_float((const uint8_t*)rpc_reply + 1, &rpc_result);\n");
+        }
+        fprintf(out, "    *result = rpc_result;\n");
+        fprintf(out, "    free(rpc_reply);\n");
+        break;
+    default: {
+        // The data is moved to the start of the reply buffer, which has a spare byte for the NUL
+        size_t overhead = type_min_size[method->result];
+        fprintf(out, "    int rpc_len = -1;\n");
+        fprintf(out, "    if (rpc_reply_len >= 5 && (uint8_t)rpc_reply[0] == %s) {\n", type_tags[method->result]);
+        fprintf(out, "        deserialize_int((const uint8_t*)rpc_reply + 1, &rpc_len);\n");
+        fprintf(out, "    }\n");
+        fprintf(out, "    if (rpc_len < 0 || (size_t)rpc_len + %zu != rpc_reply_len) {\n", overhead);
+        fprintf(out, "        free(rpc_reply);\n");
+        fprintf(out, "        rpc_set_last_error(ERR_SERIALIZATION);\n");
+        fprintf(out, "        return -1;\n");
+        fprintf(out, "    }\n");
+        fprintf(out, "    memmove(rpc_reply, rpc_reply + 5, rpc_len);\n");
+        fprintf(out, "    rpc_reply[rpc_len] = '\\0';\n");
+        fprintf(out, "    *result = rpc_reply;\n");
+        if (method->result == IDL_BYTES) {
+            fprintf(out, "    *result_len = (size_t)rpc_len;\n");
+        }
+        break;
+    }
+    }
+    fprintf(out, "    return 0;\n");
+}
+
+static void emit_stub(FILE *out, const idl_file *idl, const idl_method *method) {
+    char upper[MAX_IDENT];
+    int variable = has_variable_args(method);
+    size_t fixed = fixed_request_size(method);
+
+    upper_name(upper, method->name);
+    fprintf(out, "int %s_%s(", idl->service, method->name);
+    emit_params(out, method, 0);
+    fprintf(out, ") {\n");
+
+    // Refuse NULL pointers before anything goes out
+    int checks = 0;
+    for (int i = 0; i < method->num_params; i++) {
+        const idl_param *param = &method->params[i];
+        if (param->type == IDL_STRING) {
+            fprintf(out, checks++ ? " ||\n        %s == NULL" : "    if (%s == NULL", param->name);
+        } else if (param->type == IDL_BYTES) {
+            fprintf(out, checks++ ? " ||\n        (%s == NULL && %s_len > 0)" : "    if ((%s == NULL && %s_len > 0)",
+                    param->name, param->name);
+        }
+    }
+    if (method->result != IDL_VOID) {
+        fprintf(out, checks++ ? " || result == NULL" : "    if (result == NULL");
+    }
+    if (method->result == IDL_BYTES) {
+        fprintf(out, " || result_len == NULL");
+    }
+    if (checks) {
+        fprintf(out, ") {\n");
+        fprintf(out, "        rpc_set_last_error(ERR_INVALID_ARGS);\n");
+        fprintf(out, "        return -1;\n");
+        fprintf(out, "    }\n");
+    }
+
+    if (variable) {
+        for (int i = 0; i < method->num_params; i++) {
+            if (method->params[i].type == IDL_STRING) {
+                fprintf(out, "    size_t %s_len = strlen(%s);\n", method->params[i].name, method->params[i].name);
+            }
+        }
+        fprintf(out, "    size_t rpc_size = %zu", fixed);
+        for (int i = 0; i < method->num_params; i++) {
+            if (method->params[i].type == IDL_STRING || method->params[i].type == IDL_BYTES) {
+                fprintf(out, " + %s_len", method->params[i].name);
+            }
+        }
+        fprintf(out, ";\n");
+        fprintf(out, "    if (rpc_size > MAX_PAYLOAD_SIZE) {\n");
+        fprintf(out, "        rpc_set_last_error(ERR_INVALID_ARGS);\n");
+        fprintf(out, "        return -1;\n");
+        fprintf(out, "    }\n");
+        fprintf(out, "    char rpc_stack_frame[MESSAGE_HEADER_SIZE + %d];\n", STUB_STACK_FRAME);
+        fprintf(out, "    char *rpc_frame = rpc_size <= %d ? rpc_stack_frame : malloc(MESSAGE_HEADER_SIZE + rpc_size);\n",
+                STUB_STACK_FRAME);
+        fprintf(out, "    if (rpc_frame == NULL) {\n");
+        fprintf(out, "        rpc_set_last_error(ERR_SERIALIZATION);\n");
+        fprintf(out, "        return -1;\n");
+        fprintf(out, "    }\n");
+    } else {
+        fprintf(out, "    size_t rpc_size = %zu;\n", fixed);
+        fprintf(out, "    char rpc_frame[MESSAGE_HEADER_SIZE + %zu];\n", fixed);
+    }
+
+    fprintf(out, "    uint8_t *rpc_p = (uint8_t*)rpc_frame + MESSAGE_HEADER_SIZE;\n");
+    fprintf(out, "    rpc_p += serialize_int(rpc_p, %s_%s_ID);\n", idl->upper, upper);
+    fprintf(out, "    *rpc_p++ = %d;\n", method->num_params);
+    emit_stub_encode(out, method);
+    fprintf(out, "\n");
+
+    fprintf(out, "    char *rpc_reply;\n");
+    fprintf(out, "    size_t rpc_reply_len;\n");
+    fprintf(out, "    int rpc_rc = rpc_call_frame(MSG_TYPED_REQUEST, rpc_frame, rpc_size, &rpc_reply, &rpc_reply_len);\n");
+    if (variable) {
+        fprintf(out, "    if (rpc_frame != rpc_stack_frame) {\n");
+        fprintf(out, "        free(rpc_frame);\n");
+        fprintf(out, "    }\n");
+    }
+    fprintf(out, "    if (rpc_rc != 0) {\n");
+    fprintf(out, "        return -1;\n");
+    fprintf(out, "    }\n");
+    emit_stub_decode(out, method);
+    fprintf(out, "}\n\n");
+}
+
+static void emit_client(FILE *out, const char *idl_path, const idl_file *idl) {
+    fprintf(out, "/* Generated by rpcgen from %s; do not edit */\n\n", idl_path);
+    fprintf(out, "#include <stdlib.h>\n#include <string.h>\n");
+    fprintf(out, "#include \"%s_rpc.h\"\n#include \"rpc_client.h\"\n\n", idl->service);
+
+    for (int i = 0; i < idl->num_methods; i++) {
+        emit_stub(out, idl, &idl->methods[i]);
+    }
+
+    fprintf(out, "int %s_client_check(void) {\n", idl->service);
+    fprintf(out, "    static const char *const names[%s_NUM_METHODS] = {\n", idl->upper);
+    for (int i = 0; i < idl->num_methods; i++) {
+        fprintf(out, "        \"%s.%s\",\n", idl->service, idl->methods[i].name);
+    }
+    fprintf(out, "    };\n");
+    fprintf(out, "    for (long id = 0; id < %s_NUM_METHODS; id++) {\n", idl->upper);
+    fprintf(out, "        if (rpc_function_id(names[id]) != id) {\n");
+    fprintf(out, "            return -1;\n");
+    fprintf(out, "        }\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n");
+}
+
+// ---------------------------------------------------------------------------
+// Server skeletons
+// ---------------------------------------------------------------------------
+
+static void emit_skeleton_decode(FILE *out, const idl_method *method) {
+    // Bytes the fixed parts of the arguments after each one still need
+    size_t rest[MAX_ARGS];
+    size_t after = 0;
+    for (int i = method->num_params - 1; i >= 0; i--) {
+        rest[i] = after;
+        after += type_min_size[method->params[i].type];
+    }
+
+    fprintf(out, "    if (rpc_args_len < %zu || *rpc_p++ != %d) {\n", after + 1, method->num_params);
+    fprintf(out, "        return -1;\n");
+    fprintf(out, "    }\n");
+
+    for (int i = 0; i < method->num_params; i++) {
+        const idl_param *param = &method->params[i];
+        fprintf(out, "    if (*rpc_p++ != %s) {\n", type_tags[param->type]);
+        fprintf(out, "        return -1;\n");
+        fprintf(out, "    }\n");
+        switch (param->type) {
+        case IDL_INT:
+            fprintf(out, "    rpc_p += deserialize_int(rpc_p, &rpc_n);\n");
+            fprintf(out, "    int32_t %s = rpc_n;\n", param->name);
+            break;
+        case IDL_FLOAT:
+            fprintf(out, "    float %s;\n", param->name);
+            fprintf(out, "    rpc_p += deserialize_float(rpc_p, &%s);\n", param->name);
+            break;
+        case IDL_STRING:
+            fprintf(out, "    rpc_p += deserialize_int(rpc_p, &rpc_n);\n");
+            fprintf(out, "    if (rpc_n < 0 || (size_t)(rpc_end - rpc_p) < (size_t)rpc_n + %zu || rpc_p[rpc_n] != '\\0') {\n", 1 + rest[i]);
+            fprintf(out, "        return -1;\n");
+            fprintf(out, "    }\n");
+            fprintf(out, "    const char *%s = (const char*)rpc_p;\n", param->name);
+            fprintf(out, "    rpc_p += rpc_n + 1;\n");
+            break;
+        default:
+            fprintf(out, "    rpc_p += deserialize_int(rpc_p, &rpc_n);\n");
+            if (rest[i] > 0) {
+                fprintf(out, "    if (rpc_n < 0 || (size_t)(rpc_end - rpc_p) < (size_t)rpc_n + %zu) {\n", rest[i]);
+            } else {
+                fprintf(out, "    if (rpc_n < 0 || (size_t)(rpc_end - rpc_p) < (size_t)rpc_n) {\n");
+            }
+            fprintf(out, "        return -1;\n");
+            fprintf(out, "    }\n");
+            fprintf(out, "    const void *%s = rpc_p;\n", param->name);
+            fprintf(out, "    size_t %s_len = (size_t)rpc_n;\n", param->name);
+            fprintf(out, "    rpc_p += rpc_n;\n");
+            break;
+        }
+    }
+    fprintf(out, "    if (rpc_p != rpc_end) {\n");
+    fprintf(out, "        return -1;\n");
+    fprintf(out, "    }\n\n");
+}
+
+static void emit_skeleton_call(FILE *out, const idl_file *idl, const idl_method *method) {
+    switch (method->result) {
+    case IDL_INT:
+        fprintf(out, "    int32_t result;\n");
+        break;
+    case IDL_FLOAT:
+        fprintf(out, "    float result;\n");
+        break;
+    case IDL_STRING:
+        fprintf(out, "    const char *result = NULL;\n");
+        break;
+    case IDL_BYTES:
+        fprintf(out, "    const void *result = NULL;\n");
+        fprintf(out, "    size_t result_len = 0;\n");
+        break;
+    default:
+        break;
+    }
+
+    fprintf(out, "    if (%s_%s_impl(ctx", idl->service, method->name);
+    for (int i = 0; i < method->num_params; i++) {
+        fprintf(out, ", %s", method->params[i].name);
+        if (method->params[i].type == IDL_BYTES) {
+            fprintf(out, ", %s_len", method->params[i].name);
+        }
+    }
+    switch (method->result) {
+    case IDL_VOID:
+        break;
+    case IDL_BYTES:
+        fprintf(out, ", &result, &result_len");
+        break;
+    default:
+        fprintf(out, ", &result");
+        break;
+    }
+    fprintf(out, ") != 0) {\n");
+    fprintf(out, "        return -1;\n");
+    fprintf(out, "    }\n\n");
+}
+
+static void emit_skeleton_encode(FILE *out, const idl_method *method) {
+    switch (method->result) {
+    case IDL_VOID:
+        fprintf(out, "    const char rpc_void = TYPE_VOID;\n");
+        fprintf(out, "    return rpc_output_append(rpc_out, &rpc_void, 1);\n");
+        return;
+    case IDL_INT:
+    case IDL_FLOAT:
+        fprintf(out, "    if (rpc_output_reserve(rpc_out, 5) != 0) {\n");
+        fprintf(out, "        return -1;\n");
+        fprintf(out, "    }\n");
+        fprintf(out, "    uint8_t *rpc_o = (uint8_t*)rpc_out->data + rpc_out->len;\n");
+        fprintf(out, "    *rpc_o++ = %s;\n", type_tags[method->result]);
+        fprintf(out, "    %s(rpc_o, result);\n", method->result == IDL_INT ? "serialize_int" : "serialize_float");
+        fprintf(out, "    rpc_out->len += 5;\n");
+        fprintf(out, "    return 0;\n");
+        return;
+    default:
+        break;
+    }
+
+    if (method->result == IDL_STRING) {
+        fprintf(out, "    if (result == NULL) {\n");
+        fprintf(out, "        return -1;\n");
+        fprintf(out, "    }\n");
+        fprintf(out, "    size_t result_len = strlen(result);\n");
+    } else {
+        fprintf(out, "    if (result == NULL && result_len > 0) {\n");
+        fprintf(out, "        return -1;\n");
+        fprintf(out, "    }\n");
+    }
+    size_t overhead = type_min_size[method->result];
+    fprintf(out, "    if (result_len > MAX_BATCH_PAYLOAD_SIZE || rpc_output_reserve(rpc_out, result_len + %zu) != 0) {\n",
+            overhead);
+    fprintf(out, "        return -1;\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    uint8_t *rpc_o = (uint8_t*)rpc_out->data + rpc_out->len;\n");
+    fprintf(out, "    *rpc_o++ = %s;\n", type_tags[method->result]);
+    fprintf(out, "    rpc_o += serialize_int(rpc_o, (int)result_len);\n");
+    fprintf(out, "    if (result_len > 0) {\n");
+    fprintf(out, "        memcpy(rpc_o, result, result_len);\n");
+    fprintf(out, "    }\n");
+    if (method->result == IDL_STRING) {
+        fprintf(out, "    rpc_o[result_len] = '\\0';\n");
+    }
+    fprintf(out, "    rpc_out->len += result_len + %zu;\n", overhead);
+    fprintf(out, "    return 0;\n");
+}
+
+static void emit_skeleton(FILE *out, const idl_file *idl, const idl_method *method) {
+    int needs_n = 0;
+    for (int i = 0; i < method->num_params; i++) {
+        needs_n |= method->params[i].type != IDL_FLOAT;
+    }
+
+    fprintf(out, "static int %s_%s_skeleton(rpc_context *ctx, const char *rpc_args, size_t rpc_args_len, rpc_output *rpc_out) {\n",
+            idl->service, method->name);
+    fprintf(out, "    const uint8_t *rpc_p = (const uint8_t*)rpc_args;\n");
+    if (has_variable_args(method)) {
+        fprintf(out, "    const uint8_t *rpc_end = rpc_p + rpc_args_len;\n");
+    }
+    if (needs_n) {
+        fprintf(out, "    int rpc_n;\n");
+    }
+    fprintf(out, "\n");
+
+    // Without variable-length arguments the size check up front covers every read
+    if (!has_variable_args(method)) {
+        fprintf(out, "    if (rpc_args_len != %zu || *rpc_p++ != %d) {\n", fixed_request_size(method) - sizeof(uint32_t),
+                method->num_params);
+        fprintf(out, "        return -1;\n");
+        fprintf(out, "    }\n");
+        for (int i = 0; i < method->num_params; i++) {
+            const idl_param *param = &method->params[i];
+            fprintf(out, "    if (*rpc_p++ != %s) {\n", type_tags[param->type]);
+            fprintf(out, "        return -1;\n");
+            fprintf(out, "    }\n");
+            if (param->type == IDL_INT) {
+                fprintf(out, "    rpc_p += deserialize_int(rpc_p, &rpc_n);\n");
+                fprintf(out, "    int32_t %s = rpc_n;\n", param->name);
+            } else {
+                fprintf(out, "    float %s;\n", param->name);
+                fprintf(out, "    rpc_p += deserialize_float(rpc_p, &%s);\n", param->name);
+            }
+        }
+        fprintf(out, "\n");
+    } else {
+        emit_skeleton_decode(out, method);
+    }
+
+    emit_skeleton_call(out, idl, method);
+    emit_skeleton_encode(out, method);
+    fprintf(out, "}\n\n");
+}
+
+static void emit_server(FILE *out, const char *idl_path, const idl_file *idl) {
+    fprintf(out, "/* Generated by rpcgen from %s; do not edit */\n\n", idl_path);
+    fprintf(out, "#include <stdint.h>\n#include <string.h>\n");
+    fprintf(out, "#include \"%s_rpc.h\"\n#include \"protocol.h\"\n#include \"rpc_server.h\"\n\n", idl->service);
+
+    for (int i = 0; i < idl->num_methods; i++) {
+        emit_skeleton(out, idl, &idl->methods[i]);
+    }
+
+    // Table position is the function ID
+    fprintf(out, "static const struct {\n");
+    fprintf(out, "    const char *name;\n");
+    fprintf(out, "    rpc_raw_func skeleton;\n");
+    fprintf(out, "} %s_methods[%s_NUM_METHODS] = {\n", idl->service, idl->upper);
+    for (int i = 0; i < idl->num_methods; i++) {
+        fprintf(out, "    { \"%s.%s\", %s_%s_skeleton },\n", idl->service, idl->methods[i].name,
+                idl->service, idl->methods[i].name);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "int %s_server_register(void) {\n", idl->service);
+    fprintf(out, "    for (uint32_t id = 0; id < %s_NUM_METHODS; id++) {\n", idl->upper);
+    fprintf(out, "        if (rpc_server_register_function_raw(%s_methods[id].name, %s_methods[id].skeleton, id) != 0) {\n",
+            idl->service, idl->service);
+    fprintf(out, "            return -1;\n");
+    fprintf(out, "        }\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n");
+}
+
+// ---------------------------------------------------------------------------
+// Driver
+// ---------------------------------------------------------------------------
+
+static char *read_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    size_t len = 0;
+    size_t capacity = 4096;
+    char *data = malloc(capacity);
+    while (data != NULL) {
+        len += fread(data + len, 1, capacity - len - 1, file);
+        if (len < capacity - 1) {
+            break;
+        }
+        capacity *= 2;
+        char *grown = realloc(data, capacity);
+        if (grown == NULL) {
+            free(data);
+        }
+        data = grown;
+    }
+    fclose(file);
+
+    if (data == NULL) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        return NULL;
+    }
+    data[len] = '\0';
+    return data;
+}
+
+typedef void (*emit_func)(FILE *out, const char *idl_path, const idl_file *idl);
+
+static int write_output(const char *dir, const char *service, const char *suffix,
+                        emit_func emit, const char *idl_path, const idl_file *idl) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s%s", dir, service, suffix);
+
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        return -1;
+    }
+    emit(out, idl_path, idl);
+    if (fclose(out) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <file.idl> <output directory>\n", argv[0]);
+        return 1;
+    }
+
+    char *src = read_file(argv[1]);
+    if (src == NULL) {
+        return 1;
+    }
+
+    static idl_file idl;
+    parse_idl(argv[1], src, &idl);
+    free(src);
+
+    if (write_output(argv[2], idl.service, "_rpc.h", emit_header, argv[1], &idl) != 0 ||
+        write_output(argv[2], idl.service, "_client.c", emit_client, argv[1], &idl) != 0 ||
+        write_output(argv[2], idl.service, "_server.c", emit_server, argv[1], &idl) != 0) {
+        return 1;
+    }
+    printf("rpcgen: %s -> %s/%s_{rpc.h,client.c,server.c} (%d methods)\n",
+           argv[1], argv[2], idl.service, idl.num_methods);
+    return 0;
+}
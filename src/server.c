@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,76 +8,184 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sched.h>
 #include "server.h"
 #include "message_handler.h"
+#include "transport.h"
 
-#define MAX_PENDING_CONNECTIONS 10
+#define MAX_PENDING_CONNECTIONS SOMAXCONN
 #define BUFFER_SIZE 4096
 
-static int server_socket = -1;
-static int is_running = 0;
-pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define EPOLL_MAX_EVENTS 256
+#define IO_READ_CHUNK    65536
+#define MAX_SEND_IOV     8
+#define MAX_LISTENERS    8
+
+#define URING_ENTRIES      1024
+#define URING_BUFFERS      256      /* provided receive buffers per loop, a power of two */
+#define URING_BUFFER_SIZE  16384
+#define URING_BUFFER_STRIDE (URING_BUFFER_SIZE + 64)   /* room for the handler's spare byte */
+#define URING_BUFFER_GROUP 0
+
+/* Every address the server accepts connections on: the TCP port from
+ * server_init plus whatever server_listen added */
+typedef struct {
+    int fd;
+    transport_addr addr;
+} server_listener;
+
+static server_listener listeners[MAX_LISTENERS];
+static int num_listeners = 0;
+static atomic_int is_running = 0;
+static int wake_fd = -1;    /* server_stop writes it; every accept and event loop watches it */
+static client_handler_func channel_handler = NULL;
+static int sharded = 0;
 
 typedef struct {
     int client_socket;
-    struct sockaddr_in client_addr;
+    char peer[TRANSPORT_ADDR_MAX];
     client_handler_func handler;
 } client_thread_args;
 
+// Accept one connection from listener; the peer is described into peer
+static int accept_from(const server_listener *listener, int flags, char *peer, size_t peer_len) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    
+    int client_sock = accept4(listener->fd, (struct sockaddr*)&client_addr, &client_len, flags);
+    if (client_sock < 0) {
+        return -1;
+    }
+    
+    transport_tune(client_sock, listener->addr.kind);
+    
+    if (listener->addr.kind != TRANSPORT_TCP) {
+        transport_describe(&listener->addr, peer, peer_len);
+    } else {
+        struct sockaddr_in *in = (struct sockaddr_in*)&client_addr;
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &in->sin_addr, client_ip, INET_ADDRSTRLEN);
+        snprintf(peer, peer_len, "%s:%d", client_ip, ntohs(in->sin_port));
+    }
+    return client_sock;
+}
+
 void* client_thread(void* arg) {
     client_thread_args* args = (client_thread_args*)arg;
     int client_sock = args->client_socket;
     client_handler_func handler = args->handler;
     
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(args->client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
-    printf("[Server] Client connected from %s:%d\n", client_ip, ntohs(args->client_addr.sin_port));
-    
-    free(args);
+    printf("[Server] Client connected from %s\n", args->peer);
     
     if (handler != NULL) {
         handler(client_sock);
     }
     
     close(client_sock);
-    printf("[Server] Client %s disconnected\n", client_ip);
+    printf("[Server] Client %s disconnected\n", args->peer);
     
+    free(args);
     return NULL;
 }
 
-int server_init(int port) {
-    struct sockaddr_in server_addr;
+// Serve a connection on a thread of its own
+static int start_client_thread(int client_sock, const char *peer, client_handler_func handler) {
+    client_thread_args* args = malloc(sizeof(client_thread_args));
+    if (args == NULL) {
+        printf("Error allocating memory for client thread\n");
+        close(client_sock);
+        return -1;
+    }
     
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("Error creating socket");
+    args->client_socket = client_sock;
+    snprintf(args->peer, sizeof(args->peer), "%s", peer);
+    args->handler = handler;
+    
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, client_thread, args) != 0) {
+        perror("Error creating thread");
+        free(args);
+        close(client_sock);
         return -1;
     }
     
-    int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("Error setting socket options");
-        close(server_socket);
+    pthread_detach(thread_id);
+    return 0;
+}
+
+// Connections on shm: listeners go to handler on a thread of their own, in either
+// server mode: a thread polling a ring has nothing to give to epoll
+
+void server_set_channel_handler(client_handler_func handler) {
+    channel_handler = handler;
+}
+
+// Thread-per-core layout for the event loop modes. Must precede server_init, since
+// TCP listeners need SO_REUSEPORT from the start for the per-thread copies to bind
+
+void server_set_sharded(int enabled) {
+    sharded = enabled;
+}
+
+// Start accepting on address ("unix:/path" or "[host]:port") as well, before the server runs
+
+int server_listen(const char *address) {
+    if (num_listeners == MAX_LISTENERS) {
+        printf("Error: Too many listening addresses\n");
         return -1;
     }
     
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+    server_listener *listener = &listeners[num_listeners];
+    if (transport_parse(address, 0, &listener->addr) != 0) {
+        return -1;
+    }
     
-    if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Error binding socket");
-        close(server_socket);
+    listener->fd = transport_listen(&listener->addr, MAX_PENDING_CONNECTIONS,
+                                    sharded ? TRANSPORT_LISTEN_REUSEPORT : 0);
+    if (listener->fd < 0) {
         return -1;
     }
+    num_listeners++;
+    
+    char name[TRANSPORT_ADDR_MAX];
+    printf("[Server] Listening on %s\n", transport_describe(&listener->addr, name, sizeof(name)));
+    return 0;
+}
+
+int server_init(int port) {
+    char address[32];
+    snprintf(address, sizeof(address), ":%d", port);
     
-    if (listen(server_socket, MAX_PENDING_CONNECTIONS) < 0) {
-        perror("Error listening on socket");
-        close(server_socket);
+    num_listeners = 0;
+    if (server_listen(address) != 0) {
         return -1;
     }
     
+    // Made before any loop runs, so a stop requested at any point from here on
+    // finds the loops' wait already armed. It stays open for the next server_init,
+    // which only clears what the last shutdown left in it
+    if (wake_fd < 0) {
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd < 0) {
+            perror("Error creating wakeup eventfd");
+            return -1;
+        }
+    } else {
+        uint64_t count;
+        ssize_t ignored = read(wake_fd, &count, sizeof(count));
+        (void)ignored;
+    }
+    
     is_running = 1;
     printf("[Server] Initialized on port %d\n", port);
     
@@ -84,47 +193,48 @@ int server_init(int port) {
 }
 
 int server_accept_clients(client_handler_func handler) {
-    if (server_socket < 0 || !is_running) {
+    if (num_listeners == 0 || !is_running) {
         printf("Error: Server not initialized\n");
         return -1;
     }
     
+    // Wait on every listener at once; server_shutdown wakes the poll through wake_fd
+    struct pollfd fds[MAX_LISTENERS + 1];
+    for (int i = 0; i < num_listeners; i++) {
+        fds[i].fd = listeners[i].fd;
+        fds[i].events = POLLIN;
+    }
+    fds[num_listeners].fd = wake_fd;
+    fds[num_listeners].events = POLLIN;
+    
     printf("[Server] Waiting for client connections...\n");
     
     while (is_running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        
-        int client_sock = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
-        
-        if (client_sock < 0) {
-            if (errno == EINTR || !is_running) {
-                break;
+        if (poll(fds, num_listeners + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            perror("Error accepting client");
-            continue;
-        }
-        
-        client_thread_args* args = malloc(sizeof(client_thread_args));
-        if (args == NULL) {
-            printf("Error allocating memory for client thread\n");
-            close(client_sock);
-            continue;
+            perror("Error waiting for clients");
+            break;
         }
         
-        args->client_socket = client_sock;
-        args->client_addr = client_addr;
-        args->handler = handler;
-        
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, client_thread, args) != 0) {
-            perror("Error creating thread");
-            free(args);
-            close(client_sock);
-            continue;
+        for (int i = 0; i < num_listeners && is_running; i++) {
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+            
+            char peer[TRANSPORT_ADDR_MAX];
+            int client_sock = accept_from(&listeners[i], 0, peer, sizeof(peer));
+            if (client_sock < 0) {
+                if (errno != EINTR && is_running) {
+                    perror("Error accepting client");
+                }
+                continue;
+            }
+            
+            start_client_thread(client_sock, peer,
+                                listeners[i].addr.kind == TRANSPORT_SHM ? channel_handler : handler);
         }
-        
-        pthread_detach(thread_id);
     }
     
     return 0;
@@ -162,15 +272,1486 @@ int server_receive(int client_socket, char* buffer, size_t buffer_size) {
     return received;
 }
 
-void server_shutdown() {
-    pthread_mutex_lock(&server_mutex);
+// An atomic store and a write(), nothing else: this runs in signal handlers and
+// on loop threads while the other loops still use the listeners
+void server_stop() {
     is_running = 0;
-    pthread_mutex_unlock(&server_mutex);
     
-    if (server_socket >= 0) {
-        close(server_socket);
-        server_socket = -1;
+    // Kick every accept and event loop thread out of its wait
+    if (wake_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+// Once the loops have returned, so no thread still waits on a listener
+void server_shutdown() {
+    server_stop();
+    
+    for (int i = 0; i < num_listeners; i++) {
+        transport_close_listener(listeners[i].fd, &listeners[i].addr);
+        listeners[i].fd = -1;
     }
+    num_listeners = 0;
     
     printf("[Server] Shutdown complete\n");
-}
\ No newline at end of file
+}
+
+/* ---------------- Event loop (SERVER_MODE_EPOLL) ---------------- */
+
+struct server_conn {
+    int fd;
+    int epfd;
+    atomic_int closing;
+    atomic_int refs;    /* event loop + in-flight worker jobs; fd is closed on the last release */
+
+    /* Partial frame carried over between reads, kept for reuse once allocated
+     * (rcap excludes the spare byte handlers may write). I/O thread only */
+    char *rbuf;
+    size_t rlen;
+    size_t rcap;
+
+    /* Bytes the socket would not take yet, guarded by lock since workers send too */
+    pthread_mutex_t lock;
+    char *wbuf;
+    size_t wlen;
+    size_t woff;
+    size_t wcap;
+    int want_write;
+    int corked;         /* I/O thread is dispatching a read: queue replies, flush them together */
+    
+    /* Frame handler state, torn down through on_close when the connection goes away */
+    void *user_data;
+    void (*on_close)(void *user_data);
+
+    /* Per-thread list of live connections, used for cleanup on shutdown */
+    struct server_conn *prev;
+    struct server_conn *next;
+    
+    /* io_uring loop only: the send in flight owns sbuf while new replies collect
+     * in wbuf. sending and the s* fields are guarded by lock */
+    struct uring_loop *uring;
+    char *sbuf;
+    size_t slen;
+    size_t soff;
+    size_t scap;
+    int sending;
+    int ops;            /* submissions in flight, each holding a reference. I/O thread only */
+    int closed;         /* taken off the loop. I/O thread only */
+    struct server_conn *flush_next;
+};
+
+/* Sharded mode (server_set_sharded): an I/O thread's own SO_REUSEPORT copy of
+ * each TCP listener, so the kernel spreads connections over the threads, and
+ * the CPU the thread is pinned to */
+typedef struct {
+    server_listener own[MAX_LISTENERS];
+    int num_own;
+    int cpu;            /* -1 when not pinned */
+} io_shard;
+
+typedef struct {
+    int epfd;
+    pthread_t thread;
+    frame_handler_func handler;
+    char *scratch;      /* IO_READ_CHUNK plus a spare byte for the handler */
+    server_conn *conns;
+    io_shard shard;
+} io_thread;
+
+/* epoll_event.data.ptr tag for the wakeup eventfd; listeners are tagged with
+ * their entry in listeners[] or in their thread's shard.own[] */
+static char wake_tag;
+
+// Resolve the I/O thread count (0 = one per CPU) and, when sharded, the CPUs to pin to
+
+static int io_thread_layout(int io_threads, int *cpus, int *num_cpus) {
+    *num_cpus = 0;
+    if (sharded) {
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int c = 0; c < CPU_SETSIZE; c++) {
+                if (CPU_ISSET(c, &set)) {
+                    cpus[(*num_cpus)++] = c;
+                }
+            }
+        }
+        if (io_threads <= 0 && *num_cpus > 0) {
+            return *num_cpus;
+        }
+    }
+    if (io_threads <= 0) {
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        io_threads = count > 0 ? (int)count : 1;
+    }
+    return io_threads;
+}
+
+// Whether I/O thread index takes connections from the shared listener. When sharded,
+// TCP connections come from each thread's own socket, thread 0's being the original
+
+static int watches_listener(int index, const server_listener *listener) {
+    return !sharded || index == 0 || listener->addr.kind != TRANSPORT_TCP;
+}
+
+static int shard_open(io_shard *shard, int index) {
+    shard->num_own = 0;
+    if (!sharded || index == 0) {
+        return 0;
+    }
+    
+    for (int l = 0; l < num_listeners; l++) {
+        if (listeners[l].addr.kind != TRANSPORT_TCP) {
+            continue;
+        }
+        server_listener *own = &shard->own[shard->num_own];
+        own->addr = listeners[l].addr;
+        own->fd = transport_listen(&own->addr, MAX_PENDING_CONNECTIONS, TRANSPORT_LISTEN_REUSEPORT);
+        if (own->fd < 0) {
+            return -1;
+        }
+        shard->num_own++;
+    }
+    return 0;
+}
+
+static void shard_close(io_shard *shard) {
+    for (int i = 0; i < shard->num_own; i++) {
+        transport_close_listener(shard->own[i].fd, &shard->own[i].addr);
+    }
+    shard->num_own = 0;
+}
+
+// Start an I/O thread, pinned from its first instruction so what it allocates is node-local
+
+static int start_io_thread(pthread_t *thread, void *(*loop)(void *), void *arg, int cpu) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    int rc = pthread_create(thread, &attr, loop, arg);
+    pthread_attr_destroy(&attr);
+    return rc;
+}
+
+// Pin the calling thread, which runs loop 0, saving its old affinity in saved. 0 if pinned
+
+static int pin_caller(int cpu, cpu_set_t *saved) {
+    if (cpu < 0 || sched_getaffinity(0, sizeof(*saved), saved) != 0) {
+        return -1;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int server_conn_fd(const server_conn *conn) {
+    return conn != NULL ? conn->fd : -1;
+}
+
+void server_conn_set_data(server_conn *conn, void *data, void (*on_close)(void *data)) {
+    conn->user_data = data;
+    conn->on_close = on_close;
+}
+
+void *server_conn_get_data(const server_conn *conn) {
+    return conn->user_data;
+}
+
+void server_conn_retain(server_conn *conn) {
+    atomic_fetch_add(&conn->refs, 1);
+}
+
+void server_conn_release(server_conn *conn) {
+    if (atomic_fetch_sub(&conn->refs, 1) != 1) {
+        return;
+    }
+    
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn->rbuf);
+    free(conn->wbuf);
+    free(conn->sbuf);
+    free(conn);
+}
+
+static void uring_request_flush(server_conn *conn);
+
+// Caller holds conn->lock
+static void conn_update_events(server_conn *conn, int want_write) {
+    if (conn->want_write == want_write) {
+        return;
+    }
+    if (conn->uring != NULL) {
+        // No readiness to watch: the loop submits a send for the queued bytes
+        if (want_write) {
+            uring_request_flush(conn);
+        }
+        return;
+    }
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    if (epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        perror("Error updating connection events");
+        conn->closing = 1;
+        return;
+    }
+    conn->want_write = want_write;
+}
+
+// Caller holds conn->lock
+static int conn_flush_locked(server_conn *conn) {
+    while (conn->woff < conn->wlen) {
+        ssize_t sent = send(conn->fd, conn->wbuf + conn->woff, conn->wlen - conn->woff, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_update_events(conn, 1);
+                return 0;
+            }
+            conn->closing = 1;
+            return -1;
+        }
+        conn->woff += sent;
+    }
+    
+    // Fully drained: keep a normal-sized buffer for the next burst, release big ones
+    if (conn->wcap > IO_READ_CHUNK) {
+        free(conn->wbuf);
+        conn->wbuf = NULL;
+        conn->wcap = 0;
+    }
+    conn->wlen = conn->woff = 0;
+    conn_update_events(conn, 0);
+    return 0;
+}
+
+static int conn_flush(server_conn *conn) {
+    pthread_mutex_lock(&conn->lock);
+    int rc = conn_flush_locked(conn);
+    pthread_mutex_unlock(&conn->lock);
+    return rc;
+}
+
+// Append iov (minus the first skip bytes, already sent) behind the queued bytes. Caller holds conn->lock
+static int conn_queue_locked(server_conn *conn, const struct iovec *iov, int iovcnt, size_t skip) {
+    size_t remaining = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        remaining += iov[i].iov_len;
+    }
+    remaining -= skip;
+    
+    if (conn->woff > 0) {
+        memmove(conn->wbuf, conn->wbuf + conn->woff, conn->wlen - conn->woff);
+        conn->wlen -= conn->woff;
+        conn->woff = 0;
+    }
+    
+    if (conn->wcap < conn->wlen + remaining) {
+        size_t new_cap = conn->wcap * 2;
+        if (new_cap < conn->wlen + remaining) {
+            new_cap = conn->wlen + remaining;
+        }
+        char *grown = realloc(conn->wbuf, new_cap);
+        if (grown == NULL) {
+            printf("Error allocating connection write buffer\n");
+            conn->closing = 1;
+            return -1;
+        }
+        conn->wbuf = grown;
+        conn->wcap = new_cap;
+    }
+    
+    for (int i = 0; i < iovcnt; i++) {
+        size_t len = iov[i].iov_len;
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+        memcpy(conn->wbuf + conn->wlen, (const char*)iov[i].iov_base + skip, len - skip);
+        conn->wlen += len - skip;
+        skip = 0;
+    }
+    return 0;
+}
+
+int server_conn_sendv(server_conn *conn, const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; iov != NULL && i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (conn == NULL || len == 0 || iovcnt > MAX_SEND_IOV) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&conn->lock);
+    
+    if (conn->closing) {
+        pthread_mutex_unlock(&conn->lock);
+        return -1;
+    }
+    
+    size_t total_sent = 0;
+    
+    // Only write directly when nothing is queued or in flight (bytes would reorder)
+    // and the I/O thread isn't collecting replies to flush in one go
+    if (conn->wlen == conn->woff && !conn->corked && !conn->want_write) {
+        struct iovec pending[MAX_SEND_IOV];
+        memcpy(pending, iov, iovcnt * sizeof(struct iovec));
+        
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = pending;
+        msg.msg_iovlen = iovcnt;
+        
+        while (total_sent < len) {
+            ssize_t sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                conn->closing = 1;
+                pthread_mutex_unlock(&conn->lock);
+                return -1;
+            }
+            total_sent += sent;
+            
+            while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+                sent -= msg.msg_iov->iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+            if (msg.msg_iovlen > 0) {
+                msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + sent;
+                msg.msg_iov->iov_len -= sent;
+            }
+        }
+        if (total_sent == len) {
+            pthread_mutex_unlock(&conn->lock);
+            return len;
+        }
+    }
+    
+    if (conn_queue_locked(conn, iov, iovcnt, total_sent) != 0) {
+        pthread_mutex_unlock(&conn->lock);
+        return -1;
+    }
+    
+    // A corked connection is flushed by the I/O thread when its dispatch ends
+    if (!conn->corked) {
+        conn_update_events(conn, 1);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return len;
+}
+
+int server_conn_send(server_conn *conn, const char *data, size_t len) {
+    struct iovec iov = { (void*)data, len };
+    if (data == NULL) {
+        return -1;
+    }
+    return server_conn_sendv(conn, &iov, 1);
+}
+
+static void conn_close(io_thread *io, server_conn *conn) {
+    pthread_mutex_lock(&conn->lock);
+    conn->closing = 1;
+    pthread_mutex_unlock(&conn->lock);
+    
+    epoll_ctl(io->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        io->conns = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    
+    if (conn->on_close != NULL) {
+        conn->on_close(conn->user_data);
+    }
+    
+    // Workers still holding the connection keep the fd open until they finish
+    server_conn_release(conn);
+}
+
+// Hand every complete frame in data to the handler, returns bytes consumed
+static long conn_dispatch(frame_handler_func handler, server_conn *conn, char *data, size_t len) {
+    size_t consumed = 0;
+    
+    while (consumed < len && !conn->closing) {
+        long n = handler(conn, data + consumed, len - consumed);
+        if (n < 0) {
+            conn->closing = 1;
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        consumed += n;
+    }
+    
+    return consumed;
+}
+
+// Dispatch freshly received bytes (with a writable spare byte past them), carrying
+// a trailing partial frame over to the next read. -1 once the connection is closing
+
+static int conn_consume(frame_handler_func handler, server_conn *conn, char *data, size_t received) {
+    if (conn->rlen == 0) {
+        // Common case: frames parsed straight out of the read buffer
+        long used = conn_dispatch(handler, conn, data, received);
+        if (used < 0) {
+            return -1;
+        }
+        size_t left = received - used;
+        if (left > 0) {
+            if (conn->rcap < left) {
+                char *grown = realloc(conn->rbuf, left + 1);
+                if (grown == NULL) {
+                    conn->closing = 1;
+                    return -1;
+                }
+                conn->rbuf = grown;
+                conn->rcap = left;
+            }
+            memcpy(conn->rbuf, data + used, left);
+            conn->rlen = left;
+        }
+    } else {
+        // A partial frame is pending: append and retry from the carry buffer
+        if (conn->rcap < conn->rlen + received) {
+            size_t new_cap = conn->rcap * 2;
+            if (new_cap < conn->rlen + received) {
+                new_cap = conn->rlen + received;
+            }
+            char *grown = realloc(conn->rbuf, new_cap + 1);
+            if (grown == NULL) {
+                conn->closing = 1;
+                return -1;
+            }
+            conn->rbuf = grown;
+            conn->rcap = new_cap;
+        }
+        memcpy(conn->rbuf + conn->rlen, data, received);
+        conn->rlen += received;
+        
+        long used = conn_dispatch(handler, conn, conn->rbuf, conn->rlen);
+        if (used < 0) {
+            return -1;
+        }
+        conn->rlen -= used;
+        if (conn->rlen > 0) {
+            memmove(conn->rbuf, conn->rbuf + used, conn->rlen);
+        }
+    }
+    
+    // Keep a normal-sized carry buffer for the next split frame, drop oversized ones
+    if (conn->rlen == 0 && conn->rcap > IO_READ_CHUNK) {
+        free(conn->rbuf);
+        conn->rbuf = NULL;
+        conn->rcap = 0;
+    }
+    return conn->closing ? -1 : 0;
+}
+
+static void conn_read_frames(io_thread *io, server_conn *conn) {
+    while (!conn->closing) {
+        ssize_t received = recv(conn->fd, io->scratch, IO_READ_CHUNK, 0);
+        
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn->closing = 1;
+            }
+            return;
+        }
+        if (received == 0) {
+            conn->closing = 1;
+            return;
+        }
+        
+        if (conn_consume(io->handler, conn, io->scratch, received) != 0) {
+            return;
+        }
+    }
+}
+
+// Replies produced while handling one readiness event go out together in one send
+static void conn_on_readable(io_thread *io, server_conn *conn) {
+    pthread_mutex_lock(&conn->lock);
+    conn->corked = 1;
+    pthread_mutex_unlock(&conn->lock);
+    
+    conn_read_frames(io, conn);
+    
+    pthread_mutex_lock(&conn->lock);
+    conn->corked = 0;
+    if (conn->wlen > conn->woff && !conn->want_write) {
+        conn_flush_locked(conn);
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+static void accept_pending(io_thread *io, const server_listener *listener) {
+    while (is_running) {
+        char peer[TRANSPORT_ADDR_MAX];
+        int shm = listener->addr.kind == TRANSPORT_SHM;
+        int client_sock = accept_from(listener, shm ? 0 : SOCK_NONBLOCK, peer, sizeof(peer));
+        if (client_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Error accepting client");
+            }
+            return;
+        }
+        
+        if (shm) {
+            start_client_thread(client_sock, peer, channel_handler);
+            continue;
+        }
+        
+        server_conn *conn = calloc(1, sizeof(server_conn));
+        if (conn == NULL) {
+            printf("Error allocating memory for client connection\n");
+            close(client_sock);
+            continue;
+        }
+        conn->fd = client_sock;
+        conn->epfd = io->epfd;
+        atomic_init(&conn->refs, 1);
+        pthread_mutex_init(&conn->lock, NULL);
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            perror("Error registering client");
+            server_conn_release(conn);
+            continue;
+        }
+        
+        conn->next = io->conns;
+        if (io->conns != NULL) {
+            io->conns->prev = conn;
+        }
+        io->conns = conn;
+    }
+}
+
+static void* io_thread_loop(void* arg) {
+    io_thread *io = (io_thread*)arg;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    
+    // Allocated here so a pinned thread's buffer lands on its own NUMA node
+    io->scratch = malloc(IO_READ_CHUNK + 1);
+    if (io->scratch == NULL) {
+        printf("Error allocating I/O thread buffer\n");
+        server_stop();
+        return NULL;
+    }
+    
+    while (is_running) {
+        int n = epoll_wait(io->epfd, events, EPOLL_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for events");
+            break;
+        }
+        
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            
+            if (tag == &wake_tag) {
+                continue;
+            }
+            if (((char*)tag >= (char*)listeners && (char*)tag < (char*)(listeners + MAX_LISTENERS)) ||
+                ((char*)tag >= (char*)io->shard.own && (char*)tag < (char*)(io->shard.own + MAX_LISTENERS))) {
+                accept_pending(io, (server_listener*)tag);
+                continue;
+            }
+            
+            server_conn *conn = (server_conn*)tag;
+            uint32_t ev = events[i].events;
+            
+            if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                conn_on_readable(io, conn);
+            }
+            if (!conn->closing && (ev & EPOLLOUT)) {
+                conn_flush(conn);
+            }
+            if (conn->closing) {
+                conn_close(io, conn);
+            }
+        }
+    }
+    
+    while (io->conns != NULL) {
+        conn_close(io, io->conns);
+    }
+    
+    return NULL;
+}
+
+int server_run_event_loop(frame_handler_func handler, int io_threads) {
+    if (num_listeners == 0 || !is_running) {
+        printf("Error: Server not initialized\n");
+        return -1;
+    }
+    
+    if (handler == NULL) {
+        return -1;
+    }
+    
+    int cpus[CPU_SETSIZE];
+    int num_cpus;
+    io_threads = io_thread_layout(io_threads, cpus, &num_cpus);
+    
+    for (int i = 0; i < num_listeners; i++) {
+        if (set_nonblocking(listeners[i].fd) < 0) {
+            perror("Error setting listening socket non-blocking");
+            return -1;
+        }
+    }
+    
+    io_thread *threads = calloc(io_threads, sizeof(io_thread));
+    if (threads == NULL) {
+        printf("Error allocating memory for I/O threads\n");
+        return -1;
+    }
+    
+    int started = 0;
+    for (int i = 0; i < io_threads; i++) {
+        io_thread *io = &threads[i];
+        io->handler = handler;
+        io->shard.cpu = num_cpus > 0 ? cpus[i % num_cpus] : -1;
+        io->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (io->epfd < 0) {
+            perror("Error creating event loop");
+            break;
+        }
+        
+        // Every loop watches the shared listeners; EPOLLEXCLUSIVE wakes only one per connection
+        struct epoll_event ev;
+        int registered = 0;
+        for (int l = 0; l < num_listeners; l++, registered++) {
+            if (!watches_listener(i, &listeners[l])) {
+                continue;
+            }
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.ptr = &listeners[l];
+            if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, listeners[l].fd, &ev) < 0) {
+                perror("Error registering listening socket");
+                break;
+            }
+        }
+        if (registered < num_listeners) {
+            break;
+        }
+        
+        if (shard_open(&io->shard, i) != 0) {
+            break;
+        }
+        for (registered = 0; registered < io->shard.num_own; registered++) {
+            server_listener *own = &io->shard.own[registered];
+            ev.events = EPOLLIN;
+            ev.data.ptr = own;
+            if (set_nonblocking(own->fd) < 0 || epoll_ctl(io->epfd, EPOLL_CTL_ADD, own->fd, &ev) < 0) {
+                perror("Error registering listening socket");
+                break;
+            }
+        }
+        if (registered < io->shard.num_own) {
+            break;
+        }
+        
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wake_tag;
+        if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, wake_fd, &ev) < 0) {
+            perror("Error registering wakeup eventfd");
+            break;
+        }
+        
+        // The calling thread runs loop 0 itself
+        if (i > 0 && start_io_thread(&io->thread, io_thread_loop, io, io->shard.cpu) != 0) {
+            perror("Error creating I/O thread");
+            break;
+        }
+        started++;
+    }
+    
+    if (started == io_threads) {
+        cpu_set_t saved;
+        int pinned = pin_caller(threads[0].shard.cpu, &saved) == 0;
+        
+        printf("[Server] Event loop running on %d I/O thread(s)%s\n", io_threads,
+               sharded ? ", sharded" : "");
+        io_thread_loop(&threads[0]);
+        
+        if (pinned) {
+            sched_setaffinity(0, sizeof(saved), &saved);
+        }
+    } else {
+        server_stop();
+    }
+    
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    
+    for (int i = 0; i < io_threads; i++) {
+        if (threads[i].epfd > 0) {
+            close(threads[i].epfd);
+        }
+        shard_close(&threads[i].shard);
+        free(threads[i].scratch);
+    }
+    free(threads);
+    
+    return started == io_threads ? 0 : -1;
+}
+
+/* ---------------- io_uring loop (SERVER_MODE_URING) ---------------- */
+
+/* Each I/O thread owns a ring. Listeners get one multishot accept, connections
+ * one multishot recv that picks from a ring of provided buffers, and a reply
+ * burst goes out as a single send per connection. Every submission made while
+ * handling a batch of completions, across all connections, enters the kernel
+ * together with the wait for the next batch. */
+
+/* user_data: the connection (or listener index) in the high bits, the operation in the low ones */
+enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_FLUSH,
+    URING_OP_WAKE,
+    URING_OP_CANCEL
+};
+#define URING_OP_BITS 3
+#define URING_OP_MASK ((1ULL << URING_OP_BITS) - 1)
+
+typedef struct uring_loop {
+    int fd;
+    unsigned setup_flags;
+    pthread_t thread;
+    frame_handler_func handler;
+    int index;
+    io_shard shard;
+    
+    /* Rings shared with the kernel; heads and tails are read and written atomically */
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned to_submit;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    
+    /* Buffers multishot recv fills; consumed ones are handed back once per batch */
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    unsigned buf_tail;
+    
+    /* Connections whose workers queued replies while no send was in flight */
+    pthread_mutex_t flush_lock;
+    server_conn *flush_list;
+    int flush_fd;
+    uint64_t flush_count;
+    
+    server_conn *conns;
+    int ops;            /* connection submissions in flight */
+    int accepts;        /* multishot accepts armed */
+} uring_loop;
+
+static int uring_enter(uring_loop *loop, unsigned min_complete, unsigned flags) {
+    __atomic_store_n(loop->sq_tail, loop->sq_local_tail, __ATOMIC_RELEASE);
+    
+    int rc = (int)syscall(__NR_io_uring_enter, loop->fd, loop->to_submit, min_complete, flags, NULL, 0);
+    if (rc >= 0) {
+        loop->to_submit -= (unsigned)rc < loop->to_submit ? (unsigned)rc : loop->to_submit;
+    }
+    return rc;
+}
+
+// A cleared submission slot, or NULL if the ring stays full even after submitting
+static struct io_uring_sqe *uring_get_sqe(uring_loop *loop) {
+    unsigned head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    if (loop->sq_local_tail - head >= loop->sq_entries) {
+        uring_enter(loop, 0, 0);
+        head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+        if (loop->sq_local_tail - head >= loop->sq_entries) {
+            return NULL;
+        }
+    }
+    
+    unsigned index = loop->sq_local_tail & loop->sq_mask;
+    struct io_uring_sqe *sqe = &loop->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    loop->sq_array[index] = index;
+    loop->sq_local_tail++;
+    loop->to_submit++;
+    return sqe;
+}
+
+static uint64_t uring_tag(void *ptr, int op) {
+    return (uint64_t)(uintptr_t)ptr | (uint64_t)op;
+}
+
+static void uring_recycle_buffer(uring_loop *loop, unsigned bid) {
+    struct io_uring_buf *buf = &loop->buf_ring->bufs[loop->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(loop->buffers + (size_t)bid * URING_BUFFER_STRIDE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = (uint16_t)bid;
+    loop->buf_tail++;
+}
+
+static void uring_publish_buffers(uring_loop *loop) {
+    __atomic_store_n(&loop->buf_ring->tail, (uint16_t)loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Accepts are tagged with an index: shared listeners first, then the loop's own copies
+static const server_listener *uring_listener(const uring_loop *loop, int index) {
+    return index < MAX_LISTENERS ? &listeners[index] : &loop->shard.own[index - MAX_LISTENERS];
+}
+
+static void uring_arm_accept(uring_loop *loop, int index) {
+    const server_listener *listener = uring_listener(loop, index);
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL) {
+        printf("[Server] io_uring submission queue full, listener %d not re-armed\n", index);
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC | (listener->addr.kind == TRANSPORT_SHM ? 0 : SOCK_NONBLOCK);
+    sqe->user_data = ((uint64_t)index << URING_OP_BITS) | URING_OP_ACCEPT;
+    loop->accepts++;
+}
+
+static void uring_arm_flush(uring_loop *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->flush_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->flush_count;
+    sqe->len = sizeof(loop->flush_count);
+    sqe->user_data = URING_OP_FLUSH;
+}
+
+static void uring_arm_wake(uring_loop *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_OP_WAKE;
+}
+
+static int uring_arm_recv(uring_loop *loop, server_conn *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = uring_tag(conn, URING_OP_RECV);
+    
+    server_conn_retain(conn);
+    conn->ops++;
+    loop->ops++;
+    return 0;
+}
+
+// Send what is left of sbuf. Caller holds conn->lock
+static int uring_submit_send(uring_loop *loop, server_conn *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL) {
+        conn->closing = 1;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(conn->sbuf + conn->soff);
+    sqe->len = (uint32_t)(conn->slen - conn->soff);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uring_tag(conn, URING_OP_SEND);
+    
+    server_conn_retain(conn);
+    conn->ops++;
+    loop->ops++;
+    return 0;
+}
+
+// Put the queued bytes in flight; workers keep appending to the other buffer
+// meanwhile. Caller holds conn->lock, with nothing in flight
+static int uring_start_send(uring_loop *loop, server_conn *conn) {
+    char *buf = conn->sbuf;
+    size_t cap = conn->scap;
+    
+    conn->sbuf = conn->wbuf;
+    conn->scap = conn->wcap;
+    conn->slen = conn->wlen;
+    conn->soff = conn->woff;
+    
+    conn->wbuf = buf;
+    conn->wcap = cap;
+    conn->wlen = conn->woff = 0;
+    
+    conn->sending = 1;
+    conn->want_write = 1;
+    return uring_submit_send(loop, conn);
+}
+
+// Called by workers through conn_update_events, with conn->lock held
+static void uring_request_flush(server_conn *conn) {
+    uring_loop *loop = conn->uring;
+    
+    conn->want_write = 1;
+    server_conn_retain(conn);
+    
+    pthread_mutex_lock(&loop->flush_lock);
+    conn->flush_next = loop->flush_list;
+    loop->flush_list = conn;
+    pthread_mutex_unlock(&loop->flush_lock);
+    
+    uint64_t one = 1;
+    ssize_t ignored = write(loop->flush_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+static void uring_on_flush(uring_loop *loop) {
+    pthread_mutex_lock(&loop->flush_lock);
+    server_conn *conn = loop->flush_list;
+    loop->flush_list = NULL;
+    pthread_mutex_unlock(&loop->flush_lock);
+    
+    while (conn != NULL) {
+        server_conn *next = conn->flush_next;
+        
+        pthread_mutex_lock(&conn->lock);
+        if (!conn->closing && !conn->sending) {
+            if (conn->wlen > conn->woff) {
+                uring_start_send(loop, conn);
+            } else {
+                conn->want_write = 0;
+            }
+        }
+        pthread_mutex_unlock(&conn->lock);
+        
+        server_conn_release(conn);
+        conn = next;
+    }
+}
+
+static void uring_conn_close(uring_loop *loop, server_conn *conn) {
+    pthread_mutex_lock(&conn->lock);
+    conn->closing = 1;
+    pthread_mutex_unlock(&conn->lock);
+    conn->closed = 1;
+    
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->conns = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    
+    // The fd stays open while operations reference it, so this can't hit a reused one
+    if (conn->ops > 0) {
+        struct io_uring_sqe *sqe = uring_get_sqe(loop);
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = conn->fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = URING_OP_CANCEL;
+        }
+    }
+    
+    if (conn->on_close != NULL) {
+        conn->on_close(conn->user_data);
+    }
+    
+    server_conn_release(conn);
+}
+
+static void uring_on_accept(uring_loop *loop, int index, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        loop->accepts--;
+        if (is_running) {
+            uring_arm_accept(loop, index);
+        }
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED && cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+            printf("[Server] Error accepting client: %s\n", strerror(-cqe->res));
+        }
+        return;
+    }
+    
+    int client_sock = cqe->res;
+    const server_listener *listener = uring_listener(loop, index);
+    if (!is_running) {
+        close(client_sock);
+        return;
+    }
+    transport_tune(client_sock, listener->addr.kind);
+    
+    if (listener->addr.kind == TRANSPORT_SHM) {
+        char peer[TRANSPORT_ADDR_MAX];
+        start_client_thread(client_sock, transport_describe(&listener->addr, peer, sizeof(peer)), channel_handler);
+        return;
+    }
+    
+    server_conn *conn = calloc(1, sizeof(server_conn));
+    if (conn == NULL) {
+        printf("Error allocating memory for client connection\n");
+        close(client_sock);
+        return;
+    }
+    conn->fd = client_sock;
+    conn->epfd = -1;
+    conn->uring = loop;
+    atomic_init(&conn->refs, 1);
+    pthread_mutex_init(&conn->lock, NULL);
+    
+    if (uring_arm_recv(loop, conn) != 0) {
+        printf("Error registering client\n");
+        server_conn_release(conn);
+        return;
+    }
+    
+    conn->next = loop->conns;
+    if (loop->conns != NULL) {
+        loop->conns->prev = conn;
+    }
+    loop->conns = conn;
+}
+
+static void uring_on_recv(uring_loop *loop, server_conn *conn, const struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        
+        if (cqe->res > 0 && !conn->closing) {
+            // Replies to everything in this buffer leave in one send
+            pthread_mutex_lock(&conn->lock);
+            conn->corked = 1;
+            pthread_mutex_unlock(&conn->lock);
+            
+            conn_consume(loop->handler, conn, loop->buffers + (size_t)bid * URING_BUFFER_STRIDE, cqe->res);
+            
+            pthread_mutex_lock(&conn->lock);
+            conn->corked = 0;
+            if (conn->wlen > conn->woff && !conn->sending && !conn->closing) {
+                uring_start_send(loop, conn);
+            }
+            pthread_mutex_unlock(&conn->lock);
+        }
+        uring_recycle_buffer(loop, bid);
+    }
+    
+    // Out of buffers just ends the multishot; anything else but data ends the connection
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+        conn->closing = 1;
+    }
+    if (conn->closing && !conn->closed) {
+        uring_conn_close(loop, conn);
+    }
+    
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->ops--;
+        loop->ops--;
+        if (!conn->closed && uring_arm_recv(loop, conn) != 0) {
+            uring_conn_close(loop, conn);
+        }
+        server_conn_release(conn);
+    }
+}
+
+static void uring_on_send(uring_loop *loop, server_conn *conn, int res) {
+    pthread_mutex_lock(&conn->lock);
+    if (res < 0 && res != -EINTR && res != -EAGAIN) {
+        conn->closing = 1;
+    } else if (res > 0) {
+        conn->soff += res;
+    }
+    
+    if (conn->closing) {
+        conn->sending = 0;
+    } else if (conn->soff < conn->slen) {
+        uring_submit_send(loop, conn);
+    } else {
+        // Sent in full: keep a normal-sized buffer for the next burst, release big ones
+        if (conn->scap > IO_READ_CHUNK) {
+            free(conn->sbuf);
+            conn->sbuf = NULL;
+            conn->scap = 0;
+        }
+        conn->slen = conn->soff = 0;
+        conn->sending = 0;
+        
+        if (conn->wlen > conn->woff) {
+            uring_start_send(loop, conn);
+        } else {
+            conn->want_write = 0;
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+    
+    conn->ops--;
+    loop->ops--;
+    if (conn->closing && !conn->closed) {
+        uring_conn_close(loop, conn);
+    }
+    server_conn_release(conn);
+}
+
+// Handle every completion posted so far
+static void uring_reap(uring_loop *loop) {
+    unsigned head = __atomic_load_n(loop->cq_head, __ATOMIC_RELAXED);
+    
+    while (head != __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = loop->cqes[head & loop->cq_mask];
+        head++;
+        __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+        
+        int op = (int)(cqe.user_data & URING_OP_MASK);
+        void *ptr = (void*)(uintptr_t)(cqe.user_data & ~URING_OP_MASK);
+        
+        switch (op) {
+            case URING_OP_ACCEPT:
+                uring_on_accept(loop, (int)(cqe.user_data >> URING_OP_BITS), &cqe);
+                break;
+            case URING_OP_RECV:
+                uring_on_recv(loop, (server_conn*)ptr, &cqe);
+                break;
+            case URING_OP_SEND:
+                uring_on_send(loop, (server_conn*)ptr, cqe.res);
+                break;
+            case URING_OP_FLUSH:
+                uring_on_flush(loop);
+                if (is_running) {
+                    uring_arm_flush(loop);
+                }
+                break;
+            case URING_OP_WAKE:
+                if (is_running) {
+                    uring_arm_wake(loop);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    
+    uring_publish_buffers(loop);
+}
+
+static void* uring_thread_loop(void* arg) {
+    uring_loop *loop = (uring_loop*)arg;
+    
+    // A ring created disabled is bound to the first thread that enables it
+    if (loop->setup_flags & IORING_SETUP_R_DISABLED) {
+        if (syscall(__NR_io_uring_register, loop->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0) {
+            perror("Error enabling io_uring");
+            server_stop();
+            return NULL;
+        }
+    }
+    
+    uring_arm_wake(loop);
+    uring_arm_flush(loop);
+    for (int l = 0; l < num_listeners; l++) {
+        if (watches_listener(loop->index, &listeners[l])) {
+            uring_arm_accept(loop, l);
+        }
+    }
+    for (int l = 0; l < loop->shard.num_own; l++) {
+        uring_arm_accept(loop, MAX_LISTENERS + l);
+    }
+    
+    while (is_running) {
+        // Submit everything the last batch queued and wait for the next one, in one call
+        if (uring_enter(loop, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EBUSY) {
+            perror("Error waiting for io_uring completions");
+            break;
+        }
+        uring_reap(loop);
+    }
+    
+    // Cancel the armed accepts, so none is still waiting on a listener once the
+    // loop has returned and server_shutdown closes them
+    for (int l = 0; l < 2 * MAX_LISTENERS && loop->accepts > 0; l++) {
+        struct io_uring_sqe *sqe = uring_get_sqe(loop);
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = ((uint64_t)l << URING_OP_BITS) | URING_OP_ACCEPT;
+            sqe->user_data = URING_OP_CANCEL;
+        }
+    }
+    while (loop->conns != NULL) {
+        uring_conn_close(loop, loop->conns);
+    }
+    while (loop->ops > 0 || loop->accepts > 0) {
+        if (uring_enter(loop, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EBUSY) {
+            break;
+        }
+        uring_reap(loop);
+    }
+    uring_on_flush(loop);
+    
+    return NULL;
+}
+
+static void uring_loop_destroy(uring_loop *loop) {
+    if (loop->sqes != NULL && loop->sqes != MAP_FAILED) {
+        munmap(loop->sqes, loop->sqes_size);
+    }
+    if (loop->cq_ptr != NULL && loop->cq_ptr != MAP_FAILED && loop->cq_ptr != loop->sq_ptr) {
+        munmap(loop->cq_ptr, loop->cq_size);
+    }
+    if (loop->sq_ptr != NULL && loop->sq_ptr != MAP_FAILED) {
+        munmap(loop->sq_ptr, loop->sq_size);
+    }
+    if (loop->fd >= 0) {
+        close(loop->fd);
+    }
+    if (loop->flush_fd >= 0) {
+        close(loop->flush_fd);
+    }
+    free(loop->buf_ring);
+    free(loop->buffers);
+    pthread_mutex_destroy(&loop->flush_lock);
+}
+
+// Create the ring, map it and register the receive buffers. -1 if io_uring is unavailable
+static int uring_loop_init(uring_loop *loop, frame_handler_func handler) {
+    struct io_uring_params params;
+    
+    loop->fd = -1;
+    loop->flush_fd = -1;
+    loop->handler = handler;
+    pthread_mutex_init(&loop->flush_lock, NULL);
+    
+    // Single issuer with deferred task work when the kernel has them, plain otherwise
+    unsigned flag_sets[2] = {
+        IORING_SETUP_CQSIZE | IORING_SETUP_R_DISABLED | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_CQSIZE
+    };
+    for (int i = 0; i < 2 && loop->fd < 0; i++) {
+        memset(&params, 0, sizeof(params));
+        params.flags = flag_sets[i];
+        params.cq_entries = URING_ENTRIES * 4;
+        loop->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+        loop->setup_flags = params.flags;
+        if (loop->fd < 0 && errno != EINVAL) {
+            break;
+        }
+    }
+    if (loop->fd < 0) {
+        return -1;
+    }
+    
+    loop->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    loop->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (loop->cq_size > loop->sq_size) {
+            loop->sq_size = loop->cq_size;
+        }
+        loop->cq_size = loop->sq_size;
+    }
+    
+    loop->sq_ptr = mmap(NULL, loop->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        loop->fd, IORING_OFF_SQ_RING);
+    if (loop->sq_ptr == MAP_FAILED) {
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        loop->cq_ptr = loop->sq_ptr;
+    } else {
+        loop->cq_ptr = mmap(NULL, loop->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            loop->fd, IORING_OFF_CQ_RING);
+        if (loop->cq_ptr == MAP_FAILED) {
+            return -1;
+        }
+    }
+    loop->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      loop->fd, IORING_OFF_SQES);
+    if (loop->sqes == MAP_FAILED) {
+        return -1;
+    }
+    
+    char *sq = loop->sq_ptr;
+    char *cq = loop->cq_ptr;
+    loop->sq_head = (unsigned*)(sq + params.sq_off.head);
+    loop->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    loop->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    loop->sq_entries = params.sq_entries;
+    loop->sq_array = (unsigned*)(sq + params.sq_off.array);
+    loop->sq_local_tail = *loop->sq_tail;
+    loop->cq_head = (unsigned*)(cq + params.cq_off.head);
+    loop->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    loop->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    
+    void *ring = NULL;
+    if (posix_memalign(&ring, sysconf(_SC_PAGESIZE), URING_BUFFERS * sizeof(struct io_uring_buf)) != 0) {
+        return -1;
+    }
+    memset(ring, 0, URING_BUFFERS * sizeof(struct io_uring_buf));
+    loop->buf_ring = ring;
+    loop->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_STRIDE);
+    if (loop->buffers == NULL) {
+        return -1;
+    }
+    
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, loop->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    for (unsigned bid = 0; bid < URING_BUFFERS; bid++) {
+        uring_recycle_buffer(loop, bid);
+    }
+    uring_publish_buffers(loop);
+    
+    loop->flush_fd = eventfd(0, EFD_CLOEXEC);
+    if (loop->flush_fd < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int server_run_uring_loop(frame_handler_func handler, int io_threads) {
+    if (num_listeners == 0 || !is_running) {
+        printf("Error: Server not initialized\n");
+        return -1;
+    }
+    
+    if (handler == NULL) {
+        return -1;
+    }
+    
+    int cpus[CPU_SETSIZE];
+    int num_cpus;
+    io_threads = io_thread_layout(io_threads, cpus, &num_cpus);
+    
+    uring_loop *loops = calloc(io_threads, sizeof(uring_loop));
+    if (loops == NULL) {
+        printf("Error allocating memory for I/O threads\n");
+        return -1;
+    }
+    
+    int ready = 0;
+    for (; ready < io_threads; ready++) {
+        if (uring_loop_init(&loops[ready], handler) != 0) {
+            uring_loop_destroy(&loops[ready]);
+            break;
+        }
+    }
+    if (ready < io_threads) {
+        // Old kernel, or io_uring switched off: the epoll loop serves the same handler
+        printf("[Server] io_uring unavailable (%s), falling back to epoll\n", strerror(errno));
+        for (int i = 0; i < ready; i++) {
+            uring_loop_destroy(&loops[i]);
+        }
+        free(loops);
+        return server_run_event_loop(handler, io_threads);
+    }
+    
+    int started = 0;
+    for (; started < io_threads; started++) {
+        uring_loop *loop = &loops[started];
+        loop->index = started;
+        loop->shard.cpu = num_cpus > 0 ? cpus[started % num_cpus] : -1;
+        if (shard_open(&loop->shard, started) != 0) {
+            break;
+        }
+        
+        // The calling thread runs loop 0 itself
+        if (started > 0 && start_io_thread(&loop->thread, uring_thread_loop, loop, loop->shard.cpu) != 0) {
+            perror("Error creating I/O thread");
+            break;
+        }
+    }
+    
+    if (started == io_threads) {
+        cpu_set_t saved;
+        int pinned = pin_caller(loops[0].shard.cpu, &saved) == 0;
+        
+        printf("[Server] io_uring loop running on %d I/O thread(s)%s\n", io_threads,
+               sharded ? ", sharded" : "");
+        uring_thread_loop(&loops[0]);
+        
+        if (pinned) {
+            sched_setaffinity(0, sizeof(saved), &saved);
+        }
+    } else {
+        server_stop();
+    }
+    
+    for (int i = 1; i < started; i++) {
+        pthread_join(loops[i].thread, NULL);
+    }
+    
+    for (int i = 0; i < io_threads; i++) {
+        shard_close(&loops[i].shard);
+        uring_loop_destroy(&loops[i]);
+    }
+    free(loops);
+    
+    return started == io_threads ? 0 : -1;
+}
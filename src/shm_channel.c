@@ -0,0 +1,415 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "shm_channel.h"
+
+#define SHM_MAGIC            0x52504353      /* "RPCS" */
+#define SHM_VERSION          1
+#define SHM_MIN_RING_SIZE    4096
+#define SHM_MAX_RING_SIZE    (1U << 30)
+#define CACHE_LINE           64
+#define MIN_SPIN_NS          1000            /* the adaptive budget never drops below this */
+#define LIVENESS_CHECK_MS    100             /* a sleeper looks at the control socket this often */
+
+/* One direction. Each position lives on its own cache line, so the producer
+ * and the consumer never write the same line */
+typedef struct {
+    _Atomic uint32_t head;              /* bytes written (wrapping); readers sleep on it */
+    _Atomic uint32_t reader_waiting;
+    char pad0[CACHE_LINE - 2 * sizeof(uint32_t)];
+    _Atomic uint32_t tail;              /* bytes read; a writer short of room sleeps on it */
+    _Atomic uint32_t writer_waiting;
+    char pad1[CACHE_LINE - 2 * sizeof(uint32_t)];
+} shm_ring;
+
+/* Start of the shared mapping; the two rings' data follows it */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;
+    _Atomic uint32_t closed;
+    char pad[CACHE_LINE - 4 * sizeof(uint32_t)];
+    shm_ring rings[2];                  /* requests, replies */
+} shm_region;
+
+struct shm_channel {
+    int control_fd;
+    shm_region *region;
+    size_t map_size;
+    uint32_t mask;
+
+    shm_ring *tx;
+    uint8_t *tx_data;
+    uint32_t tx_head;                   /* ours to advance; writers are serialized by the caller */
+    atomic_ullong tx_spin_ns;
+
+    shm_ring *rx;
+    uint8_t *rx_data;
+    uint32_t rx_tail;                   /* ours to advance; there is a single reader */
+    atomic_ullong rx_spin_ns;
+
+    uint64_t spin_max_ns;
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// The region is shared with another process, so these are not FUTEX_PRIVATE
+static long futex_wait(_Atomic uint32_t *word, uint32_t expected, const struct timespec *timeout) {
+    return syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, expected, timeout, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word) {
+    syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Only pay for the syscall when the other side said it was going to sleep
+static void wake_waiter(_Atomic uint32_t *word, _Atomic uint32_t *waiting) {
+    if (atomic_load(waiting) && atomic_exchange(waiting, 0)) {
+        futex_wake(word);
+    }
+}
+
+static int peer_alive(shm_channel *channel) {
+    struct pollfd pfd = { channel->control_fd, POLLRDHUP, 0 };
+    if (poll(&pfd, 1, 0) < 0) {
+        return errno == EINTR;
+    }
+    return !(pfd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL));
+}
+
+// Wait for *word to move on from seen. Spin within the adaptive budget first:
+// it grows while data keeps arriving during the spin and shrinks while it does
+// not, then sleep on the futex. 0 once it moved, -1 if the channel was shut
+// down or the peer went away
+
+static int channel_wait(shm_channel *channel, _Atomic uint32_t *word, uint32_t seen,
+                        _Atomic uint32_t *waiting, atomic_ullong *spin_ns) {
+    uint64_t budget = atomic_load_explicit(spin_ns, memory_order_relaxed);
+    if (budget > 0) {
+        uint64_t deadline = monotonic_ns() + budget;
+        for (unsigned i = 1; ; i++) {
+            if (atomic_load_explicit(word, memory_order_acquire) != seen) {
+                uint64_t grown = budget * 2 < channel->spin_max_ns ? budget * 2 : channel->spin_max_ns;
+                atomic_store_explicit(spin_ns, grown, memory_order_relaxed);
+                return 0;
+            }
+            if ((i & 63) == 0 && monotonic_ns() >= deadline) {
+                break;
+            }
+            shm_cpu_relax();
+        }
+        atomic_store_explicit(spin_ns, budget / 2 > MIN_SPIN_NS ? budget / 2 : MIN_SPIN_NS,
+                              memory_order_relaxed);
+    }
+
+    struct timespec timeout = { 0, LIVENESS_CHECK_MS * 1000000L };
+    for (;;) {
+        if (atomic_load(&channel->region->closed)) {
+            return -1;
+        }
+
+        // Announce the sleep before the last look, pairing with wake_waiter
+        atomic_store(waiting, 1);
+        if (atomic_load(word) != seen) {
+            return 0;
+        }
+
+        if (futex_wait(word, seen, &timeout) < 0 && errno == ETIMEDOUT && !peer_alive(channel)) {
+            return -1;
+        }
+        if (atomic_load(word) != seen) {
+            return 0;
+        }
+    }
+}
+
+static void publish(shm_channel *channel) {
+    if (atomic_load_explicit(&channel->tx->head, memory_order_relaxed) != channel->tx_head) {
+        atomic_store(&channel->tx->head, channel->tx_head);
+        wake_waiter(&channel->tx->head, &channel->tx->reader_waiting);
+    }
+}
+
+int shm_channel_sendv(shm_channel *channel, const struct iovec *iov, int iovcnt) {
+    shm_ring *ring = channel->tx;
+    uint32_t size = channel->mask + 1;
+
+    for (int i = 0; i < iovcnt; i++) {
+        const uint8_t *src = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+
+        while (left > 0) {
+            if (atomic_load_explicit(&channel->region->closed, memory_order_relaxed)) {
+                return -1;
+            }
+
+            uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+            uint32_t used = channel->tx_head - tail;
+            if (used > size) {
+                return -1;      /* the peer corrupted the ring */
+            }
+            if (used == size) {
+                // Full: let the reader see everything written so far, then wait for room
+                publish(channel);
+                if (channel_wait(channel, &ring->tail, tail, &ring->writer_waiting, &channel->tx_spin_ns) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+
+            uint32_t offset = channel->tx_head & channel->mask;
+            size_t n = size - used < left ? size - used : left;
+            size_t first = size - offset < n ? size - offset : n;
+            memcpy(channel->tx_data + offset, src, first);
+            memcpy(channel->tx_data, src + first, n - first);
+            channel->tx_head += (uint32_t)n;
+            src += n;
+            left -= n;
+        }
+    }
+
+    publish(channel);
+    return 0;
+}
+
+ssize_t shm_channel_recv(shm_channel *channel, void *buf, size_t len) {
+    shm_ring *ring = channel->rx;
+    uint32_t size = channel->mask + 1;
+
+    for (;;) {
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint32_t avail = head - channel->rx_tail;
+        if (avail > size) {
+            return -1;          /* the peer corrupted the ring */
+        }
+
+        if (avail > 0) {
+            uint32_t offset = channel->rx_tail & channel->mask;
+            size_t n = avail < len ? avail : len;
+            size_t first = size - offset < n ? size - offset : n;
+            memcpy(buf, channel->rx_data + offset, first);
+            memcpy((uint8_t*)buf + first, channel->rx_data, n - first);
+            channel->rx_tail += (uint32_t)n;
+
+            atomic_store(&ring->tail, channel->rx_tail);
+            wake_waiter(&ring->tail, &ring->writer_waiting);
+            return (ssize_t)n;
+        }
+
+        // Whatever was written before a shutdown is still delivered
+        if (atomic_load(&channel->region->closed) ||
+            channel_wait(channel, &ring->head, head, &ring->reader_waiting, &channel->rx_spin_ns) != 0) {
+            return 0;
+        }
+    }
+}
+
+int shm_channel_read(shm_channel *channel, void *buf, size_t len) {
+    uint8_t *cursor = buf;
+    while (len > 0) {
+        ssize_t n = shm_channel_recv(channel, cursor, len);
+        if (n <= 0) {
+            return -1;
+        }
+        cursor += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+void shm_channel_shutdown(shm_channel *channel) {
+    atomic_store(&channel->region->closed, 1);
+    for (int i = 0; i < 2; i++) {
+        futex_wake(&channel->region->rings[i].head);
+        futex_wake(&channel->region->rings[i].tail);
+    }
+    shutdown(channel->control_fd, SHUT_RDWR);
+}
+
+void shm_channel_close(shm_channel *channel) {
+    if (channel == NULL) {
+        return;
+    }
+    munmap(channel->region, channel->map_size);
+    free(channel);
+}
+
+// Wrap a mapped region; the server writes ring 1 and reads ring 0, the client the reverse
+static shm_channel *channel_create(int control_fd, shm_region *region, size_t map_size, int server, int spin_us) {
+    shm_channel *channel = calloc(1, sizeof(shm_channel));
+    if (channel == NULL) {
+        return NULL;
+    }
+
+    uint32_t ring_size = region->ring_size;
+    uint8_t *data = (uint8_t*)region + sizeof(shm_region);
+    int tx = server ? 1 : 0;
+
+    channel->control_fd = control_fd;
+    channel->region = region;
+    channel->map_size = map_size;
+    channel->mask = ring_size - 1;
+    channel->tx = &region->rings[tx];
+    channel->tx_data = data + (size_t)tx * ring_size;
+    channel->tx_head = atomic_load(&channel->tx->head);
+    channel->rx = &region->rings[1 - tx];
+    channel->rx_data = data + (size_t)(1 - tx) * ring_size;
+    channel->rx_tail = atomic_load(&channel->rx->tail);
+
+    // With a single CPU the peer cannot make progress while we spin
+    channel->spin_max_ns = spin_us > 0 && sysconf(_SC_NPROCESSORS_ONLN) > 1 ? (uint64_t)spin_us * 1000ULL : 0;
+    atomic_init(&channel->tx_spin_ns, channel->spin_max_ns);
+    atomic_init(&channel->rx_spin_ns, channel->spin_max_ns);
+    return channel;
+}
+
+shm_channel *shm_channel_serve(int control_fd, size_t ring_size, int spin_us) {
+    if (ring_size < SHM_MIN_RING_SIZE || ring_size > SHM_MAX_RING_SIZE || (ring_size & (ring_size - 1)) != 0) {
+        printf("Error invalid ring size %zu\n", ring_size);
+        return NULL;
+    }
+
+    int memfd = memfd_create("rpc-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        perror("Error creating shared memory");
+        return NULL;
+    }
+
+    size_t map_size = sizeof(shm_region) + 2 * ring_size;
+    if (ftruncate(memfd, (off_t)map_size) < 0) {
+        perror("Error sizing shared memory");
+        close(memfd);
+        return NULL;
+    }
+
+    // The client gets the same fd: sealed, it cannot shrink the file under the
+    // server's mapping, which would make the server's next access raise SIGBUS
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        perror("Error sealing shared memory");
+        close(memfd);
+        return NULL;
+    }
+
+    shm_region *region = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (region == MAP_FAILED) {
+        perror("Error mapping shared memory");
+        close(memfd);
+        return NULL;
+    }
+    region->magic = SHM_MAGIC;
+    region->version = SHM_VERSION;
+    region->ring_size = (uint32_t)ring_size;
+
+    // Pass the memfd along with a single byte
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    int sent = sendmsg(control_fd, &msg, MSG_NOSIGNAL) == 1;
+    close(memfd);
+    if (!sent) {
+        perror("Error sending shared memory");
+        munmap(region, map_size);
+        return NULL;
+    }
+
+    shm_channel *channel = channel_create(control_fd, region, map_size, 1, spin_us);
+    if (channel == NULL) {
+        munmap(region, map_size);
+    }
+    return channel;
+}
+
+shm_channel *shm_channel_join(int control_fd, int spin_us) {
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+
+    ssize_t received;
+    do {
+        received = recvmsg(control_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    struct cmsghdr *cmsg = received == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        printf("Error: No shared memory received from server\n");
+        return NULL;
+    }
+    int memfd;
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+    struct stat st;
+    if (fstat(memfd, &st) < 0 || (size_t)st.st_size < sizeof(shm_region)) {
+        printf("Error: Invalid shared memory from server\n");
+        close(memfd);
+        return NULL;
+    }
+
+    size_t map_size = (size_t)st.st_size;
+    shm_region *region = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+    if (region == MAP_FAILED) {
+        perror("Error mapping shared memory");
+        return NULL;
+    }
+
+    uint32_t ring_size = region->ring_size;
+    if (region->magic != SHM_MAGIC || region->version != SHM_VERSION || ring_size < SHM_MIN_RING_SIZE ||
+        ring_size > SHM_MAX_RING_SIZE || (ring_size & (ring_size - 1)) != 0 ||
+        map_size != sizeof(shm_region) + 2 * (size_t)ring_size) {
+        printf("Error: Invalid shared memory from server\n");
+        munmap(region, map_size);
+        return NULL;
+    }
+
+    shm_channel *channel = channel_create(control_fd, region, map_size, 0, spin_us);
+    if (channel == NULL) {
+        munmap(region, map_size);
+    }
+    return channel;
+}
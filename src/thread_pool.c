@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include "thread_pool.h"
+
+#define DEFAULT_QUEUE_CAPACITY 4096
+#define DEFAULT_IDLE_TIMEOUT_MS 5000
+#define CACHE_LINE 64
+
+/*
+ * Bounded MPMC queue (Vyukov): every slot carries a sequence number telling
+ * producers and consumers whether it is free for the current lap, so
+ * enqueue/dequeue only need one CAS on their own position counter.
+ */
+typedef struct {
+    atomic_size_t sequence;
+    task_func fn;
+    void *arg;
+} pool_slot;
+
+struct thread_pool {
+    pool_slot *slots;
+    size_t mask;
+
+    _Alignas(CACHE_LINE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE) atomic_size_t dequeue_pos;
+
+    _Alignas(CACHE_LINE) atomic_long depth;  /* may dip below zero briefly between pop and push accounting */
+    atomic_int workers;
+    atomic_int busy;
+    atomic_int sleepers;
+    atomic_int running;
+    atomic_ulong completed;
+    atomic_ulong rejected;
+    atomic_ullong busy_ns;
+
+    int min_workers;
+    int max_workers;
+    int idle_timeout_ms;
+
+    /* Only used to park idle workers and to wait for them on destroy */
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_cond_t worker_exited;
+
+    /* Snapshot for utilization deltas */
+    unsigned long long last_busy_ns;
+    unsigned long long last_stats_ns;
+};
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int queue_push(thread_pool *pool, task_func fn, void *arg) {
+    size_t pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+
+    for (;;) {
+        pool_slot *slot = &pool->slots[pos & pool->mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->fn = fn;
+                slot->arg = arg;
+                atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;  // full
+        } else {
+            pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static int queue_pop(thread_pool *pool, task_func *fn, void **arg) {
+    size_t pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+
+    for (;;) {
+        pool_slot *slot = &pool->slots[pos & pool->mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *fn = slot->fn;
+                *arg = slot->arg;
+                atomic_store_explicit(&slot->sequence, pos + pool->mask + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;  // empty
+        } else {
+            pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static void worker_exit(thread_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_sub(&pool->workers, 1);
+    pthread_cond_broadcast(&pool->worker_exited);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void* worker_loop(void *arg) {
+    thread_pool *pool = (thread_pool*)arg;
+
+    for (;;) {
+        task_func fn;
+        void *task_arg;
+
+        if (queue_pop(pool, &fn, &task_arg) == 0) {
+            atomic_fetch_sub(&pool->depth, 1);
+            atomic_fetch_add(&pool->busy, 1);
+
+            unsigned long long start = now_ns();
+            fn(task_arg);
+            atomic_fetch_add(&pool->busy_ns, now_ns() - start);
+
+            atomic_fetch_sub(&pool->busy, 1);
+            atomic_fetch_add(&pool->completed, 1);
+            continue;
+        }
+
+        // Queue drained: leave only once shutdown has been requested
+        if (!atomic_load(&pool->running)) {
+            break;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+
+        // Re-check after announcing ourselves so a concurrent submit can't be missed
+        if (atomic_load(&pool->depth) > 0 || !atomic_load(&pool->running)) {
+            atomic_fetch_sub(&pool->sleepers, 1);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += pool->idle_timeout_ms / 1000;
+        deadline.tv_nsec += (long)(pool->idle_timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        int rc = pthread_cond_timedwait(&pool->work_available, &pool->lock, &deadline);
+        atomic_fetch_sub(&pool->sleepers, 1);
+
+        // Shrink back towards min_workers after sitting idle. Leaves under the lock
+        // like worker_exit, so destroy cannot free the pool before the broadcast
+        if (rc == ETIMEDOUT && atomic_load(&pool->depth) <= 0) {
+            int current = atomic_load(&pool->workers);
+            if (current > pool->min_workers && current > 1) {
+                atomic_fetch_sub(&pool->workers, 1);
+                pthread_cond_broadcast(&pool->worker_exited);
+                pthread_mutex_unlock(&pool->lock);
+                return NULL;
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    worker_exit(pool);
+    return NULL;
+}
+
+// Starts a worker in a slot already counted in workers, giving the slot back on failure
+static int start_worker(thread_pool *pool) {
+    pthread_t thread_id;
+
+    if (pthread_create(&thread_id, NULL, worker_loop, pool) != 0) {
+        perror("Error creating worker thread");
+        worker_exit(pool);
+        return -1;
+    }
+    pthread_detach(thread_id);
+    return 0;
+}
+
+static int spawn_worker(thread_pool *pool) {
+    atomic_fetch_add(&pool->workers, 1);
+    return start_worker(pool);
+}
+
+thread_pool *thread_pool_create(const thread_pool_config *config) {
+    if (config == NULL || config->min_workers < 0 || config->max_workers <= 0) {
+        printf("Error invalid thread pool configuration\n");
+        return NULL;
+    }
+
+    // The queue positions are cache-line aligned, so the pool must be too
+    thread_pool *pool = NULL;
+    if (posix_memalign((void**)&pool, CACHE_LINE, sizeof(thread_pool)) != 0) {
+        printf("Error unable to allocate memory for thread pool\n");
+        return NULL;
+    }
+    memset(pool, 0, sizeof(thread_pool));
+
+    size_t capacity = 2;
+    size_t wanted = config->queue_capacity > 0 ? config->queue_capacity : DEFAULT_QUEUE_CAPACITY;
+    while (capacity < wanted) {
+        capacity <<= 1;
+    }
+
+    pool->slots = calloc(capacity, sizeof(pool_slot));
+    if (pool->slots == NULL) {
+        printf("Error unable to allocate memory for thread pool queue\n");
+        free(pool);
+        return NULL;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&pool->slots[i].sequence, i);
+    }
+    pool->mask = capacity - 1;
+
+    pool->min_workers = config->min_workers;
+    pool->max_workers = config->max_workers < config->min_workers ? config->min_workers : config->max_workers;
+    pool->idle_timeout_ms = config->idle_timeout_ms > 0 ? config->idle_timeout_ms : DEFAULT_IDLE_TIMEOUT_MS;
+    atomic_store(&pool->running, 1);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_available, NULL);
+    pthread_cond_init(&pool->worker_exited, NULL);
+
+    pool->last_stats_ns = now_ns();
+
+    // Always start at least one worker so submitted work makes progress
+    int initial = pool->min_workers > 0 ? pool->min_workers : 1;
+    for (int i = 0; i < initial; i++) {
+        if (spawn_worker(pool) != 0) {
+            thread_pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+int thread_pool_submit(thread_pool *pool, task_func fn, void *arg) {
+    if (pool == NULL || fn == NULL || !atomic_load(&pool->running)) {
+        return -1;
+    }
+
+    if (queue_push(pool, fn, arg) != 0) {
+        atomic_fetch_add(&pool->rejected, 1);
+        return -1;
+    }
+    atomic_fetch_add(&pool->depth, 1);
+
+    if (atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work_available);
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+
+    // Everyone is busy: grow towards max_workers. Submitters race here, so the
+    // slot is claimed before the thread is started
+    int current = atomic_load(&pool->workers);
+    while (current < pool->max_workers && atomic_load(&pool->busy) >= current) {
+        if (atomic_compare_exchange_weak(&pool->workers, &current, current + 1)) {
+            start_worker(pool);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+void thread_pool_get_stats(thread_pool *pool, thread_pool_stats *stats) {
+    if (pool == NULL || stats == NULL) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    long depth = atomic_load(&pool->depth);
+    stats->queue_depth = depth > 0 ? (size_t)depth : 0;
+    stats->queue_capacity = pool->mask + 1;
+    stats->workers = atomic_load(&pool->workers);
+    stats->busy_workers = atomic_load(&pool->busy);
+    stats->tasks_completed = atomic_load(&pool->completed);
+    stats->tasks_rejected = atomic_load(&pool->rejected);
+
+    pthread_mutex_lock(&pool->lock);
+    unsigned long long now = now_ns();
+    unsigned long long busy = atomic_load(&pool->busy_ns);
+    unsigned long long elapsed = now - pool->last_stats_ns;
+
+    if (elapsed > 0 && stats->workers > 0) {
+        stats->utilization = (double)(busy - pool->last_busy_ns) / ((double)elapsed * stats->workers);
+        if (stats->utilization > 1.0) {
+            stats->utilization = 1.0;
+        }
+    }
+    pool->last_busy_ns = busy;
+    pool->last_stats_ns = now;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_destroy(thread_pool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    // Workers finish whatever is still queued, then exit
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->running, 0);
+    pthread_cond_broadcast(&pool->work_available);
+    while (atomic_load(&pool->workers) > 0) {
+        pthread_cond_wait(&pool->worker_exited, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_available);
+    pthread_cond_destroy(&pool->worker_exited);
+    free(pool->slots);
+    free(pool);
+}
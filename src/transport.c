@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "transport.h"
+
+// Split an address string; "host:port" overrides default_port. Returns 0, or -1 if malformed
+
+int transport_parse(const char *address, int default_port, transport_addr *addr) {
+    memset(addr, 0, sizeof(*addr));
+    if (address == NULL) {
+        return -1;
+    }
+
+    const char *path = NULL;
+    if (strncmp(address, TRANSPORT_UNIX_PREFIX, strlen(TRANSPORT_UNIX_PREFIX)) == 0) {
+        addr->kind = TRANSPORT_UNIX;
+        path = address + strlen(TRANSPORT_UNIX_PREFIX);
+    } else if (strncmp(address, TRANSPORT_SHM_PREFIX, strlen(TRANSPORT_SHM_PREFIX)) == 0) {
+        addr->kind = TRANSPORT_SHM;
+        path = address + strlen(TRANSPORT_SHM_PREFIX);
+    }
+    if (path != NULL) {
+        if (*path == '\0' || strlen(path) >= sizeof(addr->path)) {
+            printf("Error invalid socket path '%s'\n", path);
+            return -1;
+        }
+        strcpy(addr->path, path);
+        return 0;
+    }
+
+    addr->kind = TRANSPORT_TCP;
+    addr->port = default_port;
+
+    const char *colon = strchr(address, ':');
+    size_t host_len = colon != NULL ? (size_t)(colon - address) : strlen(address);
+    if (host_len >= sizeof(addr->host)) {
+        printf("Error invalid address '%s'\n", address);
+        return -1;
+    }
+    memcpy(addr->host, address, host_len);
+    addr->host[host_len] = '\0';
+
+    if (colon != NULL) {
+        char *end;
+        long port = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || port <= 0 || port > 65535) {
+            printf("Error invalid port in '%s'\n", address);
+            return -1;
+        }
+        addr->port = (int)port;
+    }
+    return 0;
+}
+
+static socklen_t unix_sockaddr(const transport_addr *addr, struct sockaddr_un *sun) {
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, addr->path);
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + strlen(addr->path) + 1);
+}
+
+// Connected socket for addr, or -1
+
+int transport_connect(const transport_addr *addr) {
+    int sock = socket(addr->kind != TRANSPORT_TCP ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+
+    int rc;
+    if (addr->kind != TRANSPORT_TCP) {
+        struct sockaddr_un server_addr;
+        socklen_t len = unix_sockaddr(addr, &server_addr);
+        rc = connect(sock, (struct sockaddr*)&server_addr, len);
+    } else {
+        struct sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(addr->port);
+
+        if (inet_pton(AF_INET, addr->host, &server_addr.sin_addr) <= 0) {
+            perror("Invalid address or address not supported");
+            close(sock);
+            return -1;
+        }
+        rc = connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    }
+
+    if (rc < 0) {
+        perror("Connection failed");
+        close(sock);
+        return -1;
+    }
+
+    transport_tune(sock, addr->kind);
+    return sock;
+}
+
+// Listening socket for addr, or -1. A socket file left behind by a previous
+// server is replaced; any other file at the path is not
+
+int transport_listen(const transport_addr *addr, int backlog, int flags) {
+    int sock = socket(addr->kind != TRANSPORT_TCP ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+
+    int rc;
+    if (addr->kind != TRANSPORT_TCP) {
+        struct sockaddr_un server_addr;
+        socklen_t len = unix_sockaddr(addr, &server_addr);
+
+        // A socket file left by a server that is gone refuses connections and can
+        // be replaced; one that accepts them belongs to a live server
+        struct stat st;
+        if (lstat(addr->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+            int stale = probe >= 0 && connect(probe, (struct sockaddr*)&server_addr, len) < 0 && errno == ECONNREFUSED;
+            if (probe >= 0) {
+                close(probe);
+            }
+            if (!stale) {
+                printf("Error %s is in use by another server\n", addr->path);
+                close(sock);
+                errno = EADDRINUSE;
+                return -1;
+            }
+            unlink(addr->path);
+        }
+
+        rc = bind(sock, (struct sockaddr*)&server_addr, len);
+    } else {
+        int opt = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+            perror("Error setting socket options");
+            close(sock);
+            return -1;
+        }
+        if ((flags & TRANSPORT_LISTEN_REUSEPORT) &&
+            setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            perror("Error setting SO_REUSEPORT");
+            close(sock);
+            return -1;
+        }
+
+        struct sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(addr->port);
+
+        if (addr->host[0] != '\0' && strcmp(addr->host, "*") != 0 &&
+            inet_pton(AF_INET, addr->host, &server_addr.sin_addr) <= 0) {
+            printf("Error invalid listen address '%s'\n", addr->host);
+            close(sock);
+            return -1;
+        }
+        rc = bind(sock, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    }
+
+    if (rc < 0) {
+        perror("Error binding socket");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, backlog) < 0) {
+        perror("Error listening on socket");
+        close(sock);
+        if (addr->kind != TRANSPORT_TCP) {
+            unlink(addr->path);
+        }
+        return -1;
+    }
+
+    return sock;
+}
+
+void transport_close_listener(int fd, const transport_addr *addr) {
+    if (fd < 0) {
+        return;
+    }
+    close(fd);
+    if (addr->kind != TRANSPORT_TCP) {
+        unlink(addr->path);
+    }
+}
+
+// Frames are written whole, so Nagle only delays them (e.g. stream credit behind
+// data). Local sockets have no such thing
+
+void transport_tune(int fd, transport_kind kind) {
+    if (kind == TRANSPORT_TCP) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+}
+
+const char *transport_describe(const transport_addr *addr, char *buf, size_t len) {
+    if (addr->kind != TRANSPORT_TCP) {
+        snprintf(buf, len, "%s%s", addr->kind == TRANSPORT_SHM ? TRANSPORT_SHM_PREFIX : TRANSPORT_UNIX_PREFIX,
+                 addr->path);
+    } else {
+        snprintf(buf, len, "%s:%d", addr->host[0] != '\0' ? addr->host : "*", addr->port);
+    }
+    return buf;
+}